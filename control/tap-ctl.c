@@ -827,6 +827,79 @@ usage:
 	return EINVAL;
 }
 
+static const char *qos_classes[] = { "high", "normal", "bulk" };
+
+#define TAP_CLI_QOS_CLASSES (sizeof(qos_classes) / sizeof(qos_classes[0]))
+
+static void
+tap_cli_qos_usage(FILE *stream)
+{
+	fprintf(stream, "usage: qos <-p pid> <-m minor> [-w weight] "
+		"[-c high|normal|bulk] [-d depth]\n"
+		"  -d: requests in flight for this vbd, 0 for no limit\n");
+}
+
+static int
+tap_cli_qos(int argc, char **argv)
+{
+	tapdisk_message_qos_t qos;
+	pid_t pid;
+	int c, i, minor, err;
+
+	pid        = -1;
+	minor      = -1;
+	qos.weight = -1;
+	qos.class  = -1;
+	qos.depth  = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:w:c:d:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'w':
+			qos.weight = atoi(optarg);
+			break;
+		case 'c':
+			for (i = 0; i < TAP_CLI_QOS_CLASSES; i++)
+				if (!strcmp(optarg, qos_classes[i]))
+					qos.class = i;
+			if (qos.class == -1)
+				goto usage;
+			break;
+		case 'd':
+			qos.depth = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_qos_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_qos(pid, minor, &qos);
+	if (err)
+		return err;
+
+	printf("weight=%d class=%s depth=%d\n", qos.weight,
+	       qos.class >= 0 && qos.class < TAP_CLI_QOS_CLASSES ?
+	       qos_classes[qos.class] : "?", qos.depth);
+
+	return 0;
+
+usage:
+	tap_cli_qos_usage(stderr);
+	return EINVAL;
+}
+
 static void
 tap_cli_check_usage(FILE *stream)
 {
@@ -867,6 +940,7 @@ struct command commands[] = {
 	{ .name = "pause",        .func = tap_cli_pause         },
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "qos",          .func = tap_cli_qos           },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
 };
@@ -34,6 +34,7 @@
 #include "tapdisk-interface.h"
 
 #define MAX_AIO_REQS         TAPDISK_DATA_REQUESTS
+#define MAX_AIO_IOVS         MAX_SEGMENTS_PER_REQ
 
 struct tdaio_state;
 
@@ -41,10 +42,12 @@ struct aio_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdaio_state  *state;
+	struct iovec         iov[MAX_AIO_IOVS];
 };
 
 struct tdaio_state {
 	int                  fd;
+	int                  blkdev;
 	td_driver_t         *driver;
 
 	int                  aio_free_count;	
@@ -113,6 +116,13 @@ static int tdaio_get_image_info(int fd, td_disk_info_t *info)
 	return 0;
 }
 
+static int tdaio_is_blkdev(int fd)
+{
+	struct stat stat;
+
+	return !fstat(fd, &stat) && S_ISBLK(stat.st_mode);
+}
+
 /* Open the disk file and initialize aio state. */
 int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -157,7 +167,8 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		goto done;
 	}
 
-        prv->fd = fd;
+        prv->fd     = fd;
+	prv->blkdev = tdaio_is_blkdev(fd);
 
 done:
 	return ret;	
@@ -228,6 +239,116 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * Vectored requests go out as a single preadv/pwritev; those with more
+ * buffers than an aio_request holds are split.
+ */
+static void tdaio_queue_rwv(td_driver_t *driver, td_request_t treq, int rw)
+{
+	int cnt;
+	uint64_t offset;
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv     = (struct tdaio_state *)driver->data;
+	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio = prv->aio_free_list[prv->aio_free_count - 1];
+
+	cnt = td_request_iovec(treq, treq.secs, aio->iov, MAX_AIO_IOVS);
+	if (cnt < 0) {
+		td_split_request(driver, treq,
+				 rw ? tdaio_queue_write : tdaio_queue_read);
+		return;
+	}
+
+	prv->aio_free_count--;
+	aio->treq  = treq;
+	aio->state = prv;
+
+	if (rw)
+		td_prep_writev(&aio->tiocb, prv->fd, aio->iov, cnt,
+			       offset, tdaio_complete, aio);
+	else
+		td_prep_readv(&aio->tiocb, prv->fd, aio->iov, cnt,
+			      offset, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
+void tdaio_queue_readv(td_driver_t *driver, td_request_t treq)
+{
+	tdaio_queue_rwv(driver, treq, 0);
+}
+
+void tdaio_queue_writev(td_driver_t *driver, td_request_t treq)
+{
+	tdaio_queue_rwv(driver, treq, 1);
+}
+
+/*
+ * BLKDISCARD on block devices, hole punching on files. The queue runs
+ * them off the event loop.
+ */
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	uint64_t offset;
+	size_t size;
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv    = (struct tdaio_state *)driver->data;
+	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs * (size_t)driver->info.sector_size;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_discard(&aio->tiocb, prv->fd, prv->blkdev,
+			offset, size, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
+/* writes reach the file with O_DIRECT; flush the file and device caches */
+void tdaio_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct aio_request *aio;
+	struct tdaio_state *prv;
+
+	prv = (struct tdaio_state *)driver->data;
+
+	if (prv->aio_free_count == 0)
+		goto fail;
+
+	aio        = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq  = treq;
+	aio->state = prv;
+
+	td_prep_fdsync(&aio->tiocb, prv->fd, tdaio_complete, aio);
+	td_queue_tiocb(driver, &aio->tiocb);
+
+	return;
+
+fail:
+	td_complete_request(treq, -EBUSY);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
@@ -269,6 +390,10 @@ struct tap_disk tapdisk_aio = {
 	.td_close           = tdaio_close,
 	.td_queue_read      = tdaio_queue_read,
 	.td_queue_write     = tdaio_queue_write,
+	.td_queue_readv     = tdaio_queue_readv,
+	.td_queue_writev    = tdaio_queue_writev,
+	.td_queue_discard   = tdaio_queue_discard,
+	.td_queue_flush     = tdaio_queue_flush,
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
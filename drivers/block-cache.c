@@ -19,11 +19,14 @@
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
@@ -37,69 +40,110 @@
 #define DBG(_f, _a...) ((void)0)
 #endif
 
-#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
+#include "libvhd.h" /* after DBG, vhd.h defines DEBUG */
 
-#define RADIX_TREE_PAGE_SHIFT           12 /* 4K pages */
-#define RADIX_TREE_PAGE_SIZE            (1 << RADIX_TREE_PAGE_SHIFT)
+#define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 
-#define RADIX_TREE_NODE_SHIFT           9 /* 512B nodes */
-#define RADIX_TREE_NODE_SIZE            (1 << RADIX_TREE_NODE_SHIFT)
-#define RADIX_TREE_NODE_MASK            (RADIX_TREE_NODE_SIZE - 1)
+/*
+ * The cache holds 4k pages of the parent image, indexed by a hash
+ * and replaced by ARC: pages seen once (T1) and pages seen again (T2)
+ * compete for the capacity, steered by ghost lists (B1, B2) of
+ * recently evicted pages. A single scan only ever churns T1, so the
+ * working set of a boot storm survives it.
+ *
+ * Optionally, pages are also kept in a host-wide region in /dev/shm,
+ * one per parent image, shared by all tapdisks caching that image.
+ * The local cache then only holds the hottest pages of each process.
+ * Every tapdisk attached holds a shared flock on the region; the
+ * last one to close removes it.
+ */
 
-#define BLOCK_CACHE_NODES_PER_PAGE      (1 << (RADIX_TREE_PAGE_SHIFT - RADIX_TREE_NODE_SHIFT))
+#define BLOCK_CACHE_PAGE_SHIFT          12 /* 4K pages */
+#define BLOCK_CACHE_PAGE_SIZE           (1 << BLOCK_CACHE_PAGE_SHIFT)
+#define BLOCK_CACHE_PAGE_SECS           (BLOCK_CACHE_PAGE_SIZE >> SECTOR_SHIFT)
 
-#define BLOCK_CACHE_MAX_SIZE            (10 << 20) /* 100MB cache */
+#define BLOCK_CACHE_SIZE_ENV            "TAPDISK_BLOCK_CACHE_MB"
+#define BLOCK_CACHE_DEFAULT_SIZE        (100ULL << 20) /* 100MB cache */
+#define BLOCK_CACHE_MAX_REQUEST_PAGES   256 /* 1MB, larger reads bypass */
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
-#define BLOCK_CACHE_PAGE_IDLETIME       60
 
-typedef struct radix_tree               radix_tree_t;
-typedef struct radix_tree_node          radix_tree_node_t;
-typedef struct radix_tree_link          radix_tree_link_t;
-typedef struct radix_tree_leaf          radix_tree_leaf_t;
-typedef struct radix_tree_page          radix_tree_page_t;
+#define BLOCK_CACHE_SHM_ENV             "TAPDISK_BLOCK_CACHE_SHM_MB"
+#define BLOCK_CACHE_SHM_PATH            "/dev/shm/td-bcache-"
+#define BLOCK_CACHE_SHM_MAGIC           0x74646263 /* "tdbc" */
+#define BLOCK_CACHE_SHM_WAYS            8
+#define BLOCK_CACHE_SHARED_SIZE         (16ULL << 20) /* local, when shared */
+
+enum {
+	BLOCK_CACHE_T1 = 0, /* resident, seen once */
+	BLOCK_CACHE_T2,     /* resident, seen again */
+	BLOCK_CACHE_B1,     /* ghost, evicted from T1 */
+	BLOCK_CACHE_B2,     /* ghost, evicted from T2 */
+	BLOCK_CACHE_LISTS,
+};
 
 typedef struct block_cache              block_cache_t;
+typedef struct block_cache_page         block_cache_page_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_shm          block_cache_shm_t;
+typedef struct block_cache_shm_slot     block_cache_shm_slot_t;
+typedef struct block_cache_shm_id       block_cache_shm_id_t;
 
-struct radix_tree_page {
-	char                           *buf;
-	size_t                          size;
-	uint64_t                        sec;
-	radix_tree_link_t              *owners[BLOCK_CACHE_NODES_PER_PAGE];
+/*
+ * Slots are seqlocked: a writer claims one by making seq odd, and
+ * readers retry nothing, they just miss if seq moved under them.
+ */
+struct block_cache_shm_slot {
+	uint32_t                        seq;
+	uint32_t                        ref;  /* clock bit */
+	uint64_t                        key;  /* page index + 1, or 0 */
 };
 
-struct radix_tree_leaf {
-	radix_tree_page_t              *page;
-	char                           *buf;
+/* the image version the pages came from */
+struct block_cache_shm_id {
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        size;
+	int64_t                         mtime_sec;
+	int64_t                         mtime_nsec;
+	int64_t                         ctime_sec;
+	int64_t                         ctime_nsec;
+	uint8_t                         uuid[16];  /* VHD footer, if any */
+	uint32_t                        timestamp;
+	uint32_t                        checksum;
 };
 
-struct radix_tree_link {
-	uint32_t                        time;
-	union {
-		radix_tree_node_t      *next;
-		radix_tree_leaf_t       leaf;
-	} u;
-};
+struct block_cache_shm {
+	uint32_t                        magic;
+	uint32_t                        page_size;
+	uint64_t                        sectors;
+	block_cache_shm_id_t            id;
+	uint64_t                        sets;
+	uint32_t                        ways;
+	uint32_t                        data_offset;
 
-struct radix_tree_node {
-	int                             height;
-	radix_tree_link_t               links[RADIX_TREE_NODE_SIZE];
-};
+	/* host-wide */
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        inserts;
 
-struct radix_tree {
-	int                             height;
-	uint64_t                        size;
-	uint32_t                        nodes;
-	radix_tree_node_t              *root;
+	block_cache_shm_slot_t          slots[0];
+};
 
-	block_cache_t                  *cache;
+struct block_cache_page {
+	uint64_t                        idx;
+	char                           *buf; /* NULL for ghosts */
+	int                             list;
+	block_cache_page_t             *hash_next;
+	struct list_head                lru;
 };
 
 struct block_cache_request {
 	int                             err;
 	char                           *buf;
 	uint64_t                        secs;
+	uint64_t                        idx;
+	int                             pages;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
 };
@@ -108,7 +152,14 @@ struct block_cache_stats {
 	uint64_t                        reads;
 	uint64_t                        hits;
 	uint64_t                        misses;
-	uint64_t                        prunes;
+	uint64_t                        bypassed;
+	uint64_t                        inserts;
+	uint64_t                        evictions;
+	uint64_t                        ghost_hits;
+	uint64_t                        enomem;
+	uint64_t                        shm_hits;
+	uint64_t                        shm_inserts;
+	uint64_t                        shm_busy;
 };
 
 struct block_cache {
@@ -121,377 +172,652 @@ struct block_cache {
 	block_cache_request_t          *request_free_list[BLOCK_CACHE_REQUESTS];
 	int                             requests_free;
 
-	event_id_t                      timeout_id;
+	uint64_t                        capacity; /* in pages */
+	uint64_t                        target;   /* of T1, in pages */
+
+	struct list_head                lists[BLOCK_CACHE_LISTS]; /* MRU first */
+	uint64_t                        count[BLOCK_CACHE_LISTS];
 
-	radix_tree_t                    tree;
+	block_cache_page_t            **hash;
+	uint64_t                        hash_mask;
+
+	block_cache_shm_t              *shm;
+	size_t                          shm_size;
+	char                           *shm_data;
+	int                             shm_fd;   /* holds the flock */
+	char                           *shm_path;
 
 	block_cache_stats_t             stats;
 };
 
-static inline uint64_t
-radix_tree_calculate_size(int height)
+#define block_cache_resident(_c) \
+	((_c)->count[BLOCK_CACHE_T1] + (_c)->count[BLOCK_CACHE_T2])
+
+static inline block_cache_page_t **
+block_cache_bucket(block_cache_t *cache, uint64_t idx)
 {
-	return (uint64_t)RADIX_TREE_NODE_SIZE <<
-	  (height * RADIX_TREE_NODE_SHIFT);
+	return &cache->hash[(idx * 0x9e3779b97f4a7c15ULL >> 32) &
+			    cache->hash_mask];
 }
 
-static inline int
-radix_tree_calculate_height(uint64_t sectors)
+static block_cache_page_t *
+block_cache_find_page(block_cache_t *cache, uint64_t idx)
 {
-	int height;
-	uint64_t tree_size;
+	block_cache_page_t *page;
 
-	height = 1;  /* always allocate root node */
-	tree_size = radix_tree_calculate_size(height);
-	while (sectors > tree_size)
-		tree_size = radix_tree_calculate_size(++height);
+	for (page = *block_cache_bucket(cache, idx); page;
+	     page = page->hash_next)
+		if (page->idx == idx)
+			return page;
 
-	return height;
+	return NULL;
 }
 
-static inline int
-radix_tree_index(radix_tree_node_t *node, uint64_t sector)
+static void
+block_cache_unhash_page(block_cache_t *cache, block_cache_page_t *page)
 {
-	return ((sector >> (node->height * RADIX_TREE_NODE_SHIFT)) &
-		RADIX_TREE_NODE_MASK);
+	block_cache_page_t **pp;
+
+	for (pp = block_cache_bucket(cache, page->idx); *pp;
+	     pp = &(*pp)->hash_next)
+		if (*pp == page) {
+			*pp = page->hash_next;
+			break;
+		}
 }
 
-static inline int
-radix_tree_node_contains_leaves(radix_tree_t *tree, radix_tree_node_t *node)
+static inline void
+block_cache_move_page(block_cache_t *cache,
+		      block_cache_page_t *page, int list)
 {
-	return (node->height == 0);
+	cache->count[page->list]--;
+	list_move(&page->lru, &cache->lists[list]);
+	page->list = list;
+	cache->count[list]++;
 }
 
-static inline int
-radix_tree_node_is_root(radix_tree_t *tree, radix_tree_node_t *node)
+static inline block_cache_page_t *
+block_cache_lru_page(block_cache_t *cache, int list)
 {
-	return (node->height == tree->height);
+	if (list_empty(&cache->lists[list]))
+		return NULL;
+
+	return list_entry(cache->lists[list].prev, block_cache_page_t, lru);
 }
 
-static inline uint64_t
-radix_tree_size(radix_tree_t *tree)
+static void
+block_cache_free_page(block_cache_t *cache, block_cache_page_t *page)
 {
-	return tree->size + tree->nodes * sizeof(radix_tree_node_t);
+	block_cache_unhash_page(cache, page);
+	list_del(&page->lru);
+	cache->count[page->list]--;
+	free(page->buf);
+	free(page);
 }
 
 static inline void
-radix_tree_clear_link(radix_tree_link_t *link)
+block_cache_drop_lru(block_cache_t *cache, int list)
 {
-	if (link)
-		memset(link, 0, sizeof(radix_tree_link_t));
+	block_cache_page_t *page;
+
+	page = block_cache_lru_page(cache, list);
+	if (page)
+		block_cache_free_page(cache, page);
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_node(radix_tree_t *tree, int height)
+/*
+ * ARC REPLACE: turn the LRU page of T1 or T2 into a ghost, and hand
+ * its buffer to the caller.
+ */
+static char *
+block_cache_replace(block_cache_t *cache, int ghost_hit_b2)
 {
-	radix_tree_node_t *node;
+	block_cache_page_t *page;
+	uint64_t t1 = cache->count[BLOCK_CACHE_T1];
+	char *buf;
+
+	if (t1 && (t1 > cache->target ||
+		   (ghost_hit_b2 && t1 == cache->target)))
+		page = block_cache_lru_page(cache, BLOCK_CACHE_T1);
+	else {
+		page = block_cache_lru_page(cache, BLOCK_CACHE_T2);
+		if (!page)
+			page = block_cache_lru_page(cache, BLOCK_CACHE_T1);
+	}
 
-	node = calloc(1, sizeof(radix_tree_node_t));
-	if (!node)
+	if (!page)
 		return NULL;
 
-	node->height = height;
-	tree->nodes++;
+	block_cache_move_page(cache, page, page->list == BLOCK_CACHE_T1 ?
+			      BLOCK_CACHE_B1 : BLOCK_CACHE_B2);
 
-	return node;
+	buf       = page->buf;
+	page->buf = NULL;
+	cache->stats.evictions++;
+
+	return buf;
 }
 
-static inline radix_tree_node_t *
-radix_tree_allocate_child_node(radix_tree_t *tree, radix_tree_node_t *parent)
+static inline char *
+block_cache_alloc_buf(block_cache_t *cache, char *buf)
 {
-	return radix_tree_allocate_node(tree, parent->height - 1);
+	if (!buf && posix_memalign((void **)&buf,
+				   BLOCK_CACHE_PAGE_SIZE, BLOCK_CACHE_PAGE_SIZE)) {
+		cache->stats.enomem++;
+		return NULL;
+	}
+
+	return buf;
 }
 
-void
-radix_tree_free_node(radix_tree_t *tree, radix_tree_node_t *node)
+static void
+block_cache_adapt(block_cache_t *cache, int list)
 {
-	if (!node)
-		return;
-
-	free(node);
-	tree->nodes--;
+	uint64_t b1 = cache->count[BLOCK_CACHE_B1];
+	uint64_t b2 = cache->count[BLOCK_CACHE_B2];
+	uint64_t delta;
+
+	if (list == BLOCK_CACHE_B1) {
+		delta = b2 > b1 ? b2 / b1 : 1;
+		cache->target = MIN(cache->capacity, cache->target + delta);
+	} else {
+		delta = b1 > b2 ? b1 / b2 : 1;
+		cache->target = cache->target > delta ? cache->target - delta : 0;
+	}
 }
 
-static inline radix_tree_page_t *
-radix_tree_allocate_page(radix_tree_t *tree,
-			 char *buf, uint64_t sec, size_t size)
+/*
+ * Page @idx was read from the parent: cache a copy of @data.
+ */
+static void
+block_cache_insert_page(block_cache_t *cache, uint64_t idx, const char *data)
 {
-	radix_tree_page_t *page;
+	block_cache_page_t *page;
+	uint64_t l1, total;
+	char *buf = NULL;
+
+	page = block_cache_find_page(cache, idx);
+	if (page && page->buf) {
+		/* filled by a racing miss */
+		block_cache_move_page(cache, page, BLOCK_CACHE_T2);
+		return;
+	}
 
-	page = calloc(1, sizeof(radix_tree_page_t));
-	if (!page)
-		return NULL;
+	if (page) {
+		cache->stats.ghost_hits++;
+		block_cache_adapt(cache, page->list);
+
+		if (block_cache_resident(cache) >= cache->capacity)
+			buf = block_cache_replace(cache,
+						  page->list == BLOCK_CACHE_B2);
+
+		page->buf = block_cache_alloc_buf(cache, buf);
+		if (!page->buf)
+			return;
+
+		block_cache_move_page(cache, page, BLOCK_CACHE_T2);
+		goto copy;
+	}
+
+	l1    = cache->count[BLOCK_CACHE_T1] + cache->count[BLOCK_CACHE_B1];
+	total = l1 + cache->count[BLOCK_CACHE_T2] + cache->count[BLOCK_CACHE_B2];
+
+	if (l1 >= cache->capacity) {
+		if (cache->count[BLOCK_CACHE_T1] < cache->capacity) {
+			block_cache_drop_lru(cache, BLOCK_CACHE_B1);
+			if (block_cache_resident(cache) >= cache->capacity)
+				buf = block_cache_replace(cache, 0);
+		} else {
+			page = block_cache_lru_page(cache, BLOCK_CACHE_T1);
+			buf  = page->buf;
+			page->buf = NULL;
+			block_cache_free_page(cache, page);
+			cache->stats.evictions++;
+		}
+	} else if (total >= cache->capacity) {
+		if (total >= cache->capacity << 1)
+			block_cache_drop_lru(cache, BLOCK_CACHE_B2);
+		if (block_cache_resident(cache) >= cache->capacity)
+			buf = block_cache_replace(cache, 0);
+	}
+
+	page = calloc(1, sizeof(*page));
+	if (!page) {
+		free(buf);
+		cache->stats.enomem++;
+		return;
+	}
+
+	page->buf = block_cache_alloc_buf(cache, buf);
+	if (!page->buf) {
+		free(page);
+		return;
+	}
 
-	page->buf   = buf;
-	page->sec   = sec;
-	page->size  = size;
-	tree->size += size;
+	page->idx       = idx;
+	page->list      = BLOCK_CACHE_T1;
+	page->hash_next = *block_cache_bucket(cache, idx);
+	*block_cache_bucket(cache, idx) = page;
+	list_add(&page->lru, &cache->lists[BLOCK_CACHE_T1]);
+	cache->count[BLOCK_CACHE_T1]++;
 
-	return page;
+copy:
+	memcpy(page->buf, data, BLOCK_CACHE_PAGE_SIZE);
+	cache->stats.inserts++;
 }
 
-static inline void
-radix_tree_free_page(radix_tree_t *tree, radix_tree_page_t *page)
+static void
+block_cache_free_pages(block_cache_t *cache)
 {
+	block_cache_page_t *page, *next;
 	int i;
 
-	for (i = 0; i < page->size >> RADIX_TREE_NODE_SHIFT; i++)
-		DBG("%s: ejecting sector 0x%llx\n",
-		    tree->cache->name, page->sec + i);
+	for (i = 0; i < BLOCK_CACHE_LISTS; i++)
+		list_for_each_entry_safe(page, next, &cache->lists[i], lru)
+			block_cache_free_page(cache, page);
 
-	tree->cache->stats.prunes += (page->size >> RADIX_TREE_NODE_SHIFT);
-	tree->size -= page->size;
-	free(page->buf);
-	free(page);
+	free(cache->hash);
+	cache->hash = NULL;
 }
 
-/*
- * remove a leaf and the shared radix_tree_page_t containing its buffer.
- * leaves are deleted, nodes are not; gc will reap the nodes later.
- */
-static void
-radix_tree_remove_page(radix_tree_t *tree, radix_tree_page_t *page)
+static uint64_t
+block_cache_env_size(const char *name)
 {
-	int i;
+	const char *env = getenv(name);
 
-	if (!page)
-		return;
+	return env ? (uint64_t)strtoull(env, NULL, 0) << 20 : 0;
+}
+
+static uint64_t
+block_cache_size(block_cache_t *cache)
+{
+	uint64_t size = block_cache_env_size(BLOCK_CACHE_SIZE_ENV);
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++)
-		radix_tree_clear_link(page->owners[i]);
+	if (size)
+		return size;
 
-	radix_tree_free_page(tree, page);
+	return cache->shm ? BLOCK_CACHE_SHARED_SIZE : BLOCK_CACHE_DEFAULT_SIZE;
 }
 
-static void
-radix_tree_insert_leaf(radix_tree_t *tree, radix_tree_link_t *link,
-		       radix_tree_page_t *page, off_t off)
+static inline block_cache_shm_slot_t *
+block_cache_shm_set(block_cache_shm_t *shm, uint64_t idx)
+{
+	uint64_t set = (idx * 0x9e3779b97f4a7c15ULL >> 32) % shm->sets;
+
+	return shm->slots + set * shm->ways;
+}
+
+static inline char *
+block_cache_shm_page(block_cache_t *cache, block_cache_shm_slot_t *slot)
+{
+	return cache->shm_data +
+		((size_t)(slot - cache->shm->slots) << BLOCK_CACHE_PAGE_SHIFT);
+}
+
+static int
+block_cache_shm_lookup(block_cache_t *cache, uint64_t idx, char *buf)
 {
+	block_cache_shm_t *shm = cache->shm;
+	block_cache_shm_slot_t *slot;
+	uint32_t seq;
 	int i;
 
-	if (off + RADIX_TREE_NODE_SIZE > page->size)
-		return;
+	slot = block_cache_shm_set(shm, idx);
 
-	for (i = 0; i < BLOCK_CACHE_NODES_PER_PAGE; i++) {
-		if (page->owners[i])
+	for (i = 0; i < shm->ways; i++, slot++) {
+		if (slot->key != idx + 1)
 			continue;
 
-		page->owners[i]   = link;
-		link->u.leaf.page = page;
-		link->u.leaf.buf  = page->buf + off;
+		seq = slot->seq;
+		__sync_synchronize();
+
+		if ((seq & 1) || slot->key != idx + 1)
+			break;
+
+		memcpy(buf, block_cache_shm_page(cache, slot),
+		       BLOCK_CACHE_PAGE_SIZE);
 
-		break;
+		__sync_synchronize();
+		if (slot->seq != seq)
+			break;
+
+		slot->ref = 1;
+		__sync_fetch_and_add(&shm->hits, 1);
+		return 0;
 	}
+
+	__sync_fetch_and_add(&shm->misses, 1);
+	return -ENOENT;
 }
 
-static char *
-radix_tree_find_leaf(radix_tree_t *tree, uint64_t sector)
+static void
+block_cache_shm_insert(block_cache_t *cache, uint64_t idx, const char *data)
 {
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
+	block_cache_shm_t *shm = cache->shm;
+	block_cache_shm_slot_t *set, *slot, *victim;
+	uint32_t seq;
+	int i;
 
-	node = tree->root;
-	gettimeofday(&now, NULL);
+	set    = block_cache_shm_set(shm, idx);
+	victim = NULL;
 
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
+	for (i = 0, slot = set; i < shm->ways; i++, slot++) {
+		if (slot->key == idx + 1)
+			return;
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			return link->u.leaf.buf;
+		if (!victim && !slot->key)
+			victim = slot;
+	}
 
-		if (!link->u.next)
-			return NULL;
+	/* clock over the set: second chance for referenced pages */
+	for (i = 0, slot = set; !victim && i < shm->ways; i++, slot++) {
+		if (!slot->ref)
+			victim = slot;
+		else
+			slot->ref = 0;
+	}
 
-		node = link->u.next;
-	} while (1);
-}
+	if (!victim)
+		victim = set;
 
-static char *
-radix_tree_add_leaf(radix_tree_t *tree, uint64_t sector,
-		    radix_tree_page_t *page, off_t off)
-{
-	int idx;
-	struct timeval now;
-	radix_tree_link_t *link;
-	radix_tree_node_t *node;
-
-	node = tree->root;
-	gettimeofday(&now, NULL);
-
-	do {
-		idx        = radix_tree_index(node, sector);
-		link       = node->links + idx;
-		link->time = now.tv_sec;
-
-		if (radix_tree_node_contains_leaves(tree, node)) {
-			radix_tree_remove_page(tree, link->u.leaf.page);
-			radix_tree_insert_leaf(tree, link, page, off);
-			return link->u.leaf.buf;
-		}
+	seq = victim->seq;
+	if ((seq & 1) ||
+	    !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1)) {
+		cache->stats.shm_busy++;
+		return;
+	}
 
-		if (!link->u.next) {
-			link->u.next = radix_tree_allocate_child_node(tree,
-								      node);
-			if (!link->u.next)
-				return NULL;
-		}
+	victim->key = 0;
+	__sync_synchronize();
+
+	memcpy(block_cache_shm_page(cache, victim), data,
+	       BLOCK_CACHE_PAGE_SIZE);
+
+	__sync_synchronize();
+	victim->key = idx + 1;
+	victim->ref = 1;
+	__sync_synchronize();
+	victim->seq = seq + 2;
 
-		node = link->u.next;
-	} while (1);
+	cache->stats.shm_inserts++;
+	__sync_fetch_and_add(&shm->inserts, 1);
 }
 
+/*
+ * Name the region after the image: the VHD uuid where there is
+ * one, else the file identity. @id tells apart versions of the image
+ * behind the same name, after a coalesce or an inode reuse.
+ */
 static int
-radix_tree_add_leaves(radix_tree_t *tree, char *buf,
-		      uint64_t sector, uint64_t sectors)
+block_cache_shm_identify(const char *name, char *path, size_t size,
+			 block_cache_shm_id_t *id)
 {
-	int i;
-	radix_tree_page_t *page;
-
-	page = radix_tree_allocate_page(tree, buf, sector,
-					sectors << RADIX_TREE_NODE_SHIFT);
-	if (!page)
-		return -ENOMEM;
-
-	for (i = 0; i < sectors; i++)
-		if (!radix_tree_add_leaf(tree, sector + i, 
-					 page, (i << RADIX_TREE_NODE_SHIFT)))
-			goto fail;
+	vhd_context_t vhd;
+	struct stat st;
+	char uuid[37];
+
+	memset(id, 0, sizeof(*id));
+
+	if (stat(name, &st))
+		return -errno;
+
+	id->dev        = st.st_dev;
+	id->ino        = st.st_ino;
+	id->size       = st.st_size;
+	id->mtime_sec  = st.st_mtim.tv_sec;
+	id->mtime_nsec = st.st_mtim.tv_nsec;
+	id->ctime_sec  = st.st_ctim.tv_sec;
+	id->ctime_nsec = st.st_ctim.tv_nsec;
+
+	if (!vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_FAST)) {
+		memcpy(id->uuid, vhd.footer.uuid, sizeof(id->uuid));
+		id->timestamp = vhd.footer.timestamp;
+		id->checksum  = vhd.footer.checksum;
+		vhd_close(&vhd);
+
+		uuid_unparse(id->uuid, uuid);
+		snprintf(path, size, BLOCK_CACHE_SHM_PATH "%s", uuid);
+		return 0;
+	}
 
+	snprintf(path, size, BLOCK_CACHE_SHM_PATH "%llx-%llx",
+		 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
 	return 0;
-
-fail:
-	page->buf = NULL;
-	radix_tree_remove_page(tree, page);
-	return -ENOMEM;
 }
 
 static void
-radix_tree_delete_branch(radix_tree_t *tree, radix_tree_node_t *node)
+block_cache_shm_layout(block_cache_shm_t *shm, size_t size)
 {
-	int i;
-	radix_tree_link_t *link;
+	uint64_t slots, sets;
+	size_t meta;
 
-	if (!node)
-		return;
+	slots = (size - sizeof(*shm) - BLOCK_CACHE_PAGE_SIZE) /
+		(BLOCK_CACHE_PAGE_SIZE + sizeof(block_cache_shm_slot_t));
+	sets  = slots / BLOCK_CACHE_SHM_WAYS;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	meta = sizeof(*shm) +
+		sets * BLOCK_CACHE_SHM_WAYS * sizeof(block_cache_shm_slot_t);
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+	shm->page_size   = BLOCK_CACHE_PAGE_SIZE;
+	shm->sets        = sets;
+	shm->ways        = BLOCK_CACHE_SHM_WAYS;
+	shm->data_offset = (meta + BLOCK_CACHE_PAGE_SIZE - 1) &
+		~(BLOCK_CACHE_PAGE_SIZE - 1);
+}
+
+static void
+block_cache_shm_close(block_cache_t *cache)
+{
+	if (cache->shm) {
+		munmap(cache->shm, cache->shm_size);
+		cache->shm      = NULL;
+		cache->shm_data = NULL;
+	}
 
-		radix_tree_clear_link(link);
+	if (cache->shm_fd >= 0) {
+		/* nobody else attached: drop the region with us */
+		if (!flock(cache->shm_fd, LOCK_EX | LOCK_NB))
+			unlink(cache->shm_path);
+		close(cache->shm_fd);
+		cache->shm_fd = -1;
 	}
 
-	radix_tree_free_node(tree, node);
+	free(cache->shm_path);
+	cache->shm_path = NULL;
 }
 
-static inline void
-radix_tree_destroy(radix_tree_t *tree)
+static inline int
+block_cache_shm_valid(block_cache_t *cache, block_cache_shm_t *shm,
+		      size_t size, const block_cache_shm_id_t *id)
 {
-	radix_tree_delete_branch(tree, tree->root);
-	tree->root = NULL;
+	return shm->magic == BLOCK_CACHE_SHM_MAGIC &&
+		shm->page_size == BLOCK_CACHE_PAGE_SIZE &&
+		shm->sectors == cache->sectors &&
+		!memcmp(&shm->id, id, sizeof(*id)) &&
+		shm->data_offset +
+		(shm->sets * shm->ways << BLOCK_CACHE_PAGE_SHIFT) <= size;
 }
 
 /*
- * returns 1 if @node is empty after pruning, 0 otherwise
+ * Lock the region at @path, shared once it is usable. Whoever gets
+ * it exclusively is alone, and (re)builds the region unless it is
+ * valid for this version of the image: a crashed creator leaves it
+ * half-initialised, an image rewritten in place leaves stale pages.
+ * Someone else building it right now only costs us the shared tier.
  */
 static int
-radix_tree_prune_branch(radix_tree_t *tree,
-			radix_tree_node_t *node, uint32_t now)
+block_cache_shm_lock(block_cache_t *cache, const char *path, size_t size,
+		     const block_cache_shm_id_t *id, int *rebuilt)
 {
-	int i, empty;
-	radix_tree_link_t *link;
+	block_cache_shm_t *shm;
+	struct stat st, pst;
+	int fd, err, excl;
 
-	empty = 1;
-	if (!node)
-		return empty;
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return -errno;
 
-	for (i = 0; i < RADIX_TREE_NODE_SIZE; i++) {
-		link = node->links + i;
+	excl = !flock(fd, LOCK_EX | LOCK_NB);
+	if (!excl && flock(fd, LOCK_SH | LOCK_NB)) {
+		err = errno == EWOULDBLOCK ? -EBUSY : -errno;
+		goto fail;
+	}
 
-		if (now - link->time < BLOCK_CACHE_PAGE_IDLETIME) {
-			if (radix_tree_node_contains_leaves(tree, node)) {
-				empty = 0;
-				continue;
-			}
+	/* the last user may have unlinked it before we got the lock */
+	if (fstat(fd, &st) || stat(path, &pst) ||
+	    st.st_dev != pst.st_dev || st.st_ino != pst.st_ino) {
+		err = -EAGAIN;
+		goto fail;
+	}
 
-			if (radix_tree_prune_branch(tree, link->u.next, now))
-				radix_tree_clear_link(link);
-			else
-				empty = 0;
+	*rebuilt = 0;
 
-			continue;
+	if (st.st_size >= sizeof(*shm)) {
+		shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (shm == MAP_FAILED) {
+			err = -errno;
+			goto fail;
 		}
 
-		if (radix_tree_node_contains_leaves(tree, node))
-			radix_tree_remove_page(tree, link->u.leaf.page);
-		else
-			radix_tree_delete_branch(tree, link->u.next);
+		err = !block_cache_shm_valid(cache, shm, st.st_size, id);
+		munmap(shm, st.st_size);
 
-		radix_tree_clear_link(link);
+		if (!err)
+			goto out;
 	}
 
-	if (empty && !radix_tree_node_is_root(tree, node))
-		radix_tree_free_node(tree, node);
+	if (!excl) {
+		err = -ESTALE;
+		goto fail;
+	}
 
-	return empty;
-}
+	/* truncating first zeroes the whole region */
+	if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+		err = -errno;
+		goto fail;
+	}
 
-/*
- * walk tree and free any node that has been idle for too long
- */
-static void
-radix_tree_prune(radix_tree_t *tree)
-{
-	struct timeval now;
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
 
-	if (!tree->root)
-		return;
+	block_cache_shm_layout(shm, size);
+	shm->sectors = cache->sectors;
+	shm->id      = *id;
+	__sync_synchronize();
+	shm->magic   = BLOCK_CACHE_SHM_MAGIC;
+	munmap(shm, size);
+
+	*rebuilt = 1;
 
-	DPRINTF("tree %s has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+out:
+	/*
+	 * Not atomic, but whoever slips in exclusively finds the region
+	 * valid and leaves it alone.
+	 */
+	if (excl && flock(fd, LOCK_SH)) {
+		err = -errno;
+		goto fail;
+	}
 
-	gettimeofday(&now, NULL);
-	radix_tree_prune_branch(tree, tree->root, now.tv_sec);
+	return fd;
 
-	DPRINTF("tree %s now has %"PRIu64" bytes\n",
-		tree->cache->name, tree->size);
+fail:
+	close(fd);
+	return err;
 }
 
-static inline int
-radix_tree_initialize(radix_tree_t *tree, uint64_t sectors)
+static int
+block_cache_shm_open(block_cache_t *cache, const char *name)
 {
-	tree->height = radix_tree_calculate_height(sectors);
-	tree->root   = radix_tree_allocate_node(tree, tree->height);
-	if (!tree->root)
-		return -ENOMEM;
+	char path[256];
+	block_cache_shm_id_t id;
+	block_cache_shm_t *shm;
+	struct stat st;
+	size_t size;
+	int i, fd, err, rebuilt = 0;
+
+	cache->shm_fd = -1;
+
+	size = block_cache_env_size(BLOCK_CACHE_SHM_ENV);
+	if (!size)
+		return 0;
+
+	if (size < sizeof(*shm) + (BLOCK_CACHE_PAGE_SIZE << 4))
+		return -EINVAL;
 
+	err = block_cache_shm_identify(name, path, sizeof(path), &id);
+	if (err)
+		return err;
+
+	fd = -EAGAIN;
+	for (i = 0; i < 3 && fd == -EAGAIN; i++)
+		fd = block_cache_shm_lock(cache, path, size, &id, &rebuilt);
+	if (fd < 0)
+		return fd;
+
+	cache->shm_fd   = fd;
+	cache->shm_path = strdup(path);
+	if (!cache->shm_path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	err = fstat(fd, &st);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	size = st.st_size;
+	shm  = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	cache->shm      = shm;
+	cache->shm_size = size;
+	cache->shm_data = (char *)shm + shm->data_offset;
+
+	DPRINTF("%s: %s shared cache %s, %"PRIu64" pages\n", cache->name,
+		rebuilt ? "created" : "attached", path, shm->sets * shm->ways);
 	return 0;
-}
 
-static inline void
-radix_tree_free(radix_tree_t *tree)
-{
-	radix_tree_destroy(tree);
+fail:
+	block_cache_shm_close(cache);
+	return err;
 }
 
-static void
-block_cache_prune_event(event_id_t id, char mode, void *private)
+static int
+block_cache_init_pages(block_cache_t *cache)
 {
-	radix_tree_t *tree;
-	block_cache_t *cache;
+	uint64_t buckets;
+	int i;
+
+	cache->capacity = block_cache_size(cache) >> BLOCK_CACHE_PAGE_SHIFT;
+	if (!cache->capacity)
+		cache->capacity = 1;
+	cache->target = 0;
+
+	/* room for the ghosts too, at load <= 1 */
+	for (buckets = 1; buckets < cache->capacity << 1; buckets <<= 1)
+		;
 
-	cache = (block_cache_t *)private;
-	tree  = &cache->tree;
+	cache->hash = calloc(buckets, sizeof(block_cache_page_t *));
+	if (!cache->hash)
+		return -ENOMEM;
+
+	cache->hash_mask = buckets - 1;
+
+	for (i = 0; i < BLOCK_CACHE_LISTS; i++) {
+		INIT_LIST_HEAD(&cache->lists[i]);
+		cache->count[i] = 0;
+	}
 
-	radix_tree_prune(tree);
+	return 0;
 }
 
 static inline block_cache_request_t *
@@ -514,13 +840,12 @@ static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
 	int i, err;
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	if (!td_flag_test(flags, TD_OPEN_RDONLY))
 		return -EINVAL;
 
-	if (driver->info.sector_size != RADIX_TREE_NODE_SIZE)
+	if (driver->info.sector_size != (1 << SECTOR_SHIFT))
 		return -EINVAL;
 
 	cache = (block_cache_t *)driver->data;
@@ -530,27 +855,21 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	cache->sectors = driver->info.size;
 
-	tree = &cache->tree;
-	err  = radix_tree_initialize(tree, cache->sectors);
+	err = block_cache_shm_open(cache, name);
+	if (err)
+		DPRINTF("%s: no shared cache: %d\n", cache->name, err);
+
+	err = block_cache_init_pages(cache);
 	if (err)
 		goto fail;
 
-	tree->cache = cache;
 	cache->requests_free = BLOCK_CACHE_REQUESTS;
 	for (i = 0; i < BLOCK_CACHE_REQUESTS; i++)
 		cache->request_free_list[i] = cache->requests + i;
 
-	cache->timeout_id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-							  -1, /* dummy fd */
-							  BLOCK_CACHE_PAGE_IDLETIME << 1,
-							  block_cache_prune_event,
-							  cache);
-	if (cache->timeout_id < 0)
-		goto fail;
-
 	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+		"capacity: %"PRIu64" pages\n",
+		cache->name, cache->sectors, cache->capacity);
 
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
@@ -558,24 +877,22 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	return 0;
 
 fail:
+	block_cache_shm_close(cache);
 	free(cache->name);
-	radix_tree_free(&cache->tree);
 	return err;
 }
 
 static int
 block_cache_close(td_driver_t *driver)
 {
-	radix_tree_t *tree;
 	block_cache_t *cache;
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	DPRINTF("closing cache for %s\n", cache->name);
 
-	tapdisk_server_unregister_event(cache->timeout_id);
-	radix_tree_free(tree);
+	block_cache_free_pages(cache);
+	block_cache_shm_close(cache);
 	free(cache->name);
 
 	return 0;
@@ -587,11 +904,9 @@ block_cache_hash(block_cache_t *cache, char *buf)
 	int i, n;
 	uint64_t cksm, *data;
 
-	return 0;
-
 	cksm = 0;
 	data = (uint64_t *)buf;
-	n    = RADIX_TREE_NODE_SIZE / sizeof(uint64_t);
+	n    = (1 << SECTOR_SHIFT) / sizeof(uint64_t);
 
 	for (i = 0; i < n; i++)
 		cksm += data[i];
@@ -600,19 +915,34 @@ block_cache_hash(block_cache_t *cache, char *buf)
 }
 
 static void
-block_cache_hit(block_cache_t *cache, td_request_t treq, char *iov[])
+block_cache_hit(block_cache_t *cache, td_request_t treq,
+		block_cache_page_t **pages)
 {
+	uint64_t sec, end;
+	size_t off, len;
+	char *buf;
 	int i;
-	off_t off;
 
 	cache->stats.hits += treq.secs;
 
-	for (i = 0; i < treq.secs; i++) {
+	buf = treq.buf;
+	sec = treq.sec;
+	end = treq.sec + treq.secs;
+
+	for (i = 0; sec < end; i++) {
+		block_cache_move_page(cache, pages[i], BLOCK_CACHE_T2);
+
+		off = (sec % BLOCK_CACHE_PAGE_SECS) << SECTOR_SHIFT;
+		len = MIN(BLOCK_CACHE_PAGE_SIZE - off,
+			  (end - sec) << SECTOR_SHIFT);
+
 		DBG("%s: block cache hit: sec 0x%08llx, hash: 0x%08llx\n",
-		    cache->name, treq.sec + i, block_cache_hash(cache, iov[i]));
+		    cache->name, sec, block_cache_hash(cache, pages[i]->buf + off));
 
-		off = i << RADIX_TREE_NODE_SHIFT;
-		memcpy(treq.buf + off, iov[i], RADIX_TREE_NODE_SIZE);
+		memcpy(buf, pages[i]->buf + off, len);
+
+		buf += len;
+		sec += len >> SECTOR_SHIFT;
 	}
 
 	td_complete_request(treq, 0);
@@ -622,104 +952,161 @@ static void
 block_cache_populate_cache(td_request_t clone, int err)
 {
 	int i;
-	radix_tree_t *tree;
+	size_t off;
 	block_cache_t *cache;
 	block_cache_request_t *breq;
 
 	breq        = (block_cache_request_t *)clone.cb_data;
 	cache       = breq->cache;
-	tree        = &cache->tree;
 	breq->secs -= clone.secs;
 	breq->err   = (breq->err ? breq->err : err);
 
 	if (breq->secs)
 		return;
 
-	if (breq->err) {
-		free(breq->buf);
+	if (breq->err)
 		goto out;
-	}
 
-	for (i = 0; i < breq->treq.secs; i++) {
-		off_t off = i << RADIX_TREE_NODE_SHIFT;
-		DBG("%s: populating sec 0x%08llx\n",
-		    cache->name, breq->treq.sec + i);
-		memcpy(breq->treq.buf + off,
-		       breq->buf + off, RADIX_TREE_NODE_SIZE);
-	}
+	DBG("%s: populating sec 0x%08llx, %d pages\n",
+	    cache->name, breq->idx * BLOCK_CACHE_PAGE_SECS, breq->pages);
+
+	off = (breq->treq.sec - breq->idx * BLOCK_CACHE_PAGE_SECS) << SECTOR_SHIFT;
+	memcpy(breq->treq.buf, breq->buf + off,
+	       breq->treq.secs << SECTOR_SHIFT);
 
-	if (radix_tree_add_leaves(tree, breq->buf,
-				  breq->treq.sec, breq->treq.secs))
-		free(breq->buf);
+	for (i = 0; i < breq->pages; i++) {
+		char *data = breq->buf + (i << BLOCK_CACHE_PAGE_SHIFT);
+
+		block_cache_insert_page(cache, breq->idx + i, data);
+		if (cache->shm)
+			block_cache_shm_insert(cache, breq->idx + i, data);
+	}
 
 out:
+	free(breq->buf);
 	td_complete_request(breq->treq, breq->err);
 	block_cache_put_request(cache, breq);
 }
 
+/*
+ * Serve @treq from local and shared pages, if the shared region has
+ * all the ones we miss. Those are then promoted to the local cache.
+ */
+static int
+block_cache_shm_fill(block_cache_t *cache, td_request_t treq,
+		     char *buf, uint64_t idx, int pages)
+{
+	block_cache_page_t *page;
+	size_t off;
+	int i;
+
+	for (i = 0; i < pages; i++) {
+		off  = (size_t)i << BLOCK_CACHE_PAGE_SHIFT;
+		page = block_cache_find_page(cache, idx + i);
+
+		if (page && page->buf)
+			memcpy(buf + off, page->buf, BLOCK_CACHE_PAGE_SIZE);
+		else if (block_cache_shm_lookup(cache, idx + i, buf + off))
+			return -ENOENT;
+	}
+
+	for (i = 0; i < pages; i++)
+		block_cache_insert_page(cache, idx + i,
+					buf + ((size_t)i << BLOCK_CACHE_PAGE_SHIFT));
+
+	off = (treq.sec - idx * BLOCK_CACHE_PAGE_SECS) << SECTOR_SHIFT;
+	memcpy(treq.buf, buf + off, treq.secs << SECTOR_SHIFT);
+
+	cache->stats.misses   -= treq.secs;
+	cache->stats.shm_hits += treq.secs;
+
+	td_complete_request(treq, 0);
+	return 0;
+}
+
+/*
+ * Read all pages covering @treq, so partial and unaligned requests
+ * populate the cache too.
+ */
 static void
-block_cache_miss(block_cache_t *cache, td_request_t treq)
+block_cache_miss(block_cache_t *cache, td_request_t treq,
+		 uint64_t idx, int pages)
 {
 	void *buf;
-	size_t size;
 	td_request_t clone;
-	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
 	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
 
-	clone = treq;
-	tree  = &cache->tree;
-	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
-
 	cache->stats.misses += treq.secs;
 
-	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
-		goto out;
+	if ((idx + pages) * BLOCK_CACHE_PAGE_SECS > cache->sectors)
+		goto bypass;
 
 	breq = block_cache_get_request(cache);
 	if (!breq)
-		goto out;
+		goto bypass;
 
-	if (posix_memalign(&buf, RADIX_TREE_NODE_SIZE, size)) {
+	if (posix_memalign(&buf, BLOCK_CACHE_PAGE_SIZE,
+			   (size_t)pages << BLOCK_CACHE_PAGE_SHIFT)) {
 		block_cache_put_request(cache, breq);
-		goto out;
+		goto bypass;
+	}
+
+	if (cache->shm && !block_cache_shm_fill(cache, treq, buf, idx, pages)) {
+		block_cache_put_request(cache, breq);
+		free(buf);
+		return;
 	}
 
 	breq->treq    = treq;
-	breq->secs    = treq.secs;
+	breq->secs    = pages * BLOCK_CACHE_PAGE_SECS;
 	breq->err     = 0;
 	breq->buf     = buf;
+	breq->idx     = idx;
+	breq->pages   = pages;
 	breq->cache   = cache;
 
+	clone         = treq;
+	clone.sec     = idx * BLOCK_CACHE_PAGE_SECS;
+	clone.secs    = breq->secs;
 	clone.buf     = buf;
 	clone.cb      = block_cache_populate_cache;
 	clone.cb_data = breq;
 
-out:
 	td_forward_request(clone);
+	return;
+
+bypass:
+	cache->stats.bypassed += treq.secs;
+	td_forward_request(treq);
 }
 
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
-	int i;
-	radix_tree_t *tree;
+	int i, pages;
+	uint64_t idx;
 	block_cache_t *cache;
-	char *iov[BLOCK_CACHE_NODES_PER_PAGE];
+	block_cache_page_t *page, *iov[BLOCK_CACHE_MAX_REQUEST_PAGES];
 
 	cache = (block_cache_t *)driver->data;
-	tree  = &cache->tree;
 
 	cache->stats.reads += treq.secs;
 
-	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
+	idx   = treq.sec / BLOCK_CACHE_PAGE_SECS;
+	pages = (treq.sec + treq.secs - 1) / BLOCK_CACHE_PAGE_SECS - idx + 1;
+
+	if (pages > BLOCK_CACHE_MAX_REQUEST_PAGES) {
+		cache->stats.bypassed += treq.secs;
 		return td_forward_request(treq);
+	}
 
-	for (i = 0; i < treq.secs; i++) {
-		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
-		if (!iov[i])
-			return block_cache_miss(cache, treq);
+	for (i = 0; i < pages; i++) {
+		page = block_cache_find_page(cache, idx + i);
+		if (!page || !page->buf)
+			return block_cache_miss(cache, treq, idx, pages);
+		iov[i] = page;
 	}
 
 	return block_cache_hit(cache, treq, iov);
@@ -761,8 +1148,57 @@ block_cache_debug(td_driver_t *driver)
 
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", "
-	     "misses: %"PRIu64", prunes: %"PRIu64"\n",
-	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	     "misses: %"PRIu64", evictions: %"PRIu64"\n",
+	     stats->reads, stats->hits, stats->misses, stats->evictions);
+	WARN("capacity: %"PRIu64", target: %"PRIu64", t1: %"PRIu64", "
+	     "t2: %"PRIu64", b1: %"PRIu64", b2: %"PRIu64"\n",
+	     cache->capacity, cache->target,
+	     cache->count[BLOCK_CACHE_T1], cache->count[BLOCK_CACHE_T2],
+	     cache->count[BLOCK_CACHE_B1], cache->count[BLOCK_CACHE_B2]);
+}
+
+static void
+block_cache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	block_cache_t *cache = (block_cache_t *)driver->data;
+	block_cache_stats_t *stats = &cache->stats;
+
+	tapdisk_stats_field(st, "capacity", "llu",
+			    cache->capacity << BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "size", "llu",
+			    block_cache_resident(cache) << BLOCK_CACHE_PAGE_SHIFT);
+	tapdisk_stats_field(st, "reads", "llu", stats->reads);
+	tapdisk_stats_field(st, "hits", "llu", stats->hits);
+	tapdisk_stats_field(st, "misses", "llu", stats->misses);
+	tapdisk_stats_field(st, "bypassed", "llu", stats->bypassed);
+	tapdisk_stats_field(st, "inserts", "llu", stats->inserts);
+	tapdisk_stats_field(st, "evictions", "llu", stats->evictions);
+	tapdisk_stats_field(st, "ghost_hits", "llu", stats->ghost_hits);
+	tapdisk_stats_field(st, "enomem", "llu", stats->enomem);
+
+	tapdisk_stats_field(st, "shm", "{");
+	tapdisk_stats_field(st, "mapped", "d", !!cache->shm);
+	if (cache->shm) {
+		tapdisk_stats_field(st, "size", "llu",
+				    cache->shm->sets * cache->shm->ways <<
+				    BLOCK_CACHE_PAGE_SHIFT);
+		tapdisk_stats_field(st, "hits", "llu", stats->shm_hits);
+		tapdisk_stats_field(st, "inserts", "llu", stats->shm_inserts);
+		tapdisk_stats_field(st, "busy", "llu", stats->shm_busy);
+		tapdisk_stats_field(st, "host_hits", "llu", cache->shm->hits);
+		tapdisk_stats_field(st, "host_misses", "llu", cache->shm->misses);
+		tapdisk_stats_field(st, "host_inserts", "llu",
+				    cache->shm->inserts);
+	}
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "arc", "{");
+	tapdisk_stats_field(st, "target", "llu", cache->target);
+	tapdisk_stats_field(st, "t1", "llu", cache->count[BLOCK_CACHE_T1]);
+	tapdisk_stats_field(st, "t2", "llu", cache->count[BLOCK_CACHE_T2]);
+	tapdisk_stats_field(st, "b1", "llu", cache->count[BLOCK_CACHE_B1]);
+	tapdisk_stats_field(st, "b2", "llu", cache->count[BLOCK_CACHE_B2]);
+	tapdisk_stats_leave(st, '}');
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -776,4 +1212,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
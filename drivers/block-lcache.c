@@ -55,9 +55,21 @@
 #define TD_LCACHE_BUFSZ                 (MAX_SEGMENTS_PER_REQ * \
 					 sysconf(_SC_PAGE_SIZE))
 
+/*
+ * Readahead: after TD_LCACHE_SEQ_MIN sequential misses, a stream
+ * prefetches through the end of the next VHD block. Prefetches are
+ * vbd reads, so sectors already in the leaf are not fetched again,
+ * and misses come back through here to be stored like any other.
+ */
+#define TD_LCACHE_STREAMS               8
+#define TD_LCACHE_SEQ_MIN               2
+#define TD_LCACHE_PF_BLOCK              ((2<<20) >> SECTOR_SHIFT)
+#define TD_LCACHE_PF_MAX_REQ            (TD_LCACHE_MAX_REQ / 4)
+
 
 typedef struct lcache                   td_lcache_t;
 typedef struct lcache_request           td_lcache_req_t;
+typedef struct lcache_stream            td_lcache_stream_t;
 
 struct lcache_request {
 	char                           *buf;
@@ -72,8 +84,16 @@ struct lcache_request {
 	td_lcache_t                    *cache;
 };
 
+struct lcache_stream {
+	td_sector_t                     next; /* expected read */
+	td_sector_t                     pf;   /* prefetched up to */
+	int                             seq;
+	unsigned long                   used;
+};
+
 struct lcache {
 	char                           *name;
+	td_sector_t                     size;
 
 	td_lcache_req_t                 reqv[TD_LCACHE_MAX_REQ];
 	td_lcache_req_t                *free[TD_LCACHE_MAX_REQ];
@@ -84,6 +104,16 @@ struct lcache {
 
 	int                             wr_en;
 	struct timeval                  ts;
+
+	td_lcache_stream_t              streams[TD_LCACHE_STREAMS];
+	unsigned long                   tick;
+	int                             pf_pending;
+
+	uint64_t                        pf_reqs;
+	uint64_t                        pf_secs;
+	uint64_t                        pf_errors;
+	uint64_t                        pf_throttled;
+	uint64_t                        stored_secs;
 };
 
 static td_lcache_req_t *
@@ -175,6 +205,7 @@ lcache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
 	timerclear(&cache->ts);
 	cache->wr_en = 1;
+	cache->size  = driver->info.size;
 
 	return 0;
 
@@ -264,6 +295,7 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 
 	vreq         = &req->vreq;
 	vreq->op     = TD_OP_WRITE;
+	vreq->flags  = TD_VBD_REQ_INTERNAL;
 	vreq->sec    = req->treq.sec;
 	vreq->iov    = iov;
 	vreq->iovcnt = 1;
@@ -274,6 +306,8 @@ lcache_store_read(td_lcache_t *cache, td_lcache_req_t *req)
 
 	err = tapdisk_vbd_queue_request(vbd, vreq);
 	BUG_ON(err);
+
+	cache->stored_secs += req->treq.secs;
 }
 
 static void
@@ -308,6 +342,119 @@ __lcache_read_cb(td_request_t treq, int err)
 		lcache_complete_read(cache, req);
 }
 
+static void
+__lcache_prefetch_cb(td_vbd_request_t *vreq, int error,
+		     void *token, int final)
+{
+	td_lcache_req_t *req = containerof(vreq, td_lcache_req_t, vreq);
+	td_lcache_t *cache = token;
+
+	if (error)
+		cache->pf_errors++;
+
+	cache->pf_pending--;
+	lcache_free_request(cache, req);
+}
+
+/*
+ * Prefetch only while guest reads leave most of the request pool
+ * idle, and the caching SR has room for the result.
+ */
+static int
+lcache_prefetch_ok(td_lcache_t *cache)
+{
+	if (cache->pf_pending >= TD_LCACHE_PF_MAX_REQ ||
+	    cache->n_free < TD_LCACHE_MAX_REQ / 2 ||
+	    !lcache_wr_enabled(cache)) {
+		cache->pf_throttled++;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+lcache_prefetch(td_lcache_t *cache, td_lcache_stream_t *stream,
+		td_vbd_t *vbd)
+{
+	td_sector_t end;
+	td_lcache_req_t *req;
+	td_vbd_request_t *vreq;
+	int secs, err;
+
+	/* through the end of the block after the one being read */
+	end = (stream->next / TD_LCACHE_PF_BLOCK + 2) * TD_LCACHE_PF_BLOCK;
+	end = MIN(end, cache->size);
+
+	if (stream->pf < stream->next)
+		stream->pf = stream->next;
+
+	while (stream->pf < end && lcache_prefetch_ok(cache)) {
+		req = lcache_alloc_request(cache);
+		if (!req)
+			break;
+
+		secs = MIN(end - stream->pf, TD_LCACHE_BUFSZ >> SECTOR_SHIFT);
+
+		req->iov.base  = req->buf;
+		req->iov.secs  = secs;
+
+		vreq           = &req->vreq;
+		vreq->op       = TD_OP_READ;
+		vreq->flags    = TD_VBD_REQ_INTERNAL;
+		vreq->sec      = stream->pf;
+		vreq->iov      = &req->iov;
+		vreq->iovcnt   = 1;
+		vreq->cb       = __lcache_prefetch_cb;
+		vreq->token    = cache;
+
+		err = tapdisk_vbd_queue_request(vbd, vreq);
+		BUG_ON(err);
+
+		stream->pf += secs;
+		cache->pf_pending++;
+		cache->pf_reqs++;
+		cache->pf_secs += secs;
+	}
+}
+
+static void
+lcache_track_read(td_lcache_t *cache, td_request_t treq)
+{
+	td_lcache_stream_t *stream, *lru = NULL;
+	int i;
+
+	cache->tick++;
+
+	for (i = 0; i < TD_LCACHE_STREAMS; i++) {
+		stream = &cache->streams[i];
+
+		/* sequential, or within the window we prefetched */
+		if (stream->used &&
+		    (treq.sec == stream->next ||
+		     (treq.sec > stream->next && treq.sec < stream->pf)))
+			goto found;
+
+		if (!lru || stream->used < lru->used)
+			lru = stream;
+	}
+
+	stream       = lru;
+	stream->seq  = 0;
+	stream->pf   = 0;
+	stream->next = treq.sec + treq.secs;
+	stream->used = cache->tick;
+	return;
+
+found:
+	stream->seq++;
+	stream->next = treq.sec + treq.secs;
+	stream->used = cache->tick;
+
+	if (stream->seq >= TD_LCACHE_SEQ_MIN)
+		lcache_prefetch(cache, stream, treq.vreq->vbd);
+}
+
 static void
 lcache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -333,6 +480,9 @@ lcache_queue_read(td_driver_t *driver, td_request_t treq)
 	clone.cb_data = req;
 
 	td_forward_request(clone);
+
+	if (!td_flag_test(treq.vreq->flags, TD_VBD_REQ_INTERNAL))
+		lcache_track_read(cache, treq);
 }
 
 static int
@@ -351,6 +501,23 @@ lcache_validate_parent(td_driver_t *driver,
 	return 0;
 }
 
+static void
+lcache_stats(td_driver_t *driver, td_stats_t *st)
+{
+	td_lcache_t *cache = driver->data;
+
+	tapdisk_stats_field(st, "wr_en", "d", cache->wr_en);
+	tapdisk_stats_field(st, "stored_secs", "llu", cache->stored_secs);
+
+	tapdisk_stats_field(st, "prefetch", "{");
+	tapdisk_stats_field(st, "pending", "d", cache->pf_pending);
+	tapdisk_stats_field(st, "reqs", "llu", cache->pf_reqs);
+	tapdisk_stats_field(st, "secs", "llu", cache->pf_secs);
+	tapdisk_stats_field(st, "errors", "llu", cache->pf_errors);
+	tapdisk_stats_field(st, "throttled", "llu", cache->pf_throttled);
+	tapdisk_stats_leave(st, '}');
+}
+
 struct tap_disk tapdisk_lcache = {
 	.disk_type                  = "tapdisk_lcache",
 	.flags                      = 0,
@@ -360,4 +527,5 @@ struct tap_disk tapdisk_lcache = {
 	.td_queue_read              = lcache_queue_read,
 	.td_get_parent_id           = lcache_get_parent_id,
 	.td_validate_parent         = lcache_validate_parent,
+	.td_stats                   = lcache_stats,
 };
@@ -24,10 +24,12 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "tapdisk.h"
 #include "tapdisk-server.h"
 #include "tapdisk-driver.h"
@@ -43,20 +45,31 @@
 #define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "nbd: " _f, ##_a)
 #define ERROR(_f, _a...)           tlog_syslog(TLOG_WARN, "nbd: " _f, ##_a)
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 #define N_PASSED_FDS 10
 #define TAPDISK_NBDCLIENT_MAX_PATH_LEN 256
 #define TAPDISK_NBDCLIENT_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdclient"
 #define MAX_NBD_REQS TAPDISK_DATA_REQUESTS
 #define NBD_TIMEOUT 30
 
+#define TDNBD_MAX_CONNS        8
+#define TDNBD_DEFAULT_CONNS    4
+#define TDNBD_CONNS_ENV        "TAPDISK_NBD_CONNECTIONS"
+#define TDNBD_STRIPE_SHIFT     20 /* 1MB stripes */
+
 /* 
  * We'll only ever have one nbdclient fd receiver per tapdisk process, so let's 
  * just store it here globally. We'll also keep track of the passed fds here 
- * too.
+ * too. The receiver is started and stopped before and after the server
+ * threads run, but fds are stashed by one thread and retrieved by
+ * another: passed_fds is under passed_fds_lock.
  */
 
 struct td_fdreceiver *fdreceiver = NULL;
 
+static pthread_mutex_t passed_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct tdnbd_passed_fd {
 	char                    id[40];
 	struct                  timeval t;
@@ -69,32 +82,69 @@ struct nbd_queued_io {
 	int                     so_far;
 };
 
+struct tdnbd_conn;
+
 struct td_nbd_request {
 	td_request_t            treq;
 	struct nbd_request      nreq;
-	int                     timeout_event;
 	int                     fake;
 	struct nbd_queued_io    header;
 	struct nbd_queued_io    body;     /* in or out, depending on whether
 					     type is read or write. */
 	struct list_head        queue;
+
+	struct tdnbd_conn      *conn;
+	scheduler_timer_t       timer;
 };
 
-struct tdnbd_data
-{
+/* negotiation steps */
+#define TDNBD_NEG_GREETING      0 /* NBDMAGIC + oldstyle or IHAVEOPT magic */
+#define TDNBD_NEG_OLDSTYLE      1 /* size, flags, 124 bytes of pad */
+#define TDNBD_NEG_HFLAGS        2 /* newstyle handshake flags */
+#define TDNBD_NEG_EXPORT        3 /* size, flags, [124 bytes of pad] */
+
+/* connection states */
+#define TDNBD_CONN_DOWN         0
+#define TDNBD_CONN_CONNECTING   1
+#define TDNBD_CONN_NEGOTIATING  2
+#define TDNBD_CONN_READY        3
+
+struct tdnbd_conn {
+	struct tdnbd_data      *prv;
+	int                     state;
+	int                     socket;
+
 	int                     writer_event_id;
+	int                     reader_event_id;
 	struct list_head        sent_reqs;
 	struct list_head        pending_reqs;
-	struct list_head        free_reqs;
-	struct td_nbd_request   requests[MAX_NBD_REQS];
-	int                     nr_free_count;
+	int                     n_reqs;
+	int                     disc;
 
-	int                     reader_event_id;
 	struct nbd_reply        current_reply;
 	struct nbd_queued_io    cur_reply_qio;
 	struct td_nbd_request  *curr_reply_req;
 
-	int                     socket;
+	/* negotiation */
+	int                     step;
+	char                    neg_buf[152];
+	struct nbd_queued_io    neg_qio;
+	uint16_t                hflags;
+	uint64_t                size;
+	uint32_t                eflags;
+	scheduler_timer_t       timer;    /* connection setup */
+};
+
+struct tdnbd_data
+{
+	struct list_head        free_reqs;
+	struct td_nbd_request   requests[MAX_NBD_REQS];
+	int                     nr_free_count;
+
+	struct tdnbd_conn       conns[TDNBD_MAX_CONNS];
+	int                     n_conns;
+	uint64_t                size;
+
 	struct sockaddr_in     *remote;
 	char                   *peer_ip;
 	int                     port;
@@ -102,11 +152,11 @@ struct tdnbd_data
 
 	int                     flags;
 	int                     closed;
-};
 
-int global_id = 0;
+	int                     next_id; /* request handles */
+};
 
-static void disable_write_queue(struct tdnbd_data *prv);
+static void disable_write_queue(struct tdnbd_conn *conn);
 
 
 /* -- fdreceiver bits and pieces -- */
@@ -116,6 +166,9 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 {
 	int free_index = -1;
 	int i;
+
+	pthread_mutex_lock(&passed_fds_lock);
+
 	for (i = 0; i < N_PASSED_FDS; i++)
 		if (passed_fds[i].fd == -1) {
 			free_index = i;
@@ -123,6 +176,7 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 		}
 
 	if (free_index == -1) {
+		pthread_mutex_unlock(&passed_fds_lock);
 		ERROR("Error - more than %d fds passed! cannot stash another",
 				N_PASSED_FDS);
 		close(fd);
@@ -134,6 +188,7 @@ tdnbd_stash_passed_fd(int fd, char *msg, void *data)
 			sizeof(passed_fds[free_index].id));
 	gettimeofday(&passed_fds[free_index].t, NULL);
 
+	pthread_mutex_unlock(&passed_fds_lock);
 }
 
 static int 
@@ -141,15 +196,20 @@ tdnbd_retreive_passed_fd(const char *name)
 {
 	int fd, i;
 
+	pthread_mutex_lock(&passed_fds_lock);
+
 	for (i = 0; i < N_PASSED_FDS; i++) {
 		if (strncmp(name, passed_fds[i].id,
 					sizeof(passed_fds[i].id)) == 0) {
 			fd = passed_fds[i].fd;
 			passed_fds[i].fd = -1;
+			pthread_mutex_unlock(&passed_fds_lock);
 			return fd;
 		}
 	}
 
+	pthread_mutex_unlock(&passed_fds_lock);
+
 	ERROR("Couldn't find the fd named: %s", name);
 
 	return -1;
@@ -189,30 +249,68 @@ __cancel_req(int i, struct td_nbd_request *pos, int e)
 	INFO("Entry %d: handle='%s' type=%d -- reporting errno: %d",
 			i, handle, ntohl(pos->nreq.type), e);
 
-	if (pos->timeout_event >= 0) {
-		tapdisk_server_unregister_event(pos->timeout_event);
-		pos->timeout_event = -1;
-	}
+	tapdisk_server_del_timer(&pos->timer);
 
 	td_complete_request(pos->treq, e);
 }
 
+static void
+tdnbd_conn_unregister(struct tdnbd_conn *conn)
+{
+	if (conn->writer_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->writer_event_id);
+		conn->writer_event_id = -1;
+	}
+
+	if (conn->reader_event_id >= 0) {
+		tapdisk_server_unregister_event(conn->reader_event_id);
+		conn->reader_event_id = -1;
+	}
+}
+
+/* give up on a connection that never carried requests */
+static void
+tdnbd_conn_drop(struct tdnbd_conn *conn)
+{
+	tdnbd_conn_unregister(conn);
+	tapdisk_server_del_timer(&conn->timer);
+
+	if (conn->socket >= 0)
+		close(conn->socket);
+	conn->socket = -1;
+	conn->state  = TDNBD_CONN_DOWN;
+}
+
 static void
 tdnbd_disable(struct tdnbd_data *prv, int e)
 {
 	struct td_nbd_request *pos, *q;
-	int i = 0;
+	struct tdnbd_conn *conn;
+	int i = 0, c;
 
 	INFO("NBD client full-disable");
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
-	tapdisk_server_unregister_event(prv->reader_event_id);
+	for (c = 0; c < prv->n_conns; c++) {
+		conn = &prv->conns[c];
 
-	list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue)
-		__cancel_req(i++, pos, e);
+		tdnbd_conn_unregister(conn);
+		tapdisk_server_del_timer(&conn->timer);
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue)
-		__cancel_req(i++, pos, e);
+		list_for_each_entry_safe(pos, q, &conn->sent_reqs, queue) {
+			__cancel_req(i++, pos, e);
+			list_move(&pos->queue, &prv->free_reqs);
+			prv->nr_free_count++;
+		}
+
+		list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+			__cancel_req(i++, pos, e);
+			list_move(&pos->queue, &prv->free_reqs);
+			prv->nr_free_count++;
+		}
+
+		conn->n_reqs = 0;
+		conn->curr_reply_req = NULL;
+	}
 
 	INFO("Setting closed");
 	prv->closed = 3;
@@ -229,7 +327,7 @@ tdnbd_write_some(int fd, struct nbd_queued_io *data)
 	char *code;
 
 	while (left > 0) {
-		rc = send(fd, data->buffer + data->so_far, left, 0);
+		rc = send(fd, data->buffer + data->so_far, left, MSG_NOSIGNAL);
 
 		if (rc == -1) {
 			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
@@ -286,27 +384,48 @@ tdnbd_read_some(int fd, struct nbd_queued_io *data)
 	return left;
 }
 
+/* -- timeouts -- */
+
+static void
+tdnbd_request_timeout(scheduler_timer_t *timer, void *private)
+{
+	struct td_nbd_request *req = private;
+
+	ERROR("Timeout!: request %.8s", req->nreq.handle);
+	tdnbd_disable(req->conn->prv, ETIMEDOUT);
+}
+
 static void
-tdnbd_timeout_cb(event_id_t eb, char mode, void *data)
+tdnbd_conn_timeout(scheduler_timer_t *timer, void *private)
 {
-	struct tdnbd_data *prv = data;
-	ERROR("Timeout!: %d", eb);
-	tdnbd_disable(prv, ETIMEDOUT);
+	struct tdnbd_conn *conn = private;
+
+	ERROR("Timeout connecting connection %d",
+			(int)(conn - conn->prv->conns));
+	tdnbd_conn_drop(conn);
 }
 
 static void
 tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 {
 	struct td_nbd_request *pos, *q;
-	struct tdnbd_data *prv = data;
+	struct tdnbd_conn *conn = data;
+	struct tdnbd_data *prv = conn->prv;
+	int rc;
+
+	list_for_each_entry_safe(pos, q, &conn->pending_reqs, queue) {
+		rc = tdnbd_write_some(conn->socket, &pos->header);
+		if (rc > 0)
+			return;
 
-	list_for_each_entry_safe(pos, q, &prv->pending_reqs, queue) {
-		if (tdnbd_write_some(prv->socket, &pos->header) > 0)
+		if (rc == 0 && ntohl(pos->nreq.type) == NBD_CMD_WRITE)
+			rc = tdnbd_write_some(conn->socket, &pos->body);
+		if (rc > 0)
 			return;
 
-		if (ntohl(pos->nreq.type) == NBD_CMD_WRITE) {
-			if (tdnbd_write_some(prv->socket, &pos->body) > 0)
-				return;
+		if (rc < 0) {
+			tdnbd_disable(prv, EIO);
+			return;
 		}
 
 		if (ntohl(pos->nreq.type) == NBD_CMD_DISC) {
@@ -317,84 +436,103 @@ tdnbd_writer_cb(event_id_t eb, char mode, void *data)
 			 */
 			list_move(&pos->queue, &prv->free_reqs);
 			prv->nr_free_count++;
-			prv->closed = 2;
+			conn->disc = 1;
 		} else {
-			list_move(&pos->queue, &prv->sent_reqs);
+			list_move_tail(&pos->queue, &conn->sent_reqs);
 		}
 	}
 
 	/* If we're here, we've written everything */
 
-	disable_write_queue(prv);
+	disable_write_queue(conn);
 
-	if (prv->closed == 2)
-		tdnbd_disable(prv, EIO);
+	if (conn->disc)
+		tdnbd_conn_unregister(conn);
 
 	return;
 }
 
 static int
-enable_write_queue(struct tdnbd_data *prv)
+enable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id >= 0) 
+	if (conn->writer_event_id >= 0) 
 		return 0;
 
-	prv->writer_event_id = 
+	conn->writer_event_id = 
 		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-				prv->socket,
+				conn->socket,
 				0,
 				tdnbd_writer_cb,
-				prv);
+				conn);
 
-	return prv->writer_event_id;
+	return conn->writer_event_id;
 }
 
 static void
-disable_write_queue(struct tdnbd_data *prv)
+disable_write_queue(struct tdnbd_conn *conn)
 {
-	if (prv->writer_event_id < 0)
+	if (conn->writer_event_id < 0)
 		return;
 
-	tapdisk_server_unregister_event(prv->writer_event_id);
+	tapdisk_server_unregister_event(conn->writer_event_id);
 
-	prv->writer_event_id = -1;
+	conn->writer_event_id = -1;
 }
 
-static int
-tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
-		char *buffer, uint32_t length, td_request_t treq, int fake)
+/*
+ * Stripe requests across the ready connections by offset, so each
+ * sequential stream stays on one socket for a stripe at a time.
+ */
+static struct tdnbd_conn *
+tdnbd_pick_conn(struct tdnbd_data *prv, uint64_t offset)
 {
-	if (prv->nr_free_count == 0) 
-		return -EBUSY;
+	int i, n;
+
+	i = (offset >> TDNBD_STRIPE_SHIFT) % prv->n_conns;
+
+	for (n = 0; n < prv->n_conns; n++, i = (i + 1) % prv->n_conns)
+		if (prv->conns[i].state == TDNBD_CONN_READY)
+			return &prv->conns[i];
+
+	return NULL;
+}
 
+static int
+tdnbd_queue_request(struct tdnbd_data *prv, struct tdnbd_conn *conn,
+		int type, uint64_t offset, char *buffer, uint32_t length,
+		td_request_t treq, int fake)
+{
 	if (prv->closed == 3) {
 		td_complete_request(treq, -ETIMEDOUT);
 		return -ETIMEDOUT;
 	}
 
+	if (prv->nr_free_count == 0) 
+		return -EBUSY;
+
+	if (!conn)
+		conn = tdnbd_pick_conn(prv, offset);
+	if (!conn) {
+		td_complete_request(treq, -EIO);
+		return -EIO;
+	}
+
 	struct td_nbd_request *req = list_entry(prv->free_reqs.next,
 			struct td_nbd_request, queue);
 
 	/* fill in the request */
 
 	req->treq = treq;
-	int id = global_id++;
+	req->conn = conn;
+	int id = prv->next_id++;
 	snprintf(req->nreq.handle, 8, "td%05x", id % 0xffff);
 
 	/* No response from a disconnect, so no need for a timeout */
-	if (type != NBD_CMD_DISC) { 
-		req->timeout_event = tapdisk_server_register_event(
-				SCHEDULER_POLL_TIMEOUT, 
-				-1, /* dummy */
-				NBD_TIMEOUT,
-				tdnbd_timeout_cb,
-				prv);
-	} else {
-		req->timeout_event = -1;
+	if (type != NBD_CMD_DISC) {
+		tapdisk_server_add_timer(&req->timer, NBD_TIMEOUT * 1000);
+		conn->n_reqs++;
 	}
 
-	INFO("request: %s timeout %d", req->nreq.handle, req->timeout_event);
-
 	req->nreq.magic = htonl(NBD_REQUEST_MAGIC);
 	req->nreq.type = htonl(type);
 	req->nreq.from = htonll(offset);
@@ -407,11 +545,11 @@ tdnbd_queue_request(struct tdnbd_data *prv, int type, uint64_t offset,
 	req->body.so_far = 0;
 	req->fake = fake;
 
-	list_move_tail(&req->queue, &prv->pending_reqs);
+	list_move_tail(&req->queue, &conn->pending_reqs);
 	prv->nr_free_count--;
 
-	if (prv->writer_event_id < 0)
-		enable_write_queue(prv);
+	if (conn->writer_event_id < 0)
+		enable_write_queue(conn);
 
 	return 0;
 }
@@ -425,8 +563,9 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 	int do_disable = 0;
 
 	/* Check to see if we're in the middle of reading a response already */
-	struct tdnbd_data *prv = data;
-	int rc = tdnbd_read_some(prv->socket, &prv->cur_reply_qio);
+	struct tdnbd_conn *conn = data;
+	struct tdnbd_data *prv = conn->prv;
+	int rc = tdnbd_read_some(conn->socket, &conn->cur_reply_qio);
 
 	if (rc < 0) {
 		ERROR("Error reading reply header: %d", rc);
@@ -438,25 +577,25 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 		return; /* need more data */
 
 	/* Got a header. */
-	if (prv->current_reply.error != 0) {
-		ERROR("Error in reply: %d", prv->current_reply.error);
+	if (conn->current_reply.error != 0) {
+		ERROR("Error in reply: %d", conn->current_reply.error);
 		tdnbd_disable(prv, EIO);
 		return;
 	}
 
 	/* Have we found the request yet? */
-	if (prv->curr_reply_req == NULL) {
+	if (conn->curr_reply_req == NULL) {
 		struct td_nbd_request *pos, *q;
-		list_for_each_entry_safe(pos, q, &prv->sent_reqs, queue) {
-			if (memcmp(pos->nreq.handle, prv->current_reply.handle,
+		list_for_each_entry_safe(pos, q, &conn->sent_reqs, queue) {
+			if (memcmp(pos->nreq.handle, conn->current_reply.handle,
 						8) == 0) {
-				prv->curr_reply_req = pos;
+				conn->curr_reply_req = pos;
 				break;
 			}
 		}
 
-		if (prv->curr_reply_req == NULL) {
-			memcpy(handle, prv->current_reply.handle, 8);
+		if (conn->curr_reply_req == NULL) {
+			memcpy(handle, conn->current_reply.handle, 8);
 			handle[8] = 0;
 
 			ERROR("Couldn't find request corresponding to reply "
@@ -466,10 +605,10 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 		}
 	}
 
-	switch(ntohl(prv->curr_reply_req->nreq.type)) {
+	switch(ntohl(conn->curr_reply_req->nreq.type)) {
 	case NBD_CMD_READ:
-		rc = tdnbd_read_some(prv->socket,
-				&prv->curr_reply_req->body);
+		rc = tdnbd_read_some(conn->socket,
+				&conn->curr_reply_req->body);
 
 		if (rc < 0) {
 			ERROR("Error reading body of request: %d", rc);
@@ -480,31 +619,28 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 		if (rc > 0)
 			return; /* need more data */
 
-		td_complete_request(prv->curr_reply_req->treq, 0);
+		td_complete_request(conn->curr_reply_req->treq, 0);
 
 		break;
 	case NBD_CMD_WRITE:
-		td_complete_request(prv->curr_reply_req->treq, 0);
+		td_complete_request(conn->curr_reply_req->treq, 0);
 
 		break;
 	default:
 		ERROR("Unhandled request response: %d",
-				ntohl(prv->curr_reply_req->nreq.type));
+				ntohl(conn->curr_reply_req->nreq.type));
 		do_disable = 1;
 		return;
 	} 
 
 	/* remove the state */
-	list_move(&prv->curr_reply_req->queue, &prv->free_reqs);
+	list_move(&conn->curr_reply_req->queue, &prv->free_reqs);
+	tapdisk_server_del_timer(&conn->curr_reply_req->timer);
 	prv->nr_free_count++;
+	conn->n_reqs--;
 
-	prv->cur_reply_qio.so_far = 0;
-	if (prv->curr_reply_req->timeout_event >= 0) {
-		tapdisk_server_unregister_event(
-				prv->curr_reply_req->timeout_event);
-	}
-
-	prv->curr_reply_req = NULL;
+	conn->cur_reply_qio.so_far = 0;
+	conn->curr_reply_req = NULL;
 
 	/*
 	 * NB: do this here otherwise we cancel the request that has just been 
@@ -514,140 +650,315 @@ tdnbd_reader_cb(event_id_t eb, char mode, void *data)
 		tdnbd_disable(prv, EIO);
 }
 
+/* -- negotiation -- */
+
+static void
+tdnbd_neg_expect(struct tdnbd_conn *conn, int step, int len)
+{
+	conn->step = step;
+	conn->neg_qio.buffer = conn->neg_buf;
+	conn->neg_qio.len = len;
+	conn->neg_qio.so_far = 0;
+}
+
+/*
+ * NBD negotiation protocol, as a state machine over a non-blocking
+ * socket:
+ *
+ * Server sends 'NBDMAGIC'
+ * then either, oldstyle, 0x00420281861253L
+ *   then it sends a 64 bit bigendian size
+ *   then it sends a 32 bit bigendian flags
+ *   then it sends 124 bytes of nothing
+ * or, newstyle, IHAVEOPT and 16 bit handshake flags
+ *   then we send our flags and NBD_OPT_EXPORT_NAME with an empty name
+ *   then it sends a 64 bit size, 16 bit transmission flags and, unless
+ *   NO_ZEROES was agreed, 124 bytes of nothing
+ *
+ * Returns 1 once the export is known, 0 when more data is needed.
+ */
 static int
-tdnbd_wait_read(int fd)
+tdnbd_negotiate_some(struct tdnbd_conn *conn)
 {
-	struct timeval select_tv;
-	fd_set socks;
-	int rc;
+	struct nbd_option opt;
+	char *buf = conn->neg_buf;
+	uint64_t magic, size;
+	uint32_t cflags, flags32;
+	uint16_t flags16;
+	int rc, len;
+
+	for (;;) {
+		rc = tdnbd_read_some(conn->socket, &conn->neg_qio);
+		if (rc < 0)
+			return -EIO;
+		if (rc > 0)
+			return 0;
+
+		switch (conn->step) {
+		case TDNBD_NEG_GREETING:
+			if (memcmp(buf, "NBDMAGIC", 8) != 0) {
+				buf[8] = 0;
+				ERROR("Error in NBD negotiation: got '%s'", buf);
+				return -EINVAL;
+			}
 
-	FD_ZERO(&socks);
-	FD_SET(fd, &socks);
-	select_tv.tv_sec = 10;
-	select_tv.tv_usec = 0;
-	rc = select(fd + 1, &socks, NULL, NULL, &select_tv);
-	return rc;
+			memcpy(&magic, buf + 8, sizeof(magic));
+			magic = ntohll(magic);
+
+			if (magic == NBD_NEGOTIATION_MAGIC)
+				tdnbd_neg_expect(conn, TDNBD_NEG_OLDSTYLE,
+						8 + 4 + 124);
+			else if (magic == NBD_OPTS_MAGIC)
+				tdnbd_neg_expect(conn, TDNBD_NEG_HFLAGS, 2);
+			else {
+				ERROR("Not enough magic in negotiation "
+						"(%"PRIu64")", magic);
+				return -EINVAL;
+			}
+			break;
+
+		case TDNBD_NEG_OLDSTYLE:
+			memcpy(&size, buf, sizeof(size));
+			memcpy(&flags32, buf + 8, sizeof(flags32));
+			conn->size   = ntohll(size);
+			conn->eflags = ntohl(flags32);
+			return 1;
+
+		case TDNBD_NEG_HFLAGS:
+			memcpy(&flags16, buf, sizeof(flags16));
+			conn->hflags = ntohs(flags16);
+
+			cflags = 0;
+			if (conn->hflags & NBD_FLAG_FIXED_NEWSTYLE)
+				cflags |= NBD_FLAG_C_FIXED_NEWSTYLE;
+			if (conn->hflags & NBD_FLAG_NO_ZEROES)
+				cflags |= NBD_FLAG_C_NO_ZEROES;
+			cflags = htonl(cflags);
+
+			opt.magic  = htonll(NBD_OPTS_MAGIC);
+			opt.option = htonl(NBD_OPT_EXPORT_NAME);
+			opt.len    = 0;
+
+			memcpy(buf, &cflags, sizeof(cflags));
+			memcpy(buf + sizeof(cflags), &opt, sizeof(opt));
+			len = sizeof(cflags) + sizeof(opt);
+
+			/* a fresh socket always has room for this */
+			rc = send(conn->socket, buf, len, MSG_NOSIGNAL);
+			if (rc != len) {
+				ERROR("Short write in negotiation (%d)", rc);
+				return -EIO;
+			}
+
+			len = 8 + 2;
+			if (!(conn->hflags & NBD_FLAG_NO_ZEROES))
+				len += 124;
+			tdnbd_neg_expect(conn, TDNBD_NEG_EXPORT, len);
+			break;
+
+		case TDNBD_NEG_EXPORT:
+			memcpy(&size, buf, sizeof(size));
+			memcpy(&flags16, buf + 8, sizeof(flags16));
+			conn->size   = ntohll(size);
+			conn->eflags = ntohs(flags16);
+			return 1;
+		}
+	}
 }
 
 static int
-tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+tdnbd_conn_ready(struct tdnbd_conn *conn)
 {
-#define RECV_BUFFER_SIZE 256
+	tdnbd_conn_unregister(conn);
+	tapdisk_server_del_timer(&conn->timer);
+
+	conn->reader_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+				conn->socket, 0,
+				tdnbd_reader_cb,
+				conn);
+	if (conn->reader_event_id < 0)
+		return conn->reader_event_id;
+
+	conn->state = TDNBD_CONN_READY;
+	return 0;
+}
+
+static void
+tdnbd_negotiate_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	struct tdnbd_data *prv = conn->prv;
+	int i = conn - prv->conns;
 	int rc;
-	char buffer[RECV_BUFFER_SIZE];
-	uint64_t magic;
-	uint64_t size;
-	uint32_t flags;
-	int padbytes = 124;
-	int sock = prv->socket;
 
-	/*
-	 * NBD negotiation protocol: 
-	 *
-	 * Server sends 'NBDMAGIC'
-	 * then it sends 0x00420281861253L
-	 * then it sends a 64 bit bigendian size
-	 * then it sends a 32 bit bigendian flags
-	 * then it sends 124 bytes of nothing
-	 */
+	rc = tdnbd_negotiate_some(conn);
+	if (!rc)
+		return;
 
-	/*
-	 * We need to limit the time we spend in this function as we're still
-	 * using blocking IO at this point
-	 */
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
+	if (rc > 0 && conn->size != prv->size) {
+		ERROR("Connection %d: export size %"PRIu64" != %"PRIu64,
+				i, conn->size, prv->size);
+		rc = -EINVAL;
 	}
 
-	rc = recv(sock, buffer, 8, 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(1) (%d)\n", rc);
-		close(sock);
-		return -1;
-	} 
+	if (rc > 0)
+		rc = tdnbd_conn_ready(conn);
 
-	if (memcmp(buffer, "NBDMAGIC", 8) != 0) {
-		buffer[8] = 0;
-		ERROR("Error in NBD negotiation: got '%s'", buffer);
-		close(sock);
-		return -1;
+	if (rc < 0) {
+		ERROR("Connection %d failed to negotiate: %d", i, rc);
+		tdnbd_conn_drop(conn);
+		return;
 	}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
+	INFO("Connection %d ready", i);
+}
+
+static void
+tdnbd_connect_cb(event_id_t eb, char mode, void *data)
+{
+	struct tdnbd_conn *conn = data;
+	int i = conn - conn->prv->conns;
+	socklen_t len;
+	int err;
+
+	len = sizeof(err);
+	if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err) {
+		ERROR("Connection %d could not connect: %s", i, strerror(err));
+		tdnbd_conn_drop(conn);
+		return;
 	}
 
-	rc = recv(sock, &magic, sizeof(magic), 0);
-	if (rc < 8) {
-		ERROR("Short read in negotiation(2) (%d)\n", rc);
+	tdnbd_conn_unregister(conn);
 
-		return -1;
-	} 
+	conn->state = TDNBD_CONN_NEGOTIATING;
+	conn->reader_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+				conn->socket, 0,
+				tdnbd_negotiate_cb,
+				conn);
+	if (conn->reader_event_id < 0)
+		tdnbd_conn_drop(conn);
+}
 
-	if (ntohll(magic) != NBD_NEGOTIATION_MAGIC) {
-		ERROR("Not enough magic in negotiation(2) (%"PRIu64")\n",
-				ntohll(magic));
-		close(sock);
+static int
+tdnbd_socket(void)
+{
+	int sock;
+	int opt = 1;
+	int rc;
+
+	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		ERROR("Could not create socket: %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
+	rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
+			sizeof(opt));
+	if (rc < 0) {
+		ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
 		close(sock);
 		return -1;
 	}
 
-	rc = recv(sock, &size, sizeof(size), 0);
-	if (rc < sizeof(size)) {
-		ERROR("Short read in negotiation(3) (%d)\n", rc);
-		close(sock);
-		return -1;
-	} 
+	return sock;
+}
 
-	INFO("Got size: %"PRIu64"", ntohll(size));
+/*
+ * Additional connections connect and negotiate from the event loop;
+ * requests go to them once they are ready.
+ */
+static void
+tdnbd_conn_start(struct tdnbd_conn *conn)
+{
+	struct tdnbd_data *prv = conn->prv;
+	int rc;
 
-	driver->info.size = ntohll(size) >> SECTOR_SHIFT;
-	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
-	driver->info.info = 0;
+	conn->socket = tdnbd_socket();
+	if (conn->socket < 0)
+		return;
 
-	if (tdnbd_wait_read(sock) <= 0) {
-		ERROR("Timeout in nbd_negotiate");
-		close(sock);
-		return -1;
+	fcntl(conn->socket, F_SETFL, O_NONBLOCK);
+
+	tdnbd_neg_expect(conn, TDNBD_NEG_GREETING, 16);
+	tapdisk_server_add_timer(&conn->timer, NBD_TIMEOUT * 1000);
+
+	rc = connect(conn->socket, (struct sockaddr *)prv->remote,
+			sizeof(struct sockaddr_in));
+	if (rc < 0 && errno != EINPROGRESS) {
+		ERROR("Could not connect to peer: %s\n", strerror(errno));
+		tdnbd_conn_drop(conn);
+		return;
 	}
 
-	rc = recv(sock, &flags, sizeof(flags), 0);
-	if (rc < sizeof(flags)) {
-		ERROR("Short read in negotiation(4) (%d)\n", rc);
-		close(sock);
-		return -1;
-	} 
+	conn->state = TDNBD_CONN_CONNECTING;
+	conn->writer_event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+				conn->socket, 0,
+				tdnbd_connect_cb,
+				conn);
+	if (conn->writer_event_id < 0)
+		tdnbd_conn_drop(conn);
+}
+
+static int
+tdnbd_wait_read(int fd)
+{
+	struct timeval select_tv;
+	fd_set socks;
+	int rc;
+
+	FD_ZERO(&socks);
+	FD_SET(fd, &socks);
+	select_tv.tv_sec = 10;
+	select_tv.tv_usec = 0;
+	rc = select(fd + 1, &socks, NULL, NULL, &select_tv);
+	return rc;
+}
 
-	INFO("Got flags: %"PRIu32"", ntohl(flags));
+/*
+ * The first connection negotiates before open returns, as the image
+ * size comes from the server.
+ */
+static int
+tdnbd_nbd_negotiate(struct tdnbd_data *prv, td_driver_t *driver)
+{
+	struct tdnbd_conn *conn = &prv->conns[0];
+	int rc;
 
-	while (padbytes > 0) {
-		if (tdnbd_wait_read(sock) <= 0) {
+	fcntl(conn->socket, F_SETFL, O_NONBLOCK);
+	tdnbd_neg_expect(conn, TDNBD_NEG_GREETING, 16);
+
+	/*
+	 * We need to limit the time we spend in this function as we're still
+	 * using blocking IO at this point
+	 */
+	while (!(rc = tdnbd_negotiate_some(conn))) {
+		if (tdnbd_wait_read(conn->socket) <= 0) {
 			ERROR("Timeout in nbd_negotiate");
-			close(sock);
-			return -1;
+			rc = -ETIMEDOUT;
+			break;
 		}
+	}
 
-		rc = recv(sock, buffer, padbytes, 0);
-		if (rc < 0) {
-			ERROR("Bad read in negotiation(5) (%d)\n", rc);
-			close(sock);
-			return -1;
-		}
-		padbytes -= rc;
+	if (rc < 0) {
+		close(conn->socket);
+		conn->socket = -1;
+		return -1;
 	}
 
-	INFO("Successfully connected to NBD server");
+	INFO("Got size: %"PRIu64" flags: %"PRIu32"", conn->size, conn->eflags);
 
-	fcntl(sock, F_SETFL, O_NONBLOCK);
+	prv->size = conn->size;
+	driver->info.size = conn->size >> SECTOR_SHIFT;
+	driver->info.sector_size = DEFAULT_SECTOR_SIZE;
+	driver->info.info = 0;
+
+	INFO("Successfully connected to NBD server");
 
 	return 0;
 }
@@ -656,29 +967,20 @@ static int
 tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 {
 	int sock;
-	int opt = 1;
 	int rc;
 
-	sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sock < 0) {
-		ERROR("Could not create socket: %s\n", strerror(errno));
+	sock = tdnbd_socket();
+	if (sock < 0)
 		return -1;
-	}
-
-	rc = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt,
-			sizeof(opt));
-	if (rc < 0) {
-		ERROR("Could not set TCP_NODELAY: %s\n", strerror(errno));
-		return -1;
-	}
 
 	prv->remote = (struct sockaddr_in *)malloc(
-			sizeof(struct sockaddr_in *));
+			sizeof(struct sockaddr_in));
 	if (!prv->remote) {
 		ERROR("struct sockaddr_in malloc failure\n");
 		close(sock);
 		return -1;
 	}
+	memset(prv->remote, 0, sizeof(struct sockaddr_in));
 	prv->remote->sin_family = AF_INET;
 	rc = inet_pton(AF_INET, prv->peer_ip, &(prv->remote->sin_addr.s_addr));
 	if (rc < 0) {
@@ -704,11 +1006,28 @@ tdnbd_connect_import_session(struct tdnbd_data *prv, td_driver_t* driver)
 		return -1;
 	}
 
-	prv->socket = sock;
+	prv->conns[0].socket = sock;
 
 	return tdnbd_nbd_negotiate(prv, driver);
 }
 
+static int
+tdnbd_get_conns(void)
+{
+	char *env;
+	int n;
+
+	env = getenv(TDNBD_CONNS_ENV);
+	if (!env)
+		return TDNBD_DEFAULT_CONNS;
+
+	n = atoi(env);
+	if (n < 1)
+		n = 1;
+
+	return MIN(n, TDNBD_MAX_CONNS);
+}
+
 /* -- interface -- */
 
 static int tdnbd_close(td_driver_t*);
@@ -717,6 +1036,7 @@ static int
 tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 {
 	struct tdnbd_data *prv;
+	struct tdnbd_conn *conn;
 	char peer_ip[256];
 	int port;
 	int rc;
@@ -730,18 +1050,29 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 
 	INFO("Opening nbd export to %s (flags=%x)\n", name, flags);
 
-	prv->writer_event_id = -1;
-	INIT_LIST_HEAD(&prv->sent_reqs);
-	INIT_LIST_HEAD(&prv->pending_reqs);
 	INIT_LIST_HEAD(&prv->free_reqs);
 	for (i = 0; i < MAX_NBD_REQS; i++) {
 		INIT_LIST_HEAD(&prv->requests[i].queue);
-		prv->requests[i].timeout_event = -1;
+		scheduler_timer_init(&prv->requests[i].timer,
+				tdnbd_request_timeout, &prv->requests[i]);
 		list_add(&prv->requests[i].queue, &prv->free_reqs);
 	}
 	prv->nr_free_count = MAX_NBD_REQS;
-	prv->cur_reply_qio.buffer = (char *)&prv->current_reply;
-	prv->cur_reply_qio.len = sizeof(struct nbd_reply);
+
+	for (i = 0; i < TDNBD_MAX_CONNS; i++) {
+		conn = &prv->conns[i];
+		conn->prv = prv;
+		conn->socket = -1;
+		conn->writer_event_id = -1;
+		conn->reader_event_id = -1;
+		INIT_LIST_HEAD(&conn->sent_reqs);
+		INIT_LIST_HEAD(&conn->pending_reqs);
+		conn->cur_reply_qio.buffer = (char *)&conn->current_reply;
+		conn->cur_reply_qio.len = sizeof(struct nbd_reply);
+		scheduler_timer_init(&conn->timer, tdnbd_conn_timeout, conn);
+	}
+	prv->n_conns = 1;
+
 	rc = sscanf(name, "%255[^:]:%d", peer_ip, &port);
 	if (rc == 2) {
 		prv->peer_ip = malloc(strlen(peer_ip) + 1);
@@ -757,8 +1088,8 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 			return -1;
 
 	} else {
-		prv->socket = tdnbd_retreive_passed_fd(name);
-		if (prv->socket < 0) {
+		prv->conns[0].socket = tdnbd_retreive_passed_fd(name);
+		if (prv->conns[0].socket < 0) {
 			ERROR("Couldn't find fd named: %s", name);
 			return -1;
 		}
@@ -773,11 +1104,11 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 		}
 	}
 
-	prv->reader_event_id = 
-		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-				prv->socket, 0,
-				tdnbd_reader_cb,
-				(void *)prv);
+	rc = tdnbd_conn_ready(&prv->conns[0]);
+	if (rc < 0) {
+		ERROR("Failed to register reader: %d", rc);
+		return rc;
+	}
 
 	prv->flags = flags;
 	prv->closed = 0;
@@ -786,6 +1117,17 @@ tdnbd_open(td_driver_t* driver, const char* name, td_flag_t flags)
 		INFO("Opening in secondary mode: Read requests will be "
 				"forwarded");
 
+	/*
+	 * Only stripe across connections when the server says writes
+	 * on one are visible on the others.
+	 */
+	if (prv->remote && (prv->conns[0].eflags & NBD_FLAG_CAN_MULTI_CONN)) {
+		prv->n_conns = tdnbd_get_conns();
+		for (i = 1; i < prv->n_conns; i++)
+			tdnbd_conn_start(&prv->conns[i]);
+		INFO("Using up to %d connections", prv->n_conns);
+	}
+
 	return 0;
 
 }
@@ -794,45 +1136,60 @@ static int
 tdnbd_close(td_driver_t* driver)
 {
 	struct tdnbd_data *prv = (struct tdnbd_data *)driver->data;
+	struct tdnbd_conn *conn;
 	td_request_t treq;
+	int i;
 
 	bzero(&treq, sizeof(treq));
 
 	if (prv->closed == 3) {
 		INFO("NBD close: already decided that the connection is dead.");
-		if (prv->socket >= 0) 
-			close(prv->socket);
-		prv->socket = -1;
-		return 0;
+		for (i = 0; i < prv->n_conns; i++)
+			tdnbd_conn_drop(&prv->conns[i]);
+		goto out;
 	}
 
-	/* Send a close packet */
+	for (i = 0; i < prv->n_conns; i++) {
+		conn = &prv->conns[i];
 
-	INFO("Sending disconnect request");
-	tdnbd_queue_request(prv, NBD_CMD_DISC, 0, 0, 0, treq, 0);
+		if (conn->state != TDNBD_CONN_READY) {
+			tdnbd_conn_drop(conn);
+			continue;
+		}
 
-	INFO("Switching socket to blocking IO mode");
-	fcntl(prv->socket, F_SETFL, fcntl(prv->socket, F_GETFL) & ~O_NONBLOCK);
+		/* Send a close packet */
 
-	INFO("Writing disconnection request");
-	tdnbd_writer_cb(0, 0, prv);
+		INFO("Sending disconnect request on connection %d", i);
+		tdnbd_queue_request(prv, conn, NBD_CMD_DISC, 0, 0, 0, treq, 0);
 
-	INFO("Written");
+		fcntl(conn->socket, F_SETFL,
+				fcntl(conn->socket, F_GETFL) & ~O_NONBLOCK);
 
-	if (prv->peer_ip) {
-		free(prv->peer_ip);
-		prv->peer_ip = NULL;
-	}
+		tdnbd_writer_cb(0, 0, conn);
+		tdnbd_conn_unregister(conn);
+		conn->state = TDNBD_CONN_DOWN;
 
-	if (prv->name) {
-		tdnbd_stash_passed_fd(prv->socket, prv->name, 0);
-		free(prv->name);
-	} else {
-		if (prv->socket >= 0) 
-			close(prv->socket);
-		prv->socket = -1;
+		INFO("Written");
+
+		if (i == 0 && prv->name) {
+			tdnbd_stash_passed_fd(conn->socket, prv->name, 0);
+			conn->socket = -1;
+		} else if (conn->socket >= 0) {
+			close(conn->socket);
+			conn->socket = -1;
+		}
 	}
 
+	tdnbd_disable(prv, EIO);
+
+out:
+	free(prv->peer_ip);
+	prv->peer_ip = NULL;
+	free(prv->name);
+	prv->name = NULL;
+	free(prv->remote);
+	prv->remote = NULL;
+
 	return 0;
 }
 
@@ -846,8 +1203,8 @@ tdnbd_queue_read(td_driver_t* driver, td_request_t treq)
 	if (prv->flags & TD_OPEN_SECONDARY)
 		td_forward_request(treq);
 	else
-		tdnbd_queue_request(prv, NBD_CMD_READ, offset, treq.buf, size,
-				treq, 0);
+		tdnbd_queue_request(prv, NULL, NBD_CMD_READ, offset,
+				treq.buf, size, treq, 0);
 
 }
 
@@ -858,7 +1215,7 @@ tdnbd_queue_write(td_driver_t* driver, td_request_t treq)
 	int      size    = treq.secs * driver->info.sector_size;
 	uint64_t offset  = treq.sec * (uint64_t)driver->info.sector_size;
 
-	tdnbd_queue_request(prv, NBD_CMD_WRITE,
+	tdnbd_queue_request(prv, NULL, NBD_CMD_WRITE,
 			offset, treq.buf, size, treq, 0);
 }
 
@@ -24,7 +24,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/un.h>
 
 #include "tapdisk.h"
@@ -34,12 +37,16 @@
 
 #include "block-valve.h"
 
+#define TD_VALVE_LAT_MAX          31
+
 typedef struct td_valve td_valve_t;
 typedef struct td_valve_request td_valve_request_t;
 
 struct td_valve_request {
 	td_request_t            treq;
 	int                     secs;
+	int64_t                 ts;  /* forwarded, us */
+	int                     granted; /* reported back as done */
 
 	struct list_head        entry;
 	td_valve_t             *valve;
@@ -48,22 +55,30 @@ struct td_valve_request {
 struct td_valve_stats {
 	unsigned long long      stor;
 	unsigned long long      forw;
+	unsigned long long      shm;
 };
 
 struct td_valve {
 	char                   *brname;
+	char                   *cls;
 	unsigned long           flags;
 
 	int                     sock;
 	event_id_t              sock_id;
 
+	struct td_rlb_shm      *shm;
+
 	event_id_t              sched_id;
-	event_id_t              retry_id;
+	scheduler_timer_t       retry;
 
 	unsigned int            cred;
 	unsigned int            need;
 	unsigned int            done;
 
+	/* latency samples, flushed with done, or early when full */
+	unsigned long           lat[TD_VALVE_LAT_MAX];
+	int                     n_lat;
+
 	struct list_head        stor;
 	struct list_head        forw;
 
@@ -84,6 +99,7 @@ struct td_valve {
 
 #define TD_VALVE_RDLIMIT  (1<<0)
 #define TD_VALVE_WRLIMIT  (1<<1)
+#define TD_VALVE_LATENCY  (1<<2)
 #define TD_VALVE_KILLED   (1<<31)
 
 static void valve_schedule_retry(td_valve_t *);
@@ -91,6 +107,7 @@ static void valve_conn_receive(td_valve_t *);
 static void valve_conn_request(td_valve_t *, unsigned long);
 static void valve_forward_stored_requests(td_valve_t *);
 static void valve_kill(td_valve_t *);
+static int valve_sock_send(td_valve_t *, const void *, size_t);
 
 #define DBG(_f, _a...)    if (1) { tlog_syslog(TLOG_DBG, _f, ##_a); }
 #define INFO(_f, _a...)   tlog_syslog(TLOG_INFO, "valve: " _f, ##_a)
@@ -157,14 +174,14 @@ __valve_sock_event(event_id_t id, char mode, void *private)
 static void
 valve_set_done_pending(td_valve_t *valve)
 {
-	WARN_ON(valve->done == 0);
+	WARN_ON(valve->done == 0 && valve->n_lat == 0);
 	tapdisk_server_mask_event(valve->sched_id, 0);
 }
 
 static void
 valve_clear_done_pending(td_valve_t *valve)
 {
-	WARN_ON(valve->done != 0);
+	WARN_ON(valve->done != 0 || valve->n_lat != 0);
 	tapdisk_server_mask_event(valve->sched_id, 1);
 }
 
@@ -173,14 +190,71 @@ __valve_sched_event(event_id_t id, char mode, void *private)
 {
 	td_valve_t *valve = private;
 
-	if (likely(valve->done > 0))
-		/* flush valve->done */
+	if (likely(valve->done > 0 || valve->n_lat > 0))
+		/* flush valve->done and samples */
 		valve_conn_request(valve, 0);
 }
 
+static void
+valve_shm_close(td_valve_t *valve)
+{
+	if (valve->shm) {
+		munmap(valve->shm, sizeof(*valve->shm));
+		valve->shm = NULL;
+	}
+}
+
+static int
+valve_shm_open(td_valve_t *valve, const char *sockpath)
+{
+	struct td_rlb_shm *shm;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path) +
+		  sizeof(TD_RLB_SHM_SUFFIX)];
+	struct stat st;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s%s", sockpath, TD_RLB_SHM_SUFFIX);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	err = fstat(fd, &st);
+	if (err) {
+		err = -errno;
+		goto out;
+	}
+
+	if (st.st_size < sizeof(*shm)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	if (shm->magic != TD_RLB_SHM_MAGIC || shm->rate <= 0) {
+		munmap(shm, sizeof(*shm));
+		err = -EINVAL;
+		goto out;
+	}
+
+	valve->shm = shm;
+	err = 0;
+out:
+	close(fd);
+	return err;
+}
+
 static void
 valve_sock_close(td_valve_t *valve)
 {
+	valve_shm_close(valve);
+
 	if (valve->sock >= 0) {
 		close(valve->sock);
 		valve->sock = -1;
@@ -225,6 +299,19 @@ valve_sock_open(td_valve_t *valve)
 		goto fail;
 	}
 
+	if (valve->cls) {
+		struct td_valve_hello hello;
+
+		memset(&hello, 0, sizeof(hello));
+		hello.req.need = TD_RLB_HELLO;
+		hello.req.done = TD_RLB_CLASS_MAX;
+		memcpy(hello.name, valve->cls, strlen(valve->cls));
+
+		err = valve_sock_send(valve, &hello, sizeof(hello));
+		if (err)
+			goto fail;
+	}
+
 	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
 					   valve->sock, 0,
 					   __valve_sock_event,
@@ -247,11 +334,17 @@ valve_sock_open(td_valve_t *valve)
 
 	valve->sched_id = id;
 
-	INFO("Connected to %s", addr.sun_path);
+	err = valve_shm_open(valve, addr.sun_path);
+	if (!err)
+		INFO("Connected to %s, shared bucket", addr.sun_path);
+	else
+		INFO("Connected to %s", addr.sun_path);
 
-	valve->cred = 0;
-	valve->need = 0;
-	valve->done = 0;
+	valve->cred  = 0;
+	valve->need  = 0;
+	valve->done  = 0;
+	valve->n_lat = 0;
+	valve->flags &= ~TD_VALVE_LATENCY;
 
 	valve_clear_done_pending(valve);
 
@@ -289,30 +382,23 @@ valve_sock_recv(td_valve_t *valve, void *msg, size_t size)
 }
 
 static void
-__valve_retry_timeout(event_id_t id, char mode, void *private)
+__valve_retry_timeout(scheduler_timer_t *timer, void *private)
 {
 	td_valve_t *valve = private;
 	int err;
 
 	err = valve_sock_open(valve);
-	if (!err)
-		tapdisk_server_unregister_event(valve->retry_id);
+	if (err)
+		valve_schedule_retry(valve);
 }
 
 static void
 valve_schedule_retry(td_valve_t *valve)
 {
-	int id;
-
 	BUG_ON(valve->sock_id >= 0);
 
-	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
-					   -1, TD_VALVE_CONNECT_INTERVAL,
-					   __valve_retry_timeout,
-					   valve);
-	BUG_ON(id < 0);
-
-	valve->retry_id = id;
+	tapdisk_server_add_timer(&valve->retry,
+				 TD_VALVE_CONNECT_INTERVAL * 1000);
 }
 
 static void
@@ -335,6 +421,7 @@ valve_conn_close(td_valve_t *valve, int reset)
 	td_valve_request_t *req, *next;
 
 	valve_sock_close(valve);
+	tapdisk_server_del_timer(&valve->retry);
 
 	if (reset)
 		td_valve_for_each_stored_request(req, next, valve) {
@@ -373,6 +460,11 @@ valve_conn_receive(td_valve_t *valve)
 	}
 
 	for (i = 0; i < n / sizeof(buf[0]); i++) {
+		if (buf[i] == TD_RLB_REPORT) {
+			valve->flags |= TD_VALVE_LATENCY;
+			continue;
+		}
+
 		err = WARN_ON(buf[i] >= TD_RLB_REQUEST_MAX);
 		if (err)
 			goto kill;
@@ -403,18 +495,24 @@ kill:
 static void
 valve_conn_request(td_valve_t *valve, unsigned long size)
 {
-	struct td_valve_req _req;
-	int err;
+	struct td_valve_req msg[1 + TD_VALVE_LAT_MAX];
+	int i, err;
 
-	_req.need    = size;
-	_req.done    = valve->done;
+	msg[0].need  = size;
+	msg[0].done  = valve->done;
+
+	for (i = 0; i < valve->n_lat; i++) {
+		msg[1 + i].need = TD_RLB_LATENCY;
+		msg[1 + i].done = valve->lat[i];
+	}
 
 	valve->need += size;
 	valve->done  = 0;
+	valve->n_lat = 0;
 
 	valve_clear_done_pending(valve);
 
-	err = valve_sock_send(valve, &_req, sizeof(_req));
+	err = valve_sock_send(valve, msg, (1 + i) * sizeof(msg[0]));
 	if (!err)
 		return;
 
@@ -439,6 +537,46 @@ valve_expend_request(td_valve_t *valve, const td_request_t treq)
 	return 0;
 }
 
+/*
+ * Debit the bridge's shared bucket directly. Only while nothing
+ * waits, here or at the bridge, so queued requests are not overtaken.
+ */
+static int
+valve_shm_expend_request(td_valve_t *valve, const td_request_t treq)
+{
+	struct td_rlb_shm *shm = valve->shm;
+
+	if (!shm || shm->magic != TD_RLB_SHM_MAGIC)
+		return -EAGAIN;
+
+	if (shm->waiters || !list_empty(&valve->stor))
+		return -EAGAIN;
+
+	td_rlb_shm_refill(shm, td_rlb_clock());
+
+	if (!td_rlb_shm_take(shm, TREQ_SIZE(treq)))
+		return -EAGAIN;
+
+	valve->stats.shm++;
+
+	return 0;
+}
+
+static void
+valve_sample_latency(td_valve_t *valve, td_valve_request_t *req)
+{
+	if (!(valve->flags & TD_VALVE_LATENCY) || valve->sock < 0)
+		return;
+
+	valve->lat[valve->n_lat++] = td_rlb_clock() - req->ts;
+
+	if (valve->n_lat == ARRAY_SIZE(valve->lat))
+		/* one message worth, flush rather than drop the next */
+		valve_conn_request(valve, 0);
+	else
+		valve_set_done_pending(valve);
+}
+
 static void
 __valve_complete_treq(td_request_t treq, int error)
 {
@@ -448,15 +586,47 @@ __valve_complete_treq(td_request_t treq, int error)
 	BUG_ON(req->secs < treq.secs);
 	req->secs -= treq.secs;
 
-	valve->done += TREQ_SIZE(treq);
-	valve_set_done_pending(valve);
+	if (req->granted) {
+		valve->done += TREQ_SIZE(treq);
+		valve_set_done_pending(valve);
+	}
 
 	if (!req->secs) {
+		valve_sample_latency(valve, req);
 		td_complete_request(req->treq, error);
 		valve_free_request(valve, req);
 	}
 }
 
+/*
+ * Forward without waiting for credit. While the bridge wants latency
+ * samples, these are tracked like forwarded stored requests, minus
+ * the done accounting.
+ */
+static void
+valve_forward_request(td_valve_t *valve, td_request_t treq)
+{
+	td_valve_request_t *req = NULL;
+
+	if (valve->flags & TD_VALVE_LATENCY)
+		req = valve_alloc_request(valve);
+
+	if (req) {
+		req->treq    = treq;
+		req->secs    = treq.secs;
+		req->granted = 0;
+		req->ts      = td_rlb_clock();
+
+		treq.cb      = __valve_complete_treq;
+		treq.cb_data = req;
+
+		list_add_tail(&req->entry, &valve->forw);
+	}
+
+	td_forward_request(treq);
+	valve->stats.forw++;
+}
+
 static void
 valve_forward_stored_requests(td_valve_t *valve)
 {
@@ -473,6 +643,7 @@ valve_forward_stored_requests(td_valve_t *valve)
 		clone         = req->treq;
 		clone.cb      = __valve_complete_treq;
 		clone.cb_data = req;
+		req->ts       = td_rlb_clock();
 
 		td_forward_request(clone);
 		valve->stats.forw++;
@@ -492,8 +663,9 @@ valve_store_request(td_valve_t *valve, td_request_t treq)
 
 	valve_conn_request(valve, TREQ_SIZE(treq));
 
-	req->treq = treq;
-	req->secs = treq.secs;
+	req->treq    = treq;
+	req->secs    = treq.secs;
+	req->granted = 1;
 
 	list_add_tail(&req->entry, &valve->stor);
 	valve->stats.stor++;
@@ -521,9 +693,10 @@ valve_init(td_valve_t *valve, unsigned long flags)
 	valve->sock     = -1;
 	valve->sock_id  = -1;
 
-	valve->retry_id = -1;
 	valve->sched_id = -1;
 
+	scheduler_timer_init(&valve->retry, __valve_retry_timeout, valve);
+
 	valve->flags    = flags;
 
 	for (i = ARRAY_SIZE(valve->reqv) - 1; i >= 0; i--) {
@@ -549,6 +722,7 @@ td_valve_close(td_driver_t *driver)
 	if (valve->brname) {
 		free(valve->brname);
 		valve->brname = NULL;
+		valve->cls    = NULL;
 	}
 
 	return 0;
@@ -569,6 +743,16 @@ td_valve_open(td_driver_t *driver,
 		goto fail;
 	}
 
+	/* <bridge>#<class path> */
+	valve->cls = strchr(valve->brname, '#');
+	if (valve->cls) {
+		*valve->cls++ = 0;
+		if (strlen(valve->cls) >= TD_RLB_CLASS_MAX) {
+			err = -ENAMETOOLONG;
+			goto fail;
+		}
+	}
+
 	valve_conn_open(valve);
 
 	return 0;
@@ -606,6 +790,10 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 	if (!err)
 		goto forward;
 
+	err = valve_shm_expend_request(valve, treq);
+	if (!err)
+		goto forward;
+
 	err = valve_store_request(valve, treq);
 	if (err)
 		td_complete_request(treq, -EBUSY);
@@ -613,8 +801,7 @@ td_valve_queue_request(td_driver_t *driver, td_request_t treq)
 	return;
 
 forward:
-	td_forward_request(treq);
-	valve->stats.forw++;
+	valve_forward_request(valve, treq);
 }
 
 static int
@@ -639,6 +826,8 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 
 	tapdisk_stats_field(st, "bridge", "d", valve->brname);
 	tapdisk_stats_field(st, "flags", "#x", valve->flags);
+	if (valve->cls)
+		tapdisk_stats_field(st, "class", "s", valve->cls);
 
 	tapdisk_stats_field(st, "cred", "d", valve->cred);
 	tapdisk_stats_field(st, "need", "d", valve->need);
@@ -669,6 +858,15 @@ td_valve_stats(td_driver_t *driver, td_stats_t *st)
 	tapdisk_stats_val(st, "d", n_reqs);
 	tapdisk_stats_val(st, "llu", valve->stats.forw);
 	tapdisk_stats_leave(st, ']');
+
+	/*
+	 * shm is [ mapped, total-direct-debits ]
+	 */
+
+	tapdisk_stats_field(st, "shm", "[");
+	tapdisk_stats_val(st, "d", !!valve->shm);
+	tapdisk_stats_val(st, "llu", valve->stats.shm);
+	tapdisk_stats_leave(st, ']');
 }
 
 struct tap_disk tapdisk_valve = {
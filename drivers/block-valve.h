@@ -18,6 +18,9 @@
 #ifndef _TAPDISK_VALVE_H_
 #define _TAPDISK_VALVE_H_
 
+#include <stdint.h>
+#include <time.h>
+
 #define TD_VALVE_SOCKDIR          "/var/run/blktap/ratelimit"
 #define TD_RLB_CONN_MAX           1024
 #define TD_RLB_REQUEST_MAX        (8 << 20)
@@ -27,4 +30,110 @@ struct td_valve_req {
 	unsigned long done;
 };
 
+/*
+ * Optional first message of a valve, naming its QoS class as a '/'
+ * separated path, e.g. "sr1/vm7/xvda". Only sent when configured,
+ * bridges predating it would reject the connection.
+ */
+
+#define TD_RLB_HELLO              (~0UL)
+#define TD_RLB_CLASS_MAX          64
+
+struct td_valve_hello {
+	struct td_valve_req req; /* { TD_RLB_HELLO, TD_RLB_CLASS_MAX } */
+	char                name[TD_RLB_CLASS_MAX];
+};
+
+/*
+ * Latency feedback. Bridges wanting it send TD_RLB_REPORT in place of
+ * a grant. Valves then follow their requests with completion latency
+ * samples, as { TD_RLB_LATENCY, <usecs> }.
+ */
+
+#define TD_RLB_REPORT             (~0UL)
+#define TD_RLB_LATENCY            (~1UL)
+
+/*
+ * Token bucket shared with valves through <socket>.shm. Valves debit
+ * credit directly, refilling it lazily from the shared clock, and
+ * only queue on the socket while the bucket is short or the bridge
+ * has waiters of its own.
+ */
+
+#define TD_RLB_SHM_SUFFIX         ".shm"
+#define TD_RLB_SHM_MAGIC          0x52534d31 /* "RSM1" */
+
+struct td_rlb_shm {
+	uint32_t      magic;
+	uint32_t      waiters;
+	int64_t       rate;  /* B/s */
+	int64_t       cap;   /* B */
+	int64_t       cred;  /* B, negative while in debt */
+	int64_t       ts;    /* us, CLOCK_MONOTONIC, of last refill */
+};
+
+/* us, CLOCK_MONOTONIC */
+static inline int64_t
+td_rlb_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+td_rlb_shm_refill(struct td_rlb_shm *shm, int64_t now)
+{
+	int64_t ts, cred, old, max_usec, gain;
+
+	ts = shm->ts;
+	if (now <= ts)
+		return;
+
+	cred = shm->cred;
+
+	max_usec  = shm->cap - cred;
+	max_usec *= 1000000;
+	max_usec += shm->rate - 1;
+	max_usec /= shm->rate;
+
+	gain  = now - ts;
+	if (gain > max_usec)
+		gain = max_usec;
+	gain *= shm->rate;
+	gain /= 1000000;
+	if (!gain)
+		return;
+
+	/* whoever advances ts owns the gain */
+	if (!__sync_bool_compare_and_swap(&shm->ts, ts, now))
+		return;
+
+	cred = __sync_add_and_fetch(&shm->cred, gain);
+	while (cred > shm->cap) {
+		old = __sync_val_compare_and_swap(&shm->cred, cred, shm->cap);
+		if (old == cred)
+			break;
+		cred = old;
+	}
+}
+
+static inline int
+td_rlb_shm_take(struct td_rlb_shm *shm, int64_t size)
+{
+	int64_t cred, old;
+
+	cred = shm->cred;
+	while (cred >= size) {
+		old = __sync_val_compare_and_swap(&shm->cred, cred, cred - size);
+		if (old == cred)
+			return 1;
+		cred = old;
+	}
+
+	return 0;
+}
+
 #endif /* _TAPDISK_VALVE_H_ */
@@ -52,7 +52,10 @@
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <limits.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "libvhd.h"
 #include "tapdisk.h"
@@ -60,8 +63,7 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 #include "tapdisk-storage.h"
-
-unsigned int SPB;
+#include "tapdisk-utils.h"
 
 #define DEBUGGING   2
 #define ASSERTING   1
@@ -73,10 +75,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%u, BBLK: 0x%04x\n",				\
+		    "%u, BALLOC: %d\n",					\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.n_allocs);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,11 +111,17 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32    /* default bitmap cache size */
+#define VHD_CACHE_PIN_MAX            256   /* cache every bitmap of disks up
+					    * to this many blocks */
+#define VHD_CACHE_SIZE_ENV           "TAPDISK_VHD_BM_CACHE"
+#define VHD_CACHE_PIN_ENV            "TAPDISK_VHD_BM_PIN"
+#define VHD_WRITE_BACK_ENV           "TAPDISK_VHD_WRITE_BACK"
+#define VHD_BAT_ALLOCS               16    /* concurrent block allocations */
+#define VHD_BAT_WRITE_SECS           8     /* bat sectors per write */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
+#define VHD_REQ_IOVS                 MAX_SEGMENTS_PER_REQ
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -122,6 +130,10 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
 #define VHD_OP_REDUNDANT_BM_WRITE    6
+#define VHD_OP_DATA_DISCARD          7
+#define VHD_OP_BITMAP_FLUSH          8
+#define VHD_OP_FLUSH                 9
+#define VHD_OP_BATMAP_WRITE          10
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -137,13 +149,19 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
 
-#define VHD_FLAG_BAT_LOCKED          1
-#define VHD_FLAG_BAT_WRITE_STARTED   2
+#define VHD_FLAG_BAT_WRITE_STARTED   1
+
+#define VHD_FLAG_ALLOC_LIVE          1
+#define VHD_FLAG_ALLOC_ZERO_PENDING  2
+#define VHD_FLAG_ALLOC_BAT_QUEUED    4
+#define VHD_FLAG_ALLOC_UNMAP         8
+#define VHD_FLAG_ALLOC_BATMAP        16
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_DIRTY            16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
@@ -152,6 +170,7 @@ unsigned int SPB;
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
+#define VHD_FLAG_TX_WRITE_BACK       4
 
 typedef uint8_t vhd_flag_t;
 
@@ -181,23 +200,63 @@ struct vhd_request {
 	struct vhd_state         *state;
 	struct vhd_request       *next;
 	struct vhd_transaction   *tx;
+	struct iovec              iov[VHD_REQ_IOVS];
+};
+
+struct vhd_bat_alloc {
+	uint32_t                  blk;
+	uint64_t                  offset;      /* sector offset of new block */
+	uint64_t                  lb_end;      /* end of data preceding it */
+	vhd_flag_t                status;
+	int                       error;
+	struct vhd_request        req;         /* stands in for the bat write
+						* in the bitmap transaction */
+	struct vhd_request        zero_req;    /* for initializing bitmaps */
+	struct vhd_transaction   *tx;          /* completed bitmap transaction
+						* waiting for the bat write */
+	struct tiocb             *zero_wait;   /* data writes held until the
+						* preallocated block is zeroed */
+	struct timeval            ts;          /* start of allocation */
+	td_request_t              discard;     /* completed once an unmapped
+						* entry is on disk */
+	struct vhd_bat_alloc     *next;
+};
+
+struct vhd_extent {
+	uint64_t                  start;
+	uint64_t                  end;
 };
 
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	int                       n_allocs;
+	struct vhd_bat_alloc      allocs[VHD_BAT_ALLOCS];
+	struct vhd_bat_alloc     *ready;       /* entries waiting for a write */
+	struct vhd_bat_alloc     *batch;       /* entries being written */
+	struct vhd_extent         freed[VHD_BAT_ALLOCS]; /* released below
+						* the end of data */
+	int                       n_freed;
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+	int                       error;       /* first error of the batch */
+
+	int                       batmap_dirty; /* bits cleared by unmaps */
+	int                       batmap_writes; /* in flight for the batch */
+	struct vhd_request        batmap_req;  /* for writing the batmap */
+	struct vhd_request        batmap_hdr_req;
+	char                     *batmap_buf;  /* header, then the map */
+	size_t                    batmap_hdr_size;
+	size_t                    batmap_map_size;
 };
 
 struct vhd_bitmap {
 	uint32_t                  blk;
-	uint64_t                  seqno;       /* lru sequence number */
 	vhd_flag_t                status;
+	struct vhd_bitmap        *hash_next;
+	struct list_head          lru;         /* on bm_lru while cached,
+						* bm_free otherwise */
 
 	char                     *map;         /* map should only be modified
 					        * in finish_bitmap_write */
@@ -233,13 +292,19 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	uint64_t                  bm_lru;      /* lru sequence number */
 	uint32_t                  bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
-
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	int                       bm_cache_size;
+	int                       bm_pinned;   /* every block fits in cache */
+	struct vhd_bitmap        *bitmap_list;
+	char                     *bitmap_maps;
+	struct vhd_bitmap       **bm_hash;
+	uint32_t                  bm_hash_mask;
+	struct list_head          bm_lru;      /* most recently used first */
+	struct list_head          bm_free;
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_evictions;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -251,6 +316,38 @@ struct vhd_state {
 	long int                  debug_skipped_redundant_writes;
 	long int                  debug_done_redundant_writes;
 
+	/* block allocation */
+	int                       zero_range;  /* FALLOC_FL_ZERO_RANGE works */
+	uint64_t                  allocs;
+	uint64_t                  alloc_zero_writes;
+	uint64_t                  alloc_errors;
+	uint64_t                  alloc_lat_total; /* usecs */
+	uint64_t                  alloc_lat_max;
+	uint64_t                  bat_writes;
+
+	/* discard */
+	int                       punch_hole;  /* FALLOC_FL_PUNCH_HOLE works */
+	uint64_t                  discards;
+	uint64_t                  discard_secs;
+	uint64_t                  unmaps;
+
+	/* zero writes which read back as zero anyway */
+	uint64_t                  zero_elided;
+	uint64_t                  zero_elided_bytes;
+
+	/* write-back bitmaps */
+	int                       write_back;
+	int                       bm_dirty;    /* committed, not on disk */
+	int                       bm_dirty_max;
+	int                       flush_writes; /* bitmap writes in flight */
+	int                       flush_error;
+	struct vhd_req_list       flush_active; /* waiting on this round */
+	struct vhd_req_list       flush_queue;  /* waiting for the next round */
+	struct vhd_request        flush_req;    /* fdatasync of a round */
+	uint64_t                  flushes;
+	uint64_t                  bm_deferred;
+	uint64_t                  bm_flushed;
+
 	td_driver_t              *driver;
 
 	uint64_t                  queued;
@@ -269,17 +366,28 @@ struct vhd_state {
 #define bat_entry(s, blk)          ((s)->bat.bat.bat[(blk)])
 
 static void vhd_complete(void *, struct tiocb *, int);
+static void vhd_queue_discard(td_driver_t *, td_request_t);
+static void finish_data_write(struct vhd_request *);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * The zero buffer is shared by all vhds in the process, which may
+ * run on several server threads: refcount it under a lock.
+ */
+static pthread_mutex_t    _vhd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int                _vhd_users;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
+	int err = 0;
+
+	pthread_mutex_lock(&_vhd_lock);
+
 	if (_vhd_zeros)
-		return 0;
+		goto out;
 
 	_vhd_zsize = 2 * getpagesize();
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
@@ -288,27 +396,35 @@ vhd_initialize(struct vhd_state *s)
 	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
 			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 	if (_vhd_zeros == MAP_FAILED) {
-		EPRINTF("vhd_initialize failed: %d\n", -errno);
+		err = -errno;
+		EPRINTF("vhd_initialize failed: %d\n", err);
 		_vhd_zeros = NULL;
 		_vhd_zsize = 0;
-		return -errno;
+		goto fail;
 	}
 
-	_vhd_master = s;
-	return 0;
+out:
+	_vhd_users++;
+fail:
+	pthread_mutex_unlock(&_vhd_lock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
-		return;
-
 	free(s->padbm_buf);
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
+	s->padbm_buf = NULL;
+
+	pthread_mutex_lock(&_vhd_lock);
+
+	if (!--_vhd_users) {
+		munmap(_vhd_zeros, _vhd_zsize);
+		_vhd_zsize  = 0;
+		_vhd_zeros  = NULL;
+	}
+
+	pthread_mutex_unlock(&_vhd_lock);
 }
 
 static char *
@@ -411,6 +527,7 @@ vhd_free_bat(struct vhd_state *s)
 	free(s->bat.bat.bat);
 	free(s->bat.batmap.map);
 	free(s->bat.bat_buf);
+	free(s->bat.batmap_buf);
 	memset(&s->bat, 0, sizeof(struct vhd_bat));
 }
 
@@ -454,12 +571,31 @@ vhd_initialize_bat(struct vhd_state *s)
 					s->vhd.file);
 	}
 
-	err = posix_memalign(&buf, VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+	err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			     VHD_BAT_WRITE_SECS * VHD_SECTOR_SIZE);
 	if (err)
 		goto fail;
 
 	s->bat.bat_buf = buf;
 
+	if (s->bat.batmap.map && batmap_required) {
+		s->bat.batmap_hdr_size =
+			vhd_bytes_padded(sizeof(vhd_batmap_header_t));
+		s->bat.batmap_map_size =
+			vhd_sectors_to_bytes(secs_round_up_no_zero(
+				s->vhd.footer.curr_size >> (VHD_BLOCK_SHIFT + 3)));
+
+		err = posix_memalign(&buf, VHD_SECTOR_SIZE,
+				     s->bat.batmap_hdr_size +
+				     s->bat.batmap_map_size);
+		if (err) {
+			err = -err;
+			goto fail;
+		}
+
+		s->bat.batmap_buf = buf;
+	}
+
 	return 0;
 
 fail:
@@ -470,52 +606,104 @@ fail:
 static void
 vhd_free_bitmap_cache(struct vhd_state *s)
 {
-	int i;
-	struct vhd_bitmap *bm;
+	free(s->bitmap_list);
+	free(s->bitmap_maps);
+	free(s->bm_hash);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	s->bitmap_list   = NULL;
+	s->bitmap_maps   = NULL;
+	s->bm_hash       = NULL;
+	s->bm_cache_size = 0;
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
+}
+
+static int
+vhd_bitmap_cache_env(const char *name, int def)
+{
+	const char *val;
+	char *end;
+	long n;
+
+	val = getenv(name);
+	if (!val)
+		return def;
+
+	n = strtol(val, &end, 0);
+	if (*end || n < 0 || n > INT_MAX) {
+		EPRINTF("ignoring invalid %s=%s\n", name, val);
+		return def;
+	}
+
+	return n;
+}
+
+/*
+ * Size the cache at open: disks small enough to be pinned get a slot
+ * for every block, others get TAPDISK_VHD_BM_CACHE slots.
+ */
+static int
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	int size, pin;
+	uint32_t entries;
+
+	entries = s->bat.bat.entries;
+	size    = vhd_bitmap_cache_env(VHD_CACHE_SIZE_ENV, VHD_CACHE_SIZE);
+	pin     = vhd_bitmap_cache_env(VHD_CACHE_PIN_ENV, VHD_CACHE_PIN_MAX);
+
+	if (entries <= pin || entries <= size) {
+		s->bm_pinned = 1;
+		size = entries;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	/* enough for the bitmaps locked by in-flight allocations */
+	return MAX(size, VHD_BAT_ALLOCS + 1);
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
 	int i, err, map_size;
+	uint32_t hash_size;
 	struct vhd_bitmap *bm;
-	void *map, *shadow;
-
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	void *maps;
 
-	s->bm_lru        = 0;
+	s->bm_cache_size = vhd_bitmap_cache_size(s);
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	hash_size = 1;
+	while (hash_size < s->bm_cache_size)
+		hash_size <<= 1;
 
-		err = posix_memalign(&map, 512, map_size);
-		if (err)
-			goto fail;
+	s->bm_hash_mask = hash_size - 1;
+	s->bm_hash      = calloc(hash_size, sizeof(struct vhd_bitmap *));
+	s->bitmap_list  = calloc(s->bm_cache_size, sizeof(struct vhd_bitmap));
+	if (!s->bm_hash || !s->bitmap_list) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
-		bm->map = map;
+	err = posix_memalign(&maps, 512, (size_t)s->bm_cache_size * map_size * 2);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
 
-		err = posix_memalign(&shadow, 512, map_size);
-		if (err)
-			goto fail;
+	s->bitmap_maps = maps;
+	memset(s->bitmap_maps, 0, (size_t)s->bm_cache_size * map_size * 2);
 
-		bm->shadow = shadow;
+	for (i = 0; i < s->bm_cache_size; i++) {
+		bm = s->bitmap_list + i;
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
+		bm->map    = s->bitmap_maps + (size_t)i * map_size * 2;
+		bm->shadow = bm->map + map_size;
+		list_add_tail(&bm->lru, &s->bm_free);
 	}
 
+	DBG(TLOG_INFO, "%s: bitmap cache: %d entries%s\n", s->vhd.file,
+	    s->bm_cache_size, s->bm_pinned ? ", pinned" : "");
+
 	return 0;
 
 fail:
@@ -523,6 +711,26 @@ fail:
 	return err;
 }
 
+/*
+ * Opt-in: bitmap updates are committed in memory and written by the
+ * next flush, like a volatile write cache. Uncached blocks still need
+ * evictable slots, so unpinned caches keep some bitmaps written through.
+ */
+static void
+vhd_initialize_write_back(struct vhd_state *s)
+{
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY) ||
+	    !vhd_bitmap_cache_env(VHD_WRITE_BACK_ENV, 0))
+		return;
+
+	s->write_back   = 1;
+	s->bm_dirty_max = s->bm_pinned ? s->bm_cache_size :
+		MAX(s->bm_cache_size - VHD_BAT_ALLOCS - 1, 0);
+
+	DBG(TLOG_INFO, "%s: write-back bitmaps, up to %d dirty\n",
+	    s->vhd.file, s->bm_dirty_max);
+}
+
 static int
 vhd_initialize_dynamic_disk(struct vhd_state *s)
 {
@@ -643,6 +851,15 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	s->flags  = flags;
 	s->driver = driver;
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	s->zero_range = test_vhd_flag(flags, VHD_FLAG_OPEN_PREALLOCATE);
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+	s->punch_hole = !test_vhd_flag(flags, VHD_FLAG_OPEN_RDONLY);
+#endif
 
 	err = vhd_initialize(s);
 	if (err)
@@ -660,6 +877,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_open(&s->vhd, name, o_flags);
 		if (err) {
 			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+			vhd_free(s);
 			return err;
 		}
 	}
@@ -674,12 +892,12 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_initialize_dynamic_disk(s);
 		if (err)
 			goto fail;
+
+		vhd_initialize_write_back(s);
 	}
 
 	vhd_log_open(s);
 
-	SPB = s->spb;
-
 	s->vreq_free_count = VHD_REQS_DATA;
 	for (i = 0; i < VHD_REQS_DATA; i++)
 		s->vreq_free[i] = s->vreq_list + i;
@@ -760,10 +978,35 @@ vhd_log_close(struct vhd_state *s)
 		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
 }
 
+/* bitmaps left dirty by write-back; needs the bat in s->vhd */
+static int
+vhd_write_dirty_bitmaps(struct vhd_state *s)
+{
+	struct vhd_bitmap *bm;
+	int err, ret = 0;
+
+	if (!s->bm_dirty)
+		return 0;
+
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY))
+			continue;
+
+		err = vhd_write_bitmap(&s->vhd, bm->blk, bm->map);
+		if (err) {
+			EPRINTF("writing %s bitmap 0x%x: %d\n",
+				s->vhd.file, bm->blk, err);
+			ret = ret ? : err;
+		}
+	}
+
+	return ret;
+}
+
 static int
 _vhd_close(td_driver_t *driver)
 {
-	int err;
+	int err, ret = 0;
 	struct vhd_state *s;
 	
 	DBG(TLOG_WARN, "vhd_close\n");
@@ -784,6 +1027,7 @@ _vhd_close(td_driver_t *driver)
 	 */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_STRICT) || s->writes) {
 		memcpy(&s->vhd.bat, &s->bat.bat, sizeof(vhd_bat_t));
+		ret = vhd_write_dirty_bitmaps(s);
 		err = vhd_write_footer(&s->vhd, &s->vhd.footer);
 		memset(&s->vhd.bat, 0, sizeof(vhd_bat_t));
 
@@ -807,7 +1051,7 @@ _vhd_close(td_driver_t *driver)
 
 	memset(s, 0, sizeof(struct vhd_state));
 
-	return 0;
+	return ret;
 }
 
 int
@@ -953,7 +1197,7 @@ add_to_transaction(struct vhd_transaction *tx, struct vhd_request *r)
 
 	DBG(TLOG_DBG, "blk: 0x%04"PRIx64", lsec: 0x%08"PRIx64", tx: %p, "
 	    "started: %d, finished: %d, status: %u\n",
-	    r->treq.sec / SPB, r->treq.sec, tx,
+	    r->treq.sec / r->state->spb, r->treq.sec, tx,
 	    tx->started, tx->finished, tx->status);
 }
 
@@ -963,41 +1207,124 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline struct vhd_bat_alloc *
+find_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
+	int i;
+	struct vhd_bat_alloc *a;
+
+	if (!s->bat.n_allocs)
+		return NULL;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		a = &s->bat.allocs[i];
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_LIVE) &&
+		    a->blk == blk)
+			return a;
+	}
+
+	return NULL;
 }
 
-static inline void
-lock_bat(struct vhd_state *s)
+static inline int
+bat_allocs_full(struct vhd_state *s)
 {
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return s->bat.n_allocs == VHD_BAT_ALLOCS;
 }
 
-static inline void
-unlock_bat(struct vhd_state *s)
+static struct vhd_bat_alloc *
+get_bat_alloc(struct vhd_state *s, uint32_t blk)
 {
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	int i;
+	struct vhd_bat_alloc *a;
+
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		a = &s->bat.allocs[i];
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_LIVE))
+			continue;
+
+		memset(a, 0, sizeof(*a));
+		init_vhd_request(s, &a->req);
+		a->blk           = blk;
+		a->status        = VHD_FLAG_ALLOC_LIVE;
+		a->req.op        = VHD_OP_BAT_WRITE;
+		a->req.treq.sec  = (uint64_t)blk * s->spb;
+		s->bat.n_allocs++;
+		return a;
+	}
+
+	return NULL;
 }
 
-static inline int
-bat_locked(struct vhd_state *s)
+/*
+ * Give back the extent of a failed allocation. At the end of data, it
+ * and any extents released before it right below are handed out again.
+ * Otherwise it is remembered, in case the ones above fail too. Extents
+ * stranded below a committed block, or not remembered, are unreferenced
+ * slack in the file: nothing points at them, so they are never read.
+ */
+static void
+reclaim_extent(struct vhd_state *s, uint64_t start, uint64_t end)
+{
+	struct vhd_bat_state *bat = &s->bat;
+	int i;
+
+	if (s->next_db != end) {
+		if (bat->n_freed < VHD_BAT_ALLOCS) {
+			bat->freed[bat->n_freed].start = start;
+			bat->freed[bat->n_freed].end   = end;
+			bat->n_freed++;
+		}
+		return;
+	}
+
+	s->next_db = start;
+
+	for (i = 0; i < bat->n_freed; i++)
+		if (bat->freed[i].end == s->next_db) {
+			s->next_db = bat->freed[i].start;
+			bat->freed[i] = bat->freed[--bat->n_freed];
+			i = -1;
+		}
+}
+
+/* extents below a committed block can't come back */
+static void
+strand_extents(struct vhd_state *s, uint64_t offset)
+{
+	struct vhd_bat_state *bat = &s->bat;
+	int i;
+
+	for (i = 0; i < bat->n_freed; i++)
+		if (bat->freed[i].end <= offset)
+			bat->freed[i--] = bat->freed[--bat->n_freed];
+}
+
+/*
+ * @reclaim: the extent can be handed out again, see reclaim_extent.
+ * Only safe once no writes into it can still be in flight.
+ */
+static void
+put_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *a, int reclaim)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	ASSERT(test_vhd_flag(a->status, VHD_FLAG_ALLOC_LIVE));
+	ASSERT(!a->zero_wait && !a->next);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", a->blk, a->error);
+
+	if (reclaim && bat_entry(s, a->blk) == DD_BLK_UNUSED)
+		reclaim_extent(s, a->lb_end, a->offset + s->spb + s->bm_secs);
+
+	memset(a, 0, sizeof(*a));
+	s->bat.n_allocs--;
 }
 
 static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->blk    = 0;
-	bm->seqno  = 0;
-	bm->status = 0;
+	bm->blk       = 0;
+	bm->status    = 0;
+	bm->hash_next = NULL;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
 	clear_req_list(&bm->waiting);
@@ -1006,21 +1333,42 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	init_vhd_request(s, &bm->req);
 }
 
+static inline struct vhd_bitmap **
+__bitmap_hash(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
+}
+
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	for (bm = *__bitmap_hash(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	for (pp = __bitmap_hash(s, bm->blk); *pp; pp = &(*pp)->hash_next)
+		if (*pp == bm) {
+			*pp = bm->hash_next;
+			bm->hash_next = NULL;
+			return;
+		}
+
+	ASSERT(0);
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1046,7 +1394,13 @@ bitmap_valid(struct vhd_bitmap *bm)
 }
 
 static inline int
-bitmap_in_use(struct vhd_bitmap *bm)
+bitmap_dirty(struct vhd_bitmap *bm)
+{
+	return test_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+}
+
+static inline int
+bitmap_busy(struct vhd_bitmap *bm)
 {
 	return (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING)  ||
 		test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING) ||
@@ -1054,6 +1408,32 @@ bitmap_in_use(struct vhd_bitmap *bm)
 		bm->waiting.head || bm->tx.requests.head || bm->queue.head);
 }
 
+/* dirty bitmaps stay cached until written */
+static inline int
+bitmap_in_use(struct vhd_bitmap *bm)
+{
+	return bitmap_busy(bm) || bitmap_dirty(bm);
+}
+
+static inline void
+mark_bitmap_dirty(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (!bitmap_dirty(bm)) {
+		set_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+		lock_bitmap(bm);
+		s->bm_dirty++;
+	}
+}
+
+static inline void
+clean_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (bitmap_dirty(bm)) {
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_DIRTY);
+		s->bm_dirty--;
+	}
+}
+
 static inline int
 bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 {
@@ -1068,28 +1448,27 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+/*
+ * The list is kept in use order, so this normally stops at the tail;
+ * it only walks past bitmaps locked by in-flight requests.
+ */
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	uint64_t seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
-		}
-	}
+	list_for_each_entry_reverse(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		ASSERT(!bitmap_in_use(bm));
+		unhash_bitmap(s, bm);
+		list_del_init(&bm->lru);
+		s->bm_evictions++;
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
@@ -1099,8 +1478,9 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del_init(&bm->lru);
 	} else {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
@@ -1114,63 +1494,32 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_move(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **pp = __bitmap_hash(s, bm->blk);
 
-	ASSERT(0);
+	ASSERT(!get_bitmap(s, bm->blk));
+
+	bm->hash_next = *pp;
+	*pp           = bm;
+	list_add(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	list_move(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1196,9 +1545,13 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
-		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
-			return VHD_BM_BAT_LOCKED;
+		if (op == VHD_OP_DATA_WRITE) {
+			struct vhd_bat_alloc *a = find_bat_alloc(s, blk);
+
+			if (a ? test_vhd_flag(a->status, VHD_FLAG_ALLOC_UNMAP)
+			      : bat_allocs_full(s))
+				return VHD_BM_BAT_LOCKED;
+		}
 
 		return VHD_BM_BAT_CLEAR;
 	}
@@ -1209,11 +1562,14 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
 	/* bump lru count */
 	touch_bitmap(s, bm);
+	s->bm_hits++;
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
 		return VHD_BM_READ_PENDING;
@@ -1273,14 +1629,35 @@ free_vhd_request(struct vhd_state *s, struct vhd_request *req)
 	s->vreq_free[s->vreq_free_count++] = req;
 }
 
+/* data spanning several guest buffers goes out as one vectored iocb */
+static inline int
+aio_prep_vectored(struct vhd_request *req)
+{
+	td_request_t *treq = &req->treq;
+	int cnt;
+
+	if (!treq->iov || td_request_segment_secs(*treq) >= treq->secs)
+		return 0;
+
+	cnt = td_request_iovec(*treq, treq->secs, req->iov, VHD_REQ_IOVS);
+	ASSERT(cnt > 0);
+
+	return cnt;
+}
+
 static inline void
 aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
 	struct tiocb *tiocb = &req->tiocb;
-
-	td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
-		     vhd_sectors_to_bytes(req->treq.secs),
-		     offset, vhd_complete, req);
+	int cnt = aio_prep_vectored(req);
+
+	if (cnt)
+		td_prep_readv(tiocb, s->vhd.fd, req->iov, cnt,
+			      offset, vhd_complete, req);
+	else
+		td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
+			     vhd_sectors_to_bytes(req->treq.secs),
+			     offset, vhd_complete, req);
 	td_queue_tiocb(s->driver, tiocb);
 
 	s->queued++;
@@ -1289,14 +1666,27 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+static inline void
+aio_prep_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
+{
+	struct tiocb *tiocb = &req->tiocb;
+	int cnt = aio_prep_vectored(req);
+
+	if (cnt)
+		td_prep_writev(tiocb, s->vhd.fd, req->iov, cnt,
+			       offset, vhd_complete, req);
+	else
+		td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
+			      vhd_sectors_to_bytes(req->treq.secs),
+			      offset, vhd_complete, req);
+}
+
 static inline void
 aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 {
 	struct tiocb *tiocb = &req->tiocb;
 
-	td_prep_write(tiocb, s->vhd.fd, req->treq.buf,
-		      vhd_sectors_to_bytes(req->treq.secs),
-		      offset, vhd_complete, req);
+	aio_prep_write(s, req, offset);
 	td_queue_tiocb(s->driver, tiocb);
 
 	s->queued++;
@@ -1305,8 +1695,44 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+/* defer a write into a block whose zero fill is still in flight */
+static void
+aio_write_held(struct vhd_state *s, struct vhd_bat_alloc *a,
+	       struct vhd_request *req, uint64_t offset)
+{
+	struct tiocb *tiocb = &req->tiocb;
+
+	aio_prep_write(s, req, offset);
+
+	tiocb->next  = a->zero_wait;
+	a->zero_wait = tiocb;
+
+	s->queued++;
+	s->writes++;
+	s->write_size += req->treq.secs;
+	TRACE(s);
+}
+
+static void
+release_held_writes(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	struct tiocb *tiocb, *next;
+
+	tiocb        = a->zero_wait;
+	a->zero_wait = NULL;
+	clear_vhd_flag(a->status, VHD_FLAG_ALLOC_ZERO_PENDING);
+
+	while (tiocb) {
+		next        = tiocb->next;
+		tiocb->next = NULL;
+		td_queue_tiocb(s->driver, tiocb);
+		tiocb       = next;
+	}
+}
+
 /**
- * Reserves a new extent.
+ * Reserves a new extent. Concurrent allocations each get their own
+ * extent, so the end of data moves forward as soon as one is reserved.
  *
  * @returns a 64-bit unsigned integer where the error code is stored in the
  * upper 32 bits and the reserved block number is stored in the lower 32 bits.
@@ -1314,12 +1740,10 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
  * are undefined.
  */
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+reserve_new_block(struct vhd_state *s, struct vhd_bat_alloc *a)
 {
 	int gap = 0;
 
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
-
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
@@ -1327,74 +1751,180 @@ reserve_new_block(struct vhd_state *s, uint32_t blk)
 	if (s->next_db + gap > UINT_MAX)
 		return (uint64_t)EIO << 32;
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	a->lb_end  = s->next_db;
+	a->offset  = s->next_db + gap;
+	s->next_db = a->offset + s->spb + s->bm_secs;
 
-	return s->next_db;
+	return a->lb_end;
 }
-
-static int
-schedule_bat_write(struct vhd_state *s)
+/*
+ * Unmaps clear batmap bits in memory only. A stale bit on disk would
+ * claim a reallocated block is full, so the batmap and its header go
+ * out ahead of the bat write carrying the unmaps, which stays held
+ * until they are done.
+ */
+static void
+schedule_batmap_write(struct vhd_state *s)
 {
-	int i;
-	uint32_t blk;
+	off64_t off;
+	vhd_batmap_t b;
+	char *hdr, *map;
+	struct vhd_request *req;
+
+	hdr = s->bat.batmap_buf;
+	map = hdr + s->bat.batmap_hdr_size;
+
+	b.header          = s->bat.batmap.header;
+	b.map             = s->bat.batmap.map;
+	b.header.checksum = vhd_checksum_batmap(&s->vhd, &b);
+	vhd_batmap_header_out(&b);
+
+	memset(hdr, 0, s->bat.batmap_hdr_size);
+	memcpy(hdr, &b.header, sizeof(vhd_batmap_header_t));
+	memcpy(map, s->bat.batmap.map, s->bat.batmap_map_size);
+
+	s->bat.batmap_dirty  = 0;
+	s->bat.batmap_writes = 2;
+
+	req            = &s->bat.batmap_req;
+	init_vhd_request(s, req);
+	req->treq.secs = s->bat.batmap_map_size >> VHD_SECTOR_SHIFT;
+	req->treq.buf  = map;
+	req->op        = VHD_OP_BATMAP_WRITE;
+	req->next      = NULL;
+	aio_write(s, req, s->bat.batmap.header.batmap_offset);
+
+	vhd_batmap_header_offset(&s->vhd, &off);
+
+	req            = &s->bat.batmap_hdr_req;
+	init_vhd_request(s, req);
+	req->treq.secs = s->bat.batmap_hdr_size >> VHD_SECTOR_SHIFT;
+	req->treq.buf  = hdr;
+	req->op        = VHD_OP_BATMAP_WRITE;
+	req->next      = NULL;
+	aio_write(s, req, off);
+}
+
+/*
+ * Write out the bat entries of every ready allocation that falls within
+ * VHD_BAT_WRITE_SECS sectors of the lowest one, as a single contiguous
+ * write. Only one bat write is in flight at a time; allocations that
+ * become ready meanwhile are picked up by the next one.
+ */
+static void
+schedule_bat_write(struct vhd_state *s)
+{
+	int i, n;
 	char *buf;
 	uint64_t offset;
+	uint32_t first, last, secs;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *a, *next, *ready;
+
+	ASSERT(s->bat.ready && !s->bat.batch);
+	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+
+	first = UINT_MAX;
+	for (a = s->bat.ready; a; a = a->next)
+		first = MIN(first, a->blk / 128);
+
+	last  = first;
+	ready = NULL;
+	n     = 0;
 
-	ASSERT(bat_locked(s));
+	for (a = s->bat.ready; a; a = next) {
+		uint32_t sec = a->blk / 128;
 
-	req = &s->bat.req;
-	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+		next = a->next;
+		if (sec - first >= VHD_BAT_WRITE_SECS) {
+			a->next = ready;
+			ready   = a;
+			continue;
+		}
+
+		a->next      = s->bat.batch;
+		s->bat.batch = a;
+		last         = MAX(last, sec);
+		n++;
+	}
+	s->bat.ready = ready;
+
+	req  = &s->bat.req;
+	buf  = s->bat.bat_buf;
+	secs = last - first + 1;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, first * 128), vhd_sectors_to_bytes(secs));
 
-	((uint32_t *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (a = s->bat.batch; a; a = a->next)
+		((uint32_t *)buf)[a->blk - first * 128] = a->offset;
 
-	for (i = 0; i < 128; i++)
+	for (i = 0; i < secs * 128; i++)
 		BE32_OUT(&((uint32_t *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
-	req->treq.secs = 1;
+	offset         = s->vhd.header.table_offset +
+		vhd_sectors_to_bytes(first);
+	req->treq.secs = secs;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
 	req->next      = NULL;
 
-	aio_write(s, req, offset);
+	if (s->bat.batmap_dirty) {
+		aio_prep_write(s, req, offset);
+		s->queued++;
+		s->writes++;
+		s->write_size += req->treq.secs;
+		TRACE(s);
+		schedule_batmap_write(s);
+	} else
+		aio_write(s, req, offset);
+
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+	s->bat_writes++;
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	DBG(TLOG_DBG, "entries: %d, secs: %u, table_offset: 0x%08"PRIx64"\n",
+	    n, secs, offset);
+}
 
-	return 0;
+static void
+queue_bat_write(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	ASSERT(!test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED));
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+	    a->blk, a->offset);
+
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED);
+	a->next      = s->bat.ready;
+	s->bat.ready = a;
+
+	if (!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		schedule_bat_write(s);
 }
 
 static void
 schedule_zero_bm_write(struct vhd_state *s,
-		       struct vhd_bitmap *bm, uint64_t lb_end)
+		       struct vhd_bat_alloc *a, struct vhd_bitmap *bm)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &a->zero_req;
 
 	init_vhd_request(s, req);
 
-	offset         = vhd_sectors_to_bytes(lb_end);
+	offset         = vhd_sectors_to_bytes(a->lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
+	req->treq.sec  = (uint64_t)a->blk * s->spb;
+	req->treq.secs = (a->offset - a->lb_end) + s->bm_secs;
 	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    a->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
 	aio_write(s, req, offset);
 }
-
 /* This is a performance optimization. When writing sequentially into full 
  * blocks, skipping (up-to-date) bitmaps causes an approx. 25% reduction in 
  * throughput. To prevent skipping, we issue redundant writes into the (padded) 
@@ -1450,13 +1980,15 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	int err;
 	uint64_t lb_end;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
+	if (find_bat_alloc(s, blk))
 		return 0;
-	}
+
+	if (bat_allocs_full(s))
+		return -EBUSY;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1470,70 +2002,138 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
+	a = get_bat_alloc(s, blk);
+	lb_end = reserve_new_block(s, a);
 	if (lb_end >> 32) {
-		unlock_bat(s);
+		put_bat_alloc(s, a, 0);
+		s->alloc_errors++;
 		return -(lb_end >> 32);
 	}
-	schedule_zero_bm_write(s, bm, lb_end);
+	gettimeofday(&a->ts, NULL);
+	schedule_zero_bm_write(s, a, bm);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
 	return 0;
 }
 
-static int
-allocate_block(struct vhd_state *s, uint32_t blk)
+/*
+ * Release the storage backing a discarded range, where supported, and
+ * finish @req in finish_discard. The queue punches the hole off the
+ * event loop.
+ */
+static void
+schedule_punch_hole(struct vhd_state *s, struct vhd_request *req,
+		    uint64_t sec, uint64_t secs)
 {
-	int err, gap;
-	uint64_t offset, size;
-	struct vhd_bitmap *bm;
-	ssize_t count;
-	uint64_t next_db;
+	struct tiocb *tiocb = &req->tiocb;
 
-	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+	s->queued++;
+	TRACE(s);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
+	if (!s->punch_hole) {
+		vhd_complete(req, tiocb, 0);
+		return;
 	}
 
-	gap     = 0;
-	offset  = vhd_sectors_to_bytes(s->next_db);
-	next_db = s->next_db;
+	td_prep_discard(tiocb, s->vhd.fd, 0, vhd_sectors_to_bytes(sec),
+			vhd_sectors_to_bytes(secs), vhd_complete, req);
+	td_queue_tiocb(s->driver, tiocb);
+}
 
-	/* data region of segment should begin on page boundary */
-	if ((next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((next_db + s->bm_secs) % s->spp));
-		next_db += gap;
-	}
+/* punch a hole under @treq, then complete it */
+static int
+discard_data(struct vhd_state *s, td_request_t treq,
+	     uint64_t sec, uint64_t secs)
+{
+	struct vhd_request *req;
 
-	if (next_db > UINT_MAX)
-		return -EIO;
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
 
-	s->next_db = next_db;
+	req->treq = treq;
+	req->op   = VHD_OP_DATA_DISCARD;
+	req->next = NULL;
 
-	s->bat.pbw_blk = blk;
-	s->bat.pbw_offset = s->next_db;
+	schedule_punch_hole(s, req, sec, secs);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	return 0;
+}
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
-		ERR(s, -errno, "lseek failed\n");
-		return -errno;
-	}
+/*
+ * Zero the extent of a preallocated block. Where the filesystem
+ * supports it, FALLOC_FL_ZERO_RANGE does this by manipulating extents
+ * only. Otherwise queue a write of zeros and hold back data writes
+ * into the block until it completes.
+ */
+static int
+zero_new_block(struct vhd_state *s, struct vhd_bat_alloc *a,
+	       struct vhd_bitmap *bm, uint32_t secs)
+{
+	uint64_t offset;
+	struct vhd_request *req;
 
-	size  = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	count = write(s->vhd.fd, vhd_zeros(size), size);
-	if (count != size) {
-		err = count < 0 ? -errno : -ENOSPC;
-		ERR(s, -errno,
-		    "write failed (%zd, offset %"PRIu64")\n", count, offset);
-		return err;
+	offset = vhd_sectors_to_bytes(a->lb_end);
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (s->zero_range) {
+		int err;
+
+		err = fallocate(s->vhd.fd, FALLOC_FL_ZERO_RANGE,
+				offset, vhd_sectors_to_bytes(secs));
+		if (!err)
+			return 0;
+
+		err = -errno;
+		if (err != -EOPNOTSUPP && err != -ENOSYS) {
+			ERR(s, err, "fallocate failed (offset %"PRIu64")\n",
+			    offset);
+			return err;
+		}
+
+		DPRINTF("%s: zero range not supported, writing zeros\n",
+			s->vhd.file);
+		s->zero_range = 0;
 	}
+#endif
+
+	req = &a->zero_req;
+	init_vhd_request(s, req);
+
+	req->op        = VHD_OP_ZERO_BM_WRITE;
+	req->treq.sec  = (uint64_t)a->blk * s->spb;
+	req->treq.secs = secs;
+	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(secs));
+	req->next      = NULL;
+
+	DBG(TLOG_DBG, "blk: 0x%04x, writing %u zero sectors at 0x%08"PRIx64"\n",
+	    a->blk, secs, offset);
+
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_ZERO_PENDING);
+	lock_bitmap(bm);
+	add_to_transaction(&bm->tx, req);
+	aio_write(s, req, offset);
+
+	s->alloc_zero_writes++;
+	return 0;
+}
+
+static int
+allocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	uint64_t lb_end;
+	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
+
+	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
+
+	a = find_bat_alloc(s, blk);
+	if (a)
+		return a->error ? -EBUSY : 0;
+
+	if (bat_allocs_full(s))
+		return -EBUSY;
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
@@ -1547,10 +2147,33 @@ allocate_block(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
+	a = get_bat_alloc(s, blk);
+	lb_end = reserve_new_block(s, a);
+	if (lb_end >> 32) {
+		put_bat_alloc(s, a, 0);
+		s->alloc_errors++;
+		return -(lb_end >> 32);
+	}
+
+	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
+	    blk, a->offset);
+
+	gettimeofday(&a->ts, NULL);
+
+	err = zero_new_block(s, a, bm,
+			     a->offset - lb_end + s->bm_secs + s->spb);
+	if (err) {
+		s->alloc_errors++;
+		put_bat_alloc(s, a, 1);
+		return err;
+	}
+
+	if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZERO_PENDING))
+		return 0;
+
 	lock_bitmap(bm);
-	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
+	add_to_transaction(&bm->tx, &a->req);
+	queue_bat_write(s, a);
 
 	return 0;
 }
@@ -1607,6 +2230,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	uint32_t blk = 0, sec = 0;
 	struct vhd_bitmap  *bm = NULL;
 	struct vhd_request *req;
+	struct vhd_bat_alloc *a = NULL;
 
 	if (s->vhd.footer.type == HD_TYPE_FIXED) {
 		offset = vhd_sectors_to_bytes(treq.sec);
@@ -1626,7 +2250,9 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		a = find_bat_alloc(s, blk);
+		ASSERT(a);
+		offset = a->offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1658,7 +2284,10 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		   test_batmap(s, blk))
 		schedule_redundant_bm_write(s, blk);
 
-	aio_write(s, req, offset);
+	if (a && test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZERO_PENDING))
+		aio_write_held(s, a, req, offset);
+	else
+		aio_write(s, req, offset);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, sec: 0x%04x, "
 	    "nr_secs: 0x%04x, offset: 0x%08"PRIx64", flags: 0x%08x\n",
@@ -1725,8 +2354,9 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		struct vhd_bat_alloc *a = find_bat_alloc(s, blk);
+		ASSERT(a);
+		offset = a->offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1751,6 +2381,42 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	    req->treq.secs, offset);
 }
 
+/* write a committed bitmap on behalf of a flush */
+static void
+schedule_bitmap_flush(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	uint64_t offset;
+	struct vhd_request *req;
+
+	offset = bat_entry(s, bm->blk);
+
+	ASSERT(bitmap_dirty(bm) && bitmap_valid(bm));
+	ASSERT(!test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
+	ASSERT(offset != DD_BLK_UNUSED);
+
+	/* commits from here on dirty it again */
+	clean_bitmap(s, bm);
+
+	req = &bm->req;
+	init_vhd_request(s, req);
+
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = s->bm_secs;
+	req->treq.buf  = bm->map;
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_BITMAP_FLUSH;
+	req->next      = NULL;
+
+	aio_write(s, req, vhd_sectors_to_bytes(offset));
+	set_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+
+	s->flush_writes++;
+	s->bm_flushed++;
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, offset: 0x%08"PRIx64"\n",
+	    s->vhd.file, bm->blk, offset);
+}
+
 /* 
  * queued requests will be submitted once the bitmap
  * describing them is read and the requests are validated. 
@@ -1787,6 +2453,10 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 	return 0;
 }
 
+/*
+ * Also takes vectored requests: each range below carries whichever
+ * buffers it covers, forwarded or read with one iocb.
+ */
 static void
 vhd_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -1795,6 +2465,9 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	if (treq.iovcnt > VHD_REQ_IOVS)
+		return td_split_request(driver, treq, vhd_queue_read);
+
 	while (treq.secs) {
 		int err;
 		td_request_t clone;
@@ -1848,9 +2521,7 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			break;
 		}
 
-		treq.sec  += clone.secs;
-		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		td_request_advance(&treq, clone.secs);
 		continue;
 
 	fail:
@@ -1860,6 +2531,48 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * An all-zero write to sectors which already read as zero, neither
+ * allocated here with nothing in flight nor anywhere below in the
+ * chain, needs no allocation and no data I/O.
+ */
+static int
+vhd_request_is_zero(td_request_t treq)
+{
+	int secs;
+
+	while (treq.secs > 0) {
+		secs = td_request_segment_secs(treq);
+		if (!tapdisk_buf_is_zero(treq.buf, vhd_sectors_to_bytes(secs)))
+			return 0;
+		td_request_advance(&treq, secs);
+	}
+
+	return 1;
+}
+
+static int
+vhd_elide_zero_write(struct vhd_state *s, td_request_t treq)
+{
+	int n, allocated;
+
+	if (!vhd_request_is_zero(treq))
+		return 0;
+
+	n = td_forward_block_status(treq, &allocated);
+	if (n < treq.secs || allocated)
+		return 0;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->zero_elided++;
+	s->zero_elided_bytes += vhd_sectors_to_bytes(treq.secs);
+	td_complete_request(treq, 0);
+
+	return 1;
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -1868,6 +2581,9 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x, (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
+	if (treq.iovcnt > VHD_REQ_IOVS)
+		return td_split_request(driver, treq, vhd_queue_write);
+
 	while (treq.secs) {
 		int err;
 		uint8_t flags;
@@ -1890,6 +2606,9 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (!find_bat_alloc(s, clone.sec / s->spb) &&
+			    vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1898,6 +2617,9 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_BIT_CLEAR:
 			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (!bitmap_busy(get_bitmap(s, clone.sec / s->spb)) &&
+			    vhd_elide_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1933,9 +2655,7 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			break;
 		}
 
-		treq.sec  += clone.secs;
-		treq.secs -= clone.secs;
-		treq.buf  += vhd_sectors_to_bytes(clone.secs);
+		td_request_advance(&treq, clone.secs);
 		continue;
 
 	fail:
@@ -1945,6 +2665,198 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/* are all sectors of the block outside [sec, sec + secs) unallocated? */
+static int
+bitmap_clear_outside(struct vhd_state *s, struct vhd_bitmap *bm,
+		     uint32_t sec, int secs)
+{
+	uint32_t i;
+
+	for (i = 0; i < s->spb; i++) {
+		if (i == sec) {
+			i += secs - 1;
+			continue;
+		}
+
+		if (vhd_bitmap_test(&s->vhd, bm->shadow, i))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Drop a block from the bat. Reads see the block unallocated right
+ * away; writes into it are held off until the bat entry is on disk.
+ */
+static int
+unmap_block(struct vhd_state *s, uint32_t blk, td_request_t treq)
+{
+	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
+	int full;
+
+	bm = get_bitmap(s, blk);
+	if (bm && bitmap_busy(bm))
+		return -EBUSY;
+
+	if (bat_allocs_full(s))
+		return -EBUSY;
+
+	/* goes out with the bat write, see schedule_batmap_write */
+	full = test_batmap(s, blk);
+	if (full) {
+		vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+		s->bat.batmap_dirty = 1;
+	}
+
+	if (bm) {
+		clean_bitmap(s, bm);
+		unlock_bitmap(bm);
+		free_vhd_bitmap(s, bm);
+	}
+
+	a          = get_bat_alloc(s, blk);
+	a->offset  = DD_BLK_UNUSED;
+	a->lb_end  = bat_entry(s, blk);
+	a->discard = treq;
+	set_vhd_flag(a->status, VHD_FLAG_ALLOC_UNMAP);
+	if (full)
+		set_vhd_flag(a->status, VHD_FLAG_ALLOC_BATMAP);
+
+	bat_entry(s, blk) = DD_BLK_UNUSED;
+	queue_bat_write(s, a);
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, old: 0x%08"PRIx64"\n",
+	    s->vhd.file, blk, a->lb_end);
+
+	return 0;
+}
+
+/*
+ * Clear the bitmap bits of a discarded range as part of the next
+ * bitmap transaction, like a data write which clears instead of sets.
+ */
+static int
+discard_bitmap(struct vhd_state *s, struct vhd_bitmap *bm, td_request_t treq)
+{
+	uint64_t offset;
+	struct vhd_request *req;
+
+	req = alloc_vhd_request(s);
+	if (!req)
+		return -EBUSY;
+
+	req->treq  = treq;
+	req->flags = VHD_FLAG_REQ_UPDATE_BITMAP;
+	req->op    = VHD_OP_DATA_DISCARD;
+	req->next  = NULL;
+
+	lock_bitmap(bm);
+
+	if (bm->tx.closed) {
+		add_to_tail(&bm->queue, req);
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_QUEUED);
+	} else
+		add_to_transaction(&bm->tx, req);
+
+	offset = bat_entry(s, bm->blk) + s->bm_secs + treq.sec % s->spb;
+	schedule_punch_hole(s, req, offset, treq.secs);
+
+	return 0;
+}
+
+static int
+discard_block(struct vhd_state *s, td_request_t treq)
+{
+	uint32_t blk, sec;
+	struct vhd_bitmap *bm;
+
+	blk = treq.sec / s->spb;
+	sec = treq.sec % s->spb;
+
+	if (blk >= s->vhd.header.max_bat_size)
+		return -EINVAL;
+
+	if (find_bat_alloc(s, blk))
+		return -EBUSY;
+
+	if (bat_entry(s, blk) == DD_BLK_UNUSED)
+		goto done;
+
+	if (!sec && treq.secs == s->spb)
+		return unmap_block(s, blk, treq);
+
+	/* a full block has no bits to spare; just drop the data */
+	if (test_batmap(s, blk))
+		return discard_data(s, treq,
+				    bat_entry(s, blk) + s->bm_secs + sec,
+				    treq.secs);
+
+	bm = get_bitmap(s, blk);
+	if (!bm) {
+		int err = schedule_bitmap_read(s, blk);
+		if (err)
+			return err;
+		return __vhd_queue_request(s, VHD_OP_DATA_DISCARD, treq);
+	}
+
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
+		return __vhd_queue_request(s, VHD_OP_DATA_DISCARD, treq);
+
+	if (!bitmap_busy(bm) && bitmap_clear_outside(s, bm, sec, treq.secs))
+		return unmap_block(s, blk, treq);
+
+	return discard_bitmap(s, bm, treq);
+
+done:
+	td_complete_request(treq, 0);
+	return 0;
+}
+
+/*
+ * Whole blocks are dropped from the bat, partial ones have their
+ * bitmap bits cleared; either way later reads of the range are
+ * forwarded to the parent, or zero-filled by the last image. Backing
+ * storage is released by punching holes where the file supports it.
+ */
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	s->discards++;
+	s->discard_secs += treq.secs;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		int err = discard_data(s, treq, treq.sec, treq.secs);
+		if (err)
+			td_complete_request(treq, err);
+		return;
+	}
+
+	while (treq.secs) {
+		int err;
+		td_request_t clone;
+
+		clone      = treq;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+
+		err = discard_block(s, clone);
+		if (err) {
+			clone.secs = treq.secs;
+			td_complete_request(clone, err);
+			break;
+		}
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+	}
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -2002,9 +2914,14 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 			tx->finished++;
 			if (!r->error) {
 				uint32_t sec = r->treq.sec % s->spb;
-				for (i = 0; i < r->treq.secs; i++)
-					vhd_bitmap_set(&s->vhd,
-						       bm->shadow, sec + i);
+				for (i = 0; i < r->treq.secs; i++) {
+					if (r->op == VHD_OP_DATA_DISCARD)
+						vhd_bitmap_clear(&s->vhd,
+								 bm->shadow, sec + i);
+					else
+						vhd_bitmap_set(&s->vhd,
+							       bm->shadow, sec + i);
+				}
 			}
 		}
 		r = next;
@@ -2018,15 +2935,17 @@ start_new_bitmap_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 static void
 finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	a = find_bat_alloc(s, bm->blk);
+	if (!a)
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
+	if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED))
 		return;
 
-	if (!s->bat.req.error)
+	if (!a->error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -2037,8 +2956,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	put_bat_alloc(s, a, 1);
 }
 
 static void
@@ -2055,10 +2973,10 @@ finish_bitmap_transaction(struct vhd_state *s,
 	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
 			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
+			struct vhd_bat_alloc *a = find_bat_alloc(s, bm->blk);
+			ASSERT(a && test_vhd_flag(a->status,
+						  VHD_FLAG_ALLOC_BAT_QUEUED));
+			a->tx = tx;
 			return;
 		}
 	}
@@ -2069,6 +2987,8 @@ finish_bitmap_transaction(struct vhd_state *s,
 	} else {
 		/* complete atomic write */
 		memcpy(bm->map, bm->shadow, map_size);
+		if (test_vhd_flag(tx->status, VHD_FLAG_TX_WRITE_BACK))
+			mark_bitmap_dirty(s, bm);
 		if (!test_batmap(s, bm->blk) && bitmap_full(s, bm))
 			set_batmap(s, bm->blk);
 	}
@@ -2084,6 +3004,27 @@ finish_bitmap_transaction(struct vhd_state *s,
 	finish_bat_transaction(s, bm);
 }
 
+/*
+ * Write-back transactions commit without writing the bitmap, leaving
+ * it dirty for the next flush. Bitmaps with a flush write in flight
+ * can take no other write, so those are always deferred.
+ */
+static int
+defer_bitmap_write(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	if (!s->write_back)
+		return 0;
+
+	if (!bitmap_dirty(bm) && s->bm_dirty >= s->bm_dirty_max &&
+	    !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING))
+		return 0;
+
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_WRITE_BACK);
+	s->bm_deferred++;
+
+	return 1;
+}
+
 static void
 finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
@@ -2093,58 +3034,166 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
 	tx->closed = 1;
 
-	if (!tx->error)
+	if (!tx->error && !defer_bitmap_write(s, bm))
 		return schedule_bitmap_write(s, bm->blk);
 
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
 static void
-finish_bat_write(struct vhd_request *req)
+account_allocation(struct vhd_state *s, struct vhd_bat_alloc *a)
+{
+	struct timeval now, delta;
+	uint64_t usecs;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &a->ts, &delta);
+	usecs = (uint64_t)delta.tv_sec * 1000000 + delta.tv_usec;
+
+	s->allocs++;
+	s->alloc_lat_total += usecs;
+	if (usecs > s->alloc_lat_max)
+		s->alloc_lat_max = usecs;
+}
+
+static void
+finish_bat_unmap(struct vhd_state *s, struct vhd_bat_alloc *a, int error)
+{
+	uint64_t lb_end;
+	td_request_t treq = a->discard;
+
+	DBG(TLOG_DBG, "blk 0x%04x, old: 0x%08"PRIx64", err %d\n",
+	    a->blk, a->lb_end, error);
+
+	clear_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED);
+
+	if (error) {
+		/* the block is still there; so is its batmap bit */
+		bat_entry(s, a->blk) = a->lb_end;
+		if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_BATMAP)) {
+			vhd_batmap_set(&s->vhd, &s->bat.batmap, a->blk);
+			s->bat.batmap_dirty = 1;
+		}
+		put_bat_alloc(s, a, 0);
+		td_complete_request(treq, error);
+		return;
+	}
+
+	lb_end = a->lb_end;
+	s->unmaps++;
+	put_bat_alloc(s, a, 0);
+
+	/* the block is gone either way, only its storage may linger */
+	if (discard_data(s, treq, lb_end, s->bm_secs + s->spb))
+		td_complete_request(treq, 0);
+}
+
+static void
+finish_bat_alloc(struct vhd_state *s, struct vhd_bat_alloc *a, int error)
 {
 	struct vhd_bitmap *bm;
 	struct vhd_transaction *tx;
-	struct vhd_state *s = req->state;
 
-	s->returned++;
-	TRACE(s);
+	if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_UNMAP))
+		return finish_bat_unmap(s, a, error);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	bm = get_bitmap(s, a->blk);
 
 	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
+	    a->blk, a->offset, error);
 	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	ASSERT(test_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED));
 
 	tx = &bm->tx;
 	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+	clear_vhd_flag(a->status, VHD_FLAG_ALLOC_BAT_QUEUED);
+
+	if (!error) {
+		bat_entry(s, a->blk) = a->offset;
+		strand_extents(s, a->offset);
+		account_allocation(s, a);
+	} else {
+		a->error  = error;
+		tx->error = error;
+		s->alloc_errors++;
+	}
 
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
 		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
+		remove_from_req_list(&tx->requests, &a->req);
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
 	} else {
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+		if (a->tx)
+			finish_bitmap_transaction(s, bm, error);
 	}
 
 	finish_bat_transaction(s, bm);
 }
 
+static void
+finish_batmap_write(struct vhd_request *req)
+{
+	int err;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	if (req->error && !s->bat.error)
+		s->bat.error = req->error;
+
+	if (--s->bat.batmap_writes)
+		return;
+
+	err          = s->bat.error;
+	s->bat.error = 0;
+
+	if (!err) {
+		td_queue_tiocb(s->driver, &s->bat.req.tiocb);
+		return;
+	}
+
+	/* fail the held bat write; the next batch retries the batmap */
+	s->bat.batmap_dirty = 1;
+	vhd_complete(&s->bat.req, &s->bat.req.tiocb, err);
+}
+
+static void
+finish_bat_write(struct vhd_request *req)
+{
+	struct vhd_bat_alloc *a, *next;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	ASSERT(test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+
+	a            = s->bat.batch;
+	s->bat.batch = NULL;
+
+	while (a) {
+		next    = a->next;
+		a->next = NULL;
+		finish_bat_alloc(s, a, req->error);
+		a       = next;
+	}
+
+	if (s->bat.ready &&
+	    !test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED))
+		schedule_bat_write(s);
+}
+
 static void
 finish_zero_bm_write(struct vhd_request *req)
 {
 	uint32_t blk;
 	struct vhd_bitmap *bm;
+	struct vhd_bat_alloc *a;
 	struct vhd_transaction *tx = req->tx;
 	struct vhd_state *s = req->state;
 
@@ -2153,22 +3202,29 @@ finish_zero_bm_write(struct vhd_request *req)
 
 	blk = req->treq.sec / s->spb;
 	bm  = get_bitmap(s, blk);
+	a   = find_bat_alloc(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
+	ASSERT(a && &a->zero_req == req);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
+	if (test_vhd_flag(a->status, VHD_FLAG_ALLOC_ZERO_PENDING))
+		release_held_writes(s, a);
+
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
-		schedule_bat_write(s);
+		s->alloc_errors++;
+		/* held writes may still land in the extent; don't reuse it */
+		put_bat_alloc(s, a, 0);
+	} else {
+		if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
+			add_to_transaction(tx, &a->req);
+		queue_bat_write(s, a);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2226,12 +3282,15 @@ finish_bitmap_read(struct vhd_request *req)
 			free_vhd_request(s, r);
 
 			ASSERT(tmp.op == VHD_OP_DATA_READ || 
-			       tmp.op == VHD_OP_DATA_WRITE);
+			       tmp.op == VHD_OP_DATA_WRITE ||
+			       tmp.op == VHD_OP_DATA_DISCARD);
 
 			if (tmp.op == VHD_OP_DATA_READ)
 				vhd_queue_read(s->driver, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
+			else
+				vhd_queue_discard(s->driver, tmp.treq);
 
 			r = next;
 		}
@@ -2272,6 +3331,131 @@ finish_bitmap_write(struct vhd_request *req)
 	finish_bitmap_transaction(s, bm, req->error);
 }
 
+static void start_flush(struct vhd_state *);
+
+static void
+finish_flush(struct vhd_state *s, int error)
+{
+	struct vhd_request *r;
+
+	r = s->flush_active.head;
+
+	clear_req_list(&s->flush_active);
+	s->flush_error = 0;
+
+	signal_completion(r, error);
+
+	if (s->flush_queue.head)
+		start_flush(s);
+}
+
+static void
+finish_flush_sync(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	finish_flush(s, req->error);
+}
+
+/* the round's bitmaps are on disk; sync the file and device caches */
+static void
+schedule_flush_sync(struct vhd_state *s)
+{
+	struct vhd_request *req = &s->flush_req;
+
+	if (s->flush_error)
+		return finish_flush(s, s->flush_error);
+
+	init_vhd_request(s, req);
+	req->op   = VHD_OP_FLUSH;
+	req->next = NULL;
+
+	td_prep_fdsync(&req->tiocb, s->vhd.fd, vhd_complete, req);
+	td_queue_tiocb(s->driver, &req->tiocb);
+
+	s->queued++;
+	TRACE(s);
+}
+
+/* one round writes every bitmap dirty when it starts */
+static void
+start_flush(struct vhd_state *s)
+{
+	struct vhd_bitmap *bm;
+
+	ASSERT(!s->flush_writes && !s->flush_active.head);
+
+	s->flush_active = s->flush_queue;
+	clear_req_list(&s->flush_queue);
+
+	list_for_each_entry(bm, &s->bm_lru, lru)
+		if (bitmap_dirty(bm))
+			schedule_bitmap_flush(s, bm);
+
+	if (!s->flush_writes)
+		schedule_flush_sync(s);
+}
+
+static void
+finish_bitmap_flush(struct vhd_request *req)
+{
+	uint32_t blk;
+	struct vhd_bitmap *bm;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	TRACE(s);
+
+	blk = req->treq.sec / s->spb;
+	bm  = get_bitmap(s, blk);
+
+	DBG(TLOG_DBG, "blk: 0x%04x, err: %d\n", blk, req->error);
+	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING);
+
+	if (req->error) {
+		mark_bitmap_dirty(s, bm);
+		s->flush_error = (s->flush_error ? : req->error);
+	}
+
+	if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+
+	if (!--s->flush_writes)
+		schedule_flush_sync(s);
+}
+
+/*
+ * Writes are on disk by the time they complete; what a flush adds is
+ * the bitmaps deferred by write-back, then an fdatasync of the file
+ * and device caches, issued through the queue. Flushes arriving during
+ * a round may be missing writes from it, so they wait for the next one.
+ */
+static void
+vhd_queue_flush(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_request *req;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	s->flushes++;
+
+	req = alloc_vhd_request(s);
+	if (!req) {
+		td_complete_request(treq, -EBUSY);
+		return;
+	}
+
+	req->treq = treq;
+	add_to_tail(&s->flush_queue, req);
+
+	if (!s->flush_writes && !s->flush_active.head)
+		start_flush(s);
+}
+
 static void
 finish_data_read(struct vhd_request *req)
 {
@@ -2308,8 +3492,14 @@ finish_data_write(struct vhd_request *req)
 		    req->treq.sec / s->spb, tx->started, tx->finished);
 
 		if (!req->error)
-			for (i = 0; i < req->treq.secs; i++)
-				vhd_bitmap_set(&s->vhd, bm->shadow,  sec + i);
+			for (i = 0; i < req->treq.secs; i++) {
+				if (req->op == VHD_OP_DATA_DISCARD)
+					vhd_bitmap_clear(&s->vhd,
+							 bm->shadow, sec + i);
+				else
+					vhd_bitmap_set(&s->vhd,
+						       bm->shadow, sec + i);
+			}
 
 		if (transaction_completed(tx))
 			finish_data_transaction(s, bm);
@@ -2322,12 +3512,26 @@ finish_data_write(struct vhd_request *req)
 	}
 }
 
+/* a range that could not be released is still discarded */
+static void
+finish_discard(struct vhd_request *req)
+{
+	struct vhd_state *s = req->state;
+
+	if (req->error == -EOPNOTSUPP || req->error == -ENOSYS) {
+		DPRINTF("%s: hole punching not supported\n", s->vhd.file);
+		s->punch_hole = 0;
+	}
+
+	req->error = 0;
+	finish_data_write(req);
+}
+
 void
 vhd_complete(void *arg, struct tiocb *tiocb, int err)
 {
 	struct vhd_request *req = (struct vhd_request *)arg;
 	struct vhd_state *s = req->state;
-	struct iocb *io = &tiocb->iocb;
 
 	s->completed++;
 	TRACE(s);
@@ -2338,7 +3542,8 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		ERR(s, req->error, "%s: op: %u, lsec: %"PRIu64", secs: %u, "
 		    "nbytes: %lu, blk: %"PRIu64", blk_offset: %u",
 		    s->vhd.file, req->op, req->treq.sec, req->treq.secs,
-		    io->u.c.nbytes, req->treq.sec / s->spb,
+		    (unsigned long)vhd_sectors_to_bytes(req->treq.secs),
+		    req->treq.sec / s->spb,
 		    bat_entry(s, req->treq.sec / s->spb));
 
 	switch (req->op) {
@@ -2358,6 +3563,14 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bitmap_write(req);
 		break;
 
+	case VHD_OP_BITMAP_FLUSH:
+		finish_bitmap_flush(req);
+		break;
+
+	case VHD_OP_FLUSH:
+		finish_flush_sync(req);
+		break;
+
 	case VHD_OP_ZERO_BM_WRITE:
 		finish_zero_bm_write(req);
 		break;
@@ -2370,6 +3583,14 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bat_write(req);
 		break;
 
+	case VHD_OP_BATMAP_WRITE:
+		finish_batmap_write(req);
+		break;
+
+	case VHD_OP_DATA_DISCARD:
+		finish_discard(req);
+		break;
+
 	default:
 		ASSERT(0);
 		break;
@@ -2380,6 +3601,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2402,16 +3624,16 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	DBG(TLOG_WARN, "BITMAP CACHE: (%d entries%s) HITS: %"PRIu64", "
+	    "MISSES: %"PRIu64", EVICTIONS: %"PRIu64"\n", s->bm_cache_size,
+	    s->bm_pinned ? ", pinned" : "", s->bm_hits, s->bm_misses,
+	    s->bm_evictions);
+	i = 0;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
-			continue;
-
 		tx = &bm->tx;
 		r = bm->queue.head;
 		while (r) {
@@ -2437,11 +3659,33 @@ vhd_debug(td_driver_t *driver)
 		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
 		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
+		i++;
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, allocs: %d, ready: %p, "
+	    "batch: %p\n", s->bat.status, s->bat.n_allocs, s->bat.ready,
+	    s->bat.batch);
+	for (i = 0; i < VHD_BAT_ALLOCS; i++) {
+		struct vhd_bat_alloc *a = &s->bat.allocs[i];
+
+		if (!test_vhd_flag(a->status, VHD_FLAG_ALLOC_LIVE))
+			continue;
+
+		DBG(TLOG_WARN, "%d: blk: 0x%04x, pbw_off: 0x%08"PRIx64", "
+		    "status: 0x%02x, err: %d, tx: %p, held: %p\n", i, a->blk,
+		    a->offset, a->status, a->error, a->tx, a->zero_wait);
+	}
+	DBG(TLOG_WARN, "ALLOCS: %"PRIu64", ZERO_WRITES: %"PRIu64", "
+	    "ERRORS: %"PRIu64", AVG_LAT: %"PRIu64"us, MAX_LAT: %"PRIu64"us, "
+	    "BAT_WRITES: %"PRIu64"\n",
+	    s->allocs, s->alloc_zero_writes, s->alloc_errors,
+	    s->allocs ? s->alloc_lat_total / s->allocs : 0, s->alloc_lat_max,
+	    s->bat_writes);
+	DBG(TLOG_WARN, "ZERO_ELIDED: %"PRIu64", ZERO_ELIDED_BYTES: %"PRIu64"\n",
+	    s->zero_elided, s->zero_elided_bytes);
+	DBG(TLOG_WARN, "FLUSHES: %"PRIu64", WRITE_BACK: %d, DIRTY: %d, "
+	    "DEFERRED: %"PRIu64", FLUSH_WRITES: %d\n", s->flushes,
+	    s->write_back, s->bm_dirty, s->bm_deferred, s->flush_writes);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2449,6 +3693,102 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static void
+vhd_stats(td_driver_t *driver, td_stats_t *st)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	tapdisk_stats_field(st, "alloc", "{");
+	tapdisk_stats_field(st, "count", "llu", s->allocs);
+	tapdisk_stats_field(st, "zero_writes", "llu", s->alloc_zero_writes);
+	tapdisk_stats_field(st, "errors", "llu", s->alloc_errors);
+	tapdisk_stats_field(st, "lat_total_us", "llu", s->alloc_lat_total);
+	tapdisk_stats_field(st, "lat_max_us", "llu", s->alloc_lat_max);
+	tapdisk_stats_field(st, "bat_writes", "llu", s->bat_writes);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "discard", "{");
+	tapdisk_stats_field(st, "count", "llu", s->discards);
+	tapdisk_stats_field(st, "secs", "llu", s->discard_secs);
+	tapdisk_stats_field(st, "unmaps", "llu", s->unmaps);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "zero_elided", "{");
+	tapdisk_stats_field(st, "count", "llu", s->zero_elided);
+	tapdisk_stats_field(st, "bytes", "llu", s->zero_elided_bytes);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "flush", "{");
+	tapdisk_stats_field(st, "count", "llu", s->flushes);
+	tapdisk_stats_field(st, "write_back", "d", s->write_back);
+	tapdisk_stats_field(st, "dirty", "d", s->bm_dirty);
+	tapdisk_stats_field(st, "deferred", "llu", s->bm_deferred);
+	tapdisk_stats_field(st, "bitmap_writes", "llu", s->bm_flushed);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "bitmap_cache", "{");
+	tapdisk_stats_field(st, "size", "d", s->bm_cache_size);
+	tapdisk_stats_field(st, "pinned", "d", s->bm_pinned);
+	tapdisk_stats_field(st, "hits", "llu", s->bm_hits);
+	tapdisk_stats_field(st, "misses", "llu", s->bm_misses);
+	tapdisk_stats_field(st, "evictions", "llu", s->bm_evictions);
+	tapdisk_stats_leave(st, '}');
+}
+
+/*
+ * Allocation from the BAT and, where cached and settled, the block
+ * bitmap. Blocks whose bitmap is not at hand are reported allocated.
+ */
+static int
+vhd_block_status(td_driver_t *driver, td_sector_t sector, int secs,
+		 int *allocated)
+{
+	struct vhd_state *s = driver->data;
+	struct vhd_bitmap *bm;
+	uint32_t blk, sec;
+	int n, run, val;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		*allocated = 1;
+		return secs;
+	}
+
+	for (run = 0; run < secs; run += n) {
+		blk = (sector + run) / s->spb;
+		sec = (sector + run) % s->spb;
+		n   = MIN(secs - run, s->spb - sec);
+
+		if (blk >= s->vhd.header.max_bat_size)
+			return run ? run : -EINVAL;
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED)
+			val = !!find_bat_alloc(s, blk);
+		else if (test_batmap(s, blk))
+			val = 1;
+		else {
+			bm = get_bitmap(s, blk);
+			if (!bm || bitmap_busy(bm))
+				val = 1;
+			else {
+				val = !!vhd_bitmap_test(&s->vhd, bm->map, sec);
+				n   = read_bitmap_cache_span(s, sector + run,
+							     n, val);
+			}
+		}
+
+		if (!run)
+			*allocated = val;
+		else if (val != *allocated)
+			break;
+
+		/* bitmap run ended inside the block */
+		if (sec + n < s->spb && run + n < secs)
+			return run + n;
+	}
+
+	return run;
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2457,7 +3797,13 @@ struct tap_disk tapdisk_vhd = {
 	.td_close           = _vhd_close,
 	.td_queue_read      = vhd_queue_read,
 	.td_queue_write     = vhd_queue_write,
+	.td_queue_readv     = vhd_queue_read,
+	.td_queue_writev    = vhd_queue_write,
+	.td_queue_discard   = vhd_queue_discard,
+	.td_queue_flush     = vhd_queue_flush,
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_block_status    = vhd_block_status,
 };
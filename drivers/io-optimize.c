@@ -51,6 +51,12 @@ opio_free(struct opioctx *ctx)
 
 	free(ctx->event_queue);
 	ctx->event_queue = NULL;
+
+	free(ctx->iovs);
+	ctx->iovs = NULL;
+
+	free(ctx->free_iovs);
+	ctx->free_iovs = NULL;
 }
 
 int
@@ -67,13 +73,24 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
 
+	/* a vectored merge spans at least two iocbs */
+	ctx->num_iovs      = (num_iocbs + 1) / 2;
+	ctx->free_iov_cnt  = ctx->num_iovs;
+	ctx->iovs          = calloc(ctx->num_iovs * OPIO_MAX_IOVS,
+				    sizeof(struct iovec));
+	ctx->free_iovs     = calloc(1, sizeof(struct iovec *) * ctx->num_iovs);
+
 	if (!ctx->opios || !ctx->free_opios ||
-	    !ctx->iocb_queue || !ctx->event_queue)
+	    !ctx->iocb_queue || !ctx->event_queue ||
+	    !ctx->iovs || !ctx->free_iovs)
 		goto fail;
 
 	for (i = 0; i < num_iocbs; i++)
 		ctx->free_opios[i] = &ctx->opios[i];
 
+	for (i = 0; i < ctx->num_iovs; i++)
+		ctx->free_iovs[i] = &ctx->iovs[i * OPIO_MAX_IOVS];
+
 	return 0;
 
  fail:
@@ -89,9 +106,20 @@ alloc_opio(struct opioctx *ctx)
 	return ctx->free_opios[--ctx->free_opio_cnt];
 }
 
+static inline struct iovec *
+alloc_iovs(struct opioctx *ctx)
+{
+	if (ctx->free_iov_cnt <= 0)
+		return NULL;
+	return ctx->free_iovs[--ctx->free_iov_cnt];
+}
+
 static inline void
 free_opio(struct opioctx *ctx, struct opio *op)
 {
+	if (op->iov)
+		ctx->free_iovs[ctx->free_iov_cnt++] = op->iov;
+
 	memset(op, 0, sizeof(struct opio));
 	ctx->free_opios[ctx->free_opio_cnt++] = op;
 }
@@ -101,9 +129,11 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
+	io->u.c.offset     = op->offset;
 }
 
 static inline int
@@ -116,10 +146,39 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 	return (iop >= start && iop < end);
 }
 
+static inline struct opio *
+iocb_vectored(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op;
+
+	if (!iocb_optimized(ctx, io))
+		return NULL;
+
+	op = (struct opio *)io->data;
+	return op->iov ? op : NULL;
+}
+
+/* u.v overlays u.c once a head goes vectored */
+static inline unsigned long
+iocb_nbytes(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op = iocb_vectored(ctx, io);
+
+	return op ? op->iovbytes : io->u.c.nbytes;
+}
+
+static inline long long
+iocb_offset(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op = iocb_vectored(ctx, io);
+
+	return op ? op->offset : io->u.c.offset;
+}
+
 static inline int
-contiguous_sectors(struct iocb *l, struct iocb *r)
+contiguous_sectors(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	return (iocb_offset(ctx, l) + iocb_nbytes(ctx, l) == r->u.c.offset);
 }
 
 static inline int
@@ -129,11 +188,10 @@ contiguous_buffers(struct iocb *l, struct iocb *r)
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+contiguous_iocbs(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
 	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+		contiguous_sectors(ctx, l, r));
 }
 
 static inline void
@@ -155,6 +213,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
 	op->data   = io->data;
+	op->opcode = io->aio_lio_opcode;
 	op->iocb   = io;
 	io->data   = op;
 
@@ -192,19 +251,87 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	return 0;
 }
 
+/*
+ * Sector-contiguous iocbs whose buffers are not adjacent are gathered
+ * into a single PREADV/PWRITEV on the head, one iovec per buffer run.
+ */
+static int
+merge_vector(struct opioctx *ctx, struct iocb *head, struct iocb *io)
+{
+	struct opio *ophead, *opio;
+	struct iovec *iov;
+
+	ophead = opio_get(ctx, head);
+	if (!ophead)
+		return -ENOMEM;
+
+	if (ophead->iov) {
+		iov = &ophead->iov[ophead->iovcnt - 1];
+		if (iov->iov_base + iov->iov_len != io->u.c.buf &&
+		    ophead->iovcnt == OPIO_MAX_IOVS)
+			return -E2BIG;
+	} else {
+		iov = alloc_iovs(ctx);
+		if (!iov)
+			return -ENOMEM;
+
+		iov->iov_base    = head->u.c.buf;
+		iov->iov_len     = head->u.c.nbytes;
+		ophead->iov      = iov;
+		ophead->iovcnt   = 1;
+		ophead->iovbytes = head->u.c.nbytes;
+	}
+
+	opio = opio_get(ctx, io);
+	if (!opio)
+		return -ENOMEM;
+
+	if (iov->iov_base + iov->iov_len == io->u.c.buf)
+		iov->iov_len += io->u.c.nbytes;
+	else {
+		iov = &ophead->iov[ophead->iovcnt++];
+		iov->iov_base = io->u.c.buf;
+		iov->iov_len  = io->u.c.nbytes;
+	}
+
+	opio->head        = ophead;
+	ophead->iovbytes += io->u.c.nbytes;
+	ophead->list.tail = ophead->list.tail->next = opio;
+
+	head->aio_lio_opcode = (ophead->opcode == IO_CMD_PREAD ?
+				IO_CMD_PREADV : IO_CMD_PWRITEV);
+	head->u.v.vec        = ophead->iov;
+	head->u.v.nr         = ophead->iovcnt;
+	head->u.v.offset     = ophead->offset;
+
+	return 0;
+}
+
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	struct opio *ophead = iocb_vectored(ctx, head);
+	short opcode = ophead ? ophead->opcode : head->aio_lio_opcode;
+
+	if (opcode != io->aio_lio_opcode)
+		return -EINVAL;
+
+	/* iocbs prepared vectored by drivers stay as they are */
+	if (opcode != IO_CMD_PREAD && opcode != IO_CMD_PWRITE)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (!contiguous_iocbs(ctx, head, io))
 		return -EINVAL;
 
-	return merge_tail(ctx, head, io);		
+	if (!ophead && contiguous_buffers(head, io))
+		return merge_tail(ctx, head, io);
+
+	return merge_vector(ctx, head, io);
 }
 
 #if (defined(TEST) || defined(DEBUG))
+static inline void __print_iocb(struct opioctx *, struct iocb *, char *);
+
 static void
 print_optimized_iocbs(struct opioctx *ctx, struct opio *op, int *cnt)
 {
@@ -322,7 +449,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == iocb_nbytes(ctx, io))
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -374,9 +501,12 @@ static inline void
 __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
-	    io->u.c.buf, (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write"),
-	    (unsigned long)io->data, iocb_optimized(ctx, io));
+	    " optimized: %d, vectored: %d\n", prefix, iocb_offset(ctx, io),
+	    iocb_nbytes(ctx, io), io->u.c.buf,
+	    (io->aio_lio_opcode == IO_CMD_PREAD ||
+	     io->aio_lio_opcode == IO_CMD_PREADV ? "read" : "write"),
+	    (unsigned long)io->data, iocb_optimized(ctx, io),
+	    iocb_vectored(ctx, io) ? iocb_vectored(ctx, io)->iovcnt : 0);
 }
 
 #define print_iocb(ctx, io) __print_iocb(ctx, io, "")
@@ -477,7 +607,8 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 }
 
 static int
-simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
+simulate_io(struct opioctx *ctx,
+	    struct iocb **iocbs, struct io_event *events, int num_iocbs)
 {
 	int i, done;
 	struct iocb *io;
@@ -492,7 +623,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_nbytes(ctx, io) : 0);
 	}
 
 	return done;
@@ -627,7 +758,8 @@ main(int argc, char **argv)
 			DBG(&ctx, "optimized remaining: %d\n", op_rem);
 
 			DBG(&ctx, "simulating\n");
-			num_events = simulate_io(ioqueue + op_done, events, op_rem);
+			num_events = simulate_io(&ctx, ioqueue + op_done,
+						 events, op_rem);
 			print_events(&ctx, events, num_events);
 
 			DBG(&ctx, "splitting %d\n", num_events);
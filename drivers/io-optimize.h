@@ -19,6 +19,10 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/* segments in one vectored merge */
+#define OPIO_MAX_IOVS       32
 
 struct opio;
 
@@ -32,6 +36,10 @@ struct opio {
 	unsigned long       nbytes;
 	long long           offset;
 	void               *data;
+	short               opcode;
+	struct iovec       *iov;       /* head of a vectored merge */
+	int                 iovcnt;
+	unsigned long       iovbytes;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
@@ -46,6 +54,10 @@ struct opioctx {
 	struct opio       **free_opios;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
+	int                 num_iovs;
+	int                 free_iov_cnt;
+	struct iovec       *iovs;
+	struct iovec      **free_iovs;
 };
 
 int opio_init(struct opioctx *ctx, int num_iocbs);
@@ -0,0 +1,65 @@
+/* 
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __IO_URING_COMPAT
+#define __IO_URING_COMPAT
+
+/*
+ * Minimal io_uring syscall wrappers. We drive the rings directly
+ * rather than depend on liburing, the same way libaio-compat.h gets
+ * at eventfd.
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifdef __NR_io_uring_setup
+#define TAPDISK_IO_URING
+
+/* IORING_OP_FALLOCATE is an enum; 5.6 headers also brought this */
+#ifdef IORING_FEAT_RW_CUR_POS
+#define TAPDISK_IO_URING_FALLOCATE
+#endif
+
+static inline int tapdisk_sys_io_uring_setup(unsigned entries,
+					     struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int tapdisk_sys_io_uring_enter(int fd, unsigned to_submit,
+					     unsigned min_complete,
+					     unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int tapdisk_sys_io_uring_register(int fd, unsigned opcode,
+						const void *arg,
+						unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+#endif /* __NR_io_uring_setup */
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif /* __IO_URING_COMPAT */
@@ -43,6 +43,8 @@ struct blktap_device_info {
 };
 
 #define BLKTAP_DEVICE_RO        0x00000001UL
+#define BLKTAP_DEVICE_DISCARD   0x00000002UL
+#define BLKTAP_DEVICE_FLUSH     0x00000004UL
 
 /*
  * I/O ring
@@ -72,16 +74,23 @@ struct blktap_segment {
 
 #define BLKTAP_OP_READ          0
 #define BLKTAP_OP_WRITE         1
+#define BLKTAP_OP_FLUSH         3
+#define BLKTAP_OP_DISCARD       5
 
 #define BLKTAP_SEGMENT_MAX      11
 
+#define BLKTAP_REQ_FUA          0x0001
+
 struct blktap_ring_request {
 	uint8_t                 operation;
 	uint8_t                 nr_segments;
-	uint16_t                __pad;
+	uint16_t                flags;
 	uint64_t                id;
 	uint64_t                sector_number;
-	struct blktap_segment   seg[BLKTAP_SEGMENT_MAX];
+	union {
+		struct blktap_segment   seg[BLKTAP_SEGMENT_MAX];
+		uint64_t                nr_sectors;  /* BLKTAP_OP_DISCARD */
+	};
 };
 
 #define BLKTAP_RSP_EOPNOTSUPP  -2
@@ -20,10 +20,13 @@
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include "tapdisk.h"
 #include "scheduler.h"
@@ -33,6 +36,7 @@
 #define BUG_ON(_cond)                if (_cond) td_panic()
 
 #define SCHEDULER_MAX_TIMEOUT        600
+#define SCHEDULER_MAX_EVENTS         64
 #define SCHEDULER_POLL_FD           (SCHEDULER_POLL_READ_FD |	\
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
@@ -40,10 +44,15 @@
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
-#define scheduler_for_each_event(s, event)	\
-	list_for_each_entry(event, &(s)->events, next)
-#define scheduler_for_each_event_safe(s, event, tmp)	\
-	list_for_each_entry_safe(event, tmp, &(s)->events, next)
+#define scheduler_hash(s, id)       (&(s)->hash[(id) % SCHEDULER_HASH_SIZE])
+
+/*
+ * Fd events are kept in epoll, level-triggered, so each wait costs
+ * O(ready fds). Several events may watch the same fd (e.g. a reader
+ * and a writer on one socket); they share a single epoll registration
+ * whose interest set is the union of their unmasked modes. Timeouts
+ * are timers on the wheel below, shared with scheduler_add_timer().
+ */
 
 typedef struct event {
 	char                         mode;
@@ -55,147 +64,461 @@ typedef struct event {
 
 	int                          fd;
 	int                          timeout;
-	int                          deadline;
+	scheduler_timer_t            timer;
 
 	event_cb_t                   cb;
 	void                        *private;
 
+	struct event                *fd_next;
+
 	struct list_head             next;
+	struct list_head             pending_next;
 } event_t;
 
+struct scheduler_fd {
+	event_t                     *events;
+	uint32_t                     mask;
+};
+
+static inline uint64_t
+scheduler_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* -- timer wheel -- */
+
+#define WHEEL_MASK                  (SCHEDULER_WHEEL_SIZE - 1)
+#define WHEEL_SHIFT(_level)         ((_level) * SCHEDULER_WHEEL_BITS)
+#define WHEEL_SPAN(_level)          ((uint64_t)1 << WHEEL_SHIFT(_level))
+#define WHEEL_MAX                   WHEEL_SPAN(SCHEDULER_WHEEL_LEVELS)
+
 static void
-scheduler_prepare_events(scheduler_t *s)
+scheduler_wheel_init(struct scheduler_wheel *w)
 {
-	int diff;
-	struct timeval now;
-	event_t *event;
+	int l, i;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	for (l = 0; l < SCHEDULER_WHEEL_LEVELS; l++) {
+		for (i = 0; i < SCHEDULER_WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&w->slots[l][i]);
+		w->occupied[l] = 0;
+	}
 
-	s->max_fd  = -1;
-	s->timeout = SCHEDULER_MAX_TIMEOUT;
+	INIT_LIST_HEAD(&w->expired);
+	w->n_timers = 0;
+	w->now      = scheduler_now();
+}
 
-	gettimeofday(&now, NULL);
+/*
+ * Level n takes timers due in [64^n, 64^(n+1)) ms, in the slot of
+ * their expiry at that resolution. That slot comes up, and cascades
+ * to the levels below, no later than the expiry itself. Timers
+ * beyond the top level park in its furthest slot and are re-filed
+ * when it comes up.
+ */
+static void
+scheduler_wheel_insert(struct scheduler_wheel *w, scheduler_timer_t *timer)
+{
+	uint64_t expires = timer->expires, delta;
+	int level;
 
-	scheduler_for_each_event(s, event) {
-		if (event->masked || event->dead)
+	if (expires <= w->now) {
+		timer->level = -1;
+		list_add_tail(&timer->entry, &w->expired);
+		return;
+	}
+
+	delta = expires - w->now;
+	if (delta >= WHEEL_MAX) {
+		delta   = WHEEL_MAX - 1;
+		expires = w->now + delta;
+	}
+
+	for (level = 0; level < SCHEDULER_WHEEL_LEVELS - 1; level++)
+		if (delta < WHEEL_SPAN(level + 1))
+			break;
+
+	timer->level = level;
+	timer->slot  = (expires >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+
+	list_add_tail(&timer->entry, &w->slots[level][timer->slot]);
+	w->occupied[level] |= 1ULL << timer->slot;
+}
+
+static void
+scheduler_wheel_remove(struct scheduler_wheel *w, scheduler_timer_t *timer)
+{
+	list_del_init(&timer->entry);
+
+	if (timer->level >= 0 &&
+	    list_empty(&w->slots[timer->level][timer->slot]))
+		w->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+/*
+ * The next tick at which a slot expires or cascades, from the first
+ * occupied slot after the current one on each level.
+ */
+static uint64_t
+scheduler_wheel_next(struct scheduler_wheel *w)
+{
+	uint64_t next = UINT64_MAX, bits, tick;
+	int level, cur;
+
+	for (level = 0; level < SCHEDULER_WHEEL_LEVELS; level++) {
+		bits = w->occupied[level];
+		if (!bits)
 			continue;
 
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+		cur  = ((w->now >> WHEEL_SHIFT(level)) + 1) & WHEEL_MASK;
+		bits = (bits >> cur) |
+			(cur ? bits << (SCHEDULER_WHEEL_SIZE - cur) : 0);
+
+		tick = (w->now >> WHEEL_SHIFT(level)) + 1 + __builtin_ctzll(bits);
+		tick <<= WHEEL_SHIFT(level);
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+		next = MIN(next, tick);
+	}
+
+	return next;
+}
+
+static void
+scheduler_wheel_cascade(struct scheduler_wheel *w, int level, int slot)
+{
+	scheduler_timer_t *timer, *tmp;
+	struct list_head list;
+
+	INIT_LIST_HEAD(&list);
+	list_splice_tail(&w->slots[level][slot], &list);
+	INIT_LIST_HEAD(&w->slots[level][slot]);
+	w->occupied[level] &= ~(1ULL << slot);
+
+	list_for_each_entry_safe(timer, tmp, &list, entry) {
+		list_del_init(&timer->entry);
+		scheduler_wheel_insert(w, timer);
+	}
+}
+
+/*
+ * Move the wheel to @to, jumping straight between the ticks where
+ * something is due, and collect expired timers.
+ */
+static void
+scheduler_wheel_advance(struct scheduler_wheel *w, uint64_t to)
+{
+	scheduler_timer_t *timer, *tmp;
+	uint64_t next;
+	int level, slot;
+
+	while (w->now < to) {
+		next = scheduler_wheel_next(w);
+		if (next > to) {
+			w->now = to;
+			break;
 		}
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
+		w->now = next;
+
+		for (level = 1; level < SCHEDULER_WHEEL_LEVELS; level++) {
+			if (next & (WHEEL_SPAN(level) - 1))
+				break;
+			slot = (next >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+			scheduler_wheel_cascade(w, level, slot);
 		}
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
+		slot = next & WHEEL_MASK;
+		list_for_each_entry_safe(timer, tmp, &w->slots[0][slot], entry) {
+			timer->level = -1;
+			list_move_tail(&timer->entry, &w->expired);
 		}
+		w->occupied[0] &= ~(1ULL << slot);
 	}
+}
+
+/* ms until the next timer is due, capped at @max */
+static int
+scheduler_wheel_timeout(struct scheduler_wheel *w, int max)
+{
+	uint64_t next, now;
+
+	if (!list_empty(&w->expired))
+		return 0;
+
+	if (!w->n_timers)
+		return max;
+
+	next = scheduler_wheel_next(w);
+	now  = scheduler_now();
+
+	if (next <= now)
+		return 0;
+
+	return MIN(next - now, (uint64_t)max);
+}
+
+static void
+scheduler_run_timers(scheduler_t *s)
+{
+	struct scheduler_wheel *w = &s->wheel;
+	scheduler_timer_t *timer;
+	struct list_head list;
+
+	scheduler_wheel_advance(w, scheduler_now());
+
+	/* timers re-added by their callbacks wait for the next round */
+	INIT_LIST_HEAD(&list);
+	list_splice_tail(&w->expired, &list);
+	INIT_LIST_HEAD(&w->expired);
+
+	while (!list_empty(&list)) {
+		timer = list_entry(list.next, scheduler_timer_t, entry);
+		list_del_init(&timer->entry);
+		w->n_timers--;
+
+		timer->cb(timer, timer->private);
+	}
+}
+
+void
+scheduler_timer_init(scheduler_timer_t *timer,
+		     scheduler_timer_cb_t cb, void *private)
+{
+	INIT_LIST_HEAD(&timer->entry);
+	timer->expires = 0;
+	timer->level   = -1;
+	timer->slot    = 0;
+	timer->cb      = cb;
+	timer->private = private;
+}
+
+/* (re)arm @timer to fire @ms from now */
+void
+scheduler_add_timer(scheduler_t *s, scheduler_timer_t *timer, int ms)
+{
+	struct scheduler_wheel *w = &s->wheel;
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	if (scheduler_timer_pending(timer))
+		scheduler_del_timer(s, timer);
+
+	timer->expires = scheduler_now() + MAX(ms, 0);
+
+	scheduler_wheel_insert(w, timer);
+	w->n_timers++;
+}
+
+void
+scheduler_del_timer(scheduler_t *s, scheduler_timer_t *timer)
+{
+	if (!scheduler_timer_pending(timer))
+		return;
+
+	scheduler_wheel_remove(&s->wheel, timer);
+	s->wheel.n_timers--;
 }
 
 static int
-scheduler_check_fd_events(scheduler_t *s, int nfds)
+scheduler_fd_reserve(scheduler_t *s, int fd)
 {
-	event_t *event;
+	struct scheduler_fd *fds;
+	int n;
 
-	scheduler_for_each_event(s, event) {
-		if (!nfds)
-			break;
+	if (fd < s->n_fds)
+		return 0;
+
+	n = MAX(s->n_fds * 2, 64);
+	while (n <= fd)
+		n *= 2;
+
+	fds = realloc(s->fds, n * sizeof(*fds));
+	if (!fds)
+		return -ENOMEM;
+
+	memset(fds + s->n_fds, 0, (n - s->n_fds) * sizeof(*fds));
+
+	s->fds   = fds;
+	s->n_fds = n;
 
-		if (event->dead)
+	return 0;
+}
+
+static uint32_t
+scheduler_fd_mask(struct scheduler_fd *sfd)
+{
+	uint32_t mask = 0;
+	event_t *event;
+
+	for (event = sfd->events; event; event = event->fd_next) {
+		if (event->masked || event->dead)
 			continue;
 
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			event->pending |= SCHEDULER_POLL_READ_FD;
-			--nfds;
-		}
+		if (event->mode & SCHEDULER_POLL_READ_FD)
+			mask |= EPOLLIN;
+		if (event->mode & SCHEDULER_POLL_WRITE_FD)
+			mask |= EPOLLOUT;
+		if (event->mode & SCHEDULER_POLL_EXCEPT_FD)
+			mask |= EPOLLPRI;
+	}
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			event->pending |= SCHEDULER_POLL_WRITE_FD;
-			--nfds;
-		}
+	return mask;
+}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			event->pending |= SCHEDULER_POLL_EXCEPT_FD;
-			--nfds;
-		}
+/*
+ * Bring the epoll interest set of @fd in line with its events. An fd
+ * with no unmasked events is removed from epoll altogether, lest
+ * EPOLLHUP/EPOLLERR keep waking us up for nobody.
+ */
+static int
+scheduler_fd_update(scheduler_t *s, int fd)
+{
+	struct scheduler_fd *sfd = &s->fds[fd];
+	struct epoll_event ev;
+	uint32_t mask;
+	int op, err;
+
+	mask = scheduler_fd_mask(sfd);
+	if (mask == sfd->mask)
+		return 0;
+
+	if (!mask)
+		op = EPOLL_CTL_DEL;
+	else if (!sfd->mask)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events  = mask;
+	ev.data.fd = fd;
+
+	err = epoll_ctl(s->epoll_fd, op, fd, &ev);
+	if (err && op != EPOLL_CTL_DEL) {
+		err = -errno;
+		DBG("epoll_ctl(%d, %d, %#x): %d\n", op, fd, mask, err);
+		return err;
 	}
 
-	return nfds;
+	sfd->mask = mask;
+
+	return 0;
 }
 
 static void
-scheduler_check_timeouts(scheduler_t *s)
+scheduler_fd_unlink(scheduler_t *s, event_t *event)
+{
+	event_t **pos;
+
+	for (pos = &s->fds[event->fd].events; *pos; pos = &(*pos)->fd_next)
+		if (*pos == event) {
+			*pos = event->fd_next;
+			break;
+		}
+
+	event->fd_next = NULL;
+	scheduler_fd_update(s, event->fd);
+}
+
+static event_t *
+scheduler_find_event(scheduler_t *s, event_id_t id)
 {
-	struct timeval now;
 	event_t *event;
 
-	gettimeofday(&now, NULL);
+	if (id <= 0)
+		return NULL;
 
-	scheduler_for_each_event(s, event) {
-		BUG_ON(event->pending && event->masked);
+	list_for_each_entry(event, scheduler_hash(s, id), next)
+		if (event->id == id)
+			return event;
 
-		if (event->dead)
-			continue;
+	return NULL;
+}
 
-		if (event->pending)
-			continue;
+static inline void
+scheduler_set_pending(scheduler_t *s, event_t *event, char mode)
+{
+	if (!event->pending)
+		list_add_tail(&event->pending_next, &s->pending);
 
-		if (!(event->mode & SCHEDULER_POLL_TIMEOUT))
-			continue;
+	event->pending |= mode;
+}
 
-		if (event->deadline > now.tv_sec)
-			continue;
+/* s->timeout is in ms, max_timeout in seconds */
+static void
+scheduler_prepare_events(scheduler_t *s)
+{
+	s->timeout = scheduler_wheel_timeout(&s->wheel,
+					     s->max_timeout * 1000);
+}
+
+static void
+scheduler_check_fd_events(scheduler_t *s,
+			  struct epoll_event *events, int nfds)
+{
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		uint32_t revents = events[i].events;
+		int fd = events[i].data.fd;
+		event_t *event;
+
+		for (event = s->fds[fd].events; event; event = event->fd_next) {
+			char mode = 0;
 
-		event->pending = SCHEDULER_POLL_TIMEOUT;
+			if (event->masked || event->dead)
+				continue;
+
+			if ((event->mode & SCHEDULER_POLL_READ_FD) &&
+			    (revents & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+				mode |= SCHEDULER_POLL_READ_FD;
+
+			if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
+			    (revents & (EPOLLOUT|EPOLLERR)))
+				mode |= SCHEDULER_POLL_WRITE_FD;
+
+			if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+			    (revents & EPOLLPRI))
+				mode |= SCHEDULER_POLL_EXCEPT_FD;
+
+			if (mode)
+				scheduler_set_pending(s, event, mode);
+		}
 	}
 }
 
-static int
-scheduler_check_events(scheduler_t *s, int nfds)
+static void
+scheduler_event_timeout(scheduler_timer_t *timer, void *private)
 {
-	if (nfds)
-		nfds = scheduler_check_fd_events(s, nfds);
+	event_t *event = containerof(timer, event_t, timer);
+	scheduler_t *s = private;
 
-	scheduler_check_timeouts(s);
+	BUG_ON(event->masked || event->dead);
 
-	return nfds;
+	/* rearmed by scheduler_event_callback */
+	if (!event->pending)
+		scheduler_set_pending(s, event, SCHEDULER_POLL_TIMEOUT);
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_check_events(scheduler_t *s, struct epoll_event *events, int nfds)
 {
-	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		event->deadline = now.tv_sec + event->timeout;
-	}
+	if (nfds)
+		scheduler_check_fd_events(s, events, nfds);
+
+	scheduler_run_timers(s);
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
+{
+	if (event->masked)
+		return;
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_add_timer(s, &event->timer, event->timeout * 1000);
 
-	if (!event->masked)
-		event->cb(event->id, mode, event->private);
+	event->cb(event->id, mode, event->private);
 }
 
 static int
@@ -204,19 +527,17 @@ scheduler_run_events(scheduler_t *s)
 	event_t *event;
 	int n_dispatched = 0;
 
-	scheduler_for_each_event(s, event) {
+	while (!list_empty(&s->pending)) {
 		char pending;
 
-		if (event->dead)
-			continue;
+		event = list_entry(s->pending.next, event_t, pending_next);
+		list_del_init(&event->pending_next);
 
 		pending = event->pending;
-		if (pending) {
-			event->pending = 0;
-			/* NB. must clear before cb */
-			scheduler_event_callback(event, pending);
-			n_dispatched++;
-		}
+		event->pending = 0;
+		/* NB. must clear before cb */
+		scheduler_event_callback(s, event, pending);
+		n_dispatched++;
 	}
 
 	return n_dispatched;
@@ -227,7 +548,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 			 int timeout, event_cb_t cb, void *private)
 {
 	event_t *event;
-	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -235,27 +556,52 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	if (!(mode & SCHEDULER_POLL_TIMEOUT) && !(mode & SCHEDULER_POLL_FD))
 		return -EINVAL;
 
+	if ((mode & SCHEDULER_POLL_FD) && fd < 0)
+		return -EBADF;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_fd_reserve(s, fd);
+		if (err)
+			return err;
+	}
+
 	event = calloc(1, sizeof(event_t));
 	if (!event)
 		return -ENOMEM;
 
-	gettimeofday(&now, NULL);
-
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->pending_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
 	event->timeout  = timeout;
-	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
 	event->id       = s->uuid++;
 	event->masked   = 0;
 
-	if (!s->uuid)
-		s->uuid++;
+	if (s->uuid <= 0)
+		s->uuid = 1;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		event->fd_next     = s->fds[fd].events;
+		s->fds[fd].events  = event;
+
+		err = scheduler_fd_update(s, fd);
+		if (err) {
+			s->fds[fd].events = event->fd_next;
+			free(event);
+			return err;
+		}
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		scheduler_timer_init(&event->timer,
+				     scheduler_event_timeout, s);
+		scheduler_add_timer(s, &event->timer, timeout * 1000);
+	}
 
-	list_add_tail(&event->next, &s->events);
+	list_add_tail(&event->next, scheduler_hash(s, event->id));
 
 	return event->id;
 }
@@ -265,14 +611,20 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 {
 	event_t *event;
 
-	if (!id)
+	event = scheduler_find_event(s, id);
+	if (!event)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->dead = 1;
-			break;
-		}
+	event->dead = 1;
+
+	if (event->mode & SCHEDULER_POLL_FD)
+		scheduler_fd_unlink(s, event);
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT)
+		scheduler_del_timer(s, &event->timer);
+
+	list_del_init(&event->pending_next);
+	list_move_tail(&event->next, &s->dead);
 }
 
 void
@@ -280,14 +632,26 @@ scheduler_mask_event(scheduler_t *s, event_id_t id, int masked)
 {
 	event_t *event;
 
-	if (!id)
+	event = scheduler_find_event(s, id);
+	if (!event)
 		return;
 
-	scheduler_for_each_event(s, event)
-		if (event->id == id) {
-			event->masked = !!masked;
-			break;
-		}
+	masked = !!masked;
+	if (event->masked == masked)
+		return;
+
+	event->masked = masked;
+
+	if (event->mode & SCHEDULER_POLL_FD)
+		scheduler_fd_update(s, event->fd);
+
+	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
+		if (masked)
+			scheduler_del_timer(s, &event->timer);
+		else
+			scheduler_add_timer(s, &event->timer,
+					    event->timeout * 1000);
+	}
 }
 
 static void
@@ -295,11 +659,10 @@ scheduler_gc_events(scheduler_t *s)
 {
 	event_t *event, *next;
 
-	scheduler_for_each_event_safe(s, event, next)
-		if (event->dead) {
-			list_del(&event->next);
-			free(event);
-		}
+	list_for_each_entry_safe(event, next, &s->dead, next) {
+		list_del(&event->next);
+		free(event);
+	}
 }
 
 void
@@ -312,8 +675,8 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
+	struct epoll_event events[SCHEDULER_MAX_EVENTS];
 	int ret;
-	struct timeval tv;
 
 	s->depth++;
 	ret = 0;
@@ -326,22 +689,19 @@ scheduler_wait_for_events(scheduler_t *s)
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	ret = epoll_wait(s->epoll_fd, events, SCHEDULER_MAX_EVENTS,
+			 s->timeout);
 
 	if (ret < 0)
 		goto out;
 
-	ret = scheduler_check_events(s, ret);
-	BUG_ON(ret);
+	scheduler_check_events(s, events, ret);
+	ret = 0;
 
-	s->timeout     = SCHEDULER_MAX_TIMEOUT;
+	s->timeout     = SCHEDULER_MAX_TIMEOUT * 1000;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	scheduler_run_events(s);
@@ -355,17 +715,51 @@ out:
 	return ret;
 }
 
-void
+int
 scheduler_initialize(scheduler_t *s)
 {
+	int i;
+
 	memset(s, 0, sizeof(scheduler_t));
 
 	s->uuid  = 1;
 	s->depth = 0;
 
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	for (i = 0; i < SCHEDULER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&s->hash[i]);
+
+	INIT_LIST_HEAD(&s->pending);
+	INIT_LIST_HEAD(&s->dead);
+
+	scheduler_wheel_init(&s->wheel);
 
-	INIT_LIST_HEAD(&s->events);
+	s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epoll_fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+void
+scheduler_destroy(scheduler_t *s)
+{
+	event_t *event, *next;
+	int i;
+
+	for (i = 0; i < SCHEDULER_HASH_SIZE; i++)
+		list_for_each_entry_safe(event, next, &s->hash[i], next)
+			list_move_tail(&event->next, &s->dead);
+
+	scheduler_gc_events(s);
+
+	free(s->fds);
+	s->fds   = NULL;
+	s->n_fds = 0;
+
+	scheduler_wheel_init(&s->wheel);
+
+	if (s->epoll_fd >= 0) {
+		close(s->epoll_fd);
+		s->epoll_fd = -1;
+	}
 }
@@ -18,7 +18,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <stdint.h>
 
 #include "list.h"
 
@@ -27,24 +27,68 @@
 #define SCHEDULER_POLL_EXCEPT_FD     0x4
 #define SCHEDULER_POLL_TIMEOUT       0x8
 
+#define SCHEDULER_HASH_SIZE          64
+
+#define SCHEDULER_WHEEL_BITS         6
+#define SCHEDULER_WHEEL_SIZE         (1 << SCHEDULER_WHEEL_BITS)
+#define SCHEDULER_WHEEL_LEVELS       5
+
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+typedef struct scheduler_timer       scheduler_timer_t;
+typedef void (*scheduler_timer_cb_t)(scheduler_timer_t *timer, void *private);
+
+struct event;
+struct scheduler_fd;
+
+/*
+ * A one-shot timer, embedded in its owner. Adding, re-adding and
+ * deleting are O(1); callbacks run from the event loop and may re-add
+ * the timer.
+ */
+struct scheduler_timer {
+	struct list_head             entry;
+	uint64_t                     expires;  /* ms */
+	int                          level;
+	int                          slot;
+	scheduler_timer_cb_t         cb;
+	void                        *private;
+};
+
+/*
+ * Hierarchical timer wheel with 1ms ticks: level n slots span
+ * 64^n ms, timers cascade down a level as their slot comes up.
+ */
+struct scheduler_wheel {
+	uint64_t                     now;
+	struct list_head             slots[SCHEDULER_WHEEL_LEVELS]
+					  [SCHEDULER_WHEEL_SIZE];
+	uint64_t                     occupied[SCHEDULER_WHEEL_LEVELS];
+	struct list_head             expired;
+	int                          n_timers;
+};
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
+
+	struct scheduler_fd         *fds;
+	int                          n_fds;
 
-	struct list_head             events;
+	struct scheduler_wheel       wheel;
+
+	struct list_head             hash[SCHEDULER_HASH_SIZE];
+	struct list_head             pending;
+	struct list_head             dead;
 
 	int                          uuid;
-	int                          max_fd;
 	int                          timeout;
 	int                          max_timeout;
 	int                          depth;
 } scheduler_t;
 
-void scheduler_initialize(scheduler_t *);
+int scheduler_initialize(scheduler_t *);
+void scheduler_destroy(scheduler_t *);
 event_id_t scheduler_register_event(scheduler_t *, char mode,
 				    int fd, int timeout,
 				    event_cb_t cb, void *private);
@@ -53,4 +97,15 @@ void scheduler_mask_event(scheduler_t *, event_id_t, int masked);
 void scheduler_set_max_timeout(scheduler_t *, int);
 int scheduler_wait_for_events(scheduler_t *);
 
+void scheduler_timer_init(scheduler_timer_t *,
+			  scheduler_timer_cb_t cb, void *private);
+void scheduler_add_timer(scheduler_t *, scheduler_timer_t *, int ms);
+void scheduler_del_timer(scheduler_t *, scheduler_timer_t *);
+
+static inline int
+scheduler_timer_pending(const scheduler_timer_t *timer)
+{
+	return !list_empty(&timer->entry);
+}
+
 #endif
@@ -209,6 +209,12 @@ tapdisk_blktap_put_response(td_blktap_t *tap,
 	case TD_OP_WRITE:
 		op = BLKTAP_OP_WRITE;
 		break;
+	case TD_OP_DISCARD:
+		op = BLKTAP_OP_DISCARD;
+		break;
+	case TD_OP_FLUSH:
+		op = BLKTAP_OP_FLUSH;
+		break;
 	default:
 		BUG();
 	}
@@ -281,6 +287,21 @@ tapdisk_blktap_vector_request(td_blktap_t *tap,
 	vreq->sec    = msg->sector_number;
 }
 
+static void
+tapdisk_blktap_discard_request(td_blktap_t *tap,
+			       const blktap_ring_req_t *msg,
+			       td_blktap_req_t *req)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+
+	req->iov[0].base = NULL;
+	req->iov[0].secs = msg->nr_sectors;
+
+	vreq->iov    = req->iov;
+	vreq->iovcnt = 1;
+	vreq->sec    = msg->sector_number;
+}
+
 static int
 tapdisk_blktap_parse_request(td_blktap_t *tap,
 			     const blktap_ring_req_t *msg, td_blktap_req_t *req)
@@ -297,6 +318,12 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 	case BLKTAP_OP_WRITE:
 		op = TD_OP_WRITE;
 		break;
+	case BLKTAP_OP_DISCARD:
+		op = TD_OP_DISCARD;
+		break;
+	case BLKTAP_OP_FLUSH:
+		op = TD_OP_FLUSH;
+		break;
 	default:
 		goto fail;
 	}
@@ -304,8 +331,14 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 	if (msg->id > BLKTAP_RING_SIZE)
 		goto fail;
 
-	if (msg->nr_segments < 1 ||
-	    msg->nr_segments > BLKTAP_SEGMENT_MAX)
+	if (op == TD_OP_DISCARD) {
+		if (msg->nr_sectors < 1 || msg->nr_sectors > INT_MAX)
+			goto fail;
+	} else if (op == TD_OP_FLUSH) {
+		if (msg->nr_segments)
+			goto fail;
+	} else if (msg->nr_segments < 1 ||
+		   msg->nr_segments > BLKTAP_SEGMENT_MAX)
 		goto fail;
 
 	req->id = msg->id;
@@ -317,7 +350,16 @@ tapdisk_blktap_parse_request(td_blktap_t *tap,
 	vreq->token = tap;
 	vreq->cb    = __tapdisk_blktap_request_cb;
 
-	tapdisk_blktap_vector_request(tap, msg, req);
+	if (op == TD_OP_WRITE && (msg->flags & BLKTAP_REQ_FUA))
+		td_flag_set(vreq->flags, TD_VBD_REQ_FUA);
+
+	if (op == TD_OP_DISCARD)
+		tapdisk_blktap_discard_request(tap, msg, req);
+	else if (op == TD_OP_FLUSH) {
+		vreq->iov    = req->iov;
+		vreq->iovcnt = 0;
+	} else
+		tapdisk_blktap_vector_request(tap, msg, req);
 
 	err = 0;
 fail:
@@ -418,7 +460,8 @@ tapdisk_blktap_compat_create_device(td_blktap_t *tap,
 
 int
 tapdisk_blktap_create_device(td_blktap_t *tap,
-			     const td_disk_info_t *info, int rdonly)
+			     const td_disk_info_t *info, int rdonly,
+			     int discard)
 {
 	struct blktap_device_info bdi;
 	unsigned long flags;
@@ -428,6 +471,8 @@ tapdisk_blktap_create_device(td_blktap_t *tap,
 
 	flags  = 0;
 	flags |= rdonly ? BLKTAP_DEVICE_RO : 0;
+	flags |= discard && !rdonly ? BLKTAP_DEVICE_DISCARD : 0;
+	flags |= !rdonly ? BLKTAP_DEVICE_FLUSH : 0;
 
 	bdi.capacity             = info->size;
 	bdi.sector_size          = info->sector_size;
@@ -449,10 +494,14 @@ tapdisk_blktap_create_device(td_blktap_t *tap,
 	return err;
 }
 
+#define BLKTAP_DATA_SIZE \
+	(BLKTAP_RING_SIZE * BLKTAP_SEGMENT_MAX * BLKTAP_PAGE_SIZE)
+
 static void
 tapdisk_blktap_unmap(td_blktap_t *tap)
 {
 	if (tap->vma) {
+		tapdisk_server_unregister_buffer(tap->vstart);
 		munmap(tap->vma, tap->vma_size);
 		tap->vma = NULL;
 	}
@@ -464,9 +513,7 @@ tapdisk_blktap_map(td_blktap_t *tap)
 	int prot, flags, err;
 	void *vma;
 
-	tap->vma_size =
-		1 + (BLKTAP_RING_SIZE *
-		     BLKTAP_SEGMENT_MAX * BLKTAP_PAGE_SIZE);
+	tap->vma_size = 1 + BLKTAP_DATA_SIZE;
 
 	prot  = PROT_READ | PROT_WRITE;
 	flags = MAP_SHARED;
@@ -484,6 +531,9 @@ tapdisk_blktap_map(td_blktap_t *tap)
 	tap->rsp_prod_pvt = 0;
 	tap->sring        = vma;
 
+	/* optional, I/O falls back to plain buffers */
+	tapdisk_server_register_buffer(tap->vstart, BLKTAP_DATA_SIZE);
+
 	return 0;
 
 fail:
@@ -65,7 +65,8 @@ struct td_blktap {
 int tapdisk_blktap_open(const char *, td_vbd_t *, td_blktap_t **);
 void tapdisk_blktap_close(td_blktap_t *);
 
-int tapdisk_blktap_create_device(td_blktap_t *, const td_disk_info_t *, int ro);
+int tapdisk_blktap_create_device(td_blktap_t *, const td_disk_info_t *, int ro,
+				 int discard);
 int tapdisk_blktap_remove_device(td_blktap_t *);
 
 void tapdisk_blktap_stats(td_blktap_t *, td_stats_t *);
@@ -0,0 +1,537 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "atomicio.h"
+#include "tapdisk-boottrace.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-image.h"
+#include "tapdisk-log.h"
+#include "tapdisk-server.h"
+#include "tapdisk-vbd.h"
+
+#define INFO(_f, _a...)            tlog_syslog(TLOG_INFO, "boottrace: " _f, ##_a)
+#define WARN(_f, _a...)            tlog_syslog(TLOG_WARN, "boottrace: " _f, ##_a)
+
+#define MIN(a, b)                  ((a) < (b) ? (a) : (b))
+
+#define TD_BOOTTRACE_MAGIC         "tdbt"
+#define TD_BOOTTRACE_VERSION       2
+
+struct td_boottrace_header {
+	char                        magic[4];
+	uint32_t                    version;
+	uint64_t                    size;
+	uint64_t                    mtime;
+	uint32_t                    count;
+	uint32_t                    pad;
+};
+
+/*
+ * Drop the trace, keeping the counters for td_stats.
+ */
+static void
+boottrace_reset(td_boottrace_t *trace)
+{
+	int i;
+
+	if (trace->timer >= 0)
+		tapdisk_server_unregister_event(trace->timer);
+	trace->timer = -1;
+
+	free(trace->slots[0].buf);
+	for (i = 0; i < TD_BOOTTRACE_REPLAY_DEPTH; i++) {
+		trace->slots[i].buf   = NULL;
+		trace->slots[i].trace = NULL;
+	}
+
+	free(trace->ranges);
+	trace->ranges   = NULL;
+	trace->n_ranges = 0;
+
+	free(trace->path);
+	trace->path     = NULL;
+
+	trace->mode     = TD_BOOTTRACE_OFF;
+	trace->next     = 0;
+	trace->offset   = 0;
+	trace->pending  = 0;
+}
+
+static int
+boottrace_load(td_boottrace_t *trace)
+{
+	struct td_boottrace_header hdr;
+	size_t len;
+	int i, fd, err;
+
+	fd = open(trace->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (atomicio(read, fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		err = -EIO;
+		goto out;
+	}
+
+	if (memcmp(hdr.magic, TD_BOOTTRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TD_BOOTTRACE_VERSION ||
+	    hdr.size != trace->size ||
+	    hdr.mtime != trace->mtime ||
+	    !hdr.count || hdr.count > TD_BOOTTRACE_MAX_RANGES) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	len = hdr.count * sizeof(struct td_boottrace_range);
+
+	trace->ranges = malloc(len);
+	if (!trace->ranges) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (atomicio(read, fd, trace->ranges, len) != len) {
+		err = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < hdr.count; i++)
+		if (!trace->ranges[i].secs ||
+		    trace->ranges[i].sec + trace->ranges[i].secs > trace->size) {
+			err = -EINVAL;
+			goto out;
+		}
+
+	trace->n_ranges = hdr.count;
+	err = 0;
+
+out:
+	if (err) {
+		free(trace->ranges);
+		trace->ranges = NULL;
+	}
+	close(fd);
+	return err;
+}
+
+/*
+ * Written to a temporary and linked into place, so concurrent attaches
+ * of other children only ever see a complete trace, or none.
+ */
+static int
+boottrace_save(td_boottrace_t *trace)
+{
+	struct td_boottrace_header hdr;
+	char *tmp;
+	size_t len;
+	int fd, err;
+
+	if (!trace->n_ranges)
+		return 0;
+
+	if (asprintf(&tmp, "%s.%d", trace->path, getpid()) == -1)
+		return -ENOMEM;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TD_BOOTTRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TD_BOOTTRACE_VERSION;
+	hdr.size    = trace->size;
+	hdr.mtime   = trace->mtime;
+	hdr.count   = trace->n_ranges;
+
+	len = trace->n_ranges * sizeof(struct td_boottrace_range);
+
+	if (atomicio(vwrite, fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    atomicio(vwrite, fd, trace->ranges, len) != len ||
+	    fsync(fd)) {
+		err = -EIO;
+		goto fail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	/* keep the first trace recorded */
+	if (link(tmp, trace->path) && errno != EEXIST) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+out:
+	free(tmp);
+	return err;
+}
+
+static void
+boottrace_stop_recording(td_boottrace_t *trace)
+{
+	int err;
+
+	err = boottrace_save(trace);
+	if (err)
+		WARN("%s: saving %d ranges: %d\n",
+		     trace->path, trace->n_ranges, err);
+	else
+		INFO("%s: recorded %d ranges, %"PRIu64" reads\n",
+		     trace->path, trace->n_ranges, trace->recorded);
+
+	boottrace_reset(trace);
+}
+
+static void
+__boottrace_timeout(event_id_t id, char mode, void *private)
+{
+	td_boottrace_t *trace = private;
+
+	boottrace_stop_recording(trace);
+}
+
+void
+tapdisk_boottrace_record(td_boottrace_t *trace, td_vbd_request_t *vreq)
+{
+	struct td_boottrace_range *r;
+	unsigned int secs;
+	int i;
+
+	if (trace->mode != TD_BOOTTRACE_RECORD ||
+	    vreq->op != TD_OP_READ ||
+	    td_flag_test(vreq->flags, TD_VBD_REQ_INTERNAL))
+		return;
+
+	if (vreq->ts.tv_sec - trace->start.tv_sec >= trace->secs) {
+		boottrace_stop_recording(trace);
+		return;
+	}
+
+	for (secs = 0, i = 0; i < vreq->iovcnt; i++)
+		secs += vreq->iov[i].secs;
+	if (!secs)
+		return;
+
+	trace->recorded++;
+
+	/* fold sequential streams into one range */
+	if (trace->n_ranges) {
+		r = &trace->ranges[trace->n_ranges - 1];
+		if (r->sec + r->secs == vreq->sec) {
+			r->secs += secs;
+			return;
+		}
+	}
+
+	if (trace->n_ranges == TD_BOOTTRACE_MAX_RANGES) {
+		boottrace_stop_recording(trace);
+		return;
+	}
+
+	r       = &trace->ranges[trace->n_ranges++];
+	r->sec  = vreq->sec;
+	r->secs = secs;
+	r->pad  = 0;
+}
+
+static void boottrace_replay(td_boottrace_t *);
+
+static void
+__boottrace_replay_cb(td_vbd_request_t *vreq, int error,
+		      void *token, int final)
+{
+	struct td_boottrace_slot *slot = token;
+	td_boottrace_t *trace = slot->trace;
+
+	slot->trace = NULL;
+	trace->pending--;
+
+	if (error)
+		trace->errors++;
+
+	boottrace_replay(trace);
+}
+
+static void
+boottrace_replay(td_boottrace_t *trace)
+{
+	struct td_boottrace_slot *slot;
+	struct td_boottrace_range *r;
+	td_vbd_request_t *vreq;
+	int i, secs;
+
+	for (i = 0; i < TD_BOOTTRACE_REPLAY_DEPTH; i++) {
+		if (trace->next == trace->n_ranges)
+			break;
+
+		slot = &trace->slots[i];
+		if (slot->trace)
+			continue;
+
+		r    = &trace->ranges[trace->next];
+		secs = MIN(r->secs - trace->offset, TD_BOOTTRACE_REPLAY_SECS);
+
+		slot->trace    = trace;
+		slot->iov.base = slot->buf;
+		slot->iov.secs = secs;
+
+		vreq           = &slot->vreq;
+		memset(vreq, 0, sizeof(*vreq));
+		vreq->op       = TD_OP_READ;
+		vreq->flags    = TD_VBD_REQ_INTERNAL;
+		vreq->sec      = r->sec + trace->offset;
+		vreq->iov      = &slot->iov;
+		vreq->iovcnt   = 1;
+		vreq->cb       = __boottrace_replay_cb;
+		vreq->token    = slot;
+		vreq->name     = "boottrace";
+
+		tapdisk_vbd_queue_request(trace->vbd, vreq);
+
+		trace->pending++;
+		trace->replay_reqs++;
+		trace->replay_secs += secs;
+
+		trace->offset += secs;
+		if (trace->offset == r->secs) {
+			trace->offset = 0;
+			trace->next++;
+		}
+	}
+
+	if (!trace->pending && trace->next == trace->n_ranges) {
+		INFO("%s: replayed %d ranges, %"PRIu64" secs, %"PRIu64
+		     " errors\n", trace->path, trace->n_ranges,
+		     trace->replay_secs, trace->errors);
+		boottrace_reset(trace);
+	}
+}
+
+static int
+boottrace_start_replay(td_boottrace_t *trace)
+{
+	size_t size;
+	char *buf;
+	int i, err;
+
+	size = TD_BOOTTRACE_REPLAY_SECS << SECTOR_SHIFT;
+
+	err = posix_memalign((void **)&buf, getpagesize(),
+			     size * TD_BOOTTRACE_REPLAY_DEPTH);
+	if (err)
+		return -err;
+
+	for (i = 0; i < TD_BOOTTRACE_REPLAY_DEPTH; i++)
+		trace->slots[i].buf = buf + i * size;
+
+	trace->mode = TD_BOOTTRACE_REPLAY;
+	boottrace_replay(trace);
+
+	return 0;
+}
+
+/*
+ * The parent is named by device and inode, so every child of it finds
+ * the same trace wherever the chain is attached from.
+ */
+static int
+boottrace_path(td_boottrace_t *trace, const char *parent)
+{
+	struct stat st;
+
+	if (stat(parent, &st))
+		return -errno;
+
+	if (mkdir(TD_BOOTTRACE_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	trace->mtime = st.st_mtime;
+
+	if (asprintf(&trace->path, TD_BOOTTRACE_DIR"/%llx-%llx",
+		     (unsigned long long)st.st_dev,
+		     (unsigned long long)st.st_ino) == -1) {
+		trace->path = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int
+boottrace_start_recording(td_boottrace_t *trace)
+{
+	event_id_t id;
+
+	trace->ranges = malloc(TD_BOOTTRACE_MAX_RANGES *
+			       sizeof(struct td_boottrace_range));
+	if (!trace->ranges)
+		return -ENOMEM;
+
+	id = tapdisk_server_register_event(SCHEDULER_POLL_TIMEOUT,
+					   -1, trace->secs,
+					   __boottrace_timeout,
+					   trace);
+	if (id < 0)
+		return id;
+
+	trace->timer = id;
+	trace->mode  = TD_BOOTTRACE_RECORD;
+	gettimeofday(&trace->start, NULL);
+
+	return 0;
+}
+
+void
+tapdisk_boottrace_init(td_boottrace_t *trace)
+{
+	memset(trace, 0, sizeof(*trace));
+	trace->timer = -1;
+}
+
+/*
+ * The trace belongs to the image right below the first cache layer:
+ * the shared parent for a block-cache, and the leaf's parent for an
+ * lcache. Chains without either are not traced.
+ */
+int
+tapdisk_boottrace_open(td_boottrace_t *trace, td_vbd_t *vbd,
+		       struct list_head *images)
+{
+	td_image_t *image, *parent = NULL;
+	const char *env;
+	int secs, err;
+
+	env = getenv(TD_BOOTTRACE_ENV);
+	if (!env)
+		return 0;
+
+	secs = atoi(env);
+	if (secs <= 0)
+		return 0;
+
+	/* a resumed guest is past booting */
+	if (trace->opened)
+		return 0;
+	trace->opened = 1;
+
+	tapdisk_for_each_image(image, images) {
+		if (image->type != DISK_TYPE_BLOCK_CACHE &&
+		    image->type != DISK_TYPE_LCACHE)
+			continue;
+
+		if (!list_is_last(&image->next, images))
+			parent = list_entry(image->next.next,
+					    td_image_t, next);
+		break;
+	}
+
+	if (!parent || !parent->driver)
+		return 0;
+
+	boottrace_reset(trace);
+
+	trace->vbd  = vbd;
+	trace->secs = secs;
+	trace->size = parent->driver->info.size;
+
+	err = boottrace_path(trace, parent->name);
+	if (err)
+		goto fail;
+
+	err = boottrace_load(trace);
+	if (!err) {
+		err = boottrace_start_replay(trace);
+		if (err)
+			goto fail;
+		INFO("%s: replaying %d ranges\n", trace->path, trace->n_ranges);
+		return 0;
+	}
+
+	if (err != -ENOENT) {
+		WARN("%s: ignoring trace: %d\n", trace->path, err);
+		goto fail;
+	}
+
+	err = boottrace_start_recording(trace);
+	if (err)
+		goto fail;
+
+	INFO("%s: recording for %ds\n", trace->path, secs);
+	return 0;
+
+fail:
+	boottrace_reset(trace);
+	return err;
+}
+
+/*
+ * Replay reads still queued on the vbd are dropped; the queue has
+ * been quiesced, so none are in flight below.
+ */
+void
+tapdisk_boottrace_close(td_boottrace_t *trace)
+{
+	struct td_boottrace_slot *slot;
+	int i;
+
+	switch (trace->mode) {
+	case TD_BOOTTRACE_RECORD:
+		boottrace_stop_recording(trace);
+		break;
+
+	case TD_BOOTTRACE_REPLAY:
+		for (i = 0; i < TD_BOOTTRACE_REPLAY_DEPTH; i++) {
+			slot = &trace->slots[i];
+			if (slot->trace)
+				list_del(&slot->vreq.next);
+		}
+		boottrace_reset(trace);
+		break;
+	}
+}
+
+void
+tapdisk_boottrace_stats(td_boottrace_t *trace, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "mode", "d", trace->mode);
+	tapdisk_stats_field(st, "ranges", "d", trace->n_ranges);
+	tapdisk_stats_field(st, "recorded", "llu", trace->recorded);
+	tapdisk_stats_field(st, "replay_reqs", "llu", trace->replay_reqs);
+	tapdisk_stats_field(st, "replay_secs", "llu", trace->replay_secs);
+	tapdisk_stats_field(st, "errors", "llu", trace->errors);
+}
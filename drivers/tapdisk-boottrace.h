@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TAPDISK_BOOTTRACE_H__
+#define __TAPDISK_BOOTTRACE_H__
+
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "blktap.h"
+#include "tapdisk.h"
+#include "scheduler.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Boot traces: the ordered sector ranges a guest read during the
+ * first seconds after attach, for the parent image behind a
+ * block-cache or lcache layer. Traces are kept in a host-local
+ * directory, keyed by the parent's device and inode, never on the SR.
+ * Later attaches of any child replay the trace as reads through the
+ * vbd, warming the cache before the guest gets there. Only the first
+ * open of a vbd is traced; resume and reopen leave it alone. Enabled
+ * by TAPDISK_BOOT_TRACE=<seconds>.
+ */
+
+#define TD_BOOTTRACE_ENV            "TAPDISK_BOOT_TRACE"
+#define TD_BOOTTRACE_DIR            BLKTAP2_CONTROL_DIR"/boottrace"
+#define TD_BOOTTRACE_MAX_RANGES     65536
+#define TD_BOOTTRACE_REPLAY_DEPTH   4
+#define TD_BOOTTRACE_REPLAY_SECS    256
+
+#define TD_BOOTTRACE_OFF            0
+#define TD_BOOTTRACE_RECORD         1
+#define TD_BOOTTRACE_REPLAY         2
+
+typedef struct td_boottrace td_boottrace_t;
+
+struct td_boottrace_range {
+	uint64_t                    sec;
+	uint32_t                    secs;
+	uint32_t                    pad;
+};
+
+struct td_boottrace_slot {
+	td_vbd_request_t            vreq;
+	struct td_iovec             iov;
+	void                       *buf;
+	td_boottrace_t             *trace;
+};
+
+struct td_boottrace {
+	int                         mode;
+	int                         opened;
+	char                       *path;
+	td_vbd_t                   *vbd;
+	td_sector_t                 size;
+	uint64_t                    mtime;
+
+	struct td_boottrace_range  *ranges;
+	int                         n_ranges;
+
+	/* recording */
+	struct timeval              start;
+	int                         secs;
+	event_id_t                  timer;
+
+	/* replay */
+	int                         next;
+	td_sector_t                 offset;
+	int                         pending;
+	struct td_boottrace_slot    slots[TD_BOOTTRACE_REPLAY_DEPTH];
+
+	uint64_t                    recorded;
+	uint64_t                    replay_reqs;
+	uint64_t                    replay_secs;
+	uint64_t                    errors;
+};
+
+void tapdisk_boottrace_init(td_boottrace_t *);
+int tapdisk_boottrace_open(td_boottrace_t *, td_vbd_t *, struct list_head *);
+void tapdisk_boottrace_close(td_boottrace_t *);
+void tapdisk_boottrace_record(td_boottrace_t *, td_vbd_request_t *);
+void tapdisk_boottrace_stats(td_boottrace_t *, td_stats_t *);
+
+#endif /* __TAPDISK_BOOTTRACE_H__ */
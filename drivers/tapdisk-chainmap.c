@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tapdisk-chainmap.h"
+#include "tapdisk-image.h"
+#include "tapdisk-disktype.h"
+
+#define CHUNK_SECS         (1ULL << TD_CHAINMAP_CHUNK_SHIFT)
+#define CHUNK_MASK         (TD_CHAINMAP_REGION_CHUNKS - 1)
+
+#define chunk_region(_c)   ((_c) >> TD_CHAINMAP_REGION_SHIFT)
+#define chunk_offset(_c)   ((_c) & CHUNK_MASK)
+
+static inline td_chainmap_region_t **
+__chainmap_bucket(td_chainmap_t *map, uint64_t idx)
+{
+	return &map->hash[idx & (TD_CHAINMAP_HASH_SIZE - 1)];
+}
+
+static td_chainmap_region_t *
+chainmap_find_region(td_chainmap_t *map, uint64_t idx)
+{
+	td_chainmap_region_t *r;
+
+	for (r = *__chainmap_bucket(map, idx); r; r = r->hash_next)
+		if (r->idx == idx)
+			return r;
+
+	return NULL;
+}
+
+static void
+chainmap_unhash_region(td_chainmap_t *map, td_chainmap_region_t *region)
+{
+	td_chainmap_region_t **pp;
+
+	for (pp = __chainmap_bucket(map, region->idx); *pp; pp = &(*pp)->hash_next)
+		if (*pp == region) {
+			*pp = region->hash_next;
+			break;
+		}
+
+	region->hash_next = NULL;
+}
+
+static td_chainmap_region_t *
+chainmap_get_region(td_chainmap_t *map, uint64_t idx)
+{
+	td_chainmap_region_t *r, **bucket;
+
+	r = chainmap_find_region(map, idx);
+	if (r) {
+		list_move(&r->lru, &map->lru);
+		return r;
+	}
+
+	if (map->n_regions < TD_CHAINMAP_MAX_REGIONS) {
+		r = malloc(sizeof(*r));
+		if (!r)
+			return NULL;
+		map->n_regions++;
+	} else {
+		r = list_entry(map->lru.prev, td_chainmap_region_t, lru);
+		chainmap_unhash_region(map, r);
+		list_del(&r->lru);
+	}
+
+	memset(r->owner, 0, sizeof(r->owner));
+	r->idx          = idx;
+	bucket          = __chainmap_bucket(map, idx);
+	r->hash_next    = *bucket;
+	*bucket         = r;
+	list_add(&r->lru, &map->lru);
+
+	return r;
+}
+
+static void
+chainmap_free_regions(td_chainmap_t *map)
+{
+	td_chainmap_region_t *r, *n;
+
+	list_for_each_entry_safe(r, n, &map->lru, lru) {
+		list_del(&r->lru);
+		free(r);
+	}
+
+	memset(map->hash, 0, sizeof(map->hash));
+	map->n_regions = 0;
+}
+
+static int
+chainmap_image_depth(td_chainmap_t *map, td_image_t *image)
+{
+	int i;
+
+	for (i = 1; i < map->depth; i++)
+		if (map->images[i] == image)
+			return i;
+
+	return -1;
+}
+
+void
+tapdisk_chainmap_init(td_chainmap_t *map)
+{
+	memset(map, 0, sizeof(*map));
+	INIT_LIST_HEAD(&map->lru);
+}
+
+/*
+ * Only plain VHD chains, optionally over a raw base, are mapped: cache
+ * and log layers must keep seeing every read. Bumping the generation
+ * past the write history refuses learning from reads still in flight
+ * against the old chain.
+ */
+void
+tapdisk_chainmap_reset(td_chainmap_t *map, struct list_head *images)
+{
+	td_image_t *image;
+	int enabled = 1;
+
+	chainmap_free_regions(map);
+
+	map->depth = 0;
+	if (images)
+		tapdisk_for_each_image(image, images) {
+			if (map->depth == TD_CHAINMAP_MAX_DEPTH) {
+				enabled = 0;
+				break;
+			}
+
+			if (image->type != DISK_TYPE_VHD &&
+			    (image->type != DISK_TYPE_AIO ||
+			     !list_is_last(&image->next, images)))
+				enabled = 0;
+
+			map->images[map->depth++] = image;
+		}
+
+	map->enabled = enabled && map->depth > 1;
+	map->gen    += TD_CHAINMAP_WRITES + 1;
+}
+
+td_image_t *
+tapdisk_chainmap_lookup(td_chainmap_t *map, td_sector_t sec, int secs)
+{
+	td_chainmap_region_t *r = NULL;
+	uint64_t c, first, last;
+	int owner = 0;
+
+	if (!map->enabled || !secs)
+		return NULL;
+
+	first = sec >> TD_CHAINMAP_CHUNK_SHIFT;
+	last  = (sec + secs - 1) >> TD_CHAINMAP_CHUNK_SHIFT;
+
+	for (c = first; c <= last; c++) {
+		if (!r || r->idx != chunk_region(c)) {
+			r = chainmap_find_region(map, chunk_region(c));
+			if (!r)
+				goto miss;
+		}
+
+		if (!r->owner[chunk_offset(c)])
+			goto miss;
+
+		if (!owner)
+			owner = r->owner[chunk_offset(c)];
+		else if (owner != r->owner[chunk_offset(c)])
+			goto miss;
+	}
+
+	list_move(&r->lru, &map->lru);
+	map->hits++;
+	return map->images[owner];
+
+miss:
+	map->misses++;
+	return NULL;
+}
+
+static int
+chainmap_written_since(td_chainmap_t *map, td_sector_t sec, int secs,
+		       uint64_t gen)
+{
+	struct td_chainmap_write *w;
+	uint64_t g;
+
+	if (map->gen - gen >= TD_CHAINMAP_WRITES)
+		return 1;
+
+	for (g = gen + 1; g <= map->gen; g++) {
+		w = &map->writes[g % TD_CHAINMAP_WRITES];
+		if (w->sec < sec + secs && sec < w->sec + w->secs)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * @image completed a read of [sec, sec + secs) issued at @gen. Record
+ * it as the owner of every chunk fully covered, unless a write to the
+ * range was issued or completed in the meantime.
+ */
+void
+tapdisk_chainmap_learn(td_chainmap_t *map, td_image_t *image,
+		       td_sector_t sec, int secs, uint64_t gen)
+{
+	td_chainmap_region_t *r = NULL;
+	uint64_t c, first, end;
+	int depth;
+
+	if (!map->enabled)
+		return;
+
+	first = (sec + CHUNK_SECS - 1) >> TD_CHAINMAP_CHUNK_SHIFT;
+	end   = (sec + secs) >> TD_CHAINMAP_CHUNK_SHIFT;
+	if (first >= end)
+		return;
+
+	depth = chainmap_image_depth(map, image);
+	if (depth < 0)
+		return;
+
+	if (chainmap_written_since(map, sec, secs, gen))
+		return;
+
+	for (c = first; c < end; c++) {
+		if (!r || r->idx != chunk_region(c)) {
+			r = chainmap_get_region(map, chunk_region(c));
+			if (!r)
+				return;
+		}
+
+		r->owner[chunk_offset(c)] = depth;
+	}
+
+	map->learned += end - first;
+}
+
+static void
+chainmap_clear_region(td_chainmap_t *map, td_chainmap_region_t *r,
+		      uint64_t first, uint64_t last)
+{
+	uint64_t c, start, end;
+
+	start = r->idx << TD_CHAINMAP_REGION_SHIFT;
+	end   = start + TD_CHAINMAP_REGION_CHUNKS - 1;
+
+	for (c = (first > start ? first : start);
+	     c <= (last < end ? last : end); c++)
+		if (r->owner[chunk_offset(c)]) {
+			r->owner[chunk_offset(c)] = 0;
+			map->invalidated++;
+		}
+}
+
+void
+tapdisk_chainmap_invalidate(td_chainmap_t *map, td_sector_t sec, int secs)
+{
+	td_chainmap_region_t *r, *n;
+	struct td_chainmap_write *w;
+	uint64_t idx, first, last;
+
+	if (!map->enabled || !secs)
+		return;
+
+	map->gen++;
+	w       = &map->writes[map->gen % TD_CHAINMAP_WRITES];
+	w->sec  = sec;
+	w->secs = secs;
+
+	first = sec >> TD_CHAINMAP_CHUNK_SHIFT;
+	last  = (sec + secs - 1) >> TD_CHAINMAP_CHUNK_SHIFT;
+
+	if (chunk_region(last) - chunk_region(first) < map->n_regions) {
+		for (idx = chunk_region(first); idx <= chunk_region(last); idx++) {
+			r = chainmap_find_region(map, idx);
+			if (r)
+				chainmap_clear_region(map, r, first, last);
+		}
+		return;
+	}
+
+	list_for_each_entry_safe(r, n, &map->lru, lru)
+		if (r->idx >= chunk_region(first) && r->idx <= chunk_region(last))
+			chainmap_clear_region(map, r, first, last);
+}
+
+void
+tapdisk_chainmap_stats(td_chainmap_t *map, td_stats_t *st)
+{
+	tapdisk_stats_field(st, "enabled", "d", map->enabled);
+	tapdisk_stats_field(st, "regions", "d", map->n_regions);
+	tapdisk_stats_field(st, "hits", "llu", map->hits);
+	tapdisk_stats_field(st, "misses", "llu", map->misses);
+	tapdisk_stats_field(st, "learned", "llu", map->learned);
+	tapdisk_stats_field(st, "invalidated", "llu", map->invalidated);
+}
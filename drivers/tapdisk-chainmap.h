@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TAPDISK_CHAINMAP_H__
+#define __TAPDISK_CHAINMAP_H__
+
+#include <inttypes.h>
+
+#include "list.h"
+#include "tapdisk.h"
+#include "tapdisk-stats.h"
+
+/*
+ * Per-VBD map from chunks of the virtual disk to the image in the
+ * chain which owns them. Learned from read completions on parent
+ * images, so later reads skip the layers which would only forward.
+ */
+
+#define TD_CHAINMAP_CHUNK_SHIFT     3	/* 4k chunks */
+#define TD_CHAINMAP_REGION_SHIFT    9	/* chunks per region */
+#define TD_CHAINMAP_REGION_CHUNKS   (1 << TD_CHAINMAP_REGION_SHIFT)
+#define TD_CHAINMAP_MAX_REGIONS     1024
+#define TD_CHAINMAP_HASH_SIZE       256
+#define TD_CHAINMAP_MAX_DEPTH       64
+#define TD_CHAINMAP_WRITES          64
+
+typedef struct td_chainmap td_chainmap_t;
+typedef struct td_chainmap_region td_chainmap_region_t;
+
+struct td_chainmap_region {
+	uint64_t                    idx;
+	td_chainmap_region_t       *hash_next;
+	struct list_head            lru;
+	uint8_t                     owner[TD_CHAINMAP_REGION_CHUNKS];
+};
+
+struct td_chainmap_write {
+	td_sector_t                 sec;
+	int                         secs;
+};
+
+struct td_chainmap {
+	int                         enabled;
+	int                         depth;
+	td_image_t                 *images[TD_CHAINMAP_MAX_DEPTH];
+
+	int                         n_regions;
+	td_chainmap_region_t       *hash[TD_CHAINMAP_HASH_SIZE];
+	struct list_head            lru;
+
+	/* recent invalidations, indexed by generation */
+	uint64_t                    gen;
+	struct td_chainmap_write    writes[TD_CHAINMAP_WRITES];
+
+	uint64_t                    hits;
+	uint64_t                    misses;
+	uint64_t                    learned;
+	uint64_t                    invalidated;
+};
+
+void tapdisk_chainmap_init(td_chainmap_t *);
+void tapdisk_chainmap_reset(td_chainmap_t *, struct list_head *images);
+td_image_t *tapdisk_chainmap_lookup(td_chainmap_t *, td_sector_t, int);
+void tapdisk_chainmap_learn(td_chainmap_t *, td_image_t *,
+			    td_sector_t, int, uint64_t gen);
+void tapdisk_chainmap_invalidate(td_chainmap_t *, td_sector_t, int);
+void tapdisk_chainmap_stats(td_chainmap_t *, td_stats_t *);
+
+static inline uint64_t
+tapdisk_chainmap_gen(td_chainmap_t *map)
+{
+	return map->gen;
+}
+
+#endif /* __TAPDISK_CHAINMAP_H__ */
@@ -91,6 +91,7 @@ struct tapdisk_ctl_conn {
 
 #define TAPDISK_MSG_REENTER    (1<<0) /* non-blocking, idempotent */
 #define TAPDISK_MSG_VERBOSE    (1<<1) /* tell syslog about it */
+#define TAPDISK_MSG_VBD        (1<<2) /* run on the vbd's server shard */
 
 struct tapdisk_control_info {
 	void (*handler)(struct tapdisk_ctl_conn *, tapdisk_message_t *);
@@ -178,7 +179,7 @@ static void
 tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 {
 	if (conn->out.event_id >= 0) {
-		tapdisk_server_unregister_event(conn->out.event_id);
+		tapdisk_server_unregister_ctl_event(conn->out.event_id);
 		conn->out.event_id = -1;
 	}
 
@@ -187,20 +188,20 @@ tapdisk_ctl_conn_close(struct tapdisk_ctl_conn *conn)
 		conn->fd = -1;
 
 		tapdisk_ctl_conn_free(conn);
-		tapdisk_server_mask_event(td_control.event_id, 0);
+		tapdisk_server_mask_ctl_event(td_control.event_id, 0);
 	}
 }
 
 static void
 tapdisk_ctl_conn_mask_out(struct tapdisk_ctl_conn *conn)
 {
-	tapdisk_server_mask_event(conn->out.event_id, 1);
+	tapdisk_server_mask_ctl_event(conn->out.event_id, 1);
 }
 
 static void
 tapdisk_ctl_conn_unmask_out(struct tapdisk_ctl_conn *conn)
 {
-	tapdisk_server_mask_event(conn->out.event_id, 0);
+	tapdisk_server_mask_ctl_event(conn->out.event_id, 0);
 }
 
 static ssize_t
@@ -298,10 +299,10 @@ tapdisk_ctl_conn_open(int fd)
 	conn = td_control.conn[td_control.n_conn++];
 
 	conn->out.event_id =
-		tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-					      fd, TD_CTL_SEND_TIMEOUT,
-					      tapdisk_ctl_conn_send_event,
-					      conn);
+		tapdisk_server_register_ctl_event(SCHEDULER_POLL_WRITE_FD,
+						  fd, TD_CTL_SEND_TIMEOUT,
+						  tapdisk_ctl_conn_send_event,
+						  conn);
 	if (conn->out.event_id < 0)
 		return NULL;
 
@@ -313,7 +314,7 @@ tapdisk_ctl_conn_open(int fd)
 	tapdisk_ctl_conn_mask_out(conn);
 
 	if (td_control.n_conn >= TD_CTL_MAX_CONNECTIONS)
-		tapdisk_server_mask_event(td_control.event_id, 1);
+		tapdisk_server_mask_ctl_event(td_control.event_id, 1);
 
 	return conn;
 }
@@ -405,7 +406,7 @@ static void
 tapdisk_control_release_connection(struct tapdisk_ctl_conn *conn)
 {
 	if (conn->in.event_id) {
-		tapdisk_server_unregister_event(conn->in.event_id);
+		tapdisk_server_unregister_ctl_event(conn->in.event_id);
 		conn->in.event_id = -1;
 	}
 
@@ -532,38 +533,61 @@ tapdisk_control_list_minors(struct tapdisk_ctl_conn *conn,
 }
 #endif
 
+struct tapdisk_control_list {
+	struct tapdisk_ctl_conn *conn;
+	tapdisk_message_t       *response;
+	int                      count;
+};
+
 static void
-tapdisk_control_list(struct tapdisk_ctl_conn *conn, tapdisk_message_t *request)
+tapdisk_control_count_vbds(void *private)
 {
+	struct tapdisk_control_list *list = private;
 	td_vbd_t *vbd;
-	struct list_head *head;
-	tapdisk_message_t response;
-	int count;
 
-	memset(&response, 0, sizeof(response));
-	response.type = TAPDISK_MESSAGE_LIST_RSP;
-	response.cookie = request->cookie;
-
-	head = tapdisk_server_get_all_vbds();
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		list->count++;
+}
 
-	count = 0;
-	list_for_each_entry(vbd, head, next)
-		count++;
+static void
+tapdisk_control_list_vbds(void *private)
+{
+	struct tapdisk_control_list *list = private;
+	tapdisk_message_t *response = list->response;
+	td_vbd_t *vbd;
 
-	list_for_each_entry(vbd, head, next) {
-		response.u.list.count   = count--;
-		response.u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
-		response.u.list.state   = vbd->state;
-		response.u.list.path[0] = 0;
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next) {
+		response->u.list.count   = list->count--;
+		response->u.list.minor   = vbd->tap ? vbd->tap->minor : -1;
+		response->u.list.state   = vbd->state;
+		response->u.list.path[0] = 0;
 
 		if (vbd->name)
-			strncpy(response.u.list.path, vbd->name,
-				sizeof(response.u.list.path));
+			strncpy(response->u.list.path, vbd->name,
+				sizeof(response->u.list.path));
 
-		tapdisk_control_write_message(conn, &response);
+		tapdisk_control_write_message(list->conn, response);
 	}
+}
+
+static void
+tapdisk_control_list(struct tapdisk_ctl_conn *conn, tapdisk_message_t *request)
+{
+	struct tapdisk_control_list list;
+	tapdisk_message_t response;
 
-	response.u.list.count   = count;
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_LIST_RSP;
+	response.cookie = request->cookie;
+
+	list.conn     = conn;
+	list.response = &response;
+	list.count    = 0;
+
+	tapdisk_server_call_all(tapdisk_control_count_vbds, &list);
+	tapdisk_server_call_all(tapdisk_control_list_vbds, &list);
+
+	response.u.list.count   = list.count;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
 
@@ -749,7 +773,8 @@ tapdisk_control_open_image(struct tapdisk_ctl_conn *conn,
 		goto fail_close;
 
 	err = tapdisk_blktap_create_device(vbd->tap, &info,
-					   !!(flags & TD_OPEN_RDONLY));
+					   !!(flags & TD_OPEN_RDONLY),
+					   tapdisk_vbd_discard_supported(vbd));
 	if (err && err != -EEXIST) {
 		err = -errno;
 		EPRINTF("create device failed: %d\n", err);
@@ -858,7 +883,9 @@ tapdisk_control_close_image(struct tapdisk_ctl_conn *conn,
 		vbd->nbdserver = NULL;
 	}
 
-	tapdisk_vbd_close_vdi(vbd);
+	err = tapdisk_vbd_close_vdi(vbd);
+	if (err)
+		ERR(err, "failure closing images\n");
 
 	/*
 	 * NB: vbd->name free should probably belong into close_vdi, but the 
@@ -959,6 +986,63 @@ out:
 	tapdisk_control_write_message(conn, &response);
 }
 
+static void
+tapdisk_control_qos(struct tapdisk_ctl_conn *conn,
+		    tapdisk_message_t *request)
+{
+	tapdisk_message_qos_t *qos = &request->u.qos;
+	tapdisk_message_t response;
+	td_vbd_t *vbd;
+	int err;
+
+	memset(&response, 0, sizeof(response));
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	if ((qos->weight != -1 &&
+	     (qos->weight < 1 || qos->weight > TQUEUE_WEIGHT_MAX)) ||
+	    (qos->class != -1 &&
+	     (qos->class < 0 || qos->class >= TQUEUE_CLASSES)) ||
+	    qos->depth < -1) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (qos->weight != -1)
+		vbd->flow.weight = qos->weight;
+	if (qos->class != -1)
+		vbd->flow.class = qos->class;
+	if (qos->depth != -1)
+		vbd->flow.depth = qos->depth;
+
+	INFO("qos: weight %u class %d depth %d\n", vbd->flow.weight,
+	     vbd->flow.class, vbd->flow.depth);
+
+	response.u.qos.weight = vbd->flow.weight;
+	response.u.qos.class  = vbd->flow.class;
+	response.u.qos.depth  = vbd->flow.depth;
+	err = 0;
+out:
+	response.type = TAPDISK_MESSAGE_QOS_RSP;
+	response.cookie = request->cookie;
+	response.u.qos.error = -err;
+	tapdisk_control_write_message(conn, &response);
+}
+
+static void
+tapdisk_control_stats_vbds(void *private)
+{
+	td_stats_t *st = private;
+	td_vbd_t *vbd;
+
+	list_for_each_entry(vbd, tapdisk_server_get_all_vbds(), next)
+		tapdisk_vbd_stats(vbd, st);
+}
+
 static void
 tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		      tapdisk_message_t *request)
@@ -989,13 +1073,8 @@ tapdisk_control_stats(struct tapdisk_ctl_conn *conn,
 		tapdisk_vbd_stats(vbd, st);
 
 	} else {
-		struct list_head *list = tapdisk_server_get_all_vbds();
-
 		tapdisk_stats_enter(st, '[');
-
-		list_for_each_entry(vbd, list, next)
-			tapdisk_vbd_stats(vbd, st);
-
+		tapdisk_server_call_all(tapdisk_control_stats_vbds, st);
 		tapdisk_stats_leave(st, ']');
 	}
 
@@ -1030,7 +1109,7 @@ out:
 		conn->out.prod += rv;
 }
 
-struct tapdisk_control_info message_infos[] = {
+struct tapdisk_control_info message_infos[TAPDISK_MESSAGE_MAX + 1] = {
 	[TAPDISK_MESSAGE_PID] = {
 		.handler = tapdisk_control_get_pid,
 		.flags   = TAPDISK_MSG_REENTER,
@@ -1041,34 +1120,74 @@ struct tapdisk_control_info message_infos[] = {
 	},
 	[TAPDISK_MESSAGE_ATTACH] = {
 		.handler = tapdisk_control_attach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_DETACH] = {
 		.handler = tapdisk_control_detach_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_OPEN] = {
 		.handler = tapdisk_control_open_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_PAUSE] = {
 		.handler = tapdisk_control_pause_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_RESUME] = {
 		.handler = tapdisk_control_resume_vbd,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_CLOSE] = {
 		.handler = tapdisk_control_close_image,
-		.flags   = TAPDISK_MSG_VERBOSE,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 	[TAPDISK_MESSAGE_STATS] = {
 		.handler = tapdisk_control_stats,
-		.flags   = TAPDISK_MSG_REENTER,
+		.flags   = TAPDISK_MSG_REENTER | TAPDISK_MSG_VBD,
+	},
+	[TAPDISK_MESSAGE_QOS] = {
+		.handler = tapdisk_control_qos,
+		.flags   = TAPDISK_MSG_VERBOSE | TAPDISK_MSG_VBD,
 	},
 };
 
+struct tapdisk_control_call {
+	struct tapdisk_ctl_conn *conn;
+	tapdisk_message_t       *message;
+};
+
+static void
+__tapdisk_control_call(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->conn->info->handler(call->conn, call->message);
+}
+
+/*
+ * With a sharded server, vbd messages run on the thread owning the
+ * vbd. New vbds go to the least loaded one.
+ */
+static void
+tapdisk_control_dispatch(struct tapdisk_ctl_conn *conn,
+			 tapdisk_message_t *message)
+{
+	struct tapdisk_control_call call;
+	int shard = -1;
+
+	if (conn->info->flags & TAPDISK_MSG_VBD) {
+		if (message->type == TAPDISK_MESSAGE_ATTACH)
+			shard = tapdisk_server_pick_shard();
+		else
+			shard = tapdisk_server_vbd_shard(message->cookie);
+	}
+
+	call.conn    = conn;
+	call.message = message;
+
+	tapdisk_server_call(shard, __tapdisk_control_call, &call);
+}
 
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
@@ -1087,7 +1206,7 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	if (err)
 		goto invalid;
 
-	if (message.type > TAPDISK_MESSAGE_EXIT)
+	if (message.type > TAPDISK_MESSAGE_MAX)
 		goto invalid;
 
 	conn->info = &message_infos[message.type];
@@ -1111,7 +1230,7 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	}
 	conn->in.busy = 1;
 
-	conn->info->handler(conn, &message);
+	tapdisk_control_dispatch(conn, &message);
 
 	conn->in.busy = 0;
 	if (excl)
@@ -1162,10 +1281,10 @@ tapdisk_control_accept(event_id_t id, char mode, void *private)
 		return;
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    conn->fd, TD_CTL_RECV_TIMEOUT,
-					    tapdisk_control_handle_request,
-					    conn);
+	err = tapdisk_server_register_ctl_event(SCHEDULER_POLL_READ_FD,
+						conn->fd, TD_CTL_RECV_TIMEOUT,
+						tapdisk_control_handle_request,
+						conn);
 	if (err == -1) {
 		tapdisk_control_close_connection(conn);
 		ERR(err, "failed to register new control event\n");
@@ -1269,9 +1388,9 @@ tapdisk_control_create_socket(char **socket_path)
 		goto fail;
 	}
 
-	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
-					    td_control.socket, 0,
-					    tapdisk_control_accept, NULL);
+	err = tapdisk_server_register_ctl_event(SCHEDULER_POLL_READ_FD,
+						td_control.socket, 0,
+						tapdisk_control_accept, NULL);
 	if (err < 0) {
 		EPRINTF("failed to add watch: %d\n", err);
 		goto fail;
@@ -124,6 +124,7 @@ tapdisk_driver_free(td_driver_t *driver)
 void
 tapdisk_driver_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 {
+	tiocb->flow = driver->flow;
 	tapdisk_server_queue_tiocb(tiocb);
 }
 
@@ -42,6 +42,8 @@ struct td_driver_handle {
 
 	td_loglimit_t                loglimit;
 	struct list_head             next;
+
+	struct tflow                *flow; /* of the owning vbd */
 };
 
 td_driver_t *tapdisk_driver_allocate(int, const char *, td_flag_t);
@@ -141,17 +141,42 @@ check_sector(struct tfilter *filter, int type, int rw, uint64_t sec, char *buf)
 }
 
 static void
-check_data(struct tfilter *filter, int type, struct iocb *io)
+check_range(struct tfilter *filter, int type, int rw,
+	    char *buf, size_t bytes, long long offset)
 {
-	int rw;
 	uint64_t i;
 
-	rw = (io->aio_lio_opcode == IO_CMD_PWRITE);
+	for (i = 0; i < bytes; i += 512) {
+		uint64_t sec = (offset + i) >> 9;
+		check_sector(filter, type, rw, sec, buf + i);
+	}
+}
 
-	for (i = 0; i < io->u.c.nbytes; i += 512) {
-		char *buf    = io->u.c.buf + i;
-		uint64_t sec = (io->u.c.offset + i) >> 9;
-		check_sector(filter, type, rw, sec, buf);
+static void
+check_data(struct tfilter *filter, int type, struct iocb *io)
+{
+	int i, rw;
+	long long offset;
+
+	switch (io->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+	case IO_CMD_PWRITE:
+		rw = (io->aio_lio_opcode == IO_CMD_PWRITE);
+		check_range(filter, type, rw,
+			    io->u.c.buf, io->u.c.nbytes, io->u.c.offset);
+		break;
+
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		rw     = (io->aio_lio_opcode == IO_CMD_PWRITEV);
+		offset = io->u.v.offset;
+		for (i = 0; i < io->u.v.nr; i++) {
+			const struct iovec *iov = &io->u.v.vec[i];
+			check_range(filter, type, rw,
+				    iov->iov_base, iov->iov_len, offset);
+			offset += iov->iov_len;
+		}
+		break;
 	}
 }
 
@@ -224,7 +249,9 @@ tapdisk_filter_iocbs(struct tfilter *filter, struct iocb **iocbs, int num)
 	for (i = 0; i < num; i++) {
 		struct iocb *io = iocbs[i];
 
-		if (filter->mode & TD_INJECT_FAULTS) {
+		if (filter->mode & TD_INJECT_FAULTS &&
+		    (io->aio_lio_opcode == IO_CMD_PREAD ||
+		     io->aio_lio_opcode == IO_CMD_PWRITE)) {
 			if ((random() % 100) <= TD_FAULT_RATE) {
 				inject_fault(filter, io);
 				continue;
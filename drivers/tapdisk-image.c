@@ -95,10 +95,15 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &image->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD && treq.op != TD_OP_FLUSH)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly) {
+	/* flushes carry no range, and are harmless on read-only images */
+	if (treq.op == TD_OP_FLUSH)
+		return 0;
+
+	if (treq.op != TD_OP_READ && rdonly) {
 		err = -EPERM;
 		goto fail;
 	}
@@ -142,6 +147,7 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 
 	switch (vreq->op) {
 	case TD_OP_WRITE:
+	case TD_OP_DISCARD:
 		if (rdonly) {
 			err = -EPERM;
 			goto fail;
@@ -153,6 +159,12 @@ tapdisk_image_check_request(td_image_t *image, td_vbd_request_t *vreq)
 			goto fail;
 		}
 		break;
+	case TD_OP_FLUSH:
+		if (vreq->iovcnt) {
+			err = -EINVAL;
+			goto fail;
+		}
+		break;
 	default:
 		err = -EOPNOTSUPP;
 		goto fail;
@@ -168,11 +180,15 @@ fail:
 	return err;
 }
 
-void
+int
 tapdisk_image_close(td_image_t *image)
 {
-	td_close(image);
+	int err;
+
+	err = td_close(image);
 	tapdisk_image_free(image);
+
+	return err;
 }
 
 int
@@ -260,13 +276,18 @@ tapdisk_image_open_parents(td_image_t *image)
 	return err;
 }
 
-void
+int
 tapdisk_image_close_chain(struct list_head *list)
 {
 	td_image_t *image, *next;
+	int err, ret = 0;
 
-	tapdisk_for_each_image_safe(image, next, list)
-		tapdisk_image_close(image);
+	tapdisk_for_each_image_safe(image, next, list) {
+		err = tapdisk_image_close(image);
+		ret = ret ? : err;
+	}
+
+	return ret;
 }
 
 static int
@@ -64,10 +64,10 @@ struct td_image_handle {
 	list_entry(_head, td_image_t, next)
 
 int tapdisk_image_open(int, const char *, int, td_image_t **);
-void tapdisk_image_close(td_image_t *);
+int tapdisk_image_close(td_image_t *);
 
 int tapdisk_image_open_chain(const char *, int, int, struct list_head *);
-void tapdisk_image_close_chain(struct list_head *);
+int tapdisk_image_close_chain(struct list_head *);
 int tapdisk_image_validate_chain(struct list_head *);
 
 td_image_t *tapdisk_image_allocate(const char *, int, td_flag_t);
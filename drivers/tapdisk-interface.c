@@ -103,6 +103,7 @@ int
 td_close(td_image_t *image)
 {
 	td_driver_t *driver;
+	int err = 0;
 
 	driver = image->driver;
 	if (!driver)
@@ -110,14 +111,14 @@ td_close(td_image_t *image)
 
 	driver->refcnt--;
 	if (!driver->refcnt && td_flag_test(driver->state, TD_DRIVER_OPEN)) {
-		driver->ops->td_close(driver);
+		err = driver->ops->td_close(driver);
 		td_flag_clear(driver->state, TD_DRIVER_OPEN);
 	}
 
 	DPRINTF("closed image %s (%d users, state: 0x%08x, type: %d)\n",
 		driver->name, driver->refcnt, driver->state, driver->type);
 
-	return 0;
+	return err;
 }
 
 int
@@ -153,6 +154,111 @@ td_validate_parent(td_image_t *image, td_image_t *parent)
 	return driver->ops->td_validate_parent(driver, pdriver, 0);
 }
 
+/*
+ * Sectors held contiguously at treq.buf.
+ */
+int
+td_request_segment_secs(td_request_t treq)
+{
+	struct td_iovec *iov = treq.iov;
+	int left;
+
+	if (!iov)
+		return treq.secs;
+
+	left = iov->secs - (((char *)treq.buf - (char *)iov->base) >>
+			    SECTOR_SHIFT);
+
+	return left < treq.secs ? left : treq.secs;
+}
+
+/*
+ * The leading buffer of @treq, as a plain request.
+ */
+td_request_t
+td_request_segment(td_request_t treq)
+{
+	td_request_t clone = treq;
+
+	clone.secs   = td_request_segment_secs(treq);
+	clone.iov    = NULL;
+	clone.iovcnt = 0;
+
+	return clone;
+}
+
+void
+td_request_advance(td_request_t *treq, int secs)
+{
+	int left;
+
+	left = td_request_segment_secs(*treq);
+
+	treq->sec  += secs;
+	treq->secs -= secs;
+
+	if (treq->iov)
+		while (secs >= left && treq->iovcnt > 1) {
+			secs -= left;
+			treq->iov++;
+			treq->iovcnt--;
+			treq->buf = treq->iov->base;
+			left      = treq->iov->secs;
+		}
+
+	treq->buf = (char *)treq->buf + ((size_t)secs << SECTOR_SHIFT);
+}
+
+/*
+ * Gathers the first @secs sectors of @treq into @iov, coalescing
+ * adjacent buffers. Returns the iovec count, or -E2BIG beyond @max.
+ */
+int
+td_request_iovec(td_request_t treq, int secs,
+		 struct iovec *iov, int max)
+{
+	int n, cnt = 0;
+	size_t len;
+
+	while (secs > 0) {
+		n   = td_request_segment_secs(treq);
+		n   = n < secs ? n : secs;
+		len = (size_t)n << SECTOR_SHIFT;
+
+		if (cnt && iov[cnt - 1].iov_base + iov[cnt - 1].iov_len ==
+		    treq.buf)
+			iov[cnt - 1].iov_len += len;
+		else {
+			if (cnt == max)
+				return -E2BIG;
+			iov[cnt].iov_base = treq.buf;
+			iov[cnt].iov_len  = len;
+			cnt++;
+		}
+
+		td_request_advance(&treq, n);
+		secs -= n;
+	}
+
+	return cnt;
+}
+
+/*
+ * Issues vectored @treq one buffer at a time.
+ */
+void
+td_split_request(td_driver_t *driver, td_request_t treq,
+		 void (*queue)(td_driver_t *, td_request_t))
+{
+	td_request_t clone;
+
+	while (treq.secs > 0) {
+		clone = td_request_segment(treq);
+		td_request_advance(&treq, clone.secs);
+		queue(driver, clone);
+	}
+}
+
 void
 td_queue_write(td_image_t *image, td_request_t treq)
 {
@@ -179,6 +285,18 @@ td_queue_write(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	if (treq.iov && td_request_segment_secs(treq) < treq.secs) {
+		if (driver->ops->td_queue_writev)
+			driver->ops->td_queue_writev(driver, treq);
+		else
+			td_split_request(driver, treq,
+					 driver->ops->td_queue_write);
+		return;
+	}
+
+	treq.iov    = NULL;
+	treq.iovcnt = 0;
+
 	driver->ops->td_queue_write(driver, treq);
 
 	return;
@@ -213,6 +331,18 @@ td_queue_read(td_image_t *image, td_request_t treq)
 	if (err)
 		goto fail;
 
+	if (treq.iov && td_request_segment_secs(treq) < treq.secs) {
+		if (driver->ops->td_queue_readv)
+			driver->ops->td_queue_readv(driver, treq);
+		else
+			td_split_request(driver, treq,
+					 driver->ops->td_queue_read);
+		return;
+	}
+
+	treq.iov    = NULL;
+	treq.iovcnt = 0;
+
 	driver->ops->td_queue_read(driver, treq);
 
 	return;
@@ -221,6 +351,106 @@ fail:
 	td_complete_request(treq, err);
 }
 
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_discard) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	driver->ops->td_queue_discard(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+void
+td_queue_flush(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	if (!driver->ops->td_queue_flush) {
+		td_forward_request(treq);
+		return;
+	}
+
+	driver->ops->td_queue_flush(driver, treq);
+
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
+/*
+ * Returns the length of the run at @sec, at most @secs, which is
+ * uniformly allocated or not in @image itself.
+ */
+int
+td_block_status(td_image_t *image, td_sector_t sec, int secs, int *allocated)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver)
+		return -ENODEV;
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return -EBADF;
+
+	if (!driver->ops->td_block_status)
+		return -EOPNOTSUPP;
+
+	return driver->ops->td_block_status(driver, sec, secs, allocated);
+}
+
+/*
+ * Allocation of @treq's range in the rest of the chain, below the
+ * image it was queued to.
+ */
+int
+td_forward_block_status(td_request_t treq, int *allocated)
+{
+	return tapdisk_vbd_forward_block_status(treq, allocated);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -253,6 +483,33 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+void
+td_prep_readv(struct tiocb *tiocb, int fd, struct iovec *iov, int iovcnt,
+	      long long offset, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_tiocbv(tiocb, fd, 0, iov, iovcnt, offset, cb, arg);
+}
+
+void
+td_prep_writev(struct tiocb *tiocb, int fd, struct iovec *iov, int iovcnt,
+	       long long offset, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_tiocbv(tiocb, fd, 1, iov, iovcnt, offset, cb, arg);
+}
+
+void
+td_prep_fdsync(struct tiocb *tiocb, int fd, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_tiocb_fdsync(tiocb, fd, cb, arg);
+}
+
+void
+td_prep_discard(struct tiocb *tiocb, int fd, int blkdev, long long offset,
+		size_t bytes, td_queue_callback_t cb, void *arg)
+{
+	tapdisk_prep_tiocb_discard(tiocb, fd, blkdev, offset, bytes, cb, arg);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -18,6 +18,8 @@
 #ifndef _TAPDISK_INTERFACE_H_
 #define _TAPDISK_INTERFACE_H_
 
+#include <sys/uio.h>
+
 #include "tapdisk.h"
 #include "tapdisk-queue.h"
 
@@ -30,9 +32,20 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+void td_queue_flush(td_image_t *, td_request_t);
 void td_forward_request(td_request_t);
+int td_block_status(td_image_t *, td_sector_t, int, int *);
+int td_forward_block_status(td_request_t, int *);
 void td_complete_request(td_request_t, int);
 
+int td_request_segment_secs(td_request_t);
+td_request_t td_request_segment(td_request_t);
+void td_request_advance(td_request_t *, int);
+int td_request_iovec(td_request_t, int, struct iovec *, int);
+void td_split_request(td_driver_t *, td_request_t,
+		      void (*)(td_driver_t *, td_request_t));
+
 void td_debug(td_image_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
@@ -40,6 +53,13 @@ void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
 		   long long, td_queue_callback_t, void *);
+void td_prep_readv(struct tiocb *, int, struct iovec *, int,
+		   long long, td_queue_callback_t, void *);
+void td_prep_writev(struct tiocb *, int, struct iovec *, int,
+		    long long, td_queue_callback_t, void *);
+void td_prep_fdsync(struct tiocb *, int, td_queue_callback_t, void *);
+void td_prep_discard(struct tiocb *, int, int, long long, size_t,
+		     td_queue_callback_t, void *);
 void td_panic(void) __noreturn;
 
 #endif
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -51,6 +52,7 @@ struct tlog {
 };
 
 static struct tlog tapdisk_log;
+static pthread_mutex_t tapdisk_log_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void
 tlog_logfile_vprint(const char *fmt, va_list ap)
@@ -232,12 +234,16 @@ tlog_close(void)
 void
 tlog_precious(int force_flush)
 {
+	pthread_mutex_lock(&tapdisk_log_lock);
+
 	if (!tapdisk_log.precious)
 		tlog_logfile_save();
 	else if (force_flush)
 		tapdisk_logfile_flush(&tapdisk_log.logfile);
 
 	tapdisk_log.precious = 1;
+
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -246,9 +252,11 @@ __tlog_write(int level, const char *fmt, ...)
 	va_list ap;
 
 	if (level <= tapdisk_log.level) {
+		pthread_mutex_lock(&tapdisk_log_lock);
 		va_start(ap, fmt);
 		tlog_logfile_vprint(fmt, ap);
 		va_end(ap);
+		pthread_mutex_unlock(&tapdisk_log_lock);
 	}
 }
 
@@ -261,7 +269,9 @@ __tlog_error(const char *fmt, ...)
 	tlog_vsyslog(LOG_ERR, fmt, ap);
 	va_end(ap);
 
+	pthread_mutex_lock(&tapdisk_log_lock);
 	tapdisk_log.errors++;
+	pthread_mutex_unlock(&tapdisk_log_lock);
 }
 
 void
@@ -36,11 +36,16 @@ enum {
 	NBD_CMD_WRITE = 1,
 	NBD_CMD_DISC = 2,
 	NBD_CMD_FLUSH = 3,
-	NBD_CMD_TRIM = 4
+	NBD_CMD_TRIM = 4,
+	NBD_CMD_WRITE_ZEROES = 6,
+	NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_CMD_MASK_COMMAND 0x0000ffff
 #define NBD_CMD_FLAG_FUA (1<<16)
+#define NBD_CMD_FLAG_NO_HOLE (1<<17)
+#define NBD_CMD_FLAG_DF (1<<18)
+#define NBD_CMD_FLAG_REQ_ONE (1<<19)
 
 /* values for flags field */
 #define NBD_FLAG_HAS_FLAGS      (1 << 0) /* Flags are there */
@@ -50,6 +55,58 @@ enum {
 #define NBD_FLAG_ROTATIONAL     (1 << 4) /* Use elevator algorithm -
 					    rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5) /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6) /* Send WRITE_ZEROES */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8) /* Flush is seen by every
+					    connection */
+
+/* fixed-newstyle negotiation */
+#define NBD_OPTS_MAGIC 0x49484156454F5054LL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC 0x3e889045565a9LL
+
+/* handshake flags, server */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+/* handshake flags, client */
+#define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES      NBD_FLAG_NO_ZEROES
+
+enum {
+	NBD_OPT_EXPORT_NAME = 1,
+	NBD_OPT_ABORT = 2,
+	NBD_OPT_LIST = 3,
+	NBD_OPT_INFO = 6,
+	NBD_OPT_GO = 7,
+	NBD_OPT_STRUCTURED_REPLY = 8,
+	NBD_OPT_LIST_META_CONTEXT = 9,
+	NBD_OPT_SET_META_CONTEXT = 10
+};
+
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_INFO            3
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_FLAG_ERROR      (1U << 31)
+#define NBD_REP_ERR_UNSUP       (NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_POLICY      (NBD_REP_FLAG_ERROR | 2)
+#define NBD_REP_ERR_INVALID     (NBD_REP_FLAG_ERROR | 3)
+
+#define NBD_INFO_EXPORT         0
+#define NBD_INFO_BLOCK_SIZE     3
+
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+
+/* structured replies */
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define NBD_REPLY_FLAG_DONE     (1 << 0)
+#define NBD_REPLY_TYPE_NONE     0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR    ((1 << 15) + 1)
+
+/* base:allocation extent flags */
+#define NBD_STATE_HOLE          (1 << 0)
+#define NBD_STATE_ZERO          (1 << 1)
 
 #define nbd_cmd(req) ((req)->cmd[0])
 
@@ -61,6 +118,7 @@ enum {
 #define NBD_REPLY_MAGIC 0x67446698
 /* Do *not* use magics: 0x12560953 0x96744668. */
 
+#define __be16 uint16_t
 #define __be32 uint32_t
 #define __be64 uint64_t
 
@@ -86,4 +144,36 @@ struct nbd_reply {
 	__be32 error;		/* 0 = ok, else error	*/
 	char handle[8];		/* handle you got from request	*/
 };
+
+/*
+ * Negotiation option and its reply, newstyle only.
+ */
+struct nbd_option {
+	__be64 magic;
+	__be32 option;
+	__be32 len;
+} __attribute__ ((packed));
+
+struct nbd_option_reply {
+	__be64 magic;
+	__be32 option;
+	__be32 type;
+	__be32 len;
+} __attribute__ ((packed));
+
+/*
+ * Header of each chunk of a structured reply.
+ */
+struct nbd_structured_reply {
+	__be32 magic;
+	__be16 flags;
+	__be16 type;
+	char handle[8];
+	__be32 len;
+} __attribute__ ((packed));
+
+struct nbd_block_descriptor {
+	__be32 len;
+	__be32 flags;
+};
 #endif
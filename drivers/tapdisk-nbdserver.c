@@ -27,6 +27,9 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "tapdisk.h"
 #include "tapdisk-server.h"
@@ -35,6 +38,7 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-nbdserver.h"
 #include "tapdisk-fdreceiver.h"
+#include "libvhd-bufpool.h"
 
 #include "tapdisk-nbd.h"
 
@@ -44,6 +48,25 @@
 
 #define NBD_SERVER_NUM_REQS TAPDISK_DATA_REQUESTS
 
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+
+/*
+ * Requests are parsed out of a per-client receive buffer, as many as
+ * arrived in one wakeup. Replies are queued as requests complete and
+ * go out together, one sendmsg per scheduler pass. The greeting and
+ * option replies are buffered the same way, in obuf.
+ */
+#define NBD_SERVER_RBUF_SIZE  (256 << 10)
+#define NBD_SERVER_MAX_IOVS   256
+
+#define NBD_SERVER_MAX_REQUEST  (32 << 20)
+#define NBD_SERVER_MAX_OPTION   4096
+#define NBD_SERVER_MAX_EXTENTS  256
+#define NBD_SERVER_ZEROES_SIZE  (1 << 20)
+#define NBD_SERVER_META_ID      1
+
+#define NBD_SERVER_NEWSTYLE_ENV "TAPDISK_NBD_NEWSTYLE"
+
 #define TAPDISK_NBDSERVER_LISTEN_SOCK_PATH "/var/run/blktap-control/nbdserver"
 #define TAPDISK_NBDSERVER_MAX_PATH_LEN 256
 
@@ -58,10 +81,29 @@ struct td_nbdserver_req {
 	td_vbd_request_t        vreq;
 	char                    id[16];
 	struct td_iovec         iov;
+	size_t                  bufsz;
+	struct td_iovec        *iovs;       /* write-zeroes segments */
+
+	int                     cmd;
+	uint64_t                from;
+	int                     err;        /* fail once payload is in */
+
+	/* reply header, followed by plen bytes from iov.base */
+	char                    rhdr[32];
+	size_t                  rhdr_len;
+	size_t                  plen;
+	struct list_head        next;
 };
 
+/* shared by servers on every shard thread, allocated once */
+static pthread_mutex_t tapdisk_nbdserver_zeroes_lock =
+	PTHREAD_MUTEX_INITIALIZER;
+static void *tapdisk_nbdserver_zeroes;
+
 static void tapdisk_nbdserver_disable_client(td_nbdserver_client_t *client);
 static void tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data);
+static void tapdisk_nbdserver_replycb(event_id_t id, char mode, void *data);
+static void tapdisk_nbdserver_parse(td_nbdserver_client_t *client);
 int tapdisk_nbdserver_setup_listening_socket(td_nbdserver_t *server);
 int tapdisk_nbdserver_unpause(td_nbdserver_t *server);
 
@@ -88,9 +130,41 @@ tapdisk_nbdserver_free_request(td_nbdserver_client_t *client,
 	client->reqs_free[client->n_reqs_free++] = req;
 }
 
+static void
+tapdisk_nbdserver_put_request(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	if (req->bufsz)
+		vhd_bufpool_put(req->iov.base, req->bufsz);
+	req->iov.base = NULL;
+	req->bufsz = 0;
+
+	free(req->iovs);
+	req->iovs = NULL;
+
+	tapdisk_nbdserver_free_request(client, req);
+}
+
 static void
 tapdisk_nbdserver_reqs_free(td_nbdserver_client_t *client)
 {
+	td_nbdserver_req_t *req, *next;
+
+	list_for_each_entry_safe(req, next, &client->replies, next) {
+		list_del(&req->next);
+		tapdisk_nbdserver_put_request(client, req);
+	}
+
+	if (client->rreq) {
+		tapdisk_nbdserver_put_request(client, client->rreq);
+		client->rreq = NULL;
+	}
+
+	if (client->rbuf) {
+		free(client->rbuf);
+		client->rbuf = NULL;
+	}
+
 	if (client->reqs) {
 		free(client->reqs);
 		client->reqs = NULL;
@@ -131,6 +205,12 @@ tapdisk_nbdserver_reqs_init(td_nbdserver_client_t *client, int n_reqs)
 		goto fail;
 	}
 
+	client->rbuf = malloc(NBD_SERVER_RBUF_SIZE);
+	if (!client->rbuf) {
+		err = -errno;
+		goto fail;
+	}
+
 	client->n_reqs      = n_reqs;
 	client->n_reqs_free = 0;
 
@@ -162,6 +242,7 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 	}
 
 	bzero(client, sizeof(td_nbdserver_client_t));
+	INIT_LIST_HEAD(&client->replies);
 
 	err = tapdisk_nbdserver_reqs_init(client, NBD_SERVER_NUM_REQS);
 	if (err < 0) {
@@ -171,6 +252,7 @@ tapdisk_nbdserver_alloc_client(td_nbdserver_t *server)
 
 	client->client_fd = -1;
 	client->client_event_id = -1;
+	client->reply_event_id = -1;
 	client->server = server;
 	INIT_LIST_HEAD(&client->clientlist);
 	list_add(&client->clientlist, &server->clients);
@@ -201,8 +283,14 @@ tapdisk_nbdserver_free_client(td_nbdserver_client_t *client)
 	if (client->client_event_id >= 0)
 		tapdisk_nbdserver_disable_client(client);
 
+	if (client->reply_event_id >= 0) {
+		tapdisk_server_unregister_event(client->reply_event_id);
+		client->reply_event_id = -1;
+	}
+
 	list_del(&client->clientlist);
 	tapdisk_nbdserver_reqs_free(client);
+	free(client->obuf);
 	free(client);
 }
 
@@ -233,6 +321,27 @@ tapdisk_nbdserver_enable_client(td_nbdserver_client_t *client)
 		return client->client_event_id;
 	}
 
+	if (client->rblocked)
+		tapdisk_server_mask_event(client->client_event_id, 1);
+
+	if (client->reply_event_id < 0) {
+		client->reply_event_id = tapdisk_server_register_event(
+				SCHEDULER_POLL_WRITE_FD,
+				client->client_fd, 0,
+				tapdisk_nbdserver_replycb,
+				client);
+		if (client->reply_event_id < 0) {
+			ERROR("Error registering reply event on client: %d",
+					client->reply_event_id);
+			tapdisk_nbdserver_disable_client(client);
+			return client->reply_event_id;
+		}
+
+		tapdisk_server_mask_event(client->reply_event_id,
+				list_empty(&client->replies) &&
+				!client->obuf_len);
+	}
+
 	return client->client_event_id;
 }
 
@@ -259,218 +368,1114 @@ static void
 	return &(((struct sockaddr_in6*)ss)->sin6_addr);
 }
 
+/*
+ * Errors go on the wire as the NBD protocol's errno values, which
+ * match Linux for the ones it defines.
+ */
+static uint32_t
+tapdisk_nbdserver_errno(int err)
+{
+	switch (-err) {
+	case 0:
+	case EPERM:
+	case EIO:
+	case ENOMEM:
+	case EINVAL:
+	case ENOSPC:
+	case EOVERFLOW:
+	case ENOTSUP:
+	case ESHUTDOWN:
+		return -err;
+	}
+
+	return EIO;
+}
+
+/*
+ * Build the reply to @req and queue it for the reply event. Once
+ * negotiated, reads and block status go out as one structured chunk.
+ */
+static void
+tapdisk_nbdserver_reply(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, int error)
+{
+	struct nbd_structured_reply chunk;
+	struct nbd_reply reply;
+	uint32_t err, tmp32;
+	uint64_t tmp64;
+	uint16_t tmp16;
+
+	err = tapdisk_nbdserver_errno(error);
+	if (err)
+		req->plen = 0;
+
+	if (!client->structured ||
+	    (req->cmd != NBD_CMD_READ && req->cmd != NBD_CMD_BLOCK_STATUS)) {
+		reply.magic = htonl(NBD_REPLY_MAGIC);
+		reply.error = htonl(err);
+		memcpy(reply.handle, req->id, sizeof(reply.handle));
+
+		memcpy(req->rhdr, &reply, sizeof(reply));
+		req->rhdr_len = sizeof(reply);
+		goto queue;
+	}
+
+	chunk.magic = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	chunk.flags = htons(NBD_REPLY_FLAG_DONE);
+	memcpy(chunk.handle, req->id, sizeof(chunk.handle));
+	req->rhdr_len = sizeof(chunk);
+
+	if (err) {
+		chunk.type = htons(NBD_REPLY_TYPE_ERROR);
+		chunk.len  = htonl(sizeof(tmp32) + sizeof(tmp16));
+		tmp32 = htonl(err);
+		tmp16 = 0;
+		memcpy(req->rhdr + req->rhdr_len, &tmp32, sizeof(tmp32));
+		req->rhdr_len += sizeof(tmp32);
+		memcpy(req->rhdr + req->rhdr_len, &tmp16, sizeof(tmp16));
+		req->rhdr_len += sizeof(tmp16);
+	} else if (req->cmd == NBD_CMD_READ) {
+		chunk.type = htons(NBD_REPLY_TYPE_OFFSET_DATA);
+		chunk.len  = htonl(sizeof(tmp64) + req->plen);
+		tmp64 = htonll(req->from);
+		memcpy(req->rhdr + req->rhdr_len, &tmp64, sizeof(tmp64));
+		req->rhdr_len += sizeof(tmp64);
+	} else {
+		chunk.type = htons(NBD_REPLY_TYPE_BLOCK_STATUS);
+		chunk.len  = htonl(sizeof(tmp32) + req->plen);
+		tmp32 = htonl(NBD_SERVER_META_ID);
+		memcpy(req->rhdr + req->rhdr_len, &tmp32, sizeof(tmp32));
+		req->rhdr_len += sizeof(tmp32);
+	}
+
+	memcpy(req->rhdr, &chunk, sizeof(chunk));
+
+queue:
+	if (list_empty(&client->replies) && client->reply_event_id >= 0)
+		tapdisk_server_mask_event(client->reply_event_id, 0);
+
+	list_add_tail(&req->next, &client->replies);
+}
+
 static void
 __tapdisk_nbdserver_request_cb(td_vbd_request_t *vreq, int error,
 		void *token, int final)
 {
 	td_nbdserver_client_t *client = token;
 	td_nbdserver_req_t *req = containerof(vreq, td_nbdserver_req_t, vreq);
-	struct nbd_reply reply;
-	int tosend = 0;
-	int sent = 0;
-	int len = 0;
-
-	reply.magic = htonl(NBD_REPLY_MAGIC);
-	reply.error = htonl(error);
-	memcpy(reply.handle, req->id, sizeof(reply.handle));
 
 	if (client->client_fd < 0) {
 		ERROR("Finishing request for client that has disappeared");
-		goto finish;
+		tapdisk_nbdserver_put_request(client, req);
+		return;
 	}
 
-	send(client->client_fd, &reply, sizeof(reply), 0);
+	tapdisk_nbdserver_reply(client, req, error);
+}
 
-	switch(vreq->op) {
-	case TD_OP_READ:
-		tosend = len = vreq->iov->secs << SECTOR_SHIFT;
-		while (tosend > 0) {
-			sent = send(client->client_fd,
-					vreq->iov->base + (len - tosend),
-					tosend, 0);
-			if (sent <= 0) {
-				ERROR("Short send or error in "
-						"callback: %d", sent);
-				goto finish;
-			}
+/*
+ * Gather every queued reply, header and payload, into one sendmsg.
+ * Whatever the socket does not take stays queued for the next
+ * writable event.
+ */
+static int
+tapdisk_nbdserver_send_replies(td_nbdserver_client_t *client)
+{
+	struct iovec iov[NBD_SERVER_MAX_IOVS];
+	td_nbdserver_req_t *req, *next;
+	struct msghdr msg;
+	size_t off, len;
+	ssize_t sent;
+	int n;
 
-			tosend -= sent;
+	if (client->obuf_len) {
+		sent = send(client->client_fd, client->obuf + client->obuf_off,
+			    client->obuf_len - client->obuf_off,
+			    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			return -errno;
 		}
-		break;
-	default:
-		break;
+
+		client->obuf_off += sent;
+		if (client->obuf_off < client->obuf_len)
+			return 0;
+
+		free(client->obuf);
+		client->obuf     = NULL;
+		client->obuf_off = 0;
+		client->obuf_len = 0;
 	}
 
-finish:
-	free(vreq->iov->base);
-	tapdisk_nbdserver_free_request(client, req);
-}
+	n   = 0;
+	off = client->reply_off;
+
+	list_for_each_entry(req, &client->replies, next) {
+		if (n + 2 > NBD_SERVER_MAX_IOVS)
+			break;
+
+		if (off < req->rhdr_len) {
+			iov[n].iov_base = req->rhdr + off;
+			iov[n].iov_len  = req->rhdr_len - off;
+			n++;
+			off = 0;
+		} else
+			off -= req->rhdr_len;
+
+		if (req->plen) {
+			iov[n].iov_base = (char *)req->iov.base + off;
+			iov[n].iov_len  = req->plen - off;
+			n++;
+		}
 
-static void tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd);
+		off = 0;
+	}
+
+	if (!n)
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = n;
+
+	sent = sendmsg(client->client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		return -errno;
+	}
+
+	sent += client->reply_off;
+
+	list_for_each_entry_safe(req, next, &client->replies, next) {
+		len = req->rhdr_len + req->plen;
+		if (sent < len)
+			break;
+
+		sent -= len;
+		list_del(&req->next);
+		tapdisk_nbdserver_put_request(client, req);
+	}
+
+	client->reply_off = sent;
+
+	return 0;
+}
 
 static void
-tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+tapdisk_nbdserver_replycb(event_id_t id, char mode, void *data)
 {
 	td_nbdserver_client_t *client = data;
-	td_nbdserver_t *server = client->server;
-	int rc;
-	int len;
-	int hdrlen;
-	int n;
 	int fd = client->client_fd;
-	char *ptr;
-	td_vbd_request_t *vreq;
-	struct nbd_request request;
-
-	td_nbdserver_req_t *req = tapdisk_nbdserver_alloc_request(client);
+	int err;
 
-	if (req == NULL) {
-		ERROR("Couldn't allocate request in clientcb - killing client");
+	err = tapdisk_nbdserver_send_replies(client);
+	if (err) {
+		ERROR("Error sending replies: %d", err);
 		tapdisk_nbdserver_free_client(client);
 		return;
 	}
 
-	vreq = &req->vreq;
+	if (list_empty(&client->replies) && !client->obuf_len) {
+		tapdisk_server_mask_event(client->reply_event_id, 1);
 
-	memset(req, 0, sizeof(td_nbdserver_req_t));
-	/* Read the request the client has sent */
+		if (client->state == TD_NBDSERVER_ABORTED) {
+			INFO("Client aborted negotiation");
+			tapdisk_nbdserver_free_client(client);
+			close(fd);
+			return;
+		}
+	}
 
-	hdrlen = sizeof(struct nbd_request);
+	/* requests or obuf freed up: resume parsing what is buffered */
+	if (client->rblocked && client->n_reqs_free && !client->obuf_len) {
+		client->rblocked = 0;
+		if (client->client_event_id >= 0)
+			tapdisk_server_mask_event(client->client_event_id, 0);
+		tapdisk_nbdserver_parse(client);
+	}
+}
 
-	n = 0;
-	ptr = (char *) &request;
-	while (n < hdrlen) {
-		rc = recv(fd, ptr + n, hdrlen - n, 0);
-		if (rc == 0) {
-			INFO("Client closed connection");
-			goto fail;
-		}
-		if (rc < 0) {
-			ERROR("Bad return in nbdserver_clientcb. Closing "
-					"connection");
-			goto fail;
+static void tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd);
+
+static uint16_t
+tapdisk_nbdserver_export_flags(td_nbdserver_t *server)
+{
+	uint16_t flags;
+
+	flags  = NBD_FLAG_HAS_FLAGS;
+	flags |= NBD_FLAG_SEND_FLUSH;
+	flags |= NBD_FLAG_SEND_FUA;
+	flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+	flags |= NBD_FLAG_CAN_MULTI_CONN;
+
+	if (tapdisk_vbd_discard_supported(server->vbd))
+		flags |= NBD_FLAG_SEND_TRIM;
+
+	if (td_flag_test(server->vbd->flags, TD_OPEN_RDONLY))
+		flags |= NBD_FLAG_READ_ONLY;
+
+	return flags;
+}
+
+static uint64_t
+tapdisk_nbdserver_size(td_nbdserver_t *server)
+{
+	return server->info.size * server->info.sector_size;
+}
+
+/* buffer @data for the reply event, which sends it ahead of replies */
+static int
+tapdisk_nbdserver_queue_out(td_nbdserver_client_t *client,
+		const void *data, size_t len)
+{
+	char *buf;
+
+	buf = realloc(client->obuf, client->obuf_len + len);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf + client->obuf_len, data, len);
+	client->obuf      = buf;
+	client->obuf_len += len;
+
+	if (client->reply_event_id >= 0)
+		tapdisk_server_mask_event(client->reply_event_id, 0);
+
+	return 0;
+}
+
+static int
+tapdisk_nbdserver_option_reply(td_nbdserver_client_t *client,
+		uint32_t option, uint32_t type, const void *data, uint32_t len)
+{
+	struct nbd_option_reply reply;
+	int err;
+
+	reply.magic  = htonll(NBD_REP_MAGIC);
+	reply.option = htonl(option);
+	reply.type   = htonl(type);
+	reply.len    = htonl(len);
+
+	err = tapdisk_nbdserver_queue_out(client, &reply, sizeof(reply));
+	if (!err && len)
+		err = tapdisk_nbdserver_queue_out(client, data, len);
+
+	return err;
+}
+
+static int
+tapdisk_nbdserver_opt_export_name(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	char buf[8 + 2 + 124];
+	uint64_t tmp64;
+	uint16_t tmp16;
+	size_t len;
+
+	tmp64 = htonll(tapdisk_nbdserver_size(server));
+	tmp16 = htons(tapdisk_nbdserver_export_flags(server));
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &tmp64, sizeof(tmp64));
+	memcpy(buf + 8, &tmp16, sizeof(tmp16));
+
+	len = sizeof(buf);
+	if (client->cflags & NBD_FLAG_C_NO_ZEROES)
+		len -= 124;
+
+	return tapdisk_nbdserver_queue_out(client, buf, len);
+}
+
+/*
+ * NBD_OPT_INFO and NBD_OPT_GO: there is a single export, whatever the
+ * name asked for. Block size is always sent, as requests must be
+ * sector aligned.
+ */
+static int
+tapdisk_nbdserver_opt_info(td_nbdserver_client_t *client, uint32_t option,
+		const char *data, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	char export[2 + 8 + 2], bsize[2 + 3 * 4];
+	uint32_t namelen, tmp32;
+	uint64_t tmp64;
+	uint16_t tmp16;
+	int err;
+
+	if (len < sizeof(namelen) + sizeof(tmp16))
+		goto invalid;
+
+	memcpy(&namelen, data, sizeof(namelen));
+	namelen = ntohl(namelen);
+	if (namelen > len - sizeof(namelen) - sizeof(tmp16))
+		goto invalid;
+
+	memcpy(&tmp16, data + sizeof(namelen) + namelen, sizeof(tmp16));
+	if (len != sizeof(namelen) + namelen + sizeof(tmp16) +
+	    ntohs(tmp16) * sizeof(tmp16))
+		goto invalid;
+
+	tmp16 = htons(NBD_INFO_EXPORT);
+	memcpy(export, &tmp16, sizeof(tmp16));
+	tmp64 = htonll(tapdisk_nbdserver_size(server));
+	memcpy(export + 2, &tmp64, sizeof(tmp64));
+	tmp16 = htons(tapdisk_nbdserver_export_flags(server));
+	memcpy(export + 10, &tmp16, sizeof(tmp16));
+
+	err = tapdisk_nbdserver_option_reply(client, option, NBD_REP_INFO,
+			export, sizeof(export));
+	if (err)
+		return err;
+
+	tmp16 = htons(NBD_INFO_BLOCK_SIZE);
+	memcpy(bsize, &tmp16, sizeof(tmp16));
+	tmp32 = htonl(1 << SECTOR_SHIFT);
+	memcpy(bsize + 2, &tmp32, sizeof(tmp32));
+	tmp32 = htonl(4096);
+	memcpy(bsize + 6, &tmp32, sizeof(tmp32));
+	tmp32 = htonl(NBD_SERVER_MAX_REQUEST);
+	memcpy(bsize + 10, &tmp32, sizeof(tmp32));
+
+	err = tapdisk_nbdserver_option_reply(client, option, NBD_REP_INFO,
+			bsize, sizeof(bsize));
+	if (err)
+		return err;
+
+	err = tapdisk_nbdserver_option_reply(client, option, NBD_REP_ACK,
+			NULL, 0);
+	if (err)
+		return err;
+
+	return option == NBD_OPT_GO;
+
+invalid:
+	return tapdisk_nbdserver_option_reply(client, option,
+			NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+/*
+ * NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. The only
+ * context is base:allocation, answered from the image metadata.
+ */
+static int
+tapdisk_nbdserver_opt_meta_context(td_nbdserver_client_t *client,
+		uint32_t option, const char *data, uint32_t len)
+{
+	const char *name = NBD_META_BASE_ALLOCATION;
+	char reply[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+	uint32_t namelen, n, qlen, off, tmp32;
+	int i, match, set, err;
+
+	set = option == NBD_OPT_SET_META_CONTEXT;
+	if (set && !client->structured)
+		goto invalid;
+
+	if (len < sizeof(namelen))
+		goto invalid;
+
+	memcpy(&namelen, data, sizeof(namelen));
+	namelen = ntohl(namelen);
+	if (namelen > len - sizeof(namelen) ||
+	    len - sizeof(namelen) - namelen < sizeof(n))
+		goto invalid;
+
+	off = sizeof(namelen) + namelen;
+	memcpy(&n, data + off, sizeof(n));
+	n    = ntohl(n);
+	off += sizeof(n);
+
+	match = !set && !n;
+
+	for (i = 0; i < n; i++) {
+		if (len - off < sizeof(qlen))
+			goto invalid;
+
+		memcpy(&qlen, data + off, sizeof(qlen));
+		qlen = ntohl(qlen);
+		off += sizeof(qlen);
+		if (qlen > len - off)
+			goto invalid;
+
+		if (qlen == strlen(name) && !memcmp(data + off, name, qlen))
+			match = 1;
+		else if (!set && qlen == strlen("base:") &&
+			 !memcmp(data + off, "base:", qlen))
+			match = 1;
+
+		off += qlen;
+	}
+
+	if (off != len)
+		goto invalid;
+
+	if (set)
+		client->meta_alloc = match;
+
+	if (match) {
+		tmp32 = htonl(NBD_SERVER_META_ID);
+		memcpy(reply, &tmp32, sizeof(tmp32));
+		memcpy(reply + 4, name, strlen(name));
+
+		err = tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_META_CONTEXT, reply, sizeof(reply));
+		if (err)
+			return err;
+	}
+
+	return tapdisk_nbdserver_option_reply(client, option, NBD_REP_ACK,
+			NULL, 0);
+
+invalid:
+	return tapdisk_nbdserver_option_reply(client, option,
+			NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+/*
+ * Returns 1 when the client moves on to transmission, 0 to wait for
+ * the next option.
+ */
+static int
+tapdisk_nbdserver_option(td_nbdserver_client_t *client, uint32_t option,
+		const char *data, uint32_t len)
+{
+	uint32_t tmp32;
+	int err;
+
+	switch (option) {
+	case NBD_OPT_EXPORT_NAME:
+		err = tapdisk_nbdserver_opt_export_name(client);
+		return err ? err : 1;
+
+	case NBD_OPT_ABORT:
+		/* closed by the reply event once the ack is out */
+		client->state = TD_NBDSERVER_ABORTED;
+		if (client->client_event_id >= 0)
+			tapdisk_server_mask_event(client->client_event_id, 1);
+		return tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_ACK, NULL, 0);
+
+	case NBD_OPT_LIST:
+		if (len)
+			break;
+		tmp32 = 0;
+		err = tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_SERVER, &tmp32, sizeof(tmp32));
+		if (err)
+			return err;
+		return tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_ACK, NULL, 0);
+
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO:
+		return tapdisk_nbdserver_opt_info(client, option, data, len);
+
+	case NBD_OPT_STRUCTURED_REPLY:
+		if (len)
+			break;
+		client->structured = 1;
+		return tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_ACK, NULL, 0);
+
+	case NBD_OPT_LIST_META_CONTEXT:
+	case NBD_OPT_SET_META_CONTEXT:
+		return tapdisk_nbdserver_opt_meta_context(client, option,
+				data, len);
+
+	default:
+		return tapdisk_nbdserver_option_reply(client, option,
+				NBD_REP_ERR_UNSUP, NULL, 0);
+	}
+
+	return tapdisk_nbdserver_option_reply(client, option,
+			NBD_REP_ERR_INVALID, NULL, 0);
+}
+
+/*
+ * Fixed-newstyle negotiation, from the receive buffer like requests.
+ * Returns 0 when more data is needed, 1 on progress.
+ */
+static int
+tapdisk_nbdserver_negotiate(td_nbdserver_client_t *client)
+{
+	struct nbd_option opt;
+	const char *data;
+	uint32_t flags, len;
+	size_t avail;
+	int rc;
+
+	if (client->state == TD_NBDSERVER_ABORTED)
+		return 0;
+
+	/* a client not reading its replies gets no more options parsed */
+	if (client->obuf_len > NBD_SERVER_MAX_OPTION) {
+		client->rblocked = 1;
+		if (client->client_event_id >= 0)
+			tapdisk_server_mask_event(client->client_event_id, 1);
+		return 0;
+	}
+
+	avail = client->rbuf_len - client->rbuf_head;
+
+	if (client->state == TD_NBDSERVER_HANDSHAKE) {
+		if (avail < sizeof(flags))
+			return 0;
+
+		memcpy(&flags, client->rbuf + client->rbuf_head, sizeof(flags));
+		client->rbuf_head += sizeof(flags);
+
+		client->cflags = ntohl(flags);
+		if (client->cflags &
+		    ~(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+			ERROR("Unknown client flags 0x%x", client->cflags);
+			return -EINVAL;
 		}
-		n += rc;
+
+		client->state = TD_NBDSERVER_OPTIONS;
+		return 1;
 	}
 
-	if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
-		ERROR("Not enough magic");
-		goto fail;
+	if (avail < sizeof(opt))
+		return 0;
+
+	memcpy(&opt, client->rbuf + client->rbuf_head, sizeof(opt));
+	if (ntohll(opt.magic) != NBD_OPTS_MAGIC) {
+		ERROR("Bad option magic");
+		return -EINVAL;
 	}
 
-	request.from = ntohll(request.from);
-	request.type = ntohl(request.type);
-	len = ntohl(request.len);
-	if (((len & 0x1ff) != 0) || ((request.from & 0x1ff) != 0)) {
-		ERROR("Non sector-aligned request (%"PRIu64", %d)",
-				request.from, len);
+	len = ntohl(opt.len);
+	if (len > NBD_SERVER_MAX_OPTION) {
+		ERROR("Option too long (%u)", len);
+		return -EINVAL;
 	}
 
-	bzero(req->id, sizeof(req->id));
-	memcpy(req->id, request.handle, sizeof(request.handle));
+	if (avail < sizeof(opt) + len)
+		return 0;
 
-	rc = posix_memalign(&req->iov.base, 512, len);
-	if (rc < 0) {
-		ERROR("posix_memalign failed (%d)", rc);
-		goto fail;
+	data = client->rbuf + client->rbuf_head + sizeof(opt);
+	client->rbuf_head += sizeof(opt) + len;
+
+	rc = tapdisk_nbdserver_option(client, ntohl(opt.option), data, len);
+	if (rc < 0)
+		return rc;
+
+	if (rc > 0) {
+		INFO("Negotiated%s%s",
+		     client->structured ? " structured replies" : "",
+		     client->meta_alloc ? " base:allocation" : "");
+		client->state = TD_NBDSERVER_TRANSMISSION;
+	}
+
+	return 1;
+}
+
+static int
+tapdisk_nbdserver_queue_request(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req)
+{
+	int rc;
+
+	if (req->err) {
+		tapdisk_nbdserver_reply(client, req, req->err);
+		return 0;
+	}
+
+	rc = tapdisk_vbd_queue_request(client->server->vbd, &req->vreq);
+	if (rc) {
+		ERROR("tapdisk_vbd_queue_request failed: %d", rc);
+		return rc;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the write payload for client->rreq from the receive buffer.
+ * Returns 1 once the payload is complete.
+ */
+static int
+tapdisk_nbdserver_fill_payload(td_nbdserver_client_t *client)
+{
+	td_nbdserver_req_t *req = client->rreq;
+	size_t n;
+
+	n = MIN(client->rbuf_len - client->rbuf_head,
+		req->bufsz - client->rreq_off);
+
+	memcpy((char *)req->iov.base + client->rreq_off,
+	       client->rbuf + client->rbuf_head, n);
+	client->rbuf_head += n;
+	client->rreq_off  += n;
+
+	if (client->rreq_off < req->bufsz)
+		return 0;
+
+	client->rreq = NULL;
+	return 1;
+}
+
+/*
+ * Answer NBD_CMD_BLOCK_STATUS with base:allocation extents, merging
+ * runs the chain reports separately.
+ */
+static int
+tapdisk_nbdserver_block_status(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, uint32_t len, int flags)
+{
+	struct nbd_block_descriptor *desc;
+	td_sector_t sec, end;
+	int n, max, run, alloc;
+	uint32_t state;
+
+	max = (flags & NBD_CMD_FLAG_REQ_ONE) ? 1 : NBD_SERVER_MAX_EXTENTS;
+
+	req->bufsz    = max * sizeof(*desc);
+	req->iov.base = vhd_bufpool_get(req->bufsz);
+	if (!req->iov.base) {
+		req->bufsz = 0;
+		return -ENOMEM;
+	}
+
+	desc = req->iov.base;
+	sec  = req->from >> SECTOR_SHIFT;
+	end  = sec + (len >> SECTOR_SHIFT);
+
+	for (n = 0; sec < end; sec += run) {
+		run = tapdisk_vbd_block_status(client->server->vbd, sec,
+				MIN(end - sec, NBD_SERVER_MAX_REQUEST >> SECTOR_SHIFT),
+				&alloc);
+		state = alloc ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+
+		if (n && ntohl(desc[n - 1].flags) == state &&
+		    ntohl(desc[n - 1].len) <= UINT32_MAX -
+		    ((uint32_t)run << SECTOR_SHIFT)) {
+			desc[n - 1].len = htonl(ntohl(desc[n - 1].len) +
+					(run << SECTOR_SHIFT));
+			continue;
+		}
+
+		if (n == max)
+			break;
+
+		desc[n].len   = htonl(run << SECTOR_SHIFT);
+		desc[n].flags = htonl(state);
+		n++;
+	}
+
+	req->plen = n * sizeof(*desc);
+	return 0;
+}
+
+static void *
+tapdisk_nbdserver_get_zeroes(void)
+{
+	void *buf;
+	int err;
+
+	pthread_mutex_lock(&tapdisk_nbdserver_zeroes_lock);
+
+	if (!tapdisk_nbdserver_zeroes) {
+		err = posix_memalign(&buf, getpagesize(),
+				NBD_SERVER_ZEROES_SIZE);
+		if (!err) {
+			memset(buf, 0, NBD_SERVER_ZEROES_SIZE);
+			tapdisk_nbdserver_zeroes = buf;
+		}
+	}
+
+	buf = tapdisk_nbdserver_zeroes;
+
+	pthread_mutex_unlock(&tapdisk_nbdserver_zeroes_lock);
+
+	return buf;
+}
+
+static int
+tapdisk_nbdserver_write_zeroes(td_nbdserver_req_t *req, uint32_t len)
+{
+	td_vbd_request_t *vreq = &req->vreq;
+	uint32_t secs;
+	void *zeroes;
+	int i, n;
+
+	zeroes = tapdisk_nbdserver_get_zeroes();
+	if (!zeroes)
+		return -ENOMEM;
+
+	n = (len + NBD_SERVER_ZEROES_SIZE - 1) / NBD_SERVER_ZEROES_SIZE;
+
+	req->iovs = calloc(n, sizeof(struct td_iovec));
+	if (!req->iovs)
+		return -ENOMEM;
+
+	secs = len >> SECTOR_SHIFT;
+	for (i = 0; i < n; i++) {
+		req->iovs[i].base = zeroes;
+		req->iovs[i].secs = MIN(secs,
+				NBD_SERVER_ZEROES_SIZE >> SECTOR_SHIFT);
+		secs -= req->iovs[i].secs;
 	}
 
-	vreq->sec = request.from >> SECTOR_SHIFT;
+	vreq->op     = TD_OP_WRITE;
+	vreq->iov    = req->iovs;
+	vreq->iovcnt = n;
+
+	return 0;
+}
+
+/*
+ * Set up @req for the command. Errors are replied to; only a bad
+ * write length, which leaves the stream unparseable, is fatal.
+ * Returns 1 when a write payload is to follow.
+ */
+static int
+tapdisk_nbdserver_prepare(td_nbdserver_client_t *client,
+		td_nbdserver_req_t *req, uint32_t type, uint32_t len)
+{
+	td_nbdserver_t *server = client->server;
+	td_vbd_request_t *vreq = &req->vreq;
+	int flags = type & ~NBD_CMD_MASK_COMMAND;
+	int rdonly, err = 0;
+
+	req->cmd = type & NBD_CMD_MASK_COMMAND;
+	rdonly   = td_flag_test(server->vbd->flags, TD_OPEN_RDONLY);
+
+	if (((len & 0x1ff) != 0) || ((req->from & 0x1ff) != 0)) {
+		ERROR("Non sector-aligned request (%"PRIu64", %u)",
+				req->from, len);
+		err = -EINVAL;
+	} else if (req->from > tapdisk_nbdserver_size(server) ||
+		   len > tapdisk_nbdserver_size(server) - req->from)
+		err = -EINVAL;
+
+	vreq->sec = req->from >> SECTOR_SHIFT;
 	vreq->iovcnt = 1;
 	vreq->iov = &req->iov;
 	vreq->iov->secs = len >> SECTOR_SHIFT;
-	vreq->token = client;
-	vreq->cb = __tapdisk_nbdserver_request_cb;
-	vreq->name = req->id;
-	vreq->vbd = server->vbd;
 
-	switch(request.type) {
+	switch (req->cmd) {
 	case NBD_CMD_READ:
 		vreq->op = TD_OP_READ;
+		if (len > NBD_SERVER_MAX_REQUEST)
+			err = -EINVAL;
+		if (err)
+			break;
+
+		req->iov.base = vhd_bufpool_get(len);
+		if (!req->iov.base) {
+			ERROR("failed to get a %u byte buffer", len);
+			err = -ENOMEM;
+			break;
+		}
+		req->bufsz = len;
+		req->plen  = len;
 		break;
+
 	case NBD_CMD_WRITE:
 		vreq->op = TD_OP_WRITE;
+		if (len > NBD_SERVER_MAX_REQUEST) {
+			ERROR("Write too large (%u)", len);
+			return -EINVAL;
+		}
 
-		n = 0;
-		while (n < len) {
-			rc = recv(fd, vreq->iov->base + n, (len - n), 0);
-			if (rc <= 0) {
-				ERROR("Short send or error in "
-						"callback: %d", rc);
-				goto fail;
-			}
+		if (rdonly)
+			err = -EPERM;
+
+		if (flags & NBD_CMD_FLAG_FUA)
+			td_flag_set(vreq->flags, TD_VBD_REQ_FUA);
 
-			n += rc;
-		};
+		if (!len)
+			break;
 
+		req->iov.base = vhd_bufpool_get(len);
+		if (!req->iov.base) {
+			ERROR("failed to get a %u byte buffer", len);
+			return -ENOMEM;
+		}
+		req->bufsz = len;
+		req->err   = err;
+
+		client->rreq     = req;
+		client->rreq_off = 0;
+		return 1;
+
+	case NBD_CMD_FLUSH:
+		vreq->op     = TD_OP_FLUSH;
+		vreq->iovcnt = 0;
+		err = 0;
 		break;
-	case NBD_CMD_DISC:
-		INFO("Received close message. Sending reconnect "
-				"header");
-		tapdisk_nbdserver_free_client(client);
-		INFO("About to send initial connection message");
-		tapdisk_nbdserver_newclient_fd(server, fd);
-		INFO("Sent");
-		return;
+
+	case NBD_CMD_TRIM:
+		vreq->op      = TD_OP_DISCARD;
+		req->iov.base = NULL;
+		if (rdonly)
+			err = -EPERM;
+		else if (!tapdisk_vbd_discard_supported(server->vbd))
+			err = -EOPNOTSUPP;
+		break;
+
+	case NBD_CMD_WRITE_ZEROES:
+		if (len > NBD_SERVER_MAX_REQUEST)
+			err = -EINVAL;
+		if (rdonly)
+			err = -EPERM;
+		if (err || !len)
+			break;
+
+		if (flags & NBD_CMD_FLAG_FUA)
+			td_flag_set(vreq->flags, TD_VBD_REQ_FUA);
+
+		err = tapdisk_nbdserver_write_zeroes(req, len);
+		break;
+
+	case NBD_CMD_BLOCK_STATUS:
+		if (!client->structured || !client->meta_alloc || !len)
+			err = -EINVAL;
+		if (err)
+			break;
+
+		err = tapdisk_nbdserver_block_status(client, req, len, flags);
+		req->err = err;
+		goto reply;
 
 	default:
-		ERROR("Unsupported operation: 0x%x", request.type);
-		goto fail;
+		ERROR("Unsupported operation: 0x%x", type);
+		err = -EINVAL;
+		break;
 	}
 
-	rc = tapdisk_vbd_queue_request(server->vbd, vreq);
-	if (rc) {
-		ERROR("tapdisk_vbd_queue_request failed: %d", rc);
-		goto fail;
+	/* zero-length and failed requests never reach the vbd */
+	if (!err && (len || req->cmd == NBD_CMD_FLUSH))
+		return 0;
+
+	req->err = err;
+reply:
+	tapdisk_nbdserver_reply(client, req, req->err);
+	return 2;
+}
+
+static void
+tapdisk_nbdserver_parse(td_nbdserver_client_t *client)
+{
+	td_nbdserver_t *server = client->server;
+	td_nbdserver_req_t *req;
+	td_vbd_request_t *vreq;
+	struct nbd_request request;
+	int fd = client->client_fd;
+	size_t avail;
+	int rc;
+
+	for (;;) {
+		if (client->rreq) {
+			req = client->rreq;
+			if (!tapdisk_nbdserver_fill_payload(client))
+				break;
+			if (tapdisk_nbdserver_queue_request(client, req))
+				goto fail;
+		}
+
+		if (client->state != TD_NBDSERVER_TRANSMISSION) {
+			rc = tapdisk_nbdserver_negotiate(client);
+			if (rc < 0)
+				goto fail;
+			if (!rc)
+				break;
+			continue;
+		}
+
+		avail = client->rbuf_len - client->rbuf_head;
+		if (avail < sizeof(request))
+			break;
+
+		req = tapdisk_nbdserver_alloc_request(client);
+		if (!req) {
+			/* wait for replies to drain before reading on */
+			client->rblocked = 1;
+			if (client->client_event_id >= 0)
+				tapdisk_server_mask_event(client->client_event_id, 1);
+			break;
+		}
+
+		vreq = &req->vreq;
+		memset(req, 0, sizeof(td_nbdserver_req_t));
+
+		memcpy(&request, client->rbuf + client->rbuf_head,
+		       sizeof(request));
+		client->rbuf_head += sizeof(request);
+
+		if (request.magic != htonl(NBD_REQUEST_MAGIC)) {
+			ERROR("Not enough magic");
+			tapdisk_nbdserver_free_request(client, req);
+			goto fail;
+		}
+
+		memcpy(req->id, request.handle, sizeof(request.handle));
+		req->from = ntohll(request.from);
+
+		vreq->token = client;
+		vreq->cb = __tapdisk_nbdserver_request_cb;
+		vreq->name = req->id;
+		vreq->vbd = server->vbd;
+
+		if ((ntohl(request.type) & NBD_CMD_MASK_COMMAND) ==
+		    NBD_CMD_DISC) {
+			INFO("Received close message. Sending reconnect "
+					"header");
+			tapdisk_nbdserver_free_request(client, req);
+			tapdisk_nbdserver_free_client(client);
+			INFO("About to send initial connection message");
+			tapdisk_nbdserver_newclient_fd(server, fd);
+			INFO("Sent");
+			return;
+		}
+
+		rc = tapdisk_nbdserver_prepare(client, req,
+				ntohl(request.type), ntohl(request.len));
+		if (rc < 0) {
+			tapdisk_nbdserver_put_request(client, req);
+			goto fail;
+		}
+
+		/* payload follows, or already replied */
+		if (rc)
+			continue;
+
+		if (tapdisk_nbdserver_queue_request(client, req))
+			goto fail;
+	}
+
+	/* keep room at the tail for the next recv */
+	if (client->rbuf_head == client->rbuf_len)
+		client->rbuf_head = client->rbuf_len = 0;
+	else if (client->rbuf_head > NBD_SERVER_RBUF_SIZE / 2 ||
+		 client->rbuf_len == NBD_SERVER_RBUF_SIZE) {
+		client->rbuf_len -= client->rbuf_head;
+		memmove(client->rbuf, client->rbuf + client->rbuf_head,
+			client->rbuf_len);
+		client->rbuf_head = 0;
 	}
 
 	return;
 
 fail:
 	tapdisk_nbdserver_free_client(client);
+	close(fd);
+}
+
+static void
+tapdisk_nbdserver_clientcb(event_id_t id, char mode, void *data)
+{
+	td_nbdserver_client_t *client = data;
+	td_nbdserver_req_t *req = client->rreq;
+	int fd = client->client_fd;
+	ssize_t rc;
+
+	if (req && client->rbuf_head == client->rbuf_len) {
+		/* large write payloads go straight to their buffer */
+		rc = recv(fd, (char *)req->iov.base + client->rreq_off,
+			  req->bufsz - client->rreq_off, MSG_DONTWAIT);
+		if (rc > 0) {
+			client->rreq_off += rc;
+			if (client->rreq_off < req->bufsz)
+				return;
+
+			client->rreq = NULL;
+			if (tapdisk_nbdserver_queue_request(client, req))
+				goto fail;
+			return;
+		}
+	} else
+		rc = recv(fd, client->rbuf + client->rbuf_len,
+			  NBD_SERVER_RBUF_SIZE - client->rbuf_len,
+			  MSG_DONTWAIT);
+
+	if (rc == 0) {
+		INFO("Client closed connection");
+		goto fail;
+	}
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		ERROR("Bad return in nbdserver_clientcb. Closing "
+				"connection");
+		goto fail;
+	}
+
+	client->rbuf_len += rc;
+	tapdisk_nbdserver_parse(client);
 	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(fd);
 }
 
+/*
+ * Greet a new connection: the old fixed 152 byte header by default,
+ * fixed-newstyle when TAPDISK_NBD_NEWSTYLE is set. The greeting goes
+ * out from obuf like any option reply.
+ */
 static void
 tapdisk_nbdserver_newclient_fd(td_nbdserver_t *server, int new_fd)
 {
+	td_nbdserver_client_t *client;
 	char buffer[256];
-	int rc;
 	uint64_t tmp64;
 	uint32_t tmp32;
+	uint16_t tmp16;
+	size_t len;
 
 	INFO("Got a new client!");
 
-	/* Spit out the NBD connection stuff */
-
 	memcpy(buffer, "NBDMAGIC", 8);
-	tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
-	memcpy(buffer + 8, &tmp64, sizeof(tmp64));
-	tmp64 = htonll(server->info.size * server->info.sector_size);
-	memcpy(buffer + 16, &tmp64, sizeof(tmp64));
-	tmp32 = htonl(0);
-	memcpy(buffer + 24, &tmp32, sizeof(tmp32));
-	bzero(buffer + 28, 124);
-
-	rc = send(new_fd, buffer, 152, 0);
 
-	if (rc < 152) {
-		close(new_fd);
-		INFO("Short write in negotiation!");
-	}	
+	if (!server->newstyle) {
+		tmp64 = htonll(NBD_NEGOTIATION_MAGIC);
+		memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+		tmp64 = htonll(tapdisk_nbdserver_size(server));
+		memcpy(buffer + 16, &tmp64, sizeof(tmp64));
+		tmp32 = htonl(tapdisk_nbdserver_export_flags(server));
+		memcpy(buffer + 24, &tmp32, sizeof(tmp32));
+		bzero(buffer + 28, 124);
+		len = 152;
+	} else {
+		tmp64 = htonll(NBD_OPTS_MAGIC);
+		memcpy(buffer + 8, &tmp64, sizeof(tmp64));
+		tmp16 = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+		memcpy(buffer + 16, &tmp16, sizeof(tmp16));
+		len = 18;
+	}
 
 	INFO("About to alloc client");
-	td_nbdserver_client_t *client = tapdisk_nbdserver_alloc_client(server);
+	client = tapdisk_nbdserver_alloc_client(server);
+	if (!client) {
+		close(new_fd);
+		return;
+	}
 	INFO("Got an allocated client at %p", client);
 	client->client_fd = new_fd;
+	client->state = server->newstyle ?
+		TD_NBDSERVER_HANDSHAKE : TD_NBDSERVER_TRANSMISSION;
+
+	if (tapdisk_nbdserver_queue_out(client, buffer, len)) {
+		ERROR("Error queueing the greeting");
+		goto fail;
+	}
+
 	INFO("About to enable client");
 
 	if (tapdisk_nbdserver_enable_client(client) < 0) {
 		ERROR("Error enabling client");
-		tapdisk_nbdserver_free_client(client);
-		close(new_fd);
-		return;
+		goto fail;
 	}
+
+	return;
+
+fail:
+	tapdisk_nbdserver_free_client(client);
+	close(new_fd);
 }
 
 static void 
@@ -527,6 +1532,7 @@ tapdisk_nbdserver_alloc(td_vbd_t *vbd, td_disk_info_t info)
 
 	server->vbd = vbd;
 	server->info = info;
+	server->newstyle = !!getenv(NBD_SERVER_NEWSTYLE_ENV);
 
 	snprintf(fdreceiver_path, TAPDISK_NBDSERVER_MAX_PATH_LEN, "%s%d.%d",
 			TAPDISK_NBDSERVER_LISTEN_SOCK_PATH, getpid(), 
@@ -35,8 +35,15 @@ struct td_nbdserver {
 
 	struct td_fdreceiver   *fdreceiver;
 	struct list_head        clients;
+
+	int                     newstyle;
 };
 
+#define TD_NBDSERVER_HANDSHAKE      0 /* awaiting client flags */
+#define TD_NBDSERVER_OPTIONS        1
+#define TD_NBDSERVER_TRANSMISSION   2
+#define TD_NBDSERVER_ABORTED        3 /* closed once obuf is out */
+
 struct td_nbdserver_client {
 	int                     n_reqs;
 	td_nbdserver_req_t     *reqs;
@@ -46,6 +53,29 @@ struct td_nbdserver_client {
 
 	int                     client_fd;
 	int                     client_event_id;
+	int                     reply_event_id;
+
+	int                     state;
+	uint32_t                cflags;
+	int                     structured;
+	int                     meta_alloc; /* base:allocation selected */
+
+	/* received, unparsed data is rbuf[rbuf_head, rbuf_len) */
+	char                   *rbuf;
+	size_t                  rbuf_head;
+	size_t                  rbuf_len;
+	td_nbdserver_req_t     *rreq;       /* write awaiting payload */
+	size_t                  rreq_off;
+	int                     rblocked;   /* out of requests */
+
+	/* completed, unsent; reply_off bytes of the first already out */
+	struct list_head        replies;
+	size_t                  reply_off;
+
+	/* greeting and option replies, sent ahead of the replies */
+	char                   *obuf;
+	size_t                  obuf_off;
+	size_t                  obuf_len;
 
 	td_nbdserver_t         *server;
 	struct list_head        clientlist;
@@ -22,9 +22,16 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #ifdef __linux__
 #include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #endif
 
 #include "tapdisk.h"
@@ -35,12 +42,17 @@
 #include "tapdisk-utils.h"
 
 #include "libaio-compat.h"
+#include "io-uring-compat.h"
 #include "atomicio.h"
 
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
 
+#define MAX(a, b) ((a) >= (b) ? (a) : (b))
+
+#define TQUEUE_IO_COST 4096 /* virtual bytes per tiocb */
+
 /*
  * We used a kernel patch to return an fd associated with the AIO context
  * so that we can concurrently poll on synchronous and async descriptors.
@@ -62,48 +74,119 @@ queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 	queue->iocbs[queue->queued++] = iocb;
 }
 
-static inline int
-deferred_tiocbs(struct tqueue *queue)
-{
-	return (queue->deferred.head != NULL);
-}
-
 static inline void
 defer_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
-	struct tlist *list = &queue->deferred;
+	struct tflow *flow = tiocb->flow;
+	struct tlist *list = &flow->pending;
 
-	if (!list->head)
+	tiocb->next = NULL;
+
+	if (!list->head) {
 		list->head = list->tail = tiocb;
-	else
+		/* idle flows don't bank virtual time */
+		flow->vtime = MAX(flow->vtime, queue->vclock[flow->class]);
+		list_add_tail(&flow->active, &queue->active[flow->class]);
+	} else
 		list->tail = list->tail->next = tiocb;
 
+	flow->n_pending++;
 	queue->tiocbs_deferred++;
-	queue->deferrals++;
 }
 
-static inline void
-queue_deferred_tiocb(struct tqueue *queue)
+static struct tflow *
+queue_next_flow(struct tqueue *queue, int class)
+{
+	struct tflow *flow, *next, *best = NULL;
+
+	list_for_each_entry_safe(flow, next, &queue->active[class], active) {
+		if (flow->class != class) {
+			/* reclassified while pending */
+			flow->vtime = MAX(flow->vtime, queue->vclock[flow->class]);
+			list_move_tail(&flow->active, &queue->active[flow->class]);
+			continue;
+		}
+
+		if (flow->depth && flow->inflight >= flow->depth)
+			continue;
+
+		if (!best || flow->vtime < best->vtime)
+			best = flow;
+	}
+
+	return best;
+}
+
+static inline unsigned long
+tiocb_nbytes(struct tiocb *tiocb)
 {
-	struct tlist *list = &queue->deferred;
+	struct iocb *iocb = &tiocb->iocb;
+	unsigned long bytes = 0;
+	int i;
 
-	if (list->head) {
-		struct tiocb *tiocb = list->head;
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+	case IO_CMD_PWRITE:
+		return iocb->u.c.nbytes;
 
-		list->head = tiocb->next;
-		if (!list->head)
-			list->tail = NULL;
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		for (i = 0; i < iocb->u.v.nr; i++)
+			bytes += iocb->u.v.vec[i].iov_len;
+		return bytes;
+	}
+
+	/* flushes and discards complete with 0 */
+	return 0;
+}
 
-		queue_tiocb(queue, tiocb);
-		queue->tiocbs_deferred--;
+static void
+queue_flow_tiocb(struct tqueue *queue, struct tflow *flow)
+{
+	struct tlist *list = &flow->pending;
+	struct tiocb *tiocb = list->head;
+	uint64_t cost;
+
+	list->head = tiocb->next;
+	if (!list->head) {
+		list->tail = NULL;
+		list_del_init(&flow->active);
 	}
+
+	flow->n_pending--;
+	queue->tiocbs_deferred--;
+
+	cost  = tiocb_nbytes(tiocb) + TQUEUE_IO_COST;
+	cost *= TQUEUE_WEIGHT_DEFAULT;
+	cost /= flow->weight;
+
+	queue->vclock[flow->class]  = flow->vtime;
+	flow->vtime                += cost;
+	flow->dispatched++;
+
+	tiocb->class = flow->class;
+	queue->inflight[tiocb->class]++;
+	flow->inflight++;
+
+	tiocb->next = NULL;
+	queue_tiocb(queue, tiocb);
 }
 
 static inline void
 queue_deferred_tiocbs(struct tqueue *queue)
 {
-	while (!tapdisk_queue_full(queue) && deferred_tiocbs(queue))
-		queue_deferred_tiocb(queue);
+	struct tflow *flow;
+	int class;
+
+	for (class = 0; class < TQUEUE_CLASSES; class++)
+		while (!tapdisk_queue_full(queue) &&
+		       queue->inflight[class] < queue->depth[class]) {
+			flow = queue_next_flow(queue, class);
+			if (!flow)
+				break;
+
+			queue_flow_tiocb(queue, flow);
+		}
 }
 
 /*
@@ -113,9 +196,13 @@ static void
 complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 {
 	int err;
-	struct iocb *iocb = &tiocb->iocb;
 
-	if (res == iocb->u.c.nbytes)
+	if (tiocb->flow) {
+		queue->inflight[tiocb->class]--;
+		tiocb->flow->inflight--;
+	}
+
+	if (res == tiocb_nbytes(tiocb))
 		err = 0;
 	else if ((int)res < 0)
 		err = (int)res;
@@ -150,6 +237,265 @@ cancel_tiocbs(struct tqueue *queue, int err)
 	return queued;
 }
 
+/*
+ * Run a flush or discard synchronously.
+ */
+static long
+tiocb_run_sync(const struct iocb *iocb)
+{
+	int fd        = iocb->aio_fildes;
+	long long off = iocb->u.c.offset;
+	size_t size   = iocb->u.c.nbytes;
+	int err;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_FDSYNC:
+		err = fdatasync(fd);
+		break;
+
+	case TIO_CMD_PUNCH:
+#ifdef FALLOC_FL_PUNCH_HOLE
+		err = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				off, size);
+#else
+		err = -1, errno = EOPNOTSUPP;
+#endif
+		break;
+
+	case TIO_CMD_DISCARD: {
+		uint64_t range[2] = { off, size };
+		err = ioctl(fd, BLKDISCARD, range);
+		break;
+	}
+
+	default:
+		err = -1, errno = EINVAL;
+		break;
+	}
+
+	return err ? -errno : 0;
+}
+
+/*
+ * worker: a helper thread per queue, for the ops a tio driver cannot
+ * issue asynchronously. Completions are handed back through an
+ * eventfd and run on the event loop, like those of the aio layer.
+ */
+
+struct tworker {
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	int              running;
+	int              closing;
+
+	struct tlist     pending;
+	struct tlist     done;
+
+	int              event_fd;
+	int              event_id;
+};
+
+static inline void
+tlist_add(struct tlist *list, struct tiocb *tiocb)
+{
+	tiocb->next = NULL;
+
+	if (!list->head)
+		list->head = list->tail = tiocb;
+	else
+		list->tail = list->tail->next = tiocb;
+}
+
+static void *
+tapdisk_worker_thread(void *arg)
+{
+	struct tworker *worker = arg;
+	struct tiocb *tiocb, *next;
+	uint64_t val = 1;
+	int gcc;
+
+	pthread_mutex_lock(&worker->lock);
+
+	for (;;) {
+		while (!worker->pending.head && !worker->closing)
+			pthread_cond_wait(&worker->cond, &worker->lock);
+
+		if (worker->closing)
+			break;
+
+		tiocb = worker->pending.head;
+		worker->pending.head = worker->pending.tail = NULL;
+
+		pthread_mutex_unlock(&worker->lock);
+
+		for (next = tiocb; next; next = next->next)
+			next->res = tiocb_run_sync(&next->iocb);
+
+		pthread_mutex_lock(&worker->lock);
+
+		for (; tiocb; tiocb = next) {
+			next = tiocb->next;
+			tlist_add(&worker->done, tiocb);
+		}
+
+		gcc = write(worker->event_fd, &val, sizeof(val));
+		if (gcc) {};
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+static void
+tapdisk_worker_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct tworker *worker = queue->worker;
+	struct tiocb *tiocb, *next;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(worker->event_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	pthread_mutex_lock(&worker->lock);
+	tiocb = worker->done.head;
+	worker->done.head = worker->done.tail = NULL;
+	pthread_mutex_unlock(&worker->lock);
+
+	for (; tiocb; tiocb = next) {
+		next = tiocb->next;
+
+		queue->iocbs_pending--;
+		queue->tiocbs_pending--;
+		complete_tiocb(queue, tiocb, tiocb->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_queue_stop_worker(struct tqueue *queue)
+{
+	struct tworker *worker = queue->worker;
+
+	if (!worker)
+		return;
+
+	if (worker->running) {
+		pthread_mutex_lock(&worker->lock);
+		worker->closing = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+
+		pthread_join(worker->thread, NULL);
+	}
+
+	if (worker->event_id >= 0)
+		tapdisk_server_unregister_event(worker->event_id);
+
+	if (worker->event_fd >= 0)
+		close(worker->event_fd);
+
+	pthread_cond_destroy(&worker->cond);
+	pthread_mutex_destroy(&worker->lock);
+
+	free(worker);
+	queue->worker = NULL;
+}
+
+static int
+tapdisk_queue_start_worker(struct tqueue *queue)
+{
+	struct tworker *worker;
+	int err;
+
+	worker = calloc(1, sizeof(*worker));
+	if (!worker)
+		return -errno;
+
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	worker->event_id = -1;
+	queue->worker    = worker;
+
+	worker->event_fd = tapdisk_sys_eventfd(0);
+	if (worker->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	worker->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      worker->event_fd, 0,
+					      tapdisk_worker_event,
+					      queue);
+	err = worker->event_id;
+	if (err < 0)
+		goto fail;
+
+	err = pthread_create(&worker->thread, NULL,
+			     tapdisk_worker_thread, worker);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	worker->running = 1;
+
+	return 0;
+
+fail:
+	tapdisk_queue_stop_worker(queue);
+	return err;
+}
+
+/*
+ * Pass the queued iocbs @native rejects to the worker. Runs before
+ * io_merge, while queue->iocbs still holds every tiocb in the order
+ * they are chained.
+ */
+static void
+tapdisk_queue_offload(struct tqueue *queue,
+		      int (*native)(struct tqueue *, const struct iocb *))
+{
+	struct tworker *worker = queue->worker;
+	int i, left, offloaded;
+
+	left = offloaded = 0;
+
+	for (i = 0; i < queue->queued; i++) {
+		struct iocb *iocb = queue->iocbs[i];
+
+		if (native(queue, iocb)) {
+			queue->iocbs[left++] = iocb;
+			continue;
+		}
+
+		if (!offloaded++)
+			pthread_mutex_lock(&worker->lock);
+		tlist_add(&worker->pending, iocb->data);
+	}
+
+	if (!offloaded)
+		return;
+
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+
+	/* relink the rest, for cancel_tiocbs */
+	for (i = 0; i < left; i++) {
+		struct tiocb *tiocb = queue->iocbs[i]->data;
+		tiocb->next = (i + 1 < left ? queue->iocbs[i + 1]->data : NULL);
+	}
+
+	queue->queued          = left;
+	queue->iocbs_pending  += offloaded;
+	queue->tiocbs_pending += offloaded;
+}
+
 static int
 fail_tiocbs(struct tqueue *queue, int succeeded, int total, int err)
 {
@@ -195,6 +541,59 @@ tapdisk_rwio_setup(struct tqueue *queue, int size)
 	return 0;
 }
 
+/*
+ * Vectored iocbs come from io_merge(); resume short transfers from the
+ * iovec they stopped in.
+ */
+static inline ssize_t
+tapdisk_rwio_rwv(const struct iocb *iocb)
+{
+	int fd                  = iocb->aio_fildes;
+	const struct iovec *iov = iocb->u.v.vec;
+	int cnt                 = iocb->u.v.nr;
+	long long off           = iocb->u.v.offset;
+	int rw                  = iocb->aio_lio_opcode == IO_CMD_PWRITEV;
+	size_t done             = 0;
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = rw ? pwritev(fd, iov, cnt, off) : preadv(fd, iov, cnt, off);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -errno;
+		}
+		if (!n)
+			break;
+
+		off  += n;
+		done += n;
+
+		for (; cnt > 0 && (size_t)n >= iov->iov_len; iov++, cnt--)
+			n -= iov->iov_len;
+
+		if (n) {
+			size_t rest = iov->iov_len - n;
+			char *buf   = (char *)iov->iov_base + n;
+			ssize_t (*func)(int, void *, size_t) =
+				(rw ? vwrite : read);
+
+			if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
+				return -errno;
+
+			if (atomicio(func, fd, buf, rest) != rest)
+				return -errno;
+
+			off  += rest;
+			done += rest;
+			iov++;
+			cnt--;
+		}
+	}
+
+	return done;
+}
+
 static inline ssize_t
 tapdisk_rwio_rw(const struct iocb *iocb)
 {
@@ -205,6 +604,17 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	ssize_t (*func)(int, void *, size_t) = 
 		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
 
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+	case IO_CMD_PWRITE:
+		break;
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		return tapdisk_rwio_rwv(iocb);
+	default:
+		return tiocb_run_sync(iocb);
+	}
+
 	if (lseek64(fd, off, SEEK_SET) == (off64_t)-1)
 		return -errno;
 
@@ -275,6 +685,7 @@ struct lio {
 };
 
 #define LIO_FLAG_EVENTFD        (1<<0)
+#define LIO_FLAG_FDSYNC         (1<<1)
 
 static int
 tapdisk_lio_check_resfd(void)
@@ -282,6 +693,12 @@ tapdisk_lio_check_resfd(void)
 	return tapdisk_linux_version() >= KERNEL_VERSION(2, 6, 22);
 }
 
+static int
+tapdisk_lio_check_fdsync(void)
+{
+	return tapdisk_linux_version() >= KERNEL_VERSION(4, 18, 0);
+}
+
 static void
 tapdisk_lio_destroy_aio(struct tqueue *queue)
 {
@@ -395,6 +812,8 @@ tapdisk_lio_destroy(struct tqueue *queue)
 	if (!lio)
 		return;
 
+	tapdisk_queue_stop_worker(queue);
+
 	if (lio->event_id >= 0) {
 		tapdisk_server_unregister_event(lio->event_id);
 		lio->event_id = -1;
@@ -490,6 +909,13 @@ tapdisk_lio_setup(struct tqueue *queue, int qlen)
 		goto fail;
 	}
 
+	err = tapdisk_queue_start_worker(queue);
+	if (err)
+		goto fail;
+
+	if (tapdisk_lio_check_fdsync())
+		lio->flags |= LIO_FLAG_FDSYNC;
+
 	return 0;
 
 fail:
@@ -497,6 +923,23 @@ fail:
 	return err;
 }
 
+/* aio gained IOCB_CMD_FDSYNC in 4.18; there is no aio discard */
+static int
+tapdisk_lio_native(struct tqueue *queue, const struct iocb *iocb)
+{
+	struct lio *lio = queue->tio_data;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_FDSYNC:
+		return !!(lio->flags & LIO_FLAG_FDSYNC);
+	case TIO_CMD_PUNCH:
+	case TIO_CMD_DISCARD:
+		return 0;
+	}
+
+	return 1;
+}
+
 static int
 tapdisk_lio_submit(struct tqueue *queue)
 {
@@ -507,6 +950,10 @@ tapdisk_lio_submit(struct tqueue *queue)
 		return 0;
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	tapdisk_queue_offload(queue, tapdisk_lio_native);
+	if (!queue->queued)
+		return 0;
+
 	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
@@ -539,51 +986,578 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * io_uring
+ */
+
+#ifdef TAPDISK_IO_URING
+
+/*
+ * Buffers are registered explicitly, typically the blktap data area;
+ * I/O falling entirely within one of them goes out as
+ * READ_FIXED/WRITE_FIXED. Files are not registered: drivers close and
+ * reopen fds without telling the queue, and a stale slot would send
+ * I/O to whatever file reused the number.
+ */
+#define URING_MAX_BUFS          64
+
+struct uring {
+	int                  ring_fd;
+
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ring;
+	size_t               sq_ring_size;
+	void                *cq_ring;
+	size_t               cq_ring_size;
+	size_t               sqes_size;
+
+	struct io_event     *aio_events;
+
+	int                  event_fd;
+	int                  event_id;
+
+	struct iovec         bufs[URING_MAX_BUFS];
+	int                  n_bufs;
+
+	int                  flags;
+};
+
+#define URING_FLAG_FIXED_BUFS   (1<<0)
+#define URING_FLAG_FALLOCATE    (1<<1)
+
 static void
-tapdisk_queue_free_io(struct tqueue *queue)
+tapdisk_uring_unmap(struct uring *uring)
 {
-	if (queue->tio) {
-		if (queue->tio->tio_destroy)
-			queue->tio->tio_destroy(queue);
-		queue->tio = NULL;
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
 	}
 
-	if (queue->tio_data) {
-		free(queue->tio_data);
-		queue->tio_data = NULL;
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	uring->cq_ring = NULL;
+
+	if (uring->sq_ring) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+		uring->sq_ring = NULL;
 	}
 }
 
 static int
-tapdisk_queue_init_io(struct tqueue *queue, int drv)
+tapdisk_uring_map(struct uring *uring, struct io_uring_params *p)
 {
-	const struct tio *tio;
+	void *ring;
 	int err;
 
-	switch (drv) {
-	case TIO_DRV_LIO:
-		tio = &td_tio_lio;
-		break;
-	case TIO_DRV_RWIO:
-		tio = &td_tio_rwio;
-		break;
-	default:
-		err = -EINVAL;
+	uring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uring->sq_ring_size = uring->cq_ring_size =
+			MAX(uring->sq_ring_size, uring->cq_ring_size);
+
+	ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+		    IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
 		goto fail;
+	uring->sq_ring = ring;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring = uring->sq_ring;
+	else {
+		ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+			    IORING_OFF_CQ_RING);
+		if (ring == MAP_FAILED)
+			goto fail;
 	}
+	uring->cq_ring = ring;
 
-	queue->tio_data = calloc(1, tio->data_size);
-	if (!queue->tio_data) {
-		PERROR("malloc(%zu)", tio->data_size);
-		err = -errno;
+	uring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+		    IORING_OFF_SQES);
+	if (ring == MAP_FAILED)
 		goto fail;
-	}
+	uring->sqes = ring;
 
-	queue->tio = tio;
+	uring->sq_head  = uring->sq_ring + p->sq_off.head;
+	uring->sq_tail  = uring->sq_ring + p->sq_off.tail;
+	uring->sq_mask  = uring->sq_ring + p->sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + p->sq_off.array;
 
-	if (tio->tio_setup) {
-		err = tio->tio_setup(queue, queue->size);
-		if (err)
+	uring->cq_head  = uring->cq_ring + p->cq_off.head;
+	uring->cq_tail  = uring->cq_ring + p->cq_off.tail;
+	uring->cq_mask  = uring->cq_ring + p->cq_off.ring_mask;
+	uring->cqes     = uring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+
+fail:
+	err = -errno;
+	tapdisk_uring_unmap(uring);
+	return err;
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	tapdisk_queue_stop_worker(queue);
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	tapdisk_uring_unmap(uring);
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+/*
+ * Reap completions straight off the CQ ring, without a syscall.
+ */
+static int
+tapdisk_uring_reap(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, n, split, reaped = 0;
+	unsigned head, tail;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	do {
+		head = *uring->cq_head;
+		tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (n = 0; head != tail && n < queue->size; head++, n++) {
+			struct io_uring_cqe *cqe;
+
+			cqe = &uring->cqes[head & *uring->cq_mask];
+			ep  = uring->aio_events + n;
+
+			ep->obj = (struct iocb *)(uintptr_t)cqe->user_data;
+			ep->res = cqe->res;
+		}
+
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (!n)
+			break;
+
+		split = io_split(&queue->opioctx, uring->aio_events, n);
+		tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+		DBG("events: %d, tiocbs: %d\n", n, split);
+
+		queue->iocbs_pending  -= n;
+		queue->tiocbs_pending -= split;
+		reaped                += n;
+
+		for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+			iocb  = ep->obj;
+			tiocb = iocb->data;
+			complete_tiocb(queue, tiocb, ep->res);
+		}
+	} while (head != tail);
+
+	if (reaped)
+		queue_deferred_tiocbs(queue);
+
+	return reaped;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring = queue->tio_data;
+	uint64_t val;
+	int gcc;
+
+	gcc = read(uring->event_fd, &val, sizeof(val));
+	if (gcc) {};
+
+	tapdisk_uring_reap(queue);
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+
+	uring->ring_fd = tapdisk_sys_io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_uring_map(uring, &p);
+	if (err)
+		goto fail;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_sys_io_uring_register(uring->ring_fd,
+					    IORING_REGISTER_EVENTFD,
+					    &uring->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = tapdisk_queue_start_worker(queue);
+	if (err)
+		goto fail;
+
+#ifdef TAPDISK_IO_URING_FALLOCATE
+	/* IORING_OP_FALLOCATE came with RW_CUR_POS, in 5.6 */
+	if (p.features & IORING_FEAT_RW_CUR_POS)
+		uring->flags |= URING_FLAG_FALLOCATE;
+#endif
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_buf(struct uring *uring, void *buf, size_t size)
+{
+	int i;
+
+	if (!(uring->flags & URING_FLAG_FIXED_BUFS))
+		return -1;
+
+	for (i = 0; i < uring->n_bufs; i++) {
+		struct iovec *iov = &uring->bufs[i];
+
+		if (buf >= iov->iov_base &&
+		    buf + size <= iov->iov_base + iov->iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring,
+		       struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	int write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	int buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->fd        = iocb->aio_fildes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->addr      = (uintptr_t)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->user_data = (uintptr_t)iocb;
+
+	switch (iocb->aio_lio_opcode) {
+	case IO_CMD_PREADV:
+	case IO_CMD_PWRITEV:
+		sqe->opcode = (iocb->aio_lio_opcode == IO_CMD_PWRITEV ?
+			       IORING_OP_WRITEV : IORING_OP_READV);
+		sqe->off    = iocb->u.v.offset;
+		sqe->addr   = (uintptr_t)iocb->u.v.vec;
+		sqe->len    = iocb->u.v.nr;
+		return;
+
+	case IO_CMD_FDSYNC:
+		sqe->opcode      = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->off         = 0;
+		sqe->addr        = 0;
+		sqe->len         = 0;
+		return;
+
+#ifdef TAPDISK_IO_URING_FALLOCATE
+	case TIO_CMD_PUNCH:
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->addr   = iocb->u.c.nbytes;
+		sqe->len    = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		return;
+#endif
+	}
+
+	buf = tapdisk_uring_buf(uring, iocb->u.c.buf, iocb->u.c.nbytes);
+	if (buf >= 0) {
+		sqe->opcode    = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+}
+
+/* no discard op, fallocate needs 5.6 */
+static int
+tapdisk_uring_native(struct tqueue *queue, const struct iocb *iocb)
+{
+	struct uring *uring = queue->tio_data;
+
+	switch (iocb->aio_lio_opcode) {
+	case TIO_CMD_PUNCH:
+		return !!(uring->flags & URING_FLAG_FALLOCATE);
+	case TIO_CMD_DISCARD:
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail, mask;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	tapdisk_queue_offload(queue, tapdisk_uring_native);
+	if (!queue->queued)
+		return 0;
+
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tail = *uring->sq_tail;
+	mask = *uring->sq_mask;
+
+	for (i = 0; i < merged; i++, tail++) {
+		unsigned idx = tail & mask;
+
+		tapdisk_uring_prep_sqe(uring, &uring->sqes[idx],
+				       queue->iocbs[i]);
+		uring->sq_array[idx] = idx;
+	}
+
+	__atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = tapdisk_sys_io_uring_enter(uring->ring_fd, merged, 0, 0);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = -errno;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	if (err)
+		/* retract whatever the kernel did not consume */
+		__atomic_store_n(uring->sq_tail,
+				 __atomic_load_n(uring->sq_head,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	/* completions which raced the submission, e.g. cached reads */
+	tapdisk_uring_reap(queue);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_update_buffers(struct uring *uring)
+{
+	int err;
+
+	if (uring->flags & URING_FLAG_FIXED_BUFS) {
+		tapdisk_sys_io_uring_register(uring->ring_fd,
+					      IORING_UNREGISTER_BUFFERS,
+					      NULL, 0);
+		uring->flags &= ~URING_FLAG_FIXED_BUFS;
+	}
+
+	if (!uring->n_bufs)
+		return 0;
+
+	err = tapdisk_sys_io_uring_register(uring->ring_fd,
+					    IORING_REGISTER_BUFFERS,
+					    uring->bufs, uring->n_bufs);
+	if (err) {
+		/* e.g. device mappings which cannot be pinned */
+		err = -errno;
+		DPRINTF("io_uring: no fixed buffers: %d\n", err);
+		return err;
+	}
+
+	uring->flags |= URING_FLAG_FIXED_BUFS;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (uring->n_bufs >= URING_MAX_BUFS)
+		return -ENOSPC;
+
+	uring->bufs[uring->n_bufs].iov_base = buf;
+	uring->bufs[uring->n_bufs].iov_len  = size;
+	uring->n_bufs++;
+
+	err = tapdisk_uring_update_buffers(uring);
+	if (err) {
+		uring->n_bufs--;
+		tapdisk_uring_update_buffers(uring);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->n_bufs; i++)
+		if (uring->bufs[i].iov_base == buf)
+			break;
+
+	if (i == uring->n_bufs)
+		return;
+
+	uring->bufs[i] = uring->bufs[--uring->n_bufs];
+
+	tapdisk_uring_update_buffers(uring);
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+#endif /* TAPDISK_IO_URING */
+
+static void
+tapdisk_queue_free_io(struct tqueue *queue)
+{
+	if (queue->tio) {
+		if (queue->tio->tio_destroy)
+			queue->tio->tio_destroy(queue);
+		queue->tio = NULL;
+	}
+
+	if (queue->tio_data) {
+		free(queue->tio_data);
+		queue->tio_data = NULL;
+	}
+}
+
+static int
+tapdisk_queue_init_io(struct tqueue *queue, int drv)
+{
+	const struct tio *tio;
+	int err;
+
+	switch (drv) {
+	case TIO_DRV_LIO:
+		tio = &td_tio_lio;
+		break;
+	case TIO_DRV_RWIO:
+		tio = &td_tio_rwio;
+		break;
+#ifdef TAPDISK_IO_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+#endif
+	default:
+		err = -EINVAL;
+		goto fail;
+	}
+
+	queue->tio_data = calloc(1, tio->data_size);
+	if (!queue->tio_data) {
+		PERROR("malloc(%zu)", tio->data_size);
+		err = -errno;
+		goto fail;
+	}
+
+	queue->tio = tio;
+
+	if (tio->tio_setup) {
+		err = tio->tio_setup(queue, queue->size);
+		if (err)
 			goto fail;
 	}
 
@@ -600,13 +1574,20 @@ int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
 {
-	int err;
+	int i, err;
 
 	memset(queue, 0, sizeof(struct tqueue));
 
 	queue->size   = size;
 	queue->filter = filter;
 
+	tapdisk_init_flow(&queue->flow);
+	for (i = 0; i < TQUEUE_CLASSES; i++) {
+		INIT_LIST_HEAD(&queue->active[i]);
+		queue->depth[i] = size;
+	}
+	queue->depth[TQUEUE_CLASS_BULK] = MAX(size / 2, 1);
+
 	if (!size)
 		return 0;
 
@@ -645,7 +1626,9 @@ tapdisk_free_queue(struct tqueue *queue)
 void 
 tapdisk_debug_queue(struct tqueue *queue)
 {
-	struct tiocb *tiocb = queue->deferred.head;
+	struct tiocb *tiocb;
+	struct tflow *flow;
+	int class;
 
 	WARN("TAPDISK QUEUE:\n");
 	WARN("size: %d, tio: %s, queued: %d, iocbs_pending: %d, "
@@ -653,14 +1636,26 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
 
-	if (tiocb) {
-		WARN("deferred:\n");
-		for (; tiocb != NULL; tiocb = tiocb->next) {
-			struct iocb *io = &tiocb->iocb;
-			WARN("%s of %lu bytes at %lld\n",
-			     (io->aio_lio_opcode == IO_CMD_PWRITE ?
-			      "write" : "read"),
-			     io->u.c.nbytes, io->u.c.offset);
+	for (class = 0; class < TQUEUE_CLASSES; class++) {
+		WARN("class %d: inflight: %d, depth: %d, vclock: %"PRIu64"\n",
+		     class, queue->inflight[class], queue->depth[class],
+		     queue->vclock[class]);
+
+		list_for_each_entry(flow, &queue->active[class], active) {
+			WARN("deferred (weight %u, vtime %"PRIu64"):\n",
+			     flow->weight, flow->vtime);
+			for (tiocb = flow->pending.head; tiocb;
+			     tiocb = tiocb->next) {
+				struct iocb *io = &tiocb->iocb;
+				int vec = (io->aio_lio_opcode == IO_CMD_PREADV ||
+					   io->aio_lio_opcode == IO_CMD_PWRITEV);
+				WARN("%s of %lu bytes at %lld\n",
+				     (io->aio_lio_opcode == IO_CMD_PWRITE ||
+				      io->aio_lio_opcode == IO_CMD_PWRITEV ?
+				      "write" : "read"),
+				     tiocb_nbytes(tiocb),
+				     vec ? io->u.v.offset : io->u.c.offset);
+			}
 		}
 	}
 }
@@ -680,15 +1675,107 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	tiocb->cb   = cb;
 	tiocb->arg  = arg;
 	tiocb->next = NULL;
+	tiocb->flow = NULL;
 }
 
 void
-tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+tapdisk_prep_tiocbv(struct tiocb *tiocb, int fd, int rw, struct iovec *iov,
+		    int iovcnt, long long offset, td_queue_callback_t cb,
+		    void *arg)
 {
-	if (!tapdisk_queue_full(queue))
-		queue_tiocb(queue, tiocb);
+	struct iocb *iocb = &tiocb->iocb;
+
+	if (rw)
+		io_prep_pwritev(iocb, fd, iov, iovcnt, offset);
 	else
-		defer_tiocb(queue, tiocb);
+		io_prep_preadv(iocb, fd, iov, iovcnt, offset);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->flow = NULL;
+}
+
+void
+tapdisk_prep_tiocb_fdsync(struct tiocb *tiocb, int fd,
+			  td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	io_prep_fdsync(iocb, fd);
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->flow = NULL;
+}
+
+/*
+ * @blkdev: BLKDISCARD the range, rather than punching a hole.
+ */
+void
+tapdisk_prep_tiocb_discard(struct tiocb *tiocb, int fd, int blkdev,
+			   long long offset, size_t size,
+			   td_queue_callback_t cb, void *arg)
+{
+	struct iocb *iocb = &tiocb->iocb;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_fildes     = fd;
+	iocb->aio_lio_opcode = blkdev ? TIO_CMD_DISCARD : TIO_CMD_PUNCH;
+	iocb->u.c.offset     = offset;
+	iocb->u.c.nbytes     = size;
+
+	iocb->data  = tiocb;
+	tiocb->cb   = cb;
+	tiocb->arg  = arg;
+	tiocb->next = NULL;
+	tiocb->flow = NULL;
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
+
+void
+tapdisk_init_flow(struct tflow *flow)
+{
+	memset(flow, 0, sizeof(*flow));
+	INIT_LIST_HEAD(&flow->active);
+
+	flow->class  = TQUEUE_CLASS_NORMAL;
+	flow->weight = TQUEUE_WEIGHT_DEFAULT;
+}
+
+/*
+ * Tiocbs are staged in their flow, and go to the ring when
+ * submitted, so one flow queueing a burst cannot take the slots
+ * of others queueing in the same round.
+ */
+void
+tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
+{
+	if (!tiocb->flow)
+		tiocb->flow = &queue->flow;
+
+	if (tapdisk_queue_full(queue))
+		queue->deferrals++;
+
+	defer_tiocb(queue, tiocb);
 }
 
 
@@ -698,6 +1785,8 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	queue_deferred_tiocbs(queue);
+
 	return queue->tio->tio_submit(queue);
 }
 
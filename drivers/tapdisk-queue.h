@@ -20,11 +20,14 @@
 
 #include <libaio.h>
 
+#include "list.h"
 #include "io-optimize.h"
 #include "scheduler.h"
 
 struct tiocb;
+struct tflow;
 struct tfilter;
+struct tworker;
 
 typedef void (*td_queue_callback_t)(void *arg, struct tiocb *, int err);
 
@@ -35,13 +38,61 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	struct tflow         *flow;
+	int                   class;  /* of flow, when dispatched */
+
+	long                  res;    /* when run by the worker */
 };
 
+/*
+ * Beyond reads and writes, tiocbs carry flushes (IO_CMD_FDSYNC) and
+ * deallocations: hole punching in files and BLKDISCARD on block
+ * devices. Neither transfers data. The tio driver issues whatever it
+ * can asynchronously; the rest runs on the queue's worker thread, off
+ * the event loop.
+ */
+#define TIO_CMD_PUNCH         64  /* u.c.offset, u.c.nbytes */
+#define TIO_CMD_DISCARD       65  /* u.c.offset, u.c.nbytes */
+
 struct tlist {
 	struct tiocb         *head;
 	struct tiocb         *tail;
 };
 
+/*
+ * Priority classes. Dispatch is strict by class, each capped to a
+ * queue depth so lower ones keep a share of the ring.
+ */
+enum {
+	TQUEUE_CLASS_HIGH     = 0,
+	TQUEUE_CLASS_NORMAL   = 1,
+	TQUEUE_CLASS_BULK     = 2,
+	TQUEUE_CLASSES,
+};
+
+#define TQUEUE_WEIGHT_DEFAULT 100
+#define TQUEUE_WEIGHT_MAX     10000
+
+/*
+ * A weighted share of a queue, typically one per vbd. Within a class,
+ * the flow with the least virtual time dispatches next. A non-zero
+ * depth caps the flow's tiocbs in flight, below its class depth.
+ */
+struct tflow {
+	int                   class;
+	unsigned int          weight;
+	int                   depth;
+	int                   inflight;
+
+	uint64_t              vtime;
+	struct tlist          pending;
+	int                   n_pending;
+	struct list_head      active;
+
+	uint64_t              dispatched;
+};
+
 struct tqueue {
 	int                   size;
 
@@ -61,15 +112,21 @@ struct tqueue {
 	 * due to request coalescing */
 	int                   tiocbs_pending;
 
-	/* iocbs may be deferred if the aio ring is full.
-	 * tapdisk_queue_complete will ensure deferred
-	 * iocbs are queued as slots become available. */
-	struct tlist          deferred;
+	/* tiocbs are staged in their flows, and dispatched
+	 * in fair order as ring slots become available. */
+	struct tflow          flow; /* for tiocbs without one */
+	struct list_head      active[TQUEUE_CLASSES];
+	uint64_t              vclock[TQUEUE_CLASSES];
+	int                   inflight[TQUEUE_CLASSES];
+	int                   depth[TQUEUE_CLASSES];
 	int                   tiocbs_deferred;
 
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
+	/* for ops the tio cannot issue asynchronously */
+	struct tworker       *worker;
+
 	uint64_t              deferrals;
 };
 
@@ -80,11 +137,17 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: pre-registered I/O buffers */
+	int  (*tio_register_buffer)   (struct tqueue *queue,
+				       void *buf, size_t size);
+	void (*tio_unregister_buffer) (struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
 };
 
 /*
@@ -110,5 +173,13 @@ int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
+void tapdisk_prep_tiocbv(struct tiocb *, int, int, struct iovec *, int,
+			 long long, td_queue_callback_t, void *);
+void tapdisk_prep_tiocb_fdsync(struct tiocb *, int, td_queue_callback_t, void *);
+void tapdisk_prep_tiocb_discard(struct tiocb *, int, int, long long, size_t,
+				td_queue_callback_t, void *);
+int tapdisk_queue_register_buffer(struct tqueue *, void *, size_t);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *);
+void tapdisk_init_flow(struct tflow *);
 
 #endif
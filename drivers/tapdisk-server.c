@@ -23,6 +23,8 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/signal.h>
 
@@ -31,26 +33,72 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-log.h"
+#include "libaio-compat.h"
 
 #define DBG(_level, _f, _a...)       tlog_write(_level, _f, ##_a)
 #define ERR(_err, _f, _a...)         tlog_error(_err, _f, ##_a)
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
-
-typedef struct tapdisk_server {
+#define TAPDISK_TIO_ENV             "TAPDISK_TIO"
+#define TAPDISK_SHARDS_ENV          "TAPDISK_SHARDS"
+#define TAPDISK_MAX_SHARDS          64
+
+struct tapdisk_server_call {
+	tapdisk_server_call_t        fn;
+	void                        *arg;
+	int                          done;
+	int                          async;
+	struct list_head             next;
+};
+
+/*
+ * A shard is one event loop: a scheduler, an aio queue and the vbds
+ * driven by it. The control shard runs on the main thread. With
+ * TAPDISK_SHARDS=N, vbds live on N worker shards instead, and the
+ * control thread hands them work through tapdisk_server_call().
+ */
+typedef struct tapdisk_shard {
 	int                          run;
 	struct list_head             vbds;
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+	int                          fixed_bufs;
+
+	pthread_t                    thread;
+	int                          started;
+	int                          wake_fd;
+	event_id_t                   wake_event;
+	pthread_cond_t               cond;
+	struct list_head             calls;
+	unsigned long                signals;
+} tapdisk_shard_t;
+
+typedef struct tapdisk_server {
+	tapdisk_shard_t              ctl;
+	tapdisk_shard_t             *shards;
+	int                          n_shards;
+	tapdisk_shard_t             *callee;
+	pthread_mutex_t              lock;
 	char                        *name;
 	char                        *ident;
 	int                          facility;
 } tapdisk_server_t;
 
 static tapdisk_server_t server;
+static __thread tapdisk_shard_t *shard_self;
+
+static inline tapdisk_shard_t *
+tapdisk_server_shard(void)
+{
+	return shard_self ? shard_self : &server.ctl;
+}
 
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
-	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
+	list_for_each_entry_safe(vbd, tmp, &tapdisk_server_shard()->vbds, next)
+
+#define tapdisk_server_for_each_shard(shard, i)				\
+	for ((i) = 0, (shard) = server.shards;				\
+	     (i) < server.n_shards; (i)++, (shard)++)
 
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
@@ -73,39 +121,248 @@ tapdisk_server_get_shared_image(td_image_t *image)
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
-	return &server.vbds;
+	return &tapdisk_server_shard()->vbds;
 }
 
-td_vbd_t *
-tapdisk_server_get_vbd(uint16_t uuid)
+static td_vbd_t *
+tapdisk_shard_find_vbd(tapdisk_shard_t *shard, uint16_t uuid)
 {
-	td_vbd_t *vbd, *tmp;
+	td_vbd_t *vbd;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	list_for_each_entry(vbd, &shard->vbds, next)
 		if (vbd->uuid == uuid)
 			return vbd;
 
 	return NULL;
 }
 
+td_vbd_t *
+tapdisk_server_get_vbd(uint16_t uuid)
+{
+	tapdisk_shard_t *shard;
+	td_vbd_t *vbd;
+	int i;
+
+	pthread_mutex_lock(&server.lock);
+
+	vbd = tapdisk_shard_find_vbd(&server.ctl, uuid);
+	if (!vbd)
+		tapdisk_server_for_each_shard(shard, i) {
+			vbd = tapdisk_shard_find_vbd(shard, uuid);
+			if (vbd)
+				break;
+		}
+
+	pthread_mutex_unlock(&server.lock);
+
+	return vbd;
+}
+
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
-	list_add_tail(&vbd->next, &server.vbds);
+	pthread_mutex_lock(&server.lock);
+	list_add_tail(&vbd->next, &tapdisk_server_shard()->vbds);
+	pthread_mutex_unlock(&server.lock);
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	pthread_mutex_lock(&server.lock);
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	pthread_mutex_unlock(&server.lock);
+
 	tapdisk_server_check_state();
 }
 
+static int
+tapdisk_shard_count_vbds(tapdisk_shard_t *shard)
+{
+	td_vbd_t *vbd;
+	int n = 0;
+
+	list_for_each_entry(vbd, &shard->vbds, next)
+		n++;
+
+	return n;
+}
+
+/*
+ * Worker shard with the fewest vbds, for a vbd about to be attached.
+ * -1 when not sharded.
+ */
+int
+tapdisk_server_pick_shard(void)
+{
+	tapdisk_shard_t *shard;
+	int i, n, best = -1, min = 0;
+
+	pthread_mutex_lock(&server.lock);
+
+	tapdisk_server_for_each_shard(shard, i) {
+		n = tapdisk_shard_count_vbds(shard);
+		if (best < 0 || n < min) {
+			best = i;
+			min  = n;
+		}
+	}
+
+	pthread_mutex_unlock(&server.lock);
+
+	return best;
+}
+
+/*
+ * Worker shard owning vbd @uuid, or -1 for vbds unknown or on the
+ * control thread.
+ */
+int
+tapdisk_server_vbd_shard(uint16_t uuid)
+{
+	tapdisk_shard_t *shard;
+	int i, idx = -1;
+
+	pthread_mutex_lock(&server.lock);
+
+	tapdisk_server_for_each_shard(shard, i)
+		if (tapdisk_shard_find_vbd(shard, uuid)) {
+			idx = i;
+			break;
+		}
+
+	pthread_mutex_unlock(&server.lock);
+
+	return idx;
+}
+
+static void
+tapdisk_shard_wake(tapdisk_shard_t *shard)
+{
+	uint64_t val = 1;
+	ssize_t n;
+
+	n = write(shard->wake_fd, &val, sizeof(val));
+	(void)n;
+}
+
+static void
+__tapdisk_server_defer(tapdisk_shard_t *shard,
+		       tapdisk_server_call_t fn, void *arg)
+{
+	struct tapdisk_server_call *call;
+
+	call = calloc(1, sizeof(*call));
+	if (!call)
+		return;
+
+	call->fn    = fn;
+	call->arg   = arg;
+	call->async = 1;
+
+	pthread_mutex_lock(&server.lock);
+	list_add_tail(&call->next, &shard->calls);
+	tapdisk_shard_wake(shard);
+	pthread_mutex_unlock(&server.lock);
+}
+
+/*
+ * Run @fn on worker shard @idx and wait for it. Control thread
+ * only. The worker runs it from its event loop, so @fn may iterate
+ * the server like any control handler.
+ */
+void
+tapdisk_server_call(int idx, tapdisk_server_call_t fn, void *arg)
+{
+	struct tapdisk_server_call call;
+	tapdisk_shard_t *shard;
+
+	if (idx < 0 || idx >= server.n_shards ||
+	    &server.shards[idx] == shard_self) {
+		fn(arg);
+		return;
+	}
+
+	shard = &server.shards[idx];
+
+	memset(&call, 0, sizeof(call));
+	call.fn  = fn;
+	call.arg = arg;
+
+	pthread_mutex_lock(&server.lock);
+
+	list_add_tail(&call.next, &shard->calls);
+	server.callee = shard;
+	tapdisk_shard_wake(shard);
+
+	while (!call.done)
+		pthread_cond_wait(&shard->cond, &server.lock);
+
+	pthread_mutex_unlock(&server.lock);
+}
+
+void
+tapdisk_server_call_all(tapdisk_server_call_t fn, void *arg)
+{
+	int i;
+
+	fn(arg);
+
+	for (i = 0; i < server.n_shards; i++)
+		tapdisk_server_call(i, fn, arg);
+}
+
+static void
+tapdisk_shard_run_calls(tapdisk_shard_t *shard)
+{
+	struct tapdisk_server_call *call;
+
+	pthread_mutex_lock(&server.lock);
+
+	while (!list_empty(&shard->calls)) {
+		call = list_entry(shard->calls.next,
+				  struct tapdisk_server_call, next);
+		list_del(&call->next);
+		pthread_mutex_unlock(&server.lock);
+
+		call->fn(call->arg);
+
+		pthread_mutex_lock(&server.lock);
+		if (call->async) {
+			free(call);
+			continue;
+		}
+
+		server.callee = NULL;
+		call->done    = 1;
+		pthread_cond_broadcast(&shard->cond);
+	}
+
+	pthread_mutex_unlock(&server.lock);
+}
+
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_shard()->aio_queue, tiocb);
+}
+
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	tapdisk_shard_t *shard = tapdisk_server_shard();
+
+	if (!shard->fixed_bufs)
+		return -EOPNOTSUPP;
+
+	return tapdisk_queue_register_buffer(&shard->aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&tapdisk_server_shard()->aio_queue, buf);
 }
 
 void
@@ -113,7 +370,7 @@ tapdisk_server_debug(void)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&tapdisk_server_shard()->aio_queue);
 
 	tapdisk_server_for_each_vbd(vbd, tmp)
 		tapdisk_vbd_debug(vbd);
@@ -125,52 +382,123 @@ tapdisk_server_debug(void)
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	tapdisk_shard_t *shard;
+	int i, empty;
+
+	pthread_mutex_lock(&server.lock);
+
+	empty = list_empty(&server.ctl.vbds);
+	tapdisk_server_for_each_shard(shard, i)
+		empty = empty && list_empty(&shard->vbds);
+
+	pthread_mutex_unlock(&server.lock);
+
+	if (!empty)
+		return;
+
+	server.ctl.run = 0;
+	if (server.n_shards)
+		tapdisk_shard_wake(&server.ctl);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_shard()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_shard()->scheduler,
+					  event);
 }
 
 void
 tapdisk_server_mask_event(event_id_t event, int masked)
 {
-	return scheduler_mask_event(&server.scheduler, event, masked);
+	return scheduler_mask_event(&tapdisk_server_shard()->scheduler,
+				    event, masked);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&tapdisk_server_shard()->scheduler, seconds);
+}
+
+void
+tapdisk_server_add_timer(scheduler_timer_t *timer, int ms)
+{
+	scheduler_add_timer(&tapdisk_server_shard()->scheduler, timer, ms);
+}
+
+void
+tapdisk_server_del_timer(scheduler_timer_t *timer)
+{
+	scheduler_del_timer(&tapdisk_server_shard()->scheduler, timer);
+}
+
+/*
+ * Events of the control thread: the control socket and connections,
+ * and syslog. Workers may touch them while running a call; masking
+ * from any other worker is deferred to the control thread.
+ */
+static int
+tapdisk_server_ctl_owner(void)
+{
+	tapdisk_shard_t *self = tapdisk_server_shard();
+
+	return self == &server.ctl || self == server.callee;
+}
+
+event_id_t
+tapdisk_server_register_ctl_event(char mode, int fd,
+				  int timeout, event_cb_t cb, void *data)
+{
+	return scheduler_register_event(&server.ctl.scheduler,
+					mode, fd, timeout, cb, data);
+}
+
+void
+tapdisk_server_unregister_ctl_event(event_id_t event)
+{
+	scheduler_unregister_event(&server.ctl.scheduler, event);
 }
 
 static void
-tapdisk_server_assert_locks(void)
+__tapdisk_server_mask_ctl_event(void *private)
+{
+	scheduler_mask_event(&server.ctl.scheduler, (long)private, 1);
+}
+
+static void
+__tapdisk_server_unmask_ctl_event(void *private)
 {
+	scheduler_mask_event(&server.ctl.scheduler, (long)private, 0);
+}
 
+void
+tapdisk_server_mask_ctl_event(event_id_t event, int masked)
+{
+	if (tapdisk_server_ctl_owner()) {
+		scheduler_mask_event(&server.ctl.scheduler, event, masked);
+		return;
+	}
+
+	__tapdisk_server_defer(&server.ctl,
+			       masked ?
+			       __tapdisk_server_mask_ctl_event :
+			       __tapdisk_server_unmask_ctl_event,
+			       (void *)(long)event);
 }
 
 static void
-tapdisk_server_set_retry_timeout(void)
+tapdisk_server_assert_locks(void)
 {
-	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		if (tapdisk_vbd_retry_needed(vbd)) {
-			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
-			return;
-		}
 }
 
 static void
@@ -188,7 +516,7 @@ tapdisk_server_check_progress(void)
 static void
 tapdisk_server_submit_tiocbs(void)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&tapdisk_server_shard()->aio_queue);
 }
 
 static void
@@ -231,16 +559,36 @@ tapdisk_server_stop_vbds(void)
 }
 
 static int
-tapdisk_server_init_aio(void)
+tapdisk_server_init_aio(tapdisk_shard_t *shard)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+	const char *tio = getenv(TAPDISK_TIO_ENV);
+	int err;
+
+	/*
+	 * "uring-fixed" additionally registers blktap data areas as
+	 * fixed buffers. Only safe if the blktap driver backs the ring
+	 * with stable pages, rather than inserting pages per request.
+	 */
+	if (tio && !strncmp(tio, "uring", 5)) {
+		err = tapdisk_init_queue(&shard->aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_URING, NULL);
+		if (!err) {
+			shard->fixed_bufs = !strcmp(tio, "uring-fixed");
+			return 0;
+		}
+
+		DBG(TLOG_WARN, "io_uring unavailable (%d), using libaio\n",
+		    err);
+	}
+
+	return tapdisk_init_queue(&shard->aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_server_close_aio(tapdisk_shard_t *shard)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_free_queue(&shard->aio_queue);
 }
 
 int
@@ -287,23 +635,16 @@ tapdisk_server_close_tlog(void)
 	tlog_close();
 }
 
-static void
-tapdisk_server_close(void)
-{
-	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
-}
-
 void
 tapdisk_server_iterate(void)
 {
+	tapdisk_shard_t *shard = tapdisk_server_shard();
 	int ret;
 
 	tapdisk_server_assert_locks();
-	tapdisk_server_set_retry_timeout();
 	tapdisk_server_check_progress();
 
-	ret = scheduler_wait_for_events(&server.scheduler);
+	ret = scheduler_wait_for_events(&shard->scheduler);
 	if (ret < 0)
 		DBG(TLOG_WARN, "server wait returned %d\n", ret);
 
@@ -319,12 +660,12 @@ tapdisk_server_iterate(void)
 static void
 __tapdisk_server_run(void)
 {
-	while (server.run)
+	while (server.ctl.run)
 		tapdisk_server_iterate();
 }
 
 static void
-tapdisk_server_signal_handler(int signal)
+tapdisk_server_handle_signal(int signal)
 {
 	td_vbd_t *vbd, *tmp;
 	static int xfsz_error_sent = 0;
@@ -352,15 +693,261 @@ tapdisk_server_signal_handler(int signal)
 	}
 }
 
+/*
+ * Sharded, the handler may interrupt any thread. Each worker handles
+ * the signal for its own vbds, from its event loop.
+ */
+static void
+tapdisk_server_signal_handler(int signal)
+{
+	tapdisk_shard_t *shard;
+	int i;
+
+	if (!server.n_shards) {
+		tapdisk_server_handle_signal(signal);
+		return;
+	}
+
+	tapdisk_server_for_each_shard(shard, i) {
+		__sync_fetch_and_or(&shard->signals, 1UL << signal);
+		tapdisk_shard_wake(shard);
+	}
+}
+
+static void
+tapdisk_shard_wake_event(event_id_t id, char mode, void *private)
+{
+	tapdisk_shard_t *shard = private;
+	unsigned long signals;
+	uint64_t val;
+	ssize_t n;
+	int sig;
+
+	n = read(shard->wake_fd, &val, sizeof(val));
+	(void)n;
+
+	signals = __sync_fetch_and_and(&shard->signals, 0);
+	for (sig = 0; signals; sig++, signals >>= 1)
+		if (signals & 1)
+			tapdisk_server_handle_signal(sig);
+
+	tapdisk_shard_run_calls(shard);
+}
+
+static void
+tapdisk_shard_close_wake(tapdisk_shard_t *shard)
+{
+	if (shard->wake_event >= 0) {
+		scheduler_unregister_event(&shard->scheduler,
+					   shard->wake_event);
+		shard->wake_event = -1;
+	}
+
+	if (shard->wake_fd >= 0) {
+		close(shard->wake_fd);
+		shard->wake_fd = -1;
+	}
+}
+
+static int
+tapdisk_shard_open_wake(tapdisk_shard_t *shard)
+{
+	event_id_t id;
+	int err;
+
+	shard->wake_fd = tapdisk_sys_eventfd(0);
+	if (shard->wake_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	id = scheduler_register_event(&shard->scheduler,
+				      SCHEDULER_POLL_READ_FD,
+				      shard->wake_fd, 0,
+				      tapdisk_shard_wake_event, shard);
+	if (id < 0) {
+		err = id;
+		goto fail;
+	}
+
+	shard->wake_event = id;
+
+	return 0;
+
+fail:
+	tapdisk_shard_close_wake(shard);
+	return err;
+}
+
+static void
+tapdisk_shard_init(tapdisk_shard_t *shard)
+{
+	memset(shard, 0, sizeof(*shard));
+	INIT_LIST_HEAD(&shard->vbds);
+	INIT_LIST_HEAD(&shard->calls);
+	pthread_cond_init(&shard->cond, NULL);
+	shard->wake_fd    = -1;
+	shard->wake_event = -1;
+}
+
+static void *
+tapdisk_shard_thread(void *private)
+{
+	tapdisk_shard_t *shard = private;
+
+	shard_self = shard;
+
+	while (shard->run)
+		tapdisk_server_iterate();
+
+	return NULL;
+}
+
+static void
+__tapdisk_shard_stop(void *private)
+{
+	tapdisk_shard_t *shard = private;
+
+	shard->run = 0;
+}
+
+static void
+tapdisk_shard_destroy(tapdisk_shard_t *shard)
+{
+	if (shard->started) {
+		__tapdisk_server_defer(shard, __tapdisk_shard_stop, shard);
+		pthread_join(shard->thread, NULL);
+		shard->started = 0;
+	}
+
+	tapdisk_shard_close_wake(shard);
+
+	shard_self = shard;
+	tapdisk_server_close_aio(shard);
+	shard_self = NULL;
+
+	scheduler_destroy(&shard->scheduler);
+	pthread_cond_destroy(&shard->cond);
+}
+
+static int
+tapdisk_shard_start(tapdisk_shard_t *shard)
+{
+	int err;
+
+	err = scheduler_initialize(&shard->scheduler);
+	if (err)
+		return err;
+
+	/* the queue registers its event with the calling shard */
+	shard_self = shard;
+	err = tapdisk_server_init_aio(shard);
+	shard_self = NULL;
+	if (err)
+		goto fail;
+
+	err = tapdisk_shard_open_wake(shard);
+	if (err)
+		goto fail;
+
+	shard->run = 1;
+
+	err = pthread_create(&shard->thread, NULL,
+			     tapdisk_shard_thread, shard);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	shard->started = 1;
+
+	return 0;
+
+fail:
+	tapdisk_shard_close_wake(shard);
+	shard_self = shard;
+	tapdisk_server_close_aio(shard);
+	shard_self = NULL;
+	scheduler_destroy(&shard->scheduler);
+	return err;
+}
+
+static void
+tapdisk_server_close_shards(void)
+{
+	tapdisk_shard_t *shard;
+	int i;
+
+	tapdisk_server_for_each_shard(shard, i)
+		tapdisk_shard_destroy(shard);
+
+	free(server.shards);
+	server.shards   = NULL;
+	server.n_shards = 0;
+
+	tapdisk_shard_close_wake(&server.ctl);
+}
+
+static int
+tapdisk_server_init_shards(void)
+{
+	const char *env = getenv(TAPDISK_SHARDS_ENV);
+	tapdisk_shard_t *shards;
+	int i, n, err;
+
+	n = env ? atoi(env) : 0;
+	if (n <= 0)
+		return 0;
+
+	if (n > TAPDISK_MAX_SHARDS)
+		n = TAPDISK_MAX_SHARDS;
+
+	shards = calloc(n, sizeof(tapdisk_shard_t));
+	if (!shards)
+		return -ENOMEM;
+
+	server.shards = shards;
+
+	err = tapdisk_shard_open_wake(&server.ctl);
+	if (err)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		tapdisk_shard_init(&shards[i]);
+
+		err = tapdisk_shard_start(&shards[i]);
+		if (err)
+			goto fail;
+
+		server.n_shards++;
+	}
+
+	DBG(TLOG_INFO, "running vbds on %d shards\n", n);
+
+	return 0;
+
+fail:
+	tapdisk_server_close_shards();
+	return err;
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_close_shards();
+	tapdisk_server_close_tlog();
+	tapdisk_server_close_aio(&server.ctl);
+	scheduler_destroy(&server.ctl.scheduler);
+}
+
 int
 tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
-	INIT_LIST_HEAD(&server.vbds);
-
-	scheduler_initialize(&server.scheduler);
+	pthread_mutex_init(&server.lock, NULL);
+	tapdisk_shard_init(&server.ctl);
 
-	return 0;
+	return scheduler_initialize(&server.ctl.scheduler);
 }
 
 int
@@ -368,7 +955,7 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_server_init_aio(&server.ctl);
 	if (err)
 		goto fail;
 
@@ -376,13 +963,17 @@ tapdisk_server_complete(void)
 	if (err)
 		goto fail;
 
-	server.run = 1;
+	err = tapdisk_server_init_shards();
+	if (err)
+		goto fail;
+
+	server.ctl.run = 1;
 
 	return 0;
 
 fail:
 	tapdisk_server_close_tlog();
-	tapdisk_server_close_aio();
+	tapdisk_server_close_aio(&server.ctl);
 	return err;
 }
 
@@ -391,7 +982,9 @@ tapdisk_server_initialize(const char *read, const char *write)
 {
 	int err;
 
-	tapdisk_server_init();
+	err = tapdisk_server_init();
+	if (err)
+		goto fail;
 
 	err = tapdisk_server_complete();
 	if (err)
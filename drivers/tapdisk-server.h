@@ -31,7 +31,16 @@ td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
+typedef void (*tapdisk_server_call_t)(void *);
+
+int tapdisk_server_pick_shard(void);
+int tapdisk_server_vbd_shard(td_uuid_t);
+void tapdisk_server_call(int, tapdisk_server_call_t, void *);
+void tapdisk_server_call_all(tapdisk_server_call_t, void *);
+
 void tapdisk_server_queue_tiocb(struct tiocb *);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
 
 void tapdisk_server_check_state(void);
 
@@ -39,6 +48,12 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_mask_event(event_id_t, int);
 void tapdisk_server_set_max_timeout(int);
+void tapdisk_server_add_timer(scheduler_timer_t *, int ms);
+void tapdisk_server_del_timer(scheduler_timer_t *);
+
+event_id_t tapdisk_server_register_ctl_event(char, int, int, event_cb_t, void *);
+void tapdisk_server_unregister_ctl_event(event_id_t);
+void tapdisk_server_mask_ctl_event(event_id_t, int);
 
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(const char *, const char *);
@@ -26,13 +26,13 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
-#include <sys/mman.h>
 
 #include "list.h"
 #include "scheduler.h"
 #include "tapdisk.h"
 #include "tapdisk-server.h"
 #include "tapdisk-disktype.h"
+#include "libvhd-bufpool.h"
 
 #define POLL_READ                        0
 #define POLL_WRITE                       1
@@ -97,19 +97,12 @@ tapdisk_stream_stop(td_stream_t *s)
 static int
 tapdisk_stream_req_create(td_stream_req_t *req)
 {
-	int prot, flags;
-
 	memset(req, 0, sizeof(*req));
 	INIT_LIST_HEAD(&req->entry);
 
-	prot  = PROT_READ|PROT_WRITE;
-	flags = MAP_ANONYMOUS|MAP_PRIVATE;
-
-	req->buf = mmap(NULL, TD_STREAM_REQ_SIZE, prot, flags, -1, 0);
-	if (req->buf == MAP_FAILED) {
-		req->buf = NULL;
-		return -errno;
-	}
+	req->buf = vhd_bufpool_get(TD_STREAM_REQ_SIZE);
+	if (!req->buf)
+		return -ENOMEM;
 
 	return 0;
 }
@@ -118,8 +111,8 @@ static void
 tapdisk_stream_req_destroy(td_stream_req_t *req)
 {
 	if (req->buf) {
-		int err = munmap(req->iov.base, TD_STREAM_REQ_SIZE);
-		BUG_ON(err);
+		vhd_bufpool_put(req->buf, TD_STREAM_REQ_SIZE);
+		req->buf = NULL;
 		req->iov.base = NULL;
 	}
 }
@@ -49,6 +49,7 @@ static int tapdisk_syslog_sock_connect(td_syslog_t *log);
 
 static void tapdisk_syslog_sock_mask(td_syslog_t *log);
 static void tapdisk_syslog_sock_unmask(td_syslog_t *log);
+static int __tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...);
 
 static const struct sockaddr_un syslog_addr = {
 	.sun_family = AF_UNIX,
@@ -230,8 +231,8 @@ tapdisk_syslog_ring_warning(td_syslog_t *log)
 	n        = log->oom;
 	log->oom = 0;
 
-	err = tapdisk_syslog(log, TLOG_WARN,
-			     "tapdisk-syslog: %d messages dropped", n);
+	err = __tapdisk_syslog(log, TLOG_WARN,
+			       "tapdisk-syslog: %d messages dropped", n);
 	if (err)
 		log->oom = n;
 }
@@ -305,10 +306,12 @@ tapdisk_syslog_vsprintf(char *buf, size_t size,
  * remaining ring contents as well, once the socket is disconnected.
  *
  * In summary, no attempts to mask service blackouts in here.
+ *
+ * Sharded tapdisks log from every worker, hence the lock.
  */
 
-int
-tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+static int
+__tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
 {
 	struct timeval now;
 	size_t len;
@@ -364,6 +367,31 @@ fail:
 	return err;
 }
 
+static int
+__tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
+{
+	va_list ap;
+	int err;
+
+	va_start(ap, fmt);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	va_end(ap);
+
+	return err;
+}
+
+int
+tapdisk_vsyslog(td_syslog_t *log, int prio, const char *fmt, va_list ap)
+{
+	int err;
+
+	pthread_mutex_lock(&log->lock);
+	err = __tapdisk_vsyslog(log, prio, fmt, ap);
+	pthread_mutex_unlock(&log->lock);
+
+	return err;
+}
+
 int
 tapdisk_syslog(td_syslog_t *log, int prio, const char *fmt, ...)
 {
@@ -396,10 +424,14 @@ tapdisk_syslog_sock_event(event_id_t id, char mode, void *private)
 {
 	td_syslog_t *log = private;
 
+	pthread_mutex_lock(&log->lock);
+
 	tapdisk_syslog_ring_dispatch(log);
 
 	if (log->cons == log->prod)
 		tapdisk_syslog_sock_mask(log);
+
+	pthread_mutex_unlock(&log->lock);
 }
 
 static void
@@ -416,7 +448,7 @@ tapdisk_syslog_sock_close(td_syslog_t *log)
 		close(log->sock);
 
 	if (log->event_id >= 0)
-		tapdisk_server_unregister_event(log->event_id);
+		tapdisk_server_unregister_ctl_event(log->event_id);
 
 	__tapdisk_syslog_sock_init(log);
 }
@@ -445,10 +477,10 @@ tapdisk_syslog_sock_open(td_syslog_t *log)
 	}
 #endif
 
-	id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
-					   s, 0,
-					   tapdisk_syslog_sock_event,
-					   log);
+	id = tapdisk_server_register_ctl_event(SCHEDULER_POLL_WRITE_FD,
+					       s, 0,
+					       tapdisk_syslog_sock_event,
+					       log);
 	if (id < 0) {
 		err = id;
 		goto fail;
@@ -480,19 +512,20 @@ tapdisk_syslog_sock_connect(td_syslog_t *log)
 static void
 tapdisk_syslog_sock_mask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 1);
+	tapdisk_server_mask_ctl_event(log->event_id, 1);
 }
 
 static void
 tapdisk_syslog_sock_unmask(td_syslog_t *log)
 {
-	tapdisk_server_mask_event(log->event_id, 0);
+	tapdisk_server_mask_ctl_event(log->event_id, 0);
 }
 
 void
 __tapdisk_syslog_init(td_syslog_t *log)
 {
 	memset(log, 0, sizeof(td_syslog_t));
+	pthread_mutex_init(&log->lock, NULL);
 	__tapdisk_syslog_sock_init(log);
 	__tapdisk_syslog_ring_init(log);
 }
@@ -20,6 +20,7 @@
 
 #include <syslog.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "scheduler.h"
 
 typedef struct _td_syslog td_syslog_t;
@@ -56,6 +57,8 @@ struct _td_syslog {
 	struct timeval   oom_tv;
 
 	struct _td_syslog_stats stats;
+
+	pthread_mutex_t  lock;
 };
 
 int  tapdisk_syslog_open(td_syslog_t *,
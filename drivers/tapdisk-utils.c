@@ -275,3 +275,46 @@ uint64_t ntohll(uint64_t a) {
 #endif
 #define htonll ntohll
 
+/*
+ * OR-reduce the buffer in 32-byte vectors, four at a time, so the
+ * compiler emits packed loads on whatever the target supports. Most
+ * non-zero data fails on the first stride.
+ */
+typedef uint64_t td_zvec_t __attribute__((vector_size(32)));
+
+#define TD_ZVEC_ZERO(v) (!((v)[0] | (v)[1] | (v)[2] | (v)[3]))
+
+int
+tapdisk_buf_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const td_zvec_t *v;
+	td_zvec_t acc;
+	size_t i, n;
+
+	for (; len && ((uintptr_t)p & (sizeof(*v) - 1)); p++, len--)
+		if (*p)
+			return 0;
+
+	v = (const td_zvec_t *)p;
+	n = len / sizeof(*v);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		acc = v[i] | v[i + 1] | v[i + 2] | v[i + 3];
+		if (!TD_ZVEC_ZERO(acc))
+			return 0;
+	}
+
+	for (; i < n; i++)
+		if (!TD_ZVEC_ZERO(v[i]))
+			return 0;
+
+	p    = (const unsigned char *)(v + n);
+	len -= n * sizeof(*v);
+
+	for (; len; p++, len--)
+		if (*p)
+			return 0;
+
+	return 1;
+}
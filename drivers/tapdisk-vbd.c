@@ -30,6 +30,7 @@
 #include <sys/ioctl.h>
 
 #include "libvhd.h"
+#include "libvhd-bufpool.h"
 #include "tapdisk-blktap.h"
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
@@ -67,6 +68,7 @@
 static void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 static int  tapdisk_vbd_queue_ready(td_vbd_t *);
 static void tapdisk_vbd_check_queue_state(td_vbd_t *);
+static void tapdisk_vbd_retry_timeout(scheduler_timer_t *, void *);
 
 /* 
  * initialization
@@ -98,6 +100,11 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	scheduler_timer_init(&vbd->retry_timer,
+			     tapdisk_vbd_retry_timeout, vbd);
+	tapdisk_chainmap_init(&vbd->chainmap);
+	tapdisk_boottrace_init(&vbd->boottrace);
+	tapdisk_init_flow(&vbd->flow);
 	tapdisk_vbd_mark_progress(vbd);
 
 	return vbd;
@@ -121,16 +128,48 @@ tapdisk_vbd_initialize(int rfd, int wfd, uint16_t uuid)
 	return 0;
 }
 
+static void
+tapdisk_image_set_flow(td_image_t *image, struct tflow *flow)
+{
+	td_driver_t *driver = image->driver;
+
+	/* shared drivers outlive any one vbd */
+	if (driver)
+		driver->flow = driver->refcnt > 1 ? NULL : flow;
+}
+
+/*
+ * Route the I/O of all our images through the vbd's share of
+ * the server queue.
+ */
+static void
+tapdisk_vbd_set_flow(td_vbd_t *vbd)
+{
+	td_image_t *image, *next;
+
+	tapdisk_vbd_for_each_image(vbd, image, next)
+		tapdisk_image_set_flow(image, &vbd->flow);
+
+	if (vbd->secondary)
+		tapdisk_image_set_flow(vbd->secondary, &vbd->flow);
+}
+
 static int
 tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 {
 	return tapdisk_image_validate_chain(&vbd->images);
 }
 
-void
+/*
+ * Returns the first error of the images closed, e.g. failing to write
+ * out metadata. They are closed regardless.
+ */
+int
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
-	tapdisk_image_close_chain(&vbd->images);
+	int err;
+
+	err = tapdisk_image_close_chain(&vbd->images);
 
 	if (vbd->secondary &&
 	    vbd->secondary_mode != TD_VBD_SECONDARY_MIRROR) {
@@ -143,7 +182,12 @@ tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 		vbd->retired = NULL;
 	}
 
+	tapdisk_chainmap_reset(&vbd->chainmap, NULL);
+	tapdisk_boottrace_close(&vbd->boottrace);
+
 	td_flag_set(vbd->state, TD_VBD_CLOSED);
+
+	return err;
 }
 
 static int
@@ -493,6 +537,15 @@ tapdisk_vbd_open_vdi(td_vbd_t *vbd, const char *name, td_flag_t flags, int prt_d
 		}
 	}
 
+	tapdisk_vbd_set_flow(vbd);
+	tapdisk_chainmap_reset(&vbd->chainmap, &vbd->images);
+
+	err = tapdisk_boottrace_open(&vbd->boottrace, vbd, &vbd->images);
+	if (err) {
+		INFO("boot trace disabled: %d\n", err);
+		err = 0;
+	}
+
 	if (tmp != vbd->name)
 		free(tmp);
 
@@ -592,7 +645,7 @@ tapdisk_vbd_queue_count(td_vbd_t *vbd, int *new,
 static int
 tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
-	int new, pending, failed, completed;
+	int err, new, pending, failed, completed;
 
 	if (!list_empty(&vbd->pending_requests))
 		return -EAGAIN;
@@ -609,13 +662,14 @@ tapdisk_vbd_shutdown(td_vbd_t *vbd)
 		vbd->errors, vbd->retries, vbd->received, vbd->returned,
 		vbd->kicked);
 
-	tapdisk_vbd_close_vdi(vbd);
+	err = tapdisk_vbd_close_vdi(vbd);
 	tapdisk_vbd_detach(vbd);
+	tapdisk_server_del_timer(&vbd->retry_timer);
 	tapdisk_server_remove_vbd(vbd);
 	free(vbd->name);
 	free(vbd);
 
-	return 0;
+	return err;
 }
 
 int
@@ -691,6 +745,76 @@ tapdisk_vbd_get_disk_info(td_vbd_t *vbd, td_disk_info_t *info)
 	return 0;
 }
 
+int
+tapdisk_vbd_discard_supported(td_vbd_t *vbd)
+{
+	td_image_t *leaf = tapdisk_vbd_first_image(vbd);
+
+	return leaf && leaf->driver &&
+		leaf->driver->ops->td_queue_discard != NULL;
+}
+
+/*
+ * Length of the run at @sec, at most @secs, whose allocation is the
+ * same through the chain below @image. Filters and caches hold no data
+ * of their own; images which cannot tell report everything allocated.
+ */
+static int
+__tapdisk_vbd_block_status(td_vbd_t *vbd, td_image_t *image,
+			   td_sector_t sec, int secs, int *allocated)
+{
+	int n, alloc;
+
+	list_for_each_entry_continue(image, &vbd->images, next) {
+		if (image->type == DISK_TYPE_BLOCK_CACHE ||
+		    tapdisk_disk_types[image->type]->flags & DISK_TYPE_FILTER)
+			continue;
+
+		n = td_block_status(image, sec, secs, &alloc);
+		if (n <= 0) {
+			*allocated = 1;
+			return secs;
+		}
+
+		if (alloc) {
+			*allocated = 1;
+			return n;
+		}
+
+		secs = n;
+	}
+
+	*allocated = 0;
+	return secs;
+}
+
+int
+tapdisk_vbd_block_status(td_vbd_t *vbd, td_sector_t sec, int secs,
+			 int *allocated)
+{
+	td_image_t *head = list_entry(&vbd->images, td_image_t, next);
+
+	return __tapdisk_vbd_block_status(vbd, head, sec, secs, allocated);
+}
+
+/*
+ * Allocation of @treq's range in the images below the one it was
+ * queued to, i.e. what forwarding the request would read.
+ */
+int
+tapdisk_vbd_forward_block_status(td_request_t treq, int *allocated)
+{
+	td_vbd_request_t *vreq = treq.vreq;
+
+	if (!vreq || !treq.image) {
+		*allocated = 1;
+		return treq.secs;
+	}
+
+	return __tapdisk_vbd_block_status(vreq->vbd, treq.image,
+					  treq.sec, treq.secs, allocated);
+}
+
 static int
 tapdisk_vbd_queue_ready(td_vbd_t *vbd)
 {
@@ -783,7 +907,9 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	if (err)
 		return err;
 
-	tapdisk_vbd_close_vdi(vbd);
+	err = tapdisk_vbd_close_vdi(vbd);
+	if (err)
+		ERR(err, "%s: closing images failed\n", vbd->name);
 
 	INFO("pause completed\n");
 
@@ -793,7 +919,7 @@ tapdisk_vbd_pause(td_vbd_t *vbd)
 	td_flag_clear(vbd->state, TD_VBD_PAUSE_REQUESTED);
 	td_flag_set(vbd->state, TD_VBD_PAUSED);
 
-	return 0;
+	return err;
 }
 
 int
@@ -869,6 +995,21 @@ tapdisk_vbd_request_timeout(td_vbd_request_t *vreq)
 static void
 tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
 {
+	if (!list_empty(&vbd->new_requests) ||
+	    !list_empty(&vbd->failed_requests))
+		tapdisk_vbd_issue_requests(vbd);
+
+	/* come back to retry, and to expire failed requests */
+	if (tapdisk_vbd_retry_needed(vbd) &&
+	    !scheduler_timer_pending(&vbd->retry_timer))
+		tapdisk_server_add_timer(&vbd->retry_timer,
+					 TD_VBD_RETRY_INTERVAL * 1000);
+}
+
+static void
+tapdisk_vbd_retry_timeout(scheduler_timer_t *timer, void *private)
+{
+	td_vbd_t *vbd = private;
 	td_vbd_request_t *vreq, *tmp;
 	struct timeval now;
 
@@ -877,10 +1018,7 @@ tapdisk_vbd_check_queue_state(td_vbd_t *vbd)
 		if (__tapdisk_vbd_request_timeout(vreq, &now))
 			tapdisk_vbd_complete_vbd_request(vbd, vreq);
 
-	if (!list_empty(&vbd->new_requests) ||
-	    !list_empty(&vbd->failed_requests))
-		tapdisk_vbd_issue_requests(vbd);
-
+	tapdisk_vbd_check_queue_state(vbd);
 }
 
 void
@@ -958,15 +1096,78 @@ tapdisk_vbd_request_should_retry(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	return 1;
 }
 
+/*
+ * Flushes go to every image taking writes: the leaf and the mirror.
+ * They carry no sectors, so each holds the request open through
+ * submitting instead of secs_pending.
+ */
+static void
+tapdisk_vbd_queue_flush(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_request_t treq;
+
+	memset(&treq, 0, sizeof(treq));
+	treq.op    = TD_OP_FLUSH;
+	treq.image = tapdisk_vbd_first_image(vbd);
+	treq.cb    = tapdisk_vbd_complete_td_request;
+	treq.vreq  = vreq;
+
+	vreq->submitting++;
+	if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR) {
+		td_request_t clone = treq;
+
+		vreq->submitting++;
+		clone.image = vbd->secondary;
+		td_queue_flush(vbd->secondary, clone);
+	}
+	td_queue_flush(treq.image, treq);
+}
+
 static void
 tapdisk_vbd_complete_vbd_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
-	if (!vreq->submitting && !vreq->secs_pending) {
-		if (vreq->error &&
-		    tapdisk_vbd_request_should_retry(vbd, vreq))
-			tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
-		else
-			tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+	if (vreq->submitting || vreq->secs_pending)
+		return;
+
+	/* fua writes complete once followed by a flush */
+	if (!vreq->error &&
+	    td_flag_test(vreq->flags, TD_VBD_REQ_FUA) &&
+	    !td_flag_test(vreq->flags, TD_VBD_REQ_FLUSHED)) {
+		td_flag_set(vreq->flags, TD_VBD_REQ_FLUSHED);
+
+		vreq->submitting++;
+		tapdisk_vbd_queue_flush(vbd, vreq);
+		if (--vreq->submitting)
+			return;
+	}
+
+	if (vreq->error &&
+	    tapdisk_vbd_request_should_retry(vbd, vreq))
+		tapdisk_vbd_move_request(vreq, &vbd->failed_requests);
+	else
+		tapdisk_vbd_move_request(vreq, &vbd->completed_requests);
+}
+
+static int
+tapdisk_vbd_iovec_secs(struct td_iovec *iov, int iovcnt)
+{
+	int i, secs = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		secs += iov[i].secs;
+
+	return secs;
+}
+
+static void
+tapdisk_vbd_zero_td_request(td_request_t treq)
+{
+	int secs;
+
+	while (treq.secs > 0) {
+		secs = td_request_segment_secs(treq);
+		memset(treq.buf, 0, (size_t)secs << SECTOR_SHIFT);
+		td_request_advance(&treq, secs);
 	}
 }
 
@@ -980,6 +1181,23 @@ FIXME_maybe_count_enospc_redirect(td_vbd_t *vbd, td_request_t treq)
 		vbd->FIXME_enospc_redirect_count += treq.secs;
 }
 
+static const char *
+tapdisk_vbd_op_name(int op)
+{
+	switch (op) {
+	case TD_OP_READ:
+		return "read";
+	case TD_OP_WRITE:
+		return "write";
+	case TD_OP_DISCARD:
+		return "discard";
+	case TD_OP_FLUSH:
+		return "flush";
+	}
+
+	return "unknown";
+}
+
 static void
 __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				  td_request_t treq, int res)
@@ -991,7 +1209,11 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 	vbd->secs_pending  -= treq.secs;
 	vreq->secs_pending -= treq.secs;
 
-	if (err != -EBUSY) {
+	if (treq.op == TD_OP_FLUSH)
+		vreq->submitting--;
+
+	if (err != -EBUSY && treq.op != TD_OP_DISCARD &&
+	    treq.op != TD_OP_FLUSH) {
 		int write = treq.op == TD_OP_WRITE;
 		td_sector_count_add(&image->stats.hits, treq.secs, write);
 		if (err)
@@ -1008,7 +1230,7 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 				tlog_drv_error(image->driver, err,
 					       "req %s: %s 0x%04x secs @ 0x%08"PRIx64" - %s",
 					       vreq->name,
-					       (treq.op == TD_OP_WRITE ? "write" : "read"),
+					       tapdisk_vbd_op_name(treq.op),
 					       treq.secs, treq.sec, strerror(abs(err)));
 			vbd->errors++;
 		}
@@ -1030,8 +1252,15 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	vreq->submitting++;
 
+	/* nothing allocated here to drop, and parents are read-only */
+	if (treq.op == TD_OP_DISCARD) {
+		td_complete_request(treq, 0);
+		goto done;
+	}
+
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+		if (treq.op != TD_OP_FLUSH)
+			tapdisk_vbd_zero_td_request(treq);
 		td_complete_request(treq, 0);
 		goto done;
 	}
@@ -1045,14 +1274,12 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 		if (parent->info.size > treq.sec) {
 			int secs    = parent->info.size - treq.sec;
-			clone.sec  += secs;
-			clone.secs -= secs;
-			clone.buf  += (secs << SECTOR_SHIFT);
+			td_request_advance(&clone, secs);
 			treq.secs   = secs;
 		} else
 			treq.secs   = 0;
 
-		memset(clone.buf, 0, clone.secs << SECTOR_SHIFT);
+		tapdisk_vbd_zero_td_request(clone);
 		td_complete_request(clone, 0);
 
 		if (!treq.secs)
@@ -1067,6 +1294,10 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 	case TD_OP_READ:
 		td_queue_read(parent, treq);
 		break;
+
+	case TD_OP_FLUSH:
+		td_queue_flush(parent, treq);
+		break;
 	}
 
 done:
@@ -1121,6 +1352,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 			vbd->FIXME_enospc_redirect_count_enabled = 1;
 		}
 		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
+			tapdisk_chainmap_reset(&vbd->chainmap, &vbd->images);
 			vbd->secondary = NULL;
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
 			signal_enospc(vbd);
@@ -1141,6 +1373,7 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 		/* It was the secondary that timed out - disable secondary */
 		list_del_init(&image->next);
 		vbd->retired = image;
+		tapdisk_chainmap_reset(&vbd->chainmap, &vbd->images);
 		if (vbd->secondary_mode != TD_VBD_SECONDARY_DISABLED) {
 			vbd->secondary = NULL;
 			vbd->secondary_mode = TD_VBD_SECONDARY_DISABLED;
@@ -1152,6 +1385,16 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	    vreq->name, treq.sidx, treq.sec, treq.secs,
 	    treq.buf, vreq->op, res);
 
+	if (!res) {
+		if (treq.op != TD_OP_READ)
+			tapdisk_chainmap_invalidate(&vbd->chainmap,
+						    treq.sec, treq.secs);
+		else if (treq.sec + treq.secs <= image->info.size)
+			tapdisk_chainmap_learn(&vbd->chainmap, image,
+					       treq.sec, treq.secs,
+					       vreq->chain_gen);
+	}
+
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
@@ -1168,12 +1411,13 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	td_image_t *image;
 	td_request_t treq;
 	td_sector_t sec;
-	int i, err;
+	int i, n, err;
 
 	sec    = vreq->sec;
 	image  = tapdisk_vbd_first_image(vbd);
 
 	vreq->submitting = 1;
+	td_flag_clear(vreq->flags, TD_VBD_REQ_FLUSHED);
 
 	tapdisk_vbd_mark_progress(vbd);
 	vreq->last_try = vbd->ts;
@@ -1192,30 +1436,41 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		goto fail;
 	}
 
-	for (i = 0; i < vreq->iovcnt; i++) {
+	vreq->chain_gen = tapdisk_chainmap_gen(&vbd->chainmap);
+
+	if (vreq->op == TD_OP_FLUSH)
+		tapdisk_vbd_queue_flush(vbd, vreq);
+
+	/* reads and writes go down whole, discards per segment */
+	for (i = 0; i < vreq->iovcnt; i += n) {
 		struct td_iovec *iov = &vreq->iov[i];
 
+		n = (vreq->op == TD_OP_DISCARD ? 1 : vreq->iovcnt - i);
+
 		treq.sidx           = i;
 		treq.buf            = iov->base;
 		treq.sec            = sec;
-		treq.secs           = iov->secs;
+		treq.secs           = tapdisk_vbd_iovec_secs(iov, n);
 		treq.image          = image;
 		treq.cb             = tapdisk_vbd_complete_td_request;
 		treq.cb_data        = NULL;
 		treq.vreq           = vreq;
+		treq.iov            = iov;
+		treq.iovcnt         = n;
 
-
-		vreq->secs_pending += iov->secs;
-		vbd->secs_pending  += iov->secs;
+		vreq->secs_pending += treq.secs;
+		vbd->secs_pending  += treq.secs;
 		if (vbd->secondary_mode == TD_VBD_SECONDARY_MIRROR &&
 		    vreq->op == TD_OP_WRITE) {
-			vreq->secs_pending += iov->secs;
-			vbd->secs_pending  += iov->secs;
+			vreq->secs_pending += treq.secs;
+			vbd->secs_pending  += treq.secs;
 		}
 
 		switch (vreq->op) {
 		case TD_OP_WRITE:
 			treq.op = TD_OP_WRITE;
+			tapdisk_chainmap_invalidate(&vbd->chainmap,
+						    treq.sec, treq.secs);
 			/*
 			 * it's important to queue the mirror request before 
 			 * queuing the main one. If the main image runs into 
@@ -1230,8 +1485,17 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 			td_queue_write(treq.image, treq);
 			break;
 
+		case TD_OP_DISCARD:
+			treq.op = TD_OP_DISCARD;
+			tapdisk_chainmap_invalidate(&vbd->chainmap,
+						    treq.sec, treq.secs);
+			td_queue_discard(treq.image, treq);
+			break;
+
 		case TD_OP_READ:
-			treq.op = TD_OP_READ;
+			treq.op    = TD_OP_READ;
+			treq.image = tapdisk_chainmap_lookup(&vbd->chainmap,
+							     treq.sec, treq.secs) ? : image;
 			td_queue_read(treq.image, treq);
 			break;
 		}
@@ -1239,7 +1503,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		DBG(TLOG_DBG, "%s: req %s seg %d sec 0x%08"PRIx64" secs 0x%04x "
 		    "buf %p op %d\n", image->name, vreq->name, i, treq.sec, treq.secs,
 		    treq.buf, vreq->op);
-		sec += iov->secs;
+		sec += treq.secs;
 	}
 
 	err = 0;
@@ -1317,8 +1581,16 @@ tapdisk_vbd_count_new_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 
 	write = vreq->op == TD_OP_WRITE;
 
+	if (vreq->op == TD_OP_FLUSH)
+		vbd->flushes++;
+	else if (write && td_flag_test(vreq->flags, TD_VBD_REQ_FUA))
+		vbd->fua_writes++;
+
 	for (iov = &vreq->iov[0]; iov < &vreq->iov[vreq->iovcnt]; iov++)
-		td_sector_count_add(&vbd->secs, iov->secs, write);
+		if (vreq->op == TD_OP_DISCARD)
+			vbd->secs_discarded += iov->secs;
+		else
+			td_sector_count_add(&vbd->secs, iov->secs, write);
 }
 
 static int
@@ -1403,6 +1675,8 @@ tapdisk_vbd_queue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	list_add_tail(&vreq->next, &vbd->new_requests);
 	vbd->received++;
 
+	tapdisk_boottrace_record(&vbd->boottrace, vreq);
+
 	return 0;
 }
 
@@ -1455,6 +1729,23 @@ tapdisk_vbd_start_nbdserver(td_vbd_t *vbd)
 	return 0;
 }
 
+static void
+tapdisk_vbd_bufpool_stats(td_stats_t *st)
+{
+	struct vhd_bufpool_stats bp;
+
+	vhd_bufpool_get_stats(&bp);
+
+	tapdisk_stats_field(st, "gets", "llu", bp.gets);
+	tapdisk_stats_field(st, "hits", "llu", bp.hits);
+	tapdisk_stats_field(st, "oversize", "llu", bp.oversize);
+	tapdisk_stats_field(st, "failed", "llu", bp.failed);
+	tapdisk_stats_field(st, "chunks", "llu", bp.chunks);
+	tapdisk_stats_field(st, "bytes", "llu", bp.bytes);
+	tapdisk_stats_field(st, "huge_bytes", "llu", bp.huge_bytes);
+	tapdisk_stats_field(st, "in_use", "llu", bp.in_use);
+}
+
 void
 tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 {
@@ -1468,11 +1759,36 @@ tapdisk_vbd_stats(td_vbd_t *vbd, td_stats_t *st)
 	tapdisk_stats_val(st, "llu", vbd->secs.wr);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "discard_secs", "llu", vbd->secs_discarded);
+	tapdisk_stats_field(st, "flushes", "llu", vbd->flushes);
+	tapdisk_stats_field(st, "fua_writes", "llu", vbd->fua_writes);
+
 	tapdisk_stats_field(st, "images", "[");
 	tapdisk_vbd_for_each_image(vbd, image, next)
 		tapdisk_image_stats(image, st);
 	tapdisk_stats_leave(st, ']');
 
+	tapdisk_stats_field(st, "chain_map", "{");
+	tapdisk_chainmap_stats(&vbd->chainmap, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "boot_trace", "{");
+	tapdisk_boottrace_stats(&vbd->boottrace, st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "bufpool", "{");
+	tapdisk_vbd_bufpool_stats(st);
+	tapdisk_stats_leave(st, '}');
+
+	tapdisk_stats_field(st, "qos", "{");
+	tapdisk_stats_field(st, "class", "d", vbd->flow.class);
+	tapdisk_stats_field(st, "weight", "u", vbd->flow.weight);
+	tapdisk_stats_field(st, "depth", "d", vbd->flow.depth);
+	tapdisk_stats_field(st, "inflight", "d", vbd->flow.inflight);
+	tapdisk_stats_field(st, "pending", "d", vbd->flow.n_pending);
+	tapdisk_stats_field(st, "dispatched", "llu", vbd->flow.dispatched);
+	tapdisk_stats_leave(st, '}');
+
 	if (vbd->tap) {
 		tapdisk_stats_field(st, "tap", "{");
 		tapdisk_blktap_stats(vbd->tap, st);
@@ -24,6 +24,9 @@
 #include "scheduler.h"
 #include "tapdisk-image.h"
 #include "tapdisk-blktap.h"
+#include "tapdisk-chainmap.h"
+#include "tapdisk-boottrace.h"
+#include "tapdisk-queue.h"
 
 #define TD_VBD_REQUEST_TIMEOUT      120
 #define TD_VBD_MAX_RETRIES          100
@@ -76,10 +79,16 @@ struct td_vbd_handle {
 
 	int                         nbd_mirror_failed;
 
+	td_chainmap_t               chainmap;
+	td_boottrace_t              boottrace;
+
+	struct tflow                flow;
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
 	struct list_head            completed_requests;
+	scheduler_timer_t           retry_timer;
 
 	td_vbd_request_t            request_list[MAX_REQUESTS]; /* XXX */
 
@@ -95,6 +104,9 @@ struct td_vbd_handle {
 	uint64_t                    retries;
 	uint64_t                    errors;
 	td_sector_count_t           secs;
+	uint64_t                    secs_discarded;
+	uint64_t                    flushes;
+	uint64_t                    fua_writes;
 
 	struct td_nbdserver        *nbdserver;
 };
@@ -156,15 +168,19 @@ int tapdisk_vbd_open(td_vbd_t *, const char *, int, const char *, td_flag_t);
 int tapdisk_vbd_close(td_vbd_t *);
 
 int tapdisk_vbd_open_vdi(td_vbd_t *, const char *, td_flag_t, int);
-void tapdisk_vbd_close_vdi(td_vbd_t *);
+int tapdisk_vbd_close_vdi(td_vbd_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
 
 int tapdisk_vbd_queue_request(td_vbd_t *, td_vbd_request_t *);
 void tapdisk_vbd_forward_request(td_request_t);
+void tapdisk_vbd_complete_td_request(td_request_t, int);
 
 int tapdisk_vbd_get_disk_info(td_vbd_t *, td_disk_info_t *);
+int tapdisk_vbd_discard_supported(td_vbd_t *);
+int tapdisk_vbd_block_status(td_vbd_t *, td_sector_t, int, int *);
+int tapdisk_vbd_forward_block_status(td_request_t, int *);
 int tapdisk_vbd_retry_needed(td_vbd_t *);
 int tapdisk_vbd_quiesce_queue(td_vbd_t *);
 int tapdisk_vbd_start_queue(td_vbd_t *);
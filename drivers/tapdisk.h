@@ -34,6 +34,17 @@
  * the resulting iocbs to tapdisk using td_prep_[read,write]() and 
  * td_queue_tiocb().
  *
+ * Drivers which can deallocate storage also implement td_queue_discard();
+ * discarded ranges read back undefined, typically from the parent image.
+ *
+ * td_queue_flush() makes every write completed before it durable; drivers
+ * without one have it forwarded down the chain.
+ *
+ * Requests spanning several guest buffers carry the iovec in treq.iov,
+ * with treq.buf pointing into iov[0]. Drivers implementing
+ * td_queue_[readv,writev]() receive them whole; everyone else gets one
+ * request per buffer, split by td_queue_[read,write]().
+ *
  * NOTE: tapdisk uses the number of sectors submitted per request as a 
  * ref count.  Plugins must use the callback function to communicate the
  * completion -- or error -- of every sector submitted to them.
@@ -70,6 +81,12 @@
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
+#define TD_OP_FLUSH                  3
+
+#define TD_VBD_REQ_FUA               0x1 /* flush once written */
+#define TD_VBD_REQ_FLUSHED           0x2 /* fua flush issued */
+#define TD_VBD_REQ_INTERNAL          0x4 /* issued by tapdisk, not the guest */
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -129,6 +146,7 @@ struct td_iovec {
 
 struct td_vbd_request {
 	int                         op;
+	int                         flags;
 	td_sector_t                 sec;
 	struct td_iovec            *iov;
 	int                         iovcnt;
@@ -145,6 +163,7 @@ struct td_vbd_request {
 	int                         num_retries;
 	struct timeval		    ts;
 	struct timeval              last_try;
+	uint64_t                    chain_gen;
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -165,6 +184,9 @@ struct td_request {
 
 	int                          sidx;
 	td_vbd_request_t            *vreq;
+
+	struct td_iovec             *iov;
+	int                          iovcnt;
 };
 
 /* 
@@ -181,8 +203,13 @@ struct tap_disk {
 	int (*td_validate_parent)    (td_driver_t *, td_driver_t *, td_flag_t);
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
+	void (*td_queue_readv)       (td_driver_t *, td_request_t);
+	void (*td_queue_writev)      (td_driver_t *, td_request_t);
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
+	void (*td_queue_flush)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
 	void (*td_stats)             (td_driver_t *, td_stats_t *);
+	int (*td_block_status)       (td_driver_t *, td_sector_t, int, int *);
 };
 
 struct td_sector_count {
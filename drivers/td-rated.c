@@ -21,6 +21,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -31,6 +33,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #include "block-valve.h"
 #include "compiler.h"
@@ -94,6 +97,13 @@ struct ratelimit_connection {
 
 	unsigned long                  need; /* I/O requested */
 	unsigned long                  gntd; /* I/O granted, pending */
+	unsigned long                  nreq; /* requests making up need */
+
+	char                          *cls;  /* from hello, or NULL */
+
+	/* a message cut short by the last recv */
+	char                           part[sizeof(struct td_valve_hello)];
+	size_t                         n_part;
 
 	struct list_head               open; /* connected */
 	struct list_head               wait; /* need > 0 */
@@ -118,6 +128,12 @@ struct ratelimit_ops {
 	void    (*timeout)(td_rlb_t *rlb, void *data);
 	void    (*dispatch)(td_rlb_t *rlb, void *data);
 	void    (*reset)(td_rlb_t *rlb, void *data);
+
+	/* optional */
+	void    (*attach)(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data);
+	void    (*detach)(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data);
+	void    (*latency)(td_rlb_t *rlb, td_rlb_conn_t *conn,
+			   unsigned long usecs, void *data);
 };
 
 struct ratelimit_bridge {
@@ -486,10 +502,10 @@ rlb_conn_info(td_rlb_t *rlb, td_rlb_conn_t *conn)
 	WARN_ON(!!conn->need != waits);
 
 	INFO("conn[%d] needs %lu (since %llu ms, total %lu.%06lu s),"
-	     " %lu granted",
+	     " %lu granted, class %s",
 	     rlb_conn_id(rlb, conn), conn->need, wtime,
 	     conn->wstat.total.tv_sec, conn->wstat.total.tv_usec,
-	     conn->gntd);
+	     conn->gntd, conn->cls ? : "-");
 }
 
 static void
@@ -514,37 +530,94 @@ rlb_conn_close(td_rlb_t *rlb, td_rlb_conn_t *conn)
 		conn->sock = -1;
 	}
 
+	if (rlb->valve.ops && rlb->valve.ops->detach)
+		rlb->valve.ops->detach(rlb, conn, rlb->valve.data);
+
+	if (conn->cls) {
+		free(conn->cls);
+		conn->cls = NULL;
+	}
+
 	list_del_init(&conn->wait);
 	list_del(&conn->open);
 
 	rlb_conn_free(rlb, conn);
 }
 
+static int
+rlb_conn_hello(td_rlb_t *rlb, td_rlb_conn_t *conn,
+	       const struct td_valve_hello *hello, size_t size)
+{
+	if (size < sizeof(*hello) || hello->req.done != TD_RLB_CLASS_MAX)
+		return -EPROTO;
+
+	if (conn->cls || conn->need || conn->gntd)
+		return -EPROTO;
+
+	conn->cls = strndup(hello->name, TD_RLB_CLASS_MAX);
+	if (!conn->cls)
+		return -ENOMEM;
+
+	INFO("conn[%d] class %s", rlb_conn_id(rlb, conn), conn->cls);
+
+	if (rlb->valve.ops->attach)
+		rlb->valve.ops->attach(rlb, conn, rlb->valve.data);
+
+	return 0;
+}
+
 static void
 rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 {
-	struct td_valve_req buf[32], req = { -1, -1 };
+	struct td_valve_req buf[32 + sizeof(conn->part) /
+				sizeof(struct td_valve_req)];
+	struct td_valve_req req = { -1, -1 };
+	size_t len;
 	ssize_t n;
 	int i, err;
 
-	n = rlb_sock_recv(rlb, conn, buf, sizeof(buf));
+	memcpy(buf, conn->part, conn->n_part);
+
+	n = rlb_sock_recv(rlb, conn, (char *)buf + conn->n_part,
+			  sizeof(buf) - conn->n_part);
 	if (!n)
 		goto close;
 
 	if (n < 0) {
 		err = n;
-		if (err != -EAGAIN)
-			goto fail;
-	}
-
-	if (unlikely(n % sizeof(req))) {
-		err = -EPROTO;
+		if (err == -EAGAIN)
+			return;
 		goto fail;
 	}
 
-	for (i = 0; i < n / sizeof(buf[0]); i++) {
+	len          = conn->n_part + n;
+	conn->n_part = 0;
+
+	for (i = 0; i < len / sizeof(buf[0]); i++) {
 		req = buf[i];
 
+		if (unlikely(req.need == TD_RLB_HELLO)) {
+			/* wait for the rest of it */
+			if (len - i * sizeof(buf[0]) <
+			    sizeof(struct td_valve_hello))
+				break;
+
+			err = rlb_conn_hello(rlb, conn, (void *)&buf[i],
+					     len - i * sizeof(buf[0]));
+			if (err)
+				goto fail;
+
+			i += sizeof(struct td_valve_hello) / sizeof(buf[0]) - 1;
+			continue;
+		}
+
+		if (unlikely(req.need == TD_RLB_LATENCY)) {
+			if (rlb->valve.ops->latency)
+				rlb->valve.ops->latency(rlb, conn, req.done,
+							rlb->valve.data);
+			continue;
+		}
+
 		if (unlikely(req.need > TD_RLB_REQUEST_MAX)) {
 			err = -EINVAL;
 			goto fail;
@@ -557,6 +630,8 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 
 		conn->need += req.need;
 		conn->gntd -= req.done;
+		if (req.need)
+			conn->nreq++;
 
 		DBG(8, "rcv: %lu/%lu need=%lu gntd=%lu",
 		    req.need, req.done, conn->need, conn->gntd);
@@ -567,6 +642,9 @@ rlb_conn_receive(td_rlb_t *rlb, td_rlb_conn_t *conn)
 		}
 	}
 
+	conn->n_part = len - i * sizeof(buf[0]);
+	memcpy(conn->part, &buf[i], conn->n_part);
+
 	if (conn->need && list_empty(&conn->wait)) {
 		list_add_tail(&conn->wait, &rlb->wait);
 		conn->wstat.since = rlb->now;
@@ -605,6 +683,8 @@ rlb_conn_respond(td_rlb_t *rlb, td_rlb_conn_t *conn, unsigned long need)
 	if (!conn->need) {
 		struct timeval delta;
 
+		conn->nreq = 0;
+
 		timersub(&rlb->now, &conn->wstat.since, &delta);
 		timeradd(&conn->wstat.total, &delta, &conn->wstat.total);
 
@@ -644,6 +724,9 @@ rlb_accept_conn(td_rlb_t *rlb)
 	conn->sock = s;
 	list_add_tail(&conn->open, &rlb->open);
 
+	if (rlb->valve.ops->attach)
+		rlb->valve.ops->attach(rlb, conn, rlb->valve.data);
+
 	return;
 
 fail:
@@ -668,13 +751,37 @@ rlb_pending(td_rlb_t *rlb)
 
 typedef struct ratelimit_token td_rlb_token_t;
 
+static struct ratelimit_ops rlb_token_ops;
+
 struct ratelimit_token {
 	long                      cred;
 	long                      cap;
 	long                      rate;
 	struct timeval            timeo;
+
+	/* credit lives here instead, with --shm */
+	struct td_rlb_shm        *shm;
+	char                     *shm_path;
 };
 
+static long
+rlb_token_cred(td_rlb_token_t *token)
+{
+	if (token->shm)
+		return token->shm->cred;
+
+	return token->cred;
+}
+
+static void
+rlb_token_debit(td_rlb_token_t *token, unsigned long size)
+{
+	if (token->shm)
+		__sync_sub_and_fetch(&token->shm->cred, size);
+	else
+		token->cred -= size;
+}
+
 static void
 rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 {
@@ -687,11 +794,13 @@ rlb_token_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
 		return;
 	}
 
-	WARN_ON(token->cred >= 0);
+	/* shm clients may have refilled since dispatch */
+	WARN_ON(!token->shm && token->cred >= 0);
 
-	us  = -token->cred;
+	us  = -rlb_token_cred(token);
 	us *= 1000000;
 	us /= token->rate;
+	us  = MAX(us, 1);
 
 	tv->tv_sec  = us / 1000000;
 	tv->tv_usec = us % 1000000;
@@ -707,6 +816,11 @@ rlb_token_refill(td_rlb_t *rlb, td_rlb_token_t *token)
 	struct timeval tv;
 	long long cred, max_usec;
 
+	if (token->shm) {
+		td_rlb_shm_refill(token->shm, td_rlb_clock());
+		return;
+	}
+
 	/* max time needed to refill up to cap */
 
 	max_usec  = token->cap - token->cred;
@@ -738,13 +852,17 @@ rlb_token_dispatch(td_rlb_t *rlb, void *data)
 	rlb_token_refill(rlb, token);
 
 	rlb_for_each_waiting_safe(conn, next, rlb) {
-		if (token->cred < 0)
+		if (rlb_token_cred(token) < 0)
 			break;
 
-		token->cred -= conn->need;
+		rlb_token_debit(token, conn->need);
 
 		rlb_conn_respond(rlb, conn, conn->need);
 	}
+
+	/* keep shm clients off the bucket while anyone queues here */
+	if (token->shm)
+		token->shm->waiters = !list_empty(&rlb->wait);
 }
 
 static void
@@ -753,6 +871,87 @@ rlb_token_reset(td_rlb_t *rlb, void *data)
 	td_rlb_token_t *token = data;
 
 	token->cred = token->cap;
+
+	if (token->shm) {
+		token->shm->ts   = td_rlb_clock();
+		token->shm->cred = token->cap;
+	}
+}
+
+static void
+rlb_token_shm_close(td_rlb_token_t *token)
+{
+	if (token->shm) {
+		token->shm->magic = 0;
+		munmap(token->shm, sizeof(*token->shm));
+		token->shm = NULL;
+	}
+
+	if (token->shm_path) {
+		unlink(token->shm_path);
+		free(token->shm_path);
+		token->shm_path = NULL;
+	}
+}
+
+static int
+rlb_token_shm_open(td_rlb_t *rlb, td_rlb_token_t *token)
+{
+	struct td_rlb_shm *shm;
+	int fd, err;
+
+	fd = -1;
+
+	token->shm_path = mprintf("%s%s", rlb->path, TD_RLB_SHM_SUFFIX);
+	if (!token->shm_path) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* never truncate a segment stale clients may still map */
+	unlink(token->shm_path);
+
+	fd = open(token->shm_path, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0) {
+		PERROR("%s", token->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	err = ftruncate(fd, sizeof(*shm));
+	if (err) {
+		PERROR("ftruncate(%s)", token->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (shm == MAP_FAILED) {
+		PERROR("mmap(%s)", token->shm_path);
+		err = -errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	shm->rate    = token->rate;
+	shm->cap     = token->cap;
+	shm->waiters = 0;
+	token->shm   = shm;
+
+	rlb_token_reset(rlb, token);
+
+	__sync_synchronize();
+	shm->magic   = TD_RLB_SHM_MAGIC;
+
+	return 0;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	rlb_token_shm_close(token);
+	return err;
 }
 
 static void
@@ -760,15 +959,17 @@ rlb_token_destroy(td_rlb_t *rlb, void *data)
 {
 	td_rlb_token_t *token = data;
 
-	if (token)
+	if (token) {
+		rlb_token_shm_close(token);
 		free(token);
+	}
 }
 
 static int
 rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 {
 	td_rlb_token_t *token;
-	int err;
+	int err, shm = 0;
 
 	token = calloc(1, sizeof(*token));
 	if (!token) {
@@ -783,11 +984,12 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		const struct option longopts[] = {
 			{ "rate",        1, NULL, 'r' },
 			{ "cap",         1, NULL, 'c' },
+			{ "shm",         0, NULL, 's' },
 			{ NULL,          0, NULL,  0  }
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "r:c:", longopts, NULL);
+		c = getopt_long(argc, argv, "r:c:s", longopts, NULL);
 		if (c < 0)
 			break;
 
@@ -808,6 +1010,10 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 			}
 			break;
 
+		case 's':
+			shm = 1;
+			break;
+
 		case '?':
 			goto usage;
 
@@ -821,6 +1027,23 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 		goto usage;
 	}
 
+	if (shm) {
+		/* a subordinate bucket must not be bypassed */
+		if (rlb->valve.ops != &rlb_token_ops) {
+			ERR("--shm requires a top-level token bucket");
+			goto usage;
+		}
+
+		if (!token->cap) {
+			ERR("--shm requires a --cap");
+			goto usage;
+		}
+
+		err = rlb_token_shm_open(rlb, token);
+		if (err)
+			goto fail;
+	}
+
 	rlb_token_reset(rlb, token);
 
 	*data = token;
@@ -829,7 +1052,7 @@ rlb_token_create(td_rlb_t *rlb, int argc, char **argv, void **data)
 
 fail:
 	if (token)
-		free(token);
+		rlb_token_destroy(rlb, token);
 
 	return err;
 
@@ -844,7 +1067,8 @@ rlb_token_usage(td_rlb_t *rlb, FILE *stream, void *data)
 	fprintf(stream,
 		" {-t|--type}=token --"
 		" {-r|--rate}=<rate [KMG]>"
-		" {-c|--cap}=<size [KMG]>");
+		" {-c|--cap}=<size [KMG]>"
+		" [-s|--shm]");
 }
 
 static void
@@ -853,7 +1077,11 @@ rlb_token_info(td_rlb_t *rlb, void *data)
 	td_rlb_token_t *token = data;
 
 	INFO("TOKEN: rate: %ld B/s cap: %ld B cred: %ld B",
-	     token->rate, token->cap, token->cred);
+	     token->rate, token->cap, rlb_token_cred(token));
+
+	if (token->shm)
+		INFO("TOKEN: shared at %s, %u waiting",
+		     token->shm_path, token->shm->waiters);
 }
 
 static struct ratelimit_ops rlb_token_ops = {
@@ -1280,6 +1508,34 @@ rlb_meminfo_dispatch(td_rlb_t *rlb, void *data)
 		m->valve.ops->dispatch(rlb, m->valve.data);
 }
 
+static void
+rlb_meminfo_attach(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	if (m->valve.ops->attach)
+		m->valve.ops->attach(rlb, conn, m->valve.data);
+}
+
+static void
+rlb_meminfo_detach(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	if (m->valve.ops->detach)
+		m->valve.ops->detach(rlb, conn, m->valve.data);
+}
+
+static void
+rlb_meminfo_latency(td_rlb_t *rlb, td_rlb_conn_t *conn,
+		    unsigned long usecs, void *data)
+{
+	td_rlb_meminfo_t *m = data;
+
+	if (m->valve.ops->latency)
+		m->valve.ops->latency(rlb, conn, usecs, m->valve.data);
+}
+
 static struct ratelimit_ops rlb_meminfo_ops = {
 	.usage    = rlb_meminfo_usage,
 	.create   = rlb_meminfo_create,
@@ -1289,101 +1545,1101 @@ static struct ratelimit_ops rlb_meminfo_ops = {
 	.settimeo = rlb_meminfo_settimeo,
 	.timeout  = rlb_meminfo_timeout,
 	.dispatch = rlb_meminfo_dispatch,
+
+	.attach   = rlb_meminfo_attach,
+	.detach   = rlb_meminfo_detach,
+	.latency  = rlb_meminfo_latency,
 };
 
 /*
- * main loop
+ * hierarchical qos valve
+ *
+ * Connections are leaves of a class tree, placed by the path in their
+ * hello (e.g. sr1/vm7/xvda), or under "default". Every class holds a
+ * byte and an I/O token bucket. A request passes once no class on its
+ * path is in debt, and is charged to all of them. Siblings share their
+ * parent by weight, start-time fair: the one with the least virtual
+ * time goes first, and idle ones cannot bank any.
+ *
+ * Classes named only by hellos live as long as a conn is placed in
+ * them, or below them; configured ones stay.
  */
 
+#define RLB_HQOS_IO_COST               4096 /* vtime per I/O [B] */
+#define RLB_HQOS_DEFAULT               "default"
+
+typedef struct ratelimit_bucket        td_rlb_bucket_t;
+typedef struct ratelimit_hqos          td_rlb_hqos_t;
+typedef struct ratelimit_hqos_class    td_rlb_hqos_class_t;
+
+struct ratelimit_bucket {
+	long long                      cred;
+	long long                      cap;
+	long long                      rate; /* 0: unlimited */
+	long long                      frac; /* sub-unit credit, x 10^6 */
+};
+
+struct ratelimit_hqos_class {
+	char                          *name;
+	td_rlb_hqos_class_t           *parent;
+	struct list_head               children;
+	struct list_head               sibling;
+
+	unsigned int                   weight;
+	td_rlb_bucket_t                bytes;
+	td_rlb_bucket_t                ios;
+
+	long long                      vtime;  /* as a child */
+	long long                      vclock; /* start of last one served */
+
+	int                            waiting; /* conns in subtree */
+	struct list_head               wait;    /* conns placed here */
+	int                            refs;    /* conns, and the config */
+};
+
+/* wait links are only valid during a dispatch, which rebuilds them */
+struct ratelimit_hqos_conn {
+	td_rlb_hqos_class_t           *cls;
+	long long                      vtime;
+	td_rlb_conn_t                 *conn;
+	struct list_head               wait;
+};
+
+struct ratelimit_hqos {
+	td_rlb_hqos_class_t            root;
+	struct ratelimit_hqos_conn     conns[RLB_CONN_MAX];
+	struct timeval                 timeo;
+};
+
+#define rlb_hqos_for_each_child(_child, _cls)				\
+	list_for_each_entry(_child, &(_cls)->children, sibling)
+
 static void
-rlb_info(td_rlb_t *rlb)
+rlb_bucket_refill(td_rlb_bucket_t *b, long long usec)
 {
-	rlb->valve.ops->info(rlb, rlb->valve.data);
+	long long cred, max_usec;
 
-	rlb_conn_infos(rlb);
-}
+	if (!b->rate)
+		return;
 
-static sigset_t rlb_sigunblock;
-static sigset_t rlb_sigpending;
+	max_usec  = b->cap - b->cred;
+	max_usec *= 1000000;
+	max_usec += b->rate - 1;
+	max_usec /= b->rate;
+
+	/* carry the remainder, low I/O rates gain < 1 per iteration */
+
+	cred    = MIN(usec, max_usec);
+	cred   *= b->rate;
+	cred   += b->frac;
+	b->frac = cred % 1000000;
+	cred   /= 1000000;
+
+	b->cred += cred;
+	if (b->cred >= b->cap) {
+		b->cred = b->cap;
+		b->frac = 0;
+	}
+}
 
 static void
-rlb_sigmark(int signo)
+rlb_bucket_debit(td_rlb_bucket_t *b, long long val)
 {
-	INFO("Caught SIG%d", signo);
-	sigaddset(&rlb_sigpending, signo);
+	if (b->rate)
+		b->cred -= val;
 }
 
 static int
-rlb_siginit(void)
+rlb_bucket_blocked(td_rlb_bucket_t *b)
 {
-	struct sigaction sa_ignore  = { .sa_handler = SIG_IGN };
-	struct sigaction sa_pending = { .sa_handler = rlb_sigmark };
-	sigset_t sigmask;
-	int err = 0;
+	return b->rate && b->cred < 0;
+}
 
-	if (!err)
-		err = sigaction(SIGPIPE, &sa_ignore, NULL);
-	if (!err)
-		err = sigaction(SIGINT,  &sa_pending, NULL);
-	if (!err)
-		err = sigaction(SIGTERM, &sa_pending, NULL);
-	if (!err)
-		err = sigaction(SIGUSR1, &sa_pending, NULL);
-	if (err) {
-		err = -errno;
-		goto fail;
+static long long
+rlb_bucket_wait(td_rlb_bucket_t *b)
+{
+	long long us;
+
+	if (!rlb_bucket_blocked(b))
+		return 0;
+
+	us  = -b->cred;
+	us *= 1000000;
+	us += b->rate - 1;
+	us /= b->rate;
+
+	return us;
+}
+
+static void
+rlb_hqos_class_init(td_rlb_hqos_class_t *cls, td_rlb_hqos_class_t *parent)
+{
+	memset(cls, 0, sizeof(*cls));
+	INIT_LIST_HEAD(&cls->children);
+	INIT_LIST_HEAD(&cls->sibling);
+	INIT_LIST_HEAD(&cls->wait);
+
+	cls->parent = parent;
+	cls->weight = 1;
+
+	if (parent) {
+		cls->vtime = parent->vclock;
+		list_add_tail(&cls->sibling, &parent->children);
 	}
+}
 
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	sigaddset(&sigmask, SIGTERM);
-	sigaddset(&sigmask, SIGUSR1);
+static void
+rlb_hqos_class_free(td_rlb_hqos_class_t *cls)
+{
+	td_rlb_hqos_class_t *child, *next;
 
-	err = sigprocmask(SIG_BLOCK, &sigmask, &rlb_sigunblock);
-	if (err) {
-		err = -errno;
-		goto fail;
+	list_for_each_entry_safe(child, next, &cls->children, sibling) {
+		list_del(&child->sibling);
+		rlb_hqos_class_free(child);
+		free(child);
 	}
 
-fail:
-	return err;
+	if (cls->name) {
+		free(cls->name);
+		cls->name = NULL;
+	}
 }
 
-static int
-rlb_main_signaled(td_rlb_t *rlb)
+static td_rlb_hqos_class_t *
+rlb_hqos_lookup(td_rlb_hqos_t *hqos, const char *path)
 {
-	if (sigismember(&rlb_sigpending, SIGUSR1))
-		rlb_info(rlb);
+	td_rlb_hqos_class_t *cls, *child;
+	const char *name, *end;
+	size_t len;
 
-	if (sigismember(&rlb_sigpending, SIGINT) ||
-	    sigismember(&rlb_sigpending, SIGTERM))
-		return -EINTR;
+	cls = &hqos->root;
 
-	return 0;
+	for (name = path; *name; name = end) {
+		while (*name == '/')
+			name++;
+		if (!*name)
+			break;
+
+		end = strchrnul(name, '/');
+		len = end - name;
+
+		rlb_hqos_for_each_child(child, cls)
+			if (strlen(child->name) == len &&
+			    !strncmp(child->name, name, len))
+				goto next;
+
+		child = malloc(sizeof(*child));
+		if (!child)
+			return NULL;
+
+		rlb_hqos_class_init(child, cls);
+
+		child->name = strndup(name, len);
+		if (!child->name) {
+			list_del(&child->sibling);
+			free(child);
+			return NULL;
+		}
+	next:
+		cls = child;
+	}
+
+	return cls;
 }
 
+static void
+rlb_hqos_class_put(td_rlb_hqos_class_t *cls)
+{
+	td_rlb_hqos_class_t *parent;
 
-static struct ratelimit_ops *
-rlb_find_valve(const char *name)
+	BUG_ON(cls->refs <= 0);
+	cls->refs--;
+
+	while (cls->parent && !cls->refs && list_empty(&cls->children)) {
+		parent = cls->parent;
+		list_del(&cls->sibling);
+		rlb_hqos_class_free(cls);
+		free(cls);
+		cls = parent;
+	}
+}
+
+static td_rlb_hqos_class_t *
+rlb_hqos_conn_class(td_rlb_t *rlb, td_rlb_hqos_t *hqos, td_rlb_conn_t *conn)
 {
-	struct ratelimit_ops *ops = NULL;
+	struct ratelimit_hqos_conn *hc = &hqos->conns[rlb_conn_id(rlb, conn)];
+
+	if (unlikely(!hc->cls)) {
+		hc->cls = rlb_hqos_lookup(hqos, conn->cls ? : RLB_HQOS_DEFAULT);
+		if (!hc->cls)
+			hc->cls = &hqos->root;
+		hc->cls->refs++;
+		hc->vtime = hc->cls->vclock;
+		hc->conn  = conn;
+		INIT_LIST_HEAD(&hc->wait);
+	}
 
-	switch (name[0]) {
-#if 0
-	case 'l':
-		if (!strcmp(name, "leaky"))
-			ops = &rlb_leaky_ops;
-		break;
-#endif
+	return hc->cls;
+}
 
-	case 't':
-		if (!strcmp(name, "token"))
-			ops = &rlb_token_ops;
-		break;
+static void
+rlb_hqos_conn_release(td_rlb_t *rlb, td_rlb_hqos_t *hqos,
+		      td_rlb_conn_t *conn)
+{
+	struct ratelimit_hqos_conn *hc = &hqos->conns[rlb_conn_id(rlb, conn)];
 
-	case 'm':
-		if (!strcmp(name, "meminfo"))
-			ops = &rlb_meminfo_ops;
+	if (hc->cls) {
+		rlb_hqos_class_put(hc->cls);
+		hc->cls = NULL;
+	}
+}
+
+static void
+rlb_hqos_attach(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+
+	/* again after the hello, which may move it */
+	rlb_hqos_conn_release(rlb, hqos, conn);
+	rlb_hqos_conn_class(rlb, hqos, conn);
+}
+
+static void
+rlb_hqos_detach(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+
+	rlb_hqos_conn_release(rlb, hqos, conn);
+}
+
+static int
+rlb_hqos_blocked(td_rlb_hqos_class_t *cls)
+{
+	return rlb_bucket_blocked(&cls->bytes) ||
+		rlb_bucket_blocked(&cls->ios);
+}
+
+static void
+rlb_hqos_refill(td_rlb_hqos_class_t *cls, long long usec)
+{
+	td_rlb_hqos_class_t *child;
+
+	rlb_bucket_refill(&cls->bytes, usec);
+	rlb_bucket_refill(&cls->ios, usec);
+
+	cls->waiting = 0;
+	INIT_LIST_HEAD(&cls->wait);
+
+	rlb_hqos_for_each_child(child, cls)
+		rlb_hqos_refill(child, usec);
+}
+
+/*
+ * Least start tag among the waiting conns below @cls which are not
+ * held back by a bucket. Blocked siblings are skipped over, so their
+ * share goes to the others.
+ */
+static td_rlb_conn_t *
+rlb_hqos_pick(td_rlb_t *rlb, td_rlb_hqos_t *hqos, td_rlb_hqos_class_t *cls)
+{
+	struct ratelimit_hqos_conn *hc;
+	td_rlb_hqos_class_t *child;
+	td_rlb_conn_t *pick, *best;
+	long long v, best_v;
+
+	if (!cls->waiting || rlb_hqos_blocked(cls))
+		return NULL;
+
+	best   = NULL;
+	best_v = LLONG_MAX;
+
+	list_for_each_entry(hc, &cls->wait, wait) {
+		v = MAX(hc->vtime, cls->vclock);
+		if (v < best_v) {
+			best   = hc->conn;
+			best_v = v;
+		}
+	}
+
+	rlb_hqos_for_each_child(child, cls) {
+		if (!child->waiting)
+			continue;
+
+		v = MAX(child->vtime, cls->vclock);
+		if (v >= best_v)
+			continue;
+
+		pick = rlb_hqos_pick(rlb, hqos, child);
+		if (pick) {
+			best   = pick;
+			best_v = v;
+		}
+	}
+
+	return best;
+}
+
+static void
+rlb_hqos_charge(td_rlb_t *rlb, td_rlb_hqos_t *hqos, td_rlb_conn_t *conn)
+{
+	struct ratelimit_hqos_conn *hc = &hqos->conns[rlb_conn_id(rlb, conn)];
+	td_rlb_hqos_class_t *cls;
+	long long cost, start;
+
+	cost = conn->need + (long long)conn->nreq * RLB_HQOS_IO_COST;
+
+	list_del_init(&hc->wait);
+
+	cls         = hc->cls;
+	start       = MAX(hc->vtime, cls->vclock);
+	cls->vclock = start;
+	hc->vtime   = start + cost;
+
+	for (; cls; cls = cls->parent) {
+		rlb_bucket_debit(&cls->bytes, conn->need);
+		rlb_bucket_debit(&cls->ios, conn->nreq);
+		cls->waiting--;
+
+		if (cls->parent) {
+			start               = MAX(cls->vtime, cls->parent->vclock);
+			cls->parent->vclock = start;
+			cls->vtime          = start + cost / cls->weight;
+		}
+	}
+}
+
+static void
+rlb_hqos_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+	struct ratelimit_hqos_conn *hc;
+	td_rlb_hqos_class_t *cls;
+	td_rlb_conn_t *conn;
+	struct timeval tv;
+
+	timersub(&rlb->now, &rlb->ts, &tv);
+	rlb_hqos_refill(&hqos->root, rlb_tv_usec(&tv));
+
+	list_for_each_entry(conn, &rlb->wait, wait) {
+		cls = rlb_hqos_conn_class(rlb, hqos, conn);
+		hc  = &hqos->conns[rlb_conn_id(rlb, conn)];
+		list_add_tail(&hc->wait, &cls->wait);
+
+		for (; cls; cls = cls->parent)
+			cls->waiting++;
+	}
+
+	while ((conn = rlb_hqos_pick(rlb, hqos, &hqos->root))) {
+		rlb_hqos_charge(rlb, hqos, conn);
+		rlb_conn_respond(rlb, conn, conn->need);
+	}
+}
+
+static void
+rlb_hqos_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+	struct timeval *tv = &hqos->timeo;
+	td_rlb_hqos_class_t *cls;
+	td_rlb_conn_t *conn;
+	long long us, w;
+
+	if (list_empty(&rlb->wait)) {
+		*_tv = NULL;
+		return;
+	}
+
+	/* earliest a waiting conn has its whole path out of debt */
+
+	us = LLONG_MAX;
+
+	list_for_each_entry(conn, &rlb->wait, wait) {
+		w = 0;
+
+		for (cls = rlb_hqos_conn_class(rlb, hqos, conn);
+		     cls; cls = cls->parent) {
+			w = MAX(w, rlb_bucket_wait(&cls->bytes));
+			w = MAX(w, rlb_bucket_wait(&cls->ios));
+		}
+
+		us = MIN(us, w);
+	}
+
+	us = MAX(us, 1);
+
+	tv->tv_sec  = us / 1000000;
+	tv->tv_usec = us % 1000000;
+
+	*_tv = tv;
+}
+
+static void
+__rlb_hqos_reset(td_rlb_hqos_class_t *cls)
+{
+	td_rlb_hqos_class_t *child;
+
+	cls->bytes.cred = cls->bytes.cap;
+	cls->ios.cred   = cls->ios.cap;
+
+	rlb_hqos_for_each_child(child, cls)
+		__rlb_hqos_reset(child);
+}
+
+static void
+rlb_hqos_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+
+	__rlb_hqos_reset(&hqos->root);
+}
+
+static void
+rlb_hqos_class_info(td_rlb_hqos_class_t *cls, int depth)
+{
+	td_rlb_hqos_class_t *child;
+
+	INFO("HQOS: %*s%s: weight %u"
+	     " rate %lld B/s cap %lld B cred %lld B,"
+	     " iops %lld cap %lld cred %lld",
+	     depth * 2, "", cls->name ? : "/", cls->weight,
+	     cls->bytes.rate, cls->bytes.cap, cls->bytes.cred,
+	     cls->ios.rate, cls->ios.cap, cls->ios.cred);
+
+	rlb_hqos_for_each_child(child, cls)
+		rlb_hqos_class_info(child, depth + 1);
+}
+
+static void
+rlb_hqos_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+
+	rlb_hqos_class_info(&hqos->root, 0);
+}
+
+static int
+rlb_hqos_class_param(td_rlb_hqos_class_t *cls, char *param)
+{
+	char *val;
+	long v;
+
+	val = strchr(param, '=');
+	if (!val)
+		return -EINVAL;
+	*val++ = 0;
+
+	v = rlb_strtol(val);
+	if (v < 0)
+		return -EINVAL;
+
+	if (!strcmp(param, "weight")) {
+		if (!v)
+			return -EINVAL;
+		cls->weight = v;
+	} else if (!strcmp(param, "rate"))
+		cls->bytes.rate = v;
+	else if (!strcmp(param, "cap"))
+		cls->bytes.cap = v;
+	else if (!strcmp(param, "iops"))
+		cls->ios.rate = v;
+	else if (!strcmp(param, "icap"))
+		cls->ios.cap = v;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * One class per line, ancestors are created as needed:
+ *
+ *   class <path> [weight=<n>] [rate=<B/s>] [cap=<B>]
+ *                [iops=<n>] [icap=<n>]
+ */
+static int
+rlb_hqos_config(td_rlb_hqos_t *hqos, const char *path)
+{
+	td_rlb_hqos_class_t *cls;
+	char buf[256], *tok, *sp;
+	int line, err;
+	FILE *s;
+
+	s = fopen(path, "r");
+	if (!s) {
+		PERROR("%s", path);
+		return -errno;
+	}
+
+	err  = 0;
+	line = 0;
+
+	while (fgets(buf, sizeof(buf), s)) {
+		line++;
+
+		tok = strtok_r(buf, " \t\n", &sp);
+		if (!tok || tok[0] == '#')
+			continue;
+
+		if (strcmp(tok, "class"))
+			goto invalid;
+
+		tok = strtok_r(NULL, " \t\n", &sp);
+		if (!tok)
+			goto invalid;
+
+		cls = rlb_hqos_lookup(hqos, tok);
+		if (!cls) {
+			err = -ENOMEM;
+			break;
+		}
+		if (!cls->refs)
+			cls->refs = 1;
+
+		while ((tok = strtok_r(NULL, " \t\n", &sp)))
+			if (rlb_hqos_class_param(cls, tok))
+				goto invalid;
+
+		continue;
+
+	invalid:
+		ERR("%s:%d: invalid class", path, line);
+		err = -EINVAL;
+		break;
+	}
+
+	fclose(s);
+	return err;
+}
+
+static void
+rlb_hqos_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_hqos_t *hqos = data;
+
+	if (hqos) {
+		rlb_hqos_class_free(&hqos->root);
+		free(hqos);
+	}
+}
+
+static int
+rlb_hqos_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_hqos_t *hqos;
+	const char *config;
+	int err;
+
+	hqos = calloc(1, sizeof(*hqos));
+	if (!hqos) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	rlb_hqos_class_init(&hqos->root, NULL);
+	config = NULL;
+
+	do {
+		const struct option longopts[] = {
+			{ "rate",        1, NULL, 'r' },
+			{ "cap",         1, NULL, 'c' },
+			{ "iops",        1, NULL, 'i' },
+			{ "icap",        1, NULL, 'I' },
+			{ "config",      1, NULL, 'f' },
+			{ NULL,          0, NULL,  0  }
+		};
+		td_rlb_bucket_t *b;
+		long val;
+		int c;
+
+		c = getopt_long(argc, argv, "r:c:i:I:f:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'r':
+			b = &hqos->root.bytes;
+			b->rate = val = rlb_strtol(optarg);
+			break;
+
+		case 'c':
+			b = &hqos->root.bytes;
+			b->cap = val = rlb_strtol(optarg);
+			break;
+
+		case 'i':
+			b = &hqos->root.ios;
+			b->rate = val = rlb_strtol(optarg);
+			break;
+
+		case 'I':
+			b = &hqos->root.ios;
+			b->cap = val = rlb_strtol(optarg);
+			break;
+
+		case 'f':
+			config = optarg;
+			val    = 0;
+			break;
+
+		case '?':
+			goto usage;
+
+		default:
+			BUG();
+		}
+
+		if (val < 0) {
+			ERR("invalid -%c", c);
+			goto usage;
+		}
+	} while (1);
+
+	if (config) {
+		err = rlb_hqos_config(hqos, config);
+		if (err)
+			goto fail;
+	}
+
+	rlb_hqos_reset(rlb, hqos);
+
+	*data = hqos;
+
+	return 0;
+
+fail:
+	rlb_hqos_destroy(rlb, hqos);
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_hqos_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=hqos --"
+		" [{-r|--rate}=<rate [KMG]>] [{-c|--cap}=<size [KMG]>]"
+		" [{-i|--iops}=<rate>] [{-I|--icap}=<count>]"
+		" [{-f|--config}=<file>]");
+}
+
+static struct ratelimit_ops rlb_hqos_ops = {
+	.usage    = rlb_hqos_usage,
+	.create   = rlb_hqos_create,
+	.destroy  = rlb_hqos_destroy,
+	.info     = rlb_hqos_info,
+
+	.settimeo = rlb_hqos_settimeo,
+	.timeout  = rlb_hqos_dispatch,
+	.dispatch = rlb_hqos_dispatch,
+	.reset    = rlb_hqos_reset,
+
+	.attach   = rlb_hqos_attach,
+	.detach   = rlb_hqos_detach,
+};
+
+/*
+ * latency valve
+ *
+ * A token bucket whose rate follows the completion latency reported
+ * back by valves. Once per period, the p99 of the samples collected is
+ * held against the target: above, the rate backs off multiplicatively,
+ * below it grows additively, but only while the bucket is what keeps
+ * clients waiting.
+ */
+
+#define RLB_LAT_BUCKETS                128 /* 4 per power of 2 */
+
+typedef struct ratelimit_latency       td_rlb_latency_t;
+
+struct ratelimit_latency {
+	td_rlb_token_t                 token;
+
+	long                           min;
+	long                           max;
+	long                           step;
+	long long                      target; /* us */
+	unsigned int                   period; /* ms */
+
+	struct timeval                 ts;
+	unsigned long                  hist[RLB_LAT_BUCKETS];
+	unsigned long                  samples;
+	int                            throttled;
+
+	long long                      p99;
+	unsigned long long             backoffs;
+	unsigned long long             raises;
+};
+
+static int
+rlb_latency_bucket(unsigned long us)
+{
+	int msb;
+
+	if (us < 4)
+		return us;
+
+	msb = 8 * sizeof(us) - 1 - __builtin_clzl(us);
+
+	return MIN(msb * 4 + ((us >> (msb - 2)) & 3), RLB_LAT_BUCKETS - 1);
+}
+
+static long long
+rlb_latency_bucket_max(int i)
+{
+	if (i < 4)
+		return i;
+
+	return ((4LL + i % 4 + 1) << (i / 4 - 2)) - 1;
+}
+
+static long long
+rlb_latency_p99(td_rlb_latency_t *l)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = RLB_LAT_BUCKETS - 1; i > 0; i--) {
+		n += l->hist[i];
+		if (n > l->samples / 100)
+			break;
+	}
+
+	return rlb_latency_bucket_max(i);
+}
+
+static void
+rlb_latency_sample(td_rlb_t *rlb, td_rlb_conn_t *conn,
+		   unsigned long us, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	l->hist[rlb_latency_bucket(us)]++;
+	l->samples++;
+}
+
+static void
+rlb_latency_control(td_rlb_t *rlb, td_rlb_latency_t *l)
+{
+	td_rlb_token_t *token = &l->token;
+	long long us;
+
+	us = rlb_usec_since(rlb, &l->ts);
+	if (us / 1000 < l->period)
+		return;
+
+	l->ts = rlb->now;
+
+	if (l->samples) {
+		l->p99 = rlb_latency_p99(l);
+
+		if (l->p99 > l->target) {
+			token->rate = MAX(token->rate * 7 / 10, l->min);
+			l->backoffs++;
+		} else if (l->throttled) {
+			token->rate = MIN(token->rate + l->step, l->max);
+			l->raises++;
+		}
+
+		DBG(3, "p99=%lld us (%lu samples) rate=%ld B/s",
+		    l->p99, l->samples, token->rate);
+	}
+
+	memset(l->hist, 0, sizeof(l->hist));
+	l->samples   = 0;
+	l->throttled = 0;
+}
+
+static void
+rlb_latency_dispatch(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	rlb_latency_control(rlb, l);
+
+	rlb_token_dispatch(rlb, &l->token);
+
+	if (!list_empty(&rlb->wait))
+		l->throttled = 1;
+}
+
+static void
+rlb_latency_settimeo(td_rlb_t *rlb, struct timeval **_tv, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	rlb_token_settimeo(rlb, _tv, &l->token);
+}
+
+static void
+rlb_latency_reset(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	rlb_token_reset(rlb, &l->token);
+}
+
+static void
+rlb_latency_attach(td_rlb_t *rlb, td_rlb_conn_t *conn, void *data)
+{
+	unsigned long report = TD_RLB_REPORT;
+	int err;
+
+	err = rlb_sock_send(rlb, conn, &report, sizeof(report));
+	if (err)
+		WARN("conn[%d]: err = %d", rlb_conn_id(rlb, conn), err);
+}
+
+static void
+rlb_latency_info(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	INFO("LATENCY: target: %lld us p99: %lld us"
+	     " rate: %ld B/s [%ld..%ld] step: %ld B/s,"
+	     " %llu backoffs %llu raises",
+	     l->target, l->p99, l->token.rate, l->min, l->max, l->step,
+	     l->backoffs, l->raises);
+
+	rlb_token_info(rlb, &l->token);
+}
+
+static void
+rlb_latency_destroy(td_rlb_t *rlb, void *data)
+{
+	td_rlb_latency_t *l = data;
+
+	if (l)
+		free(l);
+}
+
+static int
+rlb_latency_create(td_rlb_t *rlb, int argc, char **argv, void **data)
+{
+	td_rlb_latency_t *l;
+	int err;
+
+	l = calloc(1, sizeof(*l));
+	if (!l) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	l->period = 100;
+
+	do {
+		const struct option longopts[] = {
+			{ "target",      1, NULL, 'T' },
+			{ "min",         1, NULL, 'm' },
+			{ "max",         1, NULL, 'M' },
+			{ "step",        1, NULL, 's' },
+			{ "cap",         1, NULL, 'c' },
+			{ "period",      1, NULL, 'p' },
+			{ NULL,          0, NULL,  0  }
+		};
+		long val;
+		int c;
+
+		c = getopt_long(argc, argv, "T:m:M:s:c:p:", longopts, NULL);
+		if (c < 0)
+			break;
+
+		if (c == '?')
+			goto usage;
+
+		val = rlb_strtol(optarg);
+		if (val < 0) {
+			ERR("invalid -%c", c);
+			goto usage;
+		}
+
+		switch (c) {
+		case 'T':
+			l->target = val;
+			break;
+		case 'm':
+			l->min = val;
+			break;
+		case 'M':
+			l->max = val;
+			break;
+		case 's':
+			l->step = val;
+			break;
+		case 'c':
+			l->token.cap = val;
+			break;
+		case 'p':
+			l->period = val;
+			break;
+		default:
+			BUG();
+		}
+	} while (1);
+
+	if (!l->target || !l->max) {
+		ERR("--target and --max required");
+		goto usage;
+	}
+
+	if (!l->min)
+		l->min = MAX(l->max / 100, 1);
+	if (!l->step)
+		l->step = MAX(l->max / 20, 1);
+
+	if (l->min > l->max) {
+		ERR("invalid --min/--max");
+		goto usage;
+	}
+
+	l->token.rate = l->max;
+	l->ts         = rlb->now;
+
+	rlb_token_reset(rlb, &l->token);
+
+	*data = l;
+
+	return 0;
+
+fail:
+	rlb_latency_destroy(rlb, l);
+	return err;
+
+usage:
+	err = -EINVAL;
+	goto fail;
+}
+
+static void
+rlb_latency_usage(td_rlb_t *rlb, FILE *stream, void *data)
+{
+	fprintf(stream,
+		" {-t|--type}=latency --"
+		" {-T|--target}=<usecs> {-M|--max}=<rate [KMG]>"
+		" [{-m|--min}=<rate [KMG]>] [{-s|--step}=<rate [KMG]>]"
+		" [{-c|--cap}=<size [KMG]>] [{-p|--period}=<msecs>]");
+}
+
+static struct ratelimit_ops rlb_latency_ops = {
+	.usage    = rlb_latency_usage,
+	.create   = rlb_latency_create,
+	.destroy  = rlb_latency_destroy,
+	.info     = rlb_latency_info,
+
+	.settimeo = rlb_latency_settimeo,
+	.timeout  = rlb_latency_dispatch,
+	.dispatch = rlb_latency_dispatch,
+	.reset    = rlb_latency_reset,
+
+	.attach   = rlb_latency_attach,
+	.latency  = rlb_latency_sample,
+};
+
+/*
+ * main loop
+ */
+
+static void
+rlb_info(td_rlb_t *rlb)
+{
+	rlb->valve.ops->info(rlb, rlb->valve.data);
+
+	rlb_conn_infos(rlb);
+}
+
+static sigset_t rlb_sigunblock;
+static sigset_t rlb_sigpending;
+
+static void
+rlb_sigmark(int signo)
+{
+	INFO("Caught SIG%d", signo);
+	sigaddset(&rlb_sigpending, signo);
+}
+
+static int
+rlb_siginit(void)
+{
+	struct sigaction sa_ignore  = { .sa_handler = SIG_IGN };
+	struct sigaction sa_pending = { .sa_handler = rlb_sigmark };
+	sigset_t sigmask;
+	int err = 0;
+
+	if (!err)
+		err = sigaction(SIGPIPE, &sa_ignore, NULL);
+	if (!err)
+		err = sigaction(SIGINT,  &sa_pending, NULL);
+	if (!err)
+		err = sigaction(SIGTERM, &sa_pending, NULL);
+	if (!err)
+		err = sigaction(SIGUSR1, &sa_pending, NULL);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+
+	err = sigprocmask(SIG_BLOCK, &sigmask, &rlb_sigunblock);
+	if (err) {
+		err = -errno;
+		goto fail;
+	}
+
+fail:
+	return err;
+}
+
+static int
+rlb_main_signaled(td_rlb_t *rlb)
+{
+	if (sigismember(&rlb_sigpending, SIGUSR1))
+		rlb_info(rlb);
+
+	if (sigismember(&rlb_sigpending, SIGINT) ||
+	    sigismember(&rlb_sigpending, SIGTERM))
+		return -EINTR;
+
+	return 0;
+}
+
+
+static struct ratelimit_ops *
+rlb_find_valve(const char *name)
+{
+	struct ratelimit_ops *ops = NULL;
+
+	switch (name[0]) {
+#if 0
+	case 'l':
+		if (!strcmp(name, "leaky"))
+			ops = &rlb_leaky_ops;
+		break;
+#endif
+
+	case 't':
+		if (!strcmp(name, "token"))
+			ops = &rlb_token_ops;
+		break;
+
+	case 'm':
+		if (!strcmp(name, "meminfo"))
+			ops = &rlb_meminfo_ops;
+		break;
+
+	case 'l':
+		if (!strcmp(name, "latency"))
+			ops = &rlb_latency_ops;
+		break;
+
+	case 'h':
+		if (!strcmp(name, "hqos"))
+			ops = &rlb_hqos_ops;
 		break;
 	}
 
@@ -1515,7 +2771,7 @@ rlb_usage(td_rlb_t *rlb, const char *prog, FILE *stream)
 		rlb->valve.ops->usage(rlb, stream, rlb->valve.data);
 	else
 		fprintf(stream,
-			" {-t|--type}={token|meminfo}"
+			" {-t|--type}={token|meminfo|hqos|latency}"
 			" [-h|--help] [-D|--debug=<n>]");
 
 	fprintf(stream, "\n");
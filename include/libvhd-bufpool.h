@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _LIB_VHD_BUFPOOL_H_
+#define _LIB_VHD_BUFPOOL_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * Process-wide pool of I/O buffers, aligned to at least 4k, in
+ * power-of-two size classes. Buffers are carved from 2M chunks which
+ * are never returned, so once the pool has grown to the peak working
+ * set, I/O paths allocate nothing. VHD_BUFPOOL_HUGEPAGES=1 backs the
+ * chunks with hugetlb pages, or transparent hugepages if none are
+ * reserved. Larger requests fall through to the heap.
+ */
+
+#define VHD_BUFPOOL_MIN_SHIFT               12	/* 4k */
+#define VHD_BUFPOOL_MAX_SHIFT               22	/* 4M */
+#define VHD_BUFPOOL_CLASSES                 (VHD_BUFPOOL_MAX_SHIFT - \
+					     VHD_BUFPOOL_MIN_SHIFT + 1)
+
+struct vhd_bufpool_stats {
+	uint64_t                            gets;
+	uint64_t                            hits;
+	uint64_t                            oversize;
+	uint64_t                            failed;
+	uint64_t                            chunks;
+	uint64_t                            bytes;
+	uint64_t                            huge_bytes;
+	uint64_t                            in_use;
+};
+
+void *vhd_bufpool_get(size_t size);
+void vhd_bufpool_put(void *buf, size_t size);
+void vhd_bufpool_get_stats(struct vhd_bufpool_stats *);
+
+#endif
@@ -108,6 +108,8 @@ int tap_ctl_unpause(const int id, const int minor, const char *params,
 ssize_t tap_ctl_stats(pid_t pid, int minor, char *buf, size_t size);
 int tap_ctl_stats_fwrite(pid_t pid, int minor, FILE *out);
 
+int tap_ctl_qos(const int id, const int minor, tapdisk_message_qos_t *qos);
+
 int tap_ctl_blk_major(void);
 
 #endif
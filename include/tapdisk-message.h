@@ -46,6 +46,7 @@ typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
 typedef struct tapdisk_message_stat      tapdisk_message_stat_t;
+typedef struct tapdisk_message_qos       tapdisk_message_qos_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -91,6 +92,14 @@ struct tapdisk_message_stat {
 	size_t                           length;
 };
 
+/* -1 leaves a field unchanged; the response carries current values */
+struct tapdisk_message_qos {
+	int                              error;
+	int                              weight;
+	int                              class;
+	int                              depth;
+};
+
 
 struct tapdisk_message {
 	uint16_t                         type;
@@ -105,6 +114,7 @@ struct tapdisk_message {
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
 		tapdisk_message_stat_t   info;
+		tapdisk_message_qos_t    qos;
 	} u;
 };
 
@@ -133,9 +143,11 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_STATS_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_QOS,
+	TAPDISK_MESSAGE_QOS_RSP,
 };
 
-#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_EXIT
+#define TAPDISK_MESSAGE_MAX TAPDISK_MESSAGE_QOS_RSP
 
 static inline char *
 tapdisk_message_name(enum tapdisk_message_id id)
@@ -210,6 +222,12 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_QOS:
+		return "qos";
+
+	case TAPDISK_MESSAGE_QOS_RSP:
+		return "qos response";
+
 	default:
 		return "unknown";
 	}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2.1 only
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "libvhd-bufpool.h"
+
+#define VHD_BUFPOOL_HUGEPAGES_ENV           "VHD_BUFPOOL_HUGEPAGES"
+#define VHD_BUFPOOL_CHUNK_SIZE              (1UL << 21)
+
+#define bufpool_class_size(_c)              (1UL << ((_c) + VHD_BUFPOOL_MIN_SHIFT))
+
+struct vhd_bufpool_buf {
+	struct vhd_bufpool_buf             *next;
+};
+
+struct vhd_bufpool {
+	pthread_mutex_t                     lock;
+	int                                 init;
+	int                                 huge;
+	struct vhd_bufpool_buf             *free[VHD_BUFPOOL_CLASSES];
+	struct vhd_bufpool_stats            stats;
+};
+
+static struct vhd_bufpool vhd_bufpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+vhd_bufpool_class(size_t size)
+{
+	int class = 0;
+
+	while (class < VHD_BUFPOOL_CLASSES && bufpool_class_size(class) < size)
+		class++;
+
+	return class;
+}
+
+static void
+vhd_bufpool_init(struct vhd_bufpool *pool)
+{
+	const char *env;
+
+	if (pool->init)
+		return;
+
+	env = getenv(VHD_BUFPOOL_HUGEPAGES_ENV);
+	pool->huge = env && atoi(env);
+	pool->init = 1;
+}
+
+static void *
+vhd_bufpool_map(struct vhd_bufpool *pool, size_t size)
+{
+	void *mem;
+
+#ifdef MAP_HUGETLB
+	if (pool->huge) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			pool->stats.huge_bytes += size;
+			goto out;
+		}
+	}
+#endif
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (pool->huge)
+		madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+out:
+	pool->stats.bytes += size;
+	return mem;
+}
+
+static int
+vhd_bufpool_grow(struct vhd_bufpool *pool, int class)
+{
+	struct vhd_bufpool_buf *buf;
+	size_t size, chunk, off;
+	char *mem;
+
+	size  = bufpool_class_size(class);
+	chunk = size > VHD_BUFPOOL_CHUNK_SIZE ? size : VHD_BUFPOOL_CHUNK_SIZE;
+
+	mem = vhd_bufpool_map(pool, chunk);
+	if (!mem)
+		return -ENOMEM;
+
+	for (off = 0; off < chunk; off += size) {
+		buf               = (struct vhd_bufpool_buf *)(mem + off);
+		buf->next         = pool->free[class];
+		pool->free[class] = buf;
+	}
+
+	pool->stats.chunks++;
+	return 0;
+}
+
+void *
+vhd_bufpool_get(size_t size)
+{
+	struct vhd_bufpool *pool = &vhd_bufpool;
+	struct vhd_bufpool_buf *buf = NULL;
+	int class, err;
+	void *mem;
+
+	class = vhd_bufpool_class(size);
+	if (class == VHD_BUFPOOL_CLASSES) {
+		err = posix_memalign(&mem, bufpool_class_size(0), size);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->stats.oversize++;
+		if (err)
+			pool->stats.failed++;
+		pthread_mutex_unlock(&pool->lock);
+
+		return err ? NULL : mem;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	vhd_bufpool_init(pool);
+	pool->stats.gets++;
+
+	if (pool->free[class])
+		pool->stats.hits++;
+	else {
+		err = vhd_bufpool_grow(pool, class);
+		if (err) {
+			pool->stats.failed++;
+			goto out;
+		}
+	}
+
+	buf               = pool->free[class];
+	pool->free[class] = buf->next;
+	pool->stats.in_use += bufpool_class_size(class);
+
+out:
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+void
+vhd_bufpool_put(void *mem, size_t size)
+{
+	struct vhd_bufpool *pool = &vhd_bufpool;
+	struct vhd_bufpool_buf *buf = mem;
+	int class;
+
+	if (!mem)
+		return;
+
+	class = vhd_bufpool_class(size);
+	if (class == VHD_BUFPOOL_CLASSES) {
+		free(mem);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	buf->next           = pool->free[class];
+	pool->free[class]   = buf;
+	pool->stats.in_use -= bufpool_class_size(class);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+vhd_bufpool_get_stats(struct vhd_bufpool_stats *stats)
+{
+	struct vhd_bufpool *pool = &vhd_bufpool;
+
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -36,6 +36,7 @@
 #include <sys/types.h>
 
 #include "libvhd.h"
+#include "libvhd-bufpool.h"
 #include "relative-path.h"
 #include "canonpath.h"
 
@@ -1768,18 +1769,19 @@ vhd_footer_offset_at_eof(vhd_context_t *ctx, off64_t *off)
 	return 0;
 }
 
-int
-vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
+static size_t
+vhd_bitmap_size(vhd_context_t *ctx)
+{
+	return vhd_bytes_padded(ctx->spb >> 3);
+}
+
+static int
+__vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char *buf)
 {
 	int err;
-	void *buf;
-	size_t size;
 	off64_t off;
 	uint64_t blk;
 
-	buf   = NULL;
-	*bufp = NULL;
-
 	if (!vhd_type_dynamic(ctx))
 		return -EINVAL;
 
@@ -1795,17 +1797,27 @@ vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
 		return -EINVAL;
 
 	off  = vhd_sectors_to_bytes(blk);
-	size = vhd_bytes_padded(ctx->spb >> 3);
 
 	err  = vhd_seek(ctx, off, SEEK_SET);
 	if (err)
 		return err;
 
-	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
+	return vhd_read(ctx, buf, vhd_bitmap_size(ctx));
+}
+
+int
+vhd_read_bitmap(vhd_context_t *ctx, uint32_t block, char **bufp)
+{
+	int err;
+	void *buf;
+
+	*bufp = NULL;
+
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, vhd_bitmap_size(ctx));
 	if (err)
 		return -err;
 
-	err  = vhd_read(ctx, buf, size);
+	err  = __vhd_read_bitmap(ctx, block, buf);
 	if (err)
 		goto fail;
 
@@ -1817,18 +1829,14 @@ fail:
 	return err;
 }
 
-int
-vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
+static int
+__vhd_read_block(vhd_context_t *ctx, uint32_t block, char *buf)
 {
 	int err;
-	void *buf;
 	size_t size;
 	uint64_t blk;
 	off64_t end, off;
 
-	buf   = NULL;
-	*bufp = NULL;
-
 	if (!vhd_type_dynamic(ctx))
 		return -EINVAL;
 
@@ -1850,12 +1858,6 @@ vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 	if (err)
 		return err;
 
-	err  = posix_memalign(&buf, VHD_SECTOR_SIZE, size);
-	if (err) {
-		err = -err;
-		goto fail;
-	}
-
 	if (end < off + ctx->header.block_size) {
 		size = end - off;
 		memset(buf + size, 0, ctx->header.block_size - size);
@@ -1863,9 +1865,25 @@ vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
 
 	err  = vhd_seek(ctx, off, SEEK_SET);
 	if (err)
-		goto fail;
+		return err;
+
+	return vhd_read(ctx, buf, size);
+}
+
+int
+vhd_read_block(vhd_context_t *ctx, uint32_t block, char **bufp)
+{
+	int err;
+	void *buf;
 
-	err  = vhd_read(ctx, buf, size);
+	*bufp = NULL;
+
+	err  = posix_memalign(&buf, VHD_SECTOR_SIZE,
+			      vhd_sectors_to_bytes(ctx->spb));
+	if (err)
+		return -err;
+
+	err  = __vhd_read_block(ctx, block, buf);
 	if (err)
 		goto fail;
 
@@ -3206,12 +3224,20 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 	uint32_t blk, sec;
 	int err, cnt, map_off, i;
 	char *bitmap, *data, *src;
+	size_t bm_size, data_size;
+
+	map_off   = 0;
+	bm_size   = vhd_bitmap_size(ctx);
+	data_size = vhd_sectors_to_bytes(ctx->spb);
 
-	map_off = 0;
+	bitmap = vhd_bufpool_get(bm_size);
+	data   = vhd_bufpool_get(data_size);
+	if (!bitmap || !data) {
+		err = -ENOMEM;
+		goto out;
+	}
 
 	do {
-		data   = NULL;
-		bitmap = NULL;
 		if (sector >= ctx->footer.curr_size >> VHD_SECTOR_SHIFT) {
 			cnt = secs;
 			for (i = 0; i < cnt; i++)
@@ -3228,15 +3254,13 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 		if (off == DD_BLK_UNUSED)
 			goto next;
 
-		err = vhd_read_bitmap(ctx, blk, &bitmap);
+		err = __vhd_read_bitmap(ctx, blk, bitmap);
 		if (err)
-			return err;
+			goto out;
 
-		err = vhd_read_block(ctx, blk, &data);
-		if (err) {
-			free(bitmap);
-			return err;
-		}
+		err = __vhd_read_block(ctx, blk, data);
+		if (err)
+			goto out;
 
 		src = data + vhd_sectors_to_bytes(sec);
 
@@ -3246,9 +3270,6 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 					   buf, src, cnt);
 
 	next:
-		free(data);
-		free(bitmap);
-
 		secs    -= cnt;
 		sector  += cnt;
 		map_off += cnt;
@@ -3256,7 +3277,12 @@ __vhd_io_dynamic_read_link(vhd_context_t *ctx, char *map,
 
 	} while (secs);
 
-	return 0;
+	err = 0;
+
+out:
+	vhd_bufpool_put(data, data_size);
+	vhd_bufpool_put(bitmap, bm_size);
+	return err;
 }
 
 static int
@@ -3285,20 +3311,22 @@ __raw_read_link(char *filename,
 	}
 
 	size = vhd_sectors_to_bytes(secs);
-	err = posix_memalign(&data, VHD_SECTOR_SIZE, size);
-	if (err)
+	data = vhd_bufpool_get(size);
+	if (!data) {
+		err = -ENOMEM;
 		goto close;
+	}
 
 	err = read(fd, data, size);
 	if (err != size) {
 		VHDLOG("%s: reading of %"PRIu64" returned %d, errno: %d\n",
 				filename, size, err, -errno);
-		free(data);
+		vhd_bufpool_put(data, size);
 		err = errno ? -errno : -EIO;
 		goto close;
 	}
 	__vhd_io_dynamic_copy_data(NULL, map, 0, NULL, 0, buf, data, secs);
-	free(data);
+	vhd_bufpool_put(data, size);
 	err = 0;
 
 close: